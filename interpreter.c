@@ -63,6 +63,10 @@ int main(int argc, char** argv) {
         printf("-f <file>   execute a file\n");
         printf("-f -        run from stdin\n");
         printf("-i          interactive mode\n");
+        printf("-s <file>   save the context into a snapshot\n");
+        printf("-l <file>   continue from a snapshot\n");
+        printf("--emit-c <file>  translate the functions defined so far into C\n");
+        printf("--native <lib>   run functions from a library built from --emit-c\n");
         printf("\n");
         printf("When using -i and -f at the same time,\nthe interpreter goes to interactive mode on exit.\n");
         printf("You can chain multiple -f's.\n");
@@ -100,6 +104,40 @@ int main(int argc, char** argv) {
                 }
             }
         }
+        else if (strcmp(argv[i], "-s") == 0 || strcmp(argv[i], "-l") == 0) {
+            bool save = argv[i][1] == 's';
+            i++;
+            if (i == argc) {
+                fprintf(stderr, "Expected file\n");
+                return 1;
+            }
+            PawScriptError* error;
+            if (save) error = pawscript_save_context(context, argv[i]);
+            else {
+                PawScriptContext* loaded;
+                if (!(error = pawscript_load_context(argv[i], &loaded))) {
+                    pawscript_destroy_context(context);
+                    context = loaded;
+                }
+            }
+            if (error) {
+                pawscript_log_error(error, stderr);
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "--emit-c") == 0 || strcmp(argv[i], "--native") == 0) {
+            bool emit = argv[i][2] == 'e';
+            i++;
+            if (i == argc) {
+                fprintf(stderr, "Expected file\n");
+                return 1;
+            }
+            PawScriptError* error = emit ? pawscript_emit_c(context, argv[i]) : pawscript_load_native(context, argv[i]);
+            if (error) {
+                pawscript_log_error(error, stderr);
+                return 1;
+            }
+        }
         else {
             fprintf(stderr, "Unknown option: %s\n", argv[i]);
             return 1;
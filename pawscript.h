@@ -9,6 +9,7 @@
 
 typedef struct PawScriptContext PawScriptContext;
 typedef struct PawScriptError PawScriptError;
+typedef struct PawScriptProgram PawScriptProgram;
 
 typedef enum {
     PawScriptVarargs_End,
@@ -43,6 +44,17 @@ bool pawscript_print_variable(PawScriptContext* context, FILE* f, const char* na
 void pawscript_log_error(PawScriptError* error, FILE* f);
 void pawscript_destroy_error(PawScriptError* error);
 void pawscript_destroy_context(PawScriptContext* context);
+PawScriptContext* pawscript_clone_context(PawScriptContext* context);
+PawScriptError* pawscript_save_context(PawScriptContext* context, const char* filename);
+PawScriptError* pawscript_load_context(const char* filename, PawScriptContext** context);
+PawScriptError* pawscript_emit_c(PawScriptContext* context, const char* filename);
+PawScriptError* pawscript_load_native(PawScriptContext* context, const char* filename);
+PawScriptError* pawscript_compile(const char* code, PawScriptProgram** program);
+PawScriptError* pawscript_compile_file(const char* filename, PawScriptProgram** program);
+PawScriptError* pawscript_run_program(PawScriptContext* context, PawScriptProgram* program);
+void pawscript_destroy_program(PawScriptProgram* program);
+PawScriptError* pawscript_resume(PawScriptContext* context, void* generator, void* value, bool* done);
+bool pawscript_yield(const void* value);
 
 void on_segfault(void(*handler)(void* addr));
 
@@ -58,6 +70,7 @@ void on_segfault(void(*handler)(void* addr));
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <stddef.h>
 #include <stdbool.h>
 #include <stdarg.h>
 #include <string.h>
@@ -72,12 +85,16 @@ void on_segfault(void(*handler)(void* addr));
 #if _WIN32
 #define PATH_SEPARATOR '\\'
 #include <windows.h>
+#include <intrin.h>
 #define NUM_INT_REGS 4
 #define NUM_FLT_REGS 4
 #else
 #define PATH_SEPARATOR '/'
 #include <unistd.h>
 #include <sys/mman.h>
+#include <sched.h>
+#include <pthread.h>
+#include <cpuid.h>
 #define NUM_INT_REGS 6
 #define NUM_FLT_REGS 8
 #endif
@@ -106,7 +123,7 @@ static int compare_int32(const void* a, const void* b) {
 }
 
 static int compare_int64(const void* a, const void* b) {
-    return *(int64_t*)b - *(int64_t*)a;
+    return (*(int64_t*)b > *(int64_t*)a) - (*(int64_t*)b < *(int64_t*)a);
 }
 
 static int compare_float32(const void* a, const void* b) {
@@ -117,6 +134,26 @@ static int compare_float64(const void* a, const void* b) {
     return (*(double*)a > *(double*)b) - (*(double*)a < *(double*)b);
 }
 
+// == HASH FUNCTIONS ==
+
+static uint64_t hash_string(void* ptr) {
+    uint64_t hash = 0xCBF29CE484222325ULL;
+    for (char* str = *(char**)ptr; *str; str++) hash = (hash ^ (uint8_t)*str) * 0x100000001B3ULL;
+    return hash;
+}
+
+static uint64_t hash_bytes(const void* ptr, size_t size, uint64_t hash = 0xCBF29CE484222325ULL) {
+    for (size_t i = 0; i < size; i++) hash = (hash ^ ((const uint8_t*)ptr)[i]) * 0x100000001B3ULL;
+    return hash;
+}
+
+static uint64_t hash_int64(void* ptr) {
+    uint64_t hash = *(uint64_t*)ptr;
+    hash = (hash ^ (hash >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    hash = (hash ^ (hash >> 27)) * 0x94D049BB133111EBULL;
+    return hash ^ (hash >> 31);
+}
+
 // == CLASS IMPLEMENTATIONS ==
 
 template<typename T> struct Set {
@@ -130,8 +167,15 @@ template<typename T> struct Set {
             capacity *= 2;
             items = (T*)realloc(items, sizeof(T) * capacity);
         }
-        items[size++] = item;
-        qsort(items, size, sizeof(T), compare);
+        int lo = 0, hi = size; // insert after any equal items, the same place a stable sort would put it
+        while (lo < hi) {
+            int mid = (lo + hi) / 2;
+            if (compare(&items[mid], &item) <= 0) lo = mid + 1;
+            else hi = mid;
+        }
+        memmove(items + lo + 1, items + lo, sizeof(T) * (size - lo));
+        items[lo] = item;
+        size++;
         return item;
     }
     T* find(T item) {
@@ -139,8 +183,9 @@ template<typename T> struct Set {
     }
     void remove(T item) {
         T* ptr = find(item);
-        if (!ptr) return;
-        int index = ((uintptr_t)ptr - (uintptr_t)items) / sizeof(T);
+        if (ptr) remove_at(ptr - items);
+    }
+    void remove_at(int index) {
         size--;
         if (index != size) memmove(
             items + index, items + index + 1,
@@ -149,28 +194,109 @@ template<typename T> struct Set {
     }
 };
 
+// what an allocator tracks, hashed so an allocation costs the same however many others are live
+struct PointerSet {
+    int size = 0, capacity = 64;
+    void** items = (void**)calloc(capacity, sizeof(void*)); // NULL marks a free slot
+    ~PointerSet() { free(items); }
+    void add(void* ptr) {
+        if ((size + 1) * 4 > capacity * 3) rehash(capacity * 2);
+        int i = slot(ptr);
+        if (!items[i]) size++;
+        items[i] = ptr;
+    }
+    bool remove(void* ptr) {
+        int i = slot(ptr), j = i;
+        if (!items[i]) return false;
+        items[i] = NULL;
+        size--;
+        while (true) { // shift the rest of the probe chain back into the hole
+            j = (j + 1) & (capacity - 1);
+            if (!items[j]) break;
+            int home = hash_int64(&items[j]) & (capacity - 1);
+            if (i <= j ? (home > i && home <= j) : (home > i || home <= j)) continue;
+            items[i] = items[j];
+            items[j] = NULL;
+            i = j;
+        }
+        return true;
+    }
+    void clear() {
+        memset(items, 0, sizeof(void*) * capacity);
+        size = 0;
+    }
+private:
+    int slot(void* ptr) {
+        int i = hash_int64(&ptr) & (capacity - 1);
+        while (items[i] && items[i] != ptr) i = (i + 1) & (capacity - 1);
+        return i;
+    }
+    void rehash(int new_capacity) {
+        void** old_items = items;
+        int old_capacity = capacity;
+        items = (void**)calloc(new_capacity, sizeof(void*));
+        capacity = new_capacity;
+        size = 0;
+        for (int i = 0; i < old_capacity; i++) if (old_items[i]) add(old_items[i]);
+        free(old_items);
+    }
+};
+
+static void yield_thread() {
+#ifdef _WIN32
+    SwitchToThread();
+#else
+    sched_yield();
+#endif
+}
+
+static void spin_lock(int* lock) {
+    while (__atomic_exchange_n(lock, 1, __ATOMIC_ACQUIRE)) yield_thread();
+}
+
+static void spin_unlock(int* lock) {
+    __atomic_store_n(lock, 0, __ATOMIC_RELEASE);
+}
+
+// the allocator whose lock this thread holds through a ForkLock
+static thread_local struct Allocator* locked_allocator = NULL;
+
 struct Allocator {
-    Set<void*> allocs = Set<void*>(compare_int64);
+    PointerSet allocs;
     bool watch_next = false;
+    int lock = 0;
+    int shared = 0; // tasks running against this allocator, while there are any every call takes the lock
+
+    struct Guard {
+        Allocator* held;
+        Guard(Allocator* allocator): held(__atomic_load_n(&allocator->shared, __ATOMIC_ACQUIRE) && locked_allocator != allocator ? allocator : NULL) {
+            if (held) spin_lock(&held->lock);
+        }
+        ~Guard() {
+            if (held) spin_unlock(&held->lock);
+        }
+    };
+
     ~Allocator() {
-        for (int i = 0; i < allocs.size; i++) std::free(allocs.items[i]);
+        for (int i = 0; i < allocs.capacity; i++) std::free(allocs.items[i]);
     }
     template<typename T> T* malloc(size_t count = 1) {
         if (count == 0) return NULL;
+        Guard guard(this);
         void* ptr = std::malloc(sizeof(T) * count);
         memset(ptr, 0, sizeof(T) * count);
         allocs.add(ptr);
         return (T*)ptr;
     }
     template<typename T> T* realloc(T* ptr, size_t count) {
-        if (!allocs.find(ptr)) return NULL;
-        allocs.remove(ptr);
+        Guard guard(this);
+        if (!allocs.remove(ptr)) return NULL;
         allocs.add(ptr = (T*)std::realloc(ptr, sizeof(T) * count));
         return (T*)ptr;
     }
     bool free(void* ptr) {
-        if (!allocs.find(ptr)) return false;
-        allocs.remove(ptr);
+        Guard guard(this);
+        if (!allocs.remove(ptr)) return false;
         std::free(ptr);
         return true;
     }
@@ -185,9 +311,36 @@ struct Allocator {
         memcpy((void*)data, ptr, sizeof(T) * count);
         return data;
     }
+    // takes over whatever another allocator still tracks
+    void adopt(Allocator* other) {
+        Guard guard(this);
+        PointerSet& from = other->allocs;
+        for (int i = 0; i < from.capacity; i++) if (from.items[i]) allocs.add(from.items[i]);
+        from.clear();
+    }
+};
+
+// every context owns an allocator, the API binds it to the calling thread while the context runs
+static thread_local Allocator* alloc = NULL;
+
+struct BindAllocator {
+    Allocator* prev;
+    BindAllocator(Allocator* allocator): prev(alloc) { alloc = allocator; }
+    ~BindAllocator() { alloc = prev; }
 };
 
-static Allocator* alloc = new Allocator;
+// the fork of a parallel for or a task this thread is running, if any
+static thread_local struct Context* running_fork = NULL;
+static thread_local int fork_lock_depth = 0;
+
+// held while a fork changes something it shares with its parent, which is then made with the parent's allocator so it outlives the fork,
+// and by the parent itself while it has tasks running beside it
+struct ForkLock {
+    Allocator* prev = NULL;
+    bool held = false;
+    ForkLock(bool engage = true);
+    ~ForkLock();
+};
 
 template<typename T> struct List {
     int size = 0, capacity = 4;
@@ -242,9 +395,16 @@ template<typename K, typename V> struct Map {
             capacity *= 2;
             pairs = alloc->realloc<KeyValuePair>(pairs, capacity);
         }
-        pairs[size].key = key;
-        pairs[size].value = value;
-        qsort(pairs, ++size, sizeof(KeyValuePair), compare);
+        int lo = 0, hi = size; // insert after any equal keys, the same place a stable sort would put it
+        while (lo < hi) {
+            int mid = (lo + hi) / 2;
+            if (compare(&pairs[mid].key, &key) <= 0) lo = mid + 1;
+            else hi = mid;
+        }
+        memmove(pairs + lo + 1, pairs + lo, sizeof(KeyValuePair) * (size - lo));
+        pairs[lo].key = key;
+        pairs[lo].value = value;
+        size++;
         return value;
     }
     void remove(K key) {
@@ -254,12 +414,21 @@ template<typename K, typename V> struct Map {
         size--;
         if (index != size) memmove(
             pairs + index, pairs + index + 1,
-            sizeof(KeyValuePair) * (size - index - 1)
+            sizeof(KeyValuePair) * (size - index)
         );
     }
     bool has(K key) {
         return bsearch(&key, pairs, size, sizeof(KeyValuePair), compare) != NULL;
     }
+    // the pairs are copied, not what they point to
+    Map<K, V>* copy() {
+        Map<K, V>* map = new Map<K, V>(compare);
+        alloc->free(map->pairs);
+        map->pairs = alloc->copy(pairs, capacity);
+        map->size = size;
+        map->capacity = capacity;
+        return map;
+    }
     V getdef(K key, V def) {
         KeyValuePair* pair = (KeyValuePair*)bsearch(&key, pairs, size, sizeof(KeyValuePair), compare);
         if (!pair) return def;
@@ -267,6 +436,73 @@ template<typename K, typename V> struct Map {
     }
 };
 
+template<typename K, typename V> struct HashMap {
+    int size = 0, capacity = 8;
+    HashFunc hash = NULL;
+    Compare compare = NULL;
+    struct KeyValuePair { K key; V value; bool used; }* pairs = alloc->malloc<KeyValuePair>(capacity);
+    HashMap(HashFunc hash, Compare compare): hash(hash), compare(compare) {}
+    ~HashMap() { alloc->free(pairs); }
+    V& get(K key) {
+        KeyValuePair* pair = find(key);
+        if (!pair) {
+            add(key, V{});
+            pair = find(key);
+        }
+        return pair->value;
+    }
+    V add(K key, V value) {
+        if ((size + 1) * 4 > capacity * 3) rehash(capacity * 2);
+        int i = hash(&key) & (capacity - 1);
+        while (pairs[i].used && compare(&pairs[i].key, &key) != 0) i = (i + 1) & (capacity - 1);
+        if (!pairs[i].used) size++;
+        pairs[i].key = key;
+        pairs[i].value = value;
+        pairs[i].used = true;
+        return value;
+    }
+    void remove(K key) {
+        KeyValuePair* pair = find(key);
+        if (!pair) return;
+        int i = pair - pairs, j = i;
+        pairs[i].used = false;
+        size--;
+        while (true) { // shift the rest of the probe chain back into the hole
+            j = (j + 1) & (capacity - 1);
+            if (!pairs[j].used) break;
+            int home = hash(&pairs[j].key) & (capacity - 1);
+            if (i <= j ? (home > i && home <= j) : (home > i || home <= j)) continue;
+            pairs[i] = pairs[j];
+            pairs[j].used = false;
+            i = j;
+        }
+    }
+    bool has(K key) {
+        return find(key) != NULL;
+    }
+    V getdef(K key, V def) {
+        KeyValuePair* pair = find(key);
+        if (!pair) return def;
+        return pair->value;
+    }
+    KeyValuePair* find(K key) {
+        for (int i = hash(&key) & (capacity - 1); pairs[i].used; i = (i + 1) & (capacity - 1)) {
+            if (compare(&pairs[i].key, &key) == 0) return &pairs[i];
+        }
+        return NULL;
+    }
+private:
+    void rehash(int new_capacity) {
+        KeyValuePair* old_pairs = pairs;
+        int old_capacity = capacity;
+        pairs = alloc->malloc<KeyValuePair>(new_capacity);
+        capacity = new_capacity;
+        size = 0;
+        for (int i = 0; i < old_capacity; i++) if (old_pairs[i].used) add(old_pairs[i].key, old_pairs[i].value);
+        alloc->free(old_pairs);
+    }
+};
+
 struct String {
     int length = 0, capacity = 64;
     char* data;
@@ -352,11 +588,15 @@ private:
 template<typename T> struct Stack {
     int size = 0, capacity = 4;
     T* items = alloc->malloc<T>(capacity);
-    ~Stack() { alloc->free(items); }
+    T* local = NULL; // the caller's storage, used until it fills up
+    Stack() {}
+    Stack(T* storage, int capacity): capacity(capacity), items(storage), local(storage) {}
+    ~Stack() { if (items != local) alloc->free(items); }
     Stack* push(T item) {
         if (size == capacity) {
             capacity *= 2;
-            items = alloc->realloc(items, capacity);
+            if (items != local) items = alloc->realloc(items, capacity);
+            else items = (T*)memcpy((void*)alloc->malloc<T>(capacity), items, sizeof(T) * size);
         }
         items[size++] = item;
         return this;
@@ -396,9 +636,9 @@ template<typename T> struct Queue {
         size--;
         return items[tail++];
     }
-    T peek() {
-        if (size == 0) return (T){};
-        return items[tail];
+    T peek(int ahead = 0) {
+        if (ahead >= size) return (T){};
+        return items[tail + ahead];
     }
 };
 
@@ -406,8 +646,9 @@ struct ByteReader {
     int size = 0, ptr = 0;
     uint8_t* bytes = NULL;
     bool do_free = false;
+    bool shared = false; // belongs to a Program, which many contexts may run at once
     ~ByteReader() { do_free ? alloc->free(bytes) : false; }
-    ByteReader(uint8_t* bytes, uint64_t size, bool do_free = false): bytes(bytes), size(size), do_free(do_free) {}
+    ByteReader(uint8_t* bytes, uint64_t size, bool do_free = false): size(size), bytes(bytes), do_free(do_free) {}
     template<typename T> T read() {
         if (ptr + sizeof(T) > size) return (T)0;
         T value = *(T*)(bytes + ptr);
@@ -600,19 +841,180 @@ struct FFI {
     ); }
 };
 
-// == UTILITY FUNCTIONS ==
-
-static void make_executable(void* ptr, size_t size) {
+// executable memory for generated code, pages are either writable or executable, never both
+struct CodeArena {
+    static const size_t CHUNK_SIZE = 64 * 1024;
+    static const size_t SLOT_ALIGN = 64;
+    static const size_t TRAMPOLINE_SIZE = 16;
+    struct Header {
+        uint64_t size;
+        uint64_t reserved;
+    };
+    struct Chunk {
+        uint8_t* base;
+        size_t size, used;
+        bool writable;
+    };
+    // a trampoline loads its data slot into %r10 and jumps to the shared thunk,
+    // the code half is written once, the data half (at +CHUNK_SIZE) stays writable
+    struct TrampolineData {
+        void* owner;
+        void* target;
+    };
+    // only ever added to in front and never taken out before the arena goes, so owner() walks it without the lock
+    struct TrampolineChunk {
+        uint8_t* base;
+        TrampolineChunk* next;
+    };
+    List<Chunk> chunks;
+    TrampolineChunk* trampoline_chunks = NULL;
+    List<uint8_t*> free_trampolines;
+    Map<uint64_t, List<uint8_t*>*> free_slots = Map<uint64_t, List<uint8_t*>*>(compare_int64);
+    bool dirty = false;
+
+    ~CodeArena() {
+        for (int i = 0; i < chunks.size; i++) unmap(chunks.items[i].base, chunks.items[i].size);
+        while (TrampolineChunk* chunk = trampoline_chunks) {
+            trampoline_chunks = chunk->next;
+            unmap(chunk->base, CHUNK_SIZE * 2);
+            delete chunk;
+        }
+        for (int i = 0; i < free_slots.size; i++) delete free_slots.pairs[i].value;
+    }
+    // returns a writable slot, stays writable until the next seal()
+    void* allocate(size_t size) {
+        size = (size + sizeof(Header) + SLOT_ALIGN - 1) / SLOT_ALIGN * SLOT_ALIGN;
+        uint8_t* slot = NULL;
+        bool pinned = fork_lock_depth > 0; // other threads may be running sealed code, so it can't be unsealed
+        List<uint8_t*>* slots = free_slots.getdef(size, NULL);
+        if (slots && slots->size > 0 && (!pinned || chunkof(slots->items[slots->size - 1])->writable)) {
+            slot = slots->items[--slots->size];
+            unseal(chunkof(slot));
+        }
+        for (int i = chunks.size - 1; i >= 0 && !slot; i--) {
+            Chunk* chunk = &chunks.items[i];
+            if (chunk->size - chunk->used < size || (pinned && !chunk->writable)) continue;
+            unseal(chunk);
+            slot = chunk->base + chunk->used;
+            chunk->used += size;
+        }
+        if (!slot) {
+            Chunk chunk;
+            chunk.size = size > CHUNK_SIZE ? size : CHUNK_SIZE;
+            chunk.base = map(chunk.size);
+            chunk.used = size;
+            chunk.writable = true;
+            if (!chunk.base) return NULL;
+            chunks.add(chunk);
+            slot = chunk.base;
+            dirty = true;
+        }
+        ((Header*)slot)->size = size;
+        return slot + sizeof(Header);
+    }
+    void free(void* ptr) {
+        if (!ptr) return;
+        Header* header = (Header*)((uint8_t*)ptr - sizeof(Header));
+        List<uint8_t*>* slots = free_slots.getdef(header->size, NULL);
+        if (!slots) free_slots.add(header->size, slots = new List<uint8_t*>);
+        slots->add((uint8_t*)header);
+    }
+    // a callable entry point that enters target with owner in %r10, no code is generated
+    void* trampoline(void* owner, void* target) {
+        if (free_trampolines.size == 0 && !map_trampolines()) return NULL;
+        uint8_t* code = free_trampolines.items[--free_trampolines.size];
+        TrampolineData* data = (TrampolineData*)(code + CHUNK_SIZE);
+        data->target = target;
+        __atomic_store_n(&data->owner, owner, __ATOMIC_RELEASE);
+        return code;
+    }
+    void free_trampoline(void* ptr) {
+        if (!ptr) return;
+        TrampolineData* data = (TrampolineData*)((uint8_t*)ptr + CHUNK_SIZE);
+        __atomic_store_n(&data->owner, (void*)NULL, __ATOMIC_RELEASE);
+        data->target = NULL;
+        free_trampolines.add((uint8_t*)ptr);
+    }
+    // the data of a pointer already known to be a trampoline, read without a lookup
+    static void* trampoline_owner(void* ptr) {
+        return __atomic_load_n(&((TrampolineData*)((uint8_t*)ptr + CHUNK_SIZE))->owner, __ATOMIC_ACQUIRE);
+    }
+    // every Function::from goes through here, forks included, so it doesn't take the lock
+    void* owner(void* ptr) {
+        for (TrampolineChunk* chunk = __atomic_load_n(&trampoline_chunks, __ATOMIC_ACQUIRE); chunk; chunk = chunk->next) {
+            if ((uint8_t*)ptr < chunk->base || (uint8_t*)ptr >= chunk->base + CHUNK_SIZE) continue;
+            if (((uint8_t*)ptr - chunk->base) % TRAMPOLINE_SIZE != 0) return NULL;
+            return trampoline_owner(ptr);
+        }
+        return NULL;
+    }
+    // flips every page written to since the last call back to executable
+    void seal() {
+        if (!dirty) return;
+        for (int i = 0; i < chunks.size; i++) {
+            Chunk* chunk = &chunks.items[i];
+            if (!chunk->writable) continue;
+            protect(chunk->base, chunk->size, true);
+            chunk->writable = false;
+        }
+        dirty = false;
+    }
+private:
+    Chunk* chunkof(uint8_t* ptr) {
+        for (int i = 0; i < chunks.size; i++) {
+            Chunk* chunk = &chunks.items[i];
+            if (ptr >= chunk->base && ptr < chunk->base + chunk->used) return chunk;
+        }
+        return NULL;
+    }
+    void unseal(Chunk* chunk) {
+        if (chunk->writable) return;
+        protect(chunk->base, chunk->size, false);
+        chunk->writable = true;
+        dirty = true;
+    }
+    bool map_trampolines() {
+        uint8_t* base = map(CHUNK_SIZE * 2);
+        if (!base) return false;
+        for (size_t off = 0; off < CHUNK_SIZE; off += TRAMPOLINE_SIZE) {
+            uint8_t* code = base + off;
+            uint32_t load = CHUNK_SIZE - 7, jump = CHUNK_SIZE + 8 - 13;
+            code[0] = 0x4C; code[1] = 0x8B; code[2] = 0x15; memcpy(code + 3, &load, 4); // mov x(%rip), %r10
+            code[7] = 0xFF; code[8] = 0x25; memcpy(code + 9, &jump, 4);                 // jmp *x(%rip)
+            code[13] = 0xCC; code[14] = 0xCC; code[15] = 0xCC;                          // int3 padding
+        }
+        protect(base, CHUNK_SIZE, true);
+        __atomic_store_n(&trampoline_chunks, new TrampolineChunk{ base, trampoline_chunks }, __ATOMIC_RELEASE);
+        for (size_t off = CHUNK_SIZE; off > 0; off -= TRAMPOLINE_SIZE) free_trampolines.add(base + off - TRAMPOLINE_SIZE);
+        return true;
+    }
+    static uint8_t* map(size_t size) {
 #ifdef _WIN32
-    DWORD old_protect;
-    VirtualProtect(ptr, size, PAGE_EXECUTE_READWRITE, &old_protect);
+        return (uint8_t*)VirtualAlloc(NULL, size, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
 #else
-    size_t pagesize = sysconf(_SC_PAGESIZE);
-    void* page_start = (void*)((uintptr_t)ptr / pagesize * pagesize);
-    size_t length = ((uintptr_t)ptr + (pagesize - 1)) / pagesize * pagesize;
-    mprotect((void*)page_start, length, PROT_READ | PROT_WRITE | PROT_EXEC);
+        void* ptr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        return ptr == MAP_FAILED ? NULL : (uint8_t*)ptr;
 #endif
-}
+    }
+    static void unmap(uint8_t* ptr, size_t size) {
+#ifdef _WIN32
+        VirtualFree(ptr, 0, MEM_RELEASE);
+#else
+        munmap(ptr, size);
+#endif
+    }
+    static void protect(uint8_t* ptr, size_t size, bool executable) {
+#ifdef _WIN32
+        DWORD old_protect;
+        VirtualProtect(ptr, size, executable ? PAGE_EXECUTE_READ : PAGE_READWRITE, &old_protect);
+        if (executable) FlushInstructionCache(GetCurrentProcess(), ptr, size);
+#else
+        mprotect(ptr, size, executable ? PROT_READ | PROT_EXEC : PROT_READ | PROT_WRITE);
+#endif
+    }
+};
+
+// == UTILITY FUNCTIONS ==
 
 static char* strfmt(const char* fmt, ...) {
     va_list args1, args2;
@@ -693,21 +1095,33 @@ template<typename T> T* mkptr(T&& val) {
 
 // == TYPES ==
 
-struct ErrorScope {
-    struct ErrorScope* parent;
+struct ErrorFrame {
     const char* file;
     const char* name;
     int row, col;
 };
 
+// errors only snapshot the call stack, the message is formatted once somebody asks for it
 struct Error {
-    ErrorScope* scope;
-    char* msg;
+    char* msg;         // owned, or NULL until message() formats it
+    const char* text;  // borrowed message, string literals and bytecode strings live as long as the context
+    struct Type* value_type; // a thrown scalar, formatted on demand
+    uint64_t value;
+    struct Allocator* allocator; // the owning context's, errors have to be released before it is destroyed
+    bool owns_allocator;
+    int num_frames;
+    ErrorFrame* frames; // innermost first, allocated together with the error
+    const char* message();
+    static Error* create(int num_frames, int extra = 0);
     static Error* syntax(const char* filename, int row, int col, String str);
     static Error* parser(struct Token* token, String str);
+    static Error* runtime(struct Context* context, const char* text);
     static Error* runtime(struct Context* context, String str);
+    static Error* thrown(struct Context* context, struct Variable value);
 };
 
+API void pawscript_destroy_error(Error* error);
+
 enum CaptureMode: uint8_t {
     CaptureMode_None,
     CaptureMode_Shared,
@@ -716,19 +1130,31 @@ enum CaptureMode: uint8_t {
 };
 
 struct Function {
-    char jmp[5];
+    void* code;
+    void* site;
     char* name;
     char* file;
     uint8_t* entry;
     uint64_t length;
     CaptureMode capture_mode;
-    Map<char*, struct Variable*>* variables;
-    struct Type* this_ptr_type;
-    void* this_ptr;
-
-    bool is_native() {
-         // 0xE9 is the jmp instruction, realistically no function begins with the jmp instruction besides the one we generated
-        return *(uint8_t*)this != 0xE9;
+    bool shared;
+    int num_captures;
+    char** capture_names; // points into the bytecode
+    struct Variable** captures;
+    // machine code, once the function ran hot enough and the JIT could translate it
+    void* jit;
+    struct Type* jit_type; // the signature it was compiled for, a call through another one stays interpreted
+    struct JitCallSite* jit_sites;
+    void* jit_baseline; // replaced by the second tier's code, calls may still be running in it
+    struct JitCallSite* jit_baseline_sites;
+    uint64_t heat; // calls plus loop iterations so far
+    uint8_t jit_tier; // 1 once the baseline compiler ran, 2 once the second tier did
+    bool jit_failed;
+    bool jit_cache_tried;
+
+    // NULL if the pointer is a native function
+    static Function* from(CodeArena* arena, void* code) {
+        return (Function*)arena->owner(code);
     }
 };
 
@@ -755,20 +1181,28 @@ struct Type {
         Type* parent;
         TypeHandle(Type* type = NULL, Type* parent = NULL): type(type), parent(parent) {}
         Type* operator->() {
-            type->parent = parent;
-            return type->resolve_parent();
+            return resolve();
         }
         operator Type*() {
-            type->parent = parent;
-            return type->resolve_parent();
+            return resolve();
         }
         Type* operator=(Type* other) {
             type = other;
-            other->parent = parent;
-            return type->resolve_parent();
+            return resolve();
+        }
+        // a parent ref is one type shared by every type that uses it, so it's resolved without writing to it
+        Type* resolve() {
+            if (type->kind != TypeKind_Parent) {
+                if (type->parent != parent && !type->sealed) type->parent = parent;
+                return type;
+            }
+            Type* resolved = parent;
+            for (int i = 1; i < type->parent_info.offset; i++) resolved = resolved->parent;
+            return resolved;
         }
         Type* operator<<(Type* other) {
-            type->parent = parent = other;
+            parent = other;
+            if (!type->sealed) type->parent = other;
             return other->resolve_parent();
         }
     };
@@ -781,15 +1215,45 @@ struct Type {
         uintptr_t value = 0;
         int64_t inline_size = -1;
     };
+    // a field as seen from a struct, with anonymous inline members flattened into it
+    struct FieldEntry {
+        Type* owner;
+        FieldEntry* via;
+        Field* field;
+        size_t offset;
+
+        Type* type() {
+            if (via) via->type();
+            return field->type;
+        }
+    };
+    struct FieldTable {
+        HashMap<char*, FieldEntry*> fields = HashMap<char*, FieldEntry*>(hash_string, compare_strings);
+        List<FieldEntry*> entries;
+        ~FieldTable() {
+            for (int i = 0; i < entries.size; i++) alloc->free(entries.items[i]);
+        }
+    };
     Type() { memset((void*)this, 0, sizeof(*this)); }
 
     Type* parent;
     TypeKind kind;
     bool is_const;
+    bool is_atomic;
     bool is_unsigned;
     bool lvalue_return;
+    bool has_defers, validated;
+    bool sealed; // owned by a program and read by every context that runs it, nothing on it is written anymore
     uint64_t hash;
     int size, alignment;
+    FieldTable* field_table;
+    // derived types and the last resolve_defers result, reset when registered
+    Type* pointer_to;
+    Type* const_of;
+    Type* atomic_of;
+    Type* unsigned_of;
+    Type* resolved;
+    uint64_t resolved_epoch, resolved_frame;
     union {
         struct {
             TypeHandle base;
@@ -819,10 +1283,35 @@ struct Type {
 
     Type* unsign(struct Context* context);
     Type* constant(struct Context* context);
+    Type* atomic(struct Context* context);
     Type* pointer(struct Context* context);
     Type* function(struct Context* context, List<Param>* params, bool lvalue_return);
     Type* resolve_defers(struct Context* context);
+    FieldEntry* find_field(const char* name) {
+        if (!__atomic_load_n(&field_table, __ATOMIC_ACQUIRE)) {
+            ForkLock lock;
+            if (!field_table) { // only published once it's complete, forks read it without the lock
+                FieldTable* table = new FieldTable;
+                add_fields(table, this, NULL, 0);
+                __atomic_store_n(&field_table, table, __ATOMIC_RELEASE);
+            }
+        }
+        return field_table->fields.getdef((char*)name, NULL);
+    }
+    void add_fields(FieldTable* table, Type* str, FieldEntry* via, size_t offset) {
+        for (int i = 0; i < str->struct_info.num_fields; i++) {
+            Field* field = &str->struct_info.fields[i];
+            FieldEntry* entry = table->entries.add(alloc->malloc<FieldEntry>());
+            entry->owner = this;
+            entry->via = via;
+            entry->field = field;
+            entry->offset = offset + field->offset;
+            if (field->inline_size != -1 && !field->name) add_fields(table, entry->type(), entry, entry->offset);
+            else if (!table->fields.has(field->name)) table->fields.add(field->name, entry);
+        }
+    }
     void destroy() {
+        delete field_table;
         if (kind == TypeKind_Struct) alloc->free(struct_info.fields);
         if (kind == TypeKind_Function) alloc->free(function_info.params);
         alloc->free(this);
@@ -896,25 +1385,68 @@ struct Type {
     }
 };
 
+// memo slot in the bytecode of a type expression, reused while nothing it was built from can have changed
+struct TypeSite {
+    Type* input;  // the operand the result was built from, if any
+    Type* result;
+    uint64_t epoch, frame; // only checked if the expression read type variables
+    bool bound;
+    int32_t end;
+
+    Type* lookup(struct Context* context, struct ByteReader* reader, Type* input = NULL);
+    void store(struct Context* context, struct ByteReader* reader, Type* result, Type* input = NULL);
+};
+
 struct Variable {
+    // fixed size copies, these compile to a single mov
+    template<typename T> static T read(const void* ptr) {
+        T value;
+        memcpy(&value, ptr, sizeof(T));
+        return value;
+    }
+    template<typename T> static void write(void* ptr, T value) {
+        memcpy(ptr, &value, sizeof(T));
+    }
+    // loads and stores an integer of a script type's width, widened to 64 bits
+    static uint64_t load(const void* ptr, int size, bool is_unsigned) {
+        switch (size) {
+            case 1: return is_unsigned ? (uint64_t)read<uint8_t>(ptr)  : (uint64_t)read<int8_t>(ptr);
+            case 2: return is_unsigned ? (uint64_t)read<uint16_t>(ptr) : (uint64_t)read<int16_t>(ptr);
+            case 4: return is_unsigned ? (uint64_t)read<uint32_t>(ptr) : (uint64_t)read<int32_t>(ptr);
+            case 8: return read<uint64_t>(ptr);
+            default: return 0;
+        }
+    }
+    static void store(void* ptr, int size, uint64_t value) {
+        switch (size) {
+            case 1: write<uint8_t>(ptr, value);  break;
+            case 2: write<uint16_t>(ptr, value); break;
+            case 4: write<uint32_t>(ptr, value); break;
+            case 8: write<uint64_t>(ptr, value); break;
+        }
+    }
     template<typename T> struct Value {
         T* ptr;
         int size = 0;
         bool is_unsigned = false;
         Value(T* ptr, int size = sizeof(T), bool is_unsigned = false): ptr(ptr), size(size), is_unsigned(is_unsigned) {}
         T operator=(const T& other) {
-            memcpy(ptr, &other, size);
+            if (size == sizeof(T)) write<T>(ptr, other);
+            else {
+                uint64_t value = 0;
+                memcpy(&value, &other, sizeof(T));
+                store(ptr, size, value);
+            }
             return *this;
         }
         T operator=(const Value<T>& other) {
             return *this = (T)other;
         }
         operator T() const {
+            if (size == sizeof(T)) return read<T>(ptr);
             T value = {};
-            memcpy(&value, ptr, size);
-            bool is_negative = is_unsigned ? false : (uintptr_t)value & (1 << (size * 8 - 1));
-            int negative_bytes = sizeof(T) - size;
-            if (negative_bytes > 0) memset((char*)&value + size, is_negative ? 0xFF : 0x00, negative_bytes);
+            uint64_t wide = load(ptr, size, is_unsigned);
+            memcpy(&value, &wide, sizeof(T));
             return value;
         }
         Value<T>& operator  +=(const T& oth) { T val = *this; val  += oth; *this = val; return *this; }
@@ -933,23 +1465,36 @@ struct Variable {
         Value<T>& operator--() { *this = (T)(*this) - 1; return *this; }
         T operator--(int) { T old = *this; --(*this); return old; }
     };
+    // a Type* with the lvalue flag in its low bit, types are at least 8 byte aligned
+    struct TypeRef {
+        uintptr_t bits = 0;
+        TypeRef() {}
+        explicit TypeRef(Type* type): bits((uintptr_t)type) {}
+        operator Type*() const { return (Type*)(bits & ~(uintptr_t)1); }
+        Type* operator->() const { return (Type*)(bits & ~(uintptr_t)1); }
+        TypeRef& operator=(Type* type) {
+            bits = (uintptr_t)type | (bits & 1);
+            return *this;
+        }
+    };
 
-    Type* type = NULL;
-    bool ref = false;
-    int refcount = 0;
-    void* _value = NULL;
+    TypeRef type;
+    void* _value = NULL; // the value itself, or the address of its storage if the variable is an lvalue
 
     Variable(Type* type = NULL): type(type) {}
-    Variable(const Variable& other): type(other.type), ref(other.ref), _value(other._value) {}
+
+    // a heap copy shared by scopes and closures, the refcount sits in front of it
+    static Variable* allocate(const Variable& var) {
+        int64_t* block = (int64_t*)alloc->malloc<uint8_t>(sizeof(int64_t) + sizeof(Variable));
+        return (Variable*)memcpy(block + 1, &var, sizeof(Variable));
+    }
+    int64_t& refcount() {
+        return ((int64_t*)this)[-1];
+    }
 
     Variable& operator<<(const Variable& other) {
         if (!type || !other.type) return *this;
-        uint64_t value = 0;
-        memcpy(&value, other.ptr(), other.type->value_size());
-        bool is_negative = other.type->is_unsigned ? false : value & (1 << (other.type->value_size() * 8 - 1));
-        int negative_size = type->value_size() - other.type->value_size();
-        if (negative_size > 0) memset((char*)&value + other.type->value_size(), is_negative ? 0xFF : 0x00, negative_size);
-        memcpy(ptr(), &value, type->value_size());
+        store(ptr(), type->value_size(), load(other.ptr(), other.type->value_size(), other.type->is_unsigned));
         return *this;
     }
 
@@ -957,37 +1502,40 @@ struct Variable {
         return Value<T>(ptr<T>(), sizeof(T) < type->value_size() ? sizeof(T) : type->value_size(), type->is_unsigned);
     }
     template<typename T = void> T* ptr() const {
-        return (T*)(ref ? _value : &_value);
+        return (T*)(is_ref() ? _value : &_value);
+    }
+    bool is_ref() const {
+        return type.bits & 1;
     }
     Variable deref(int offset = 0) {
         return Variable(type->pointer_info.base).lvalue(as<char*>() + type->pointer_info.base->value_size() * offset);
     }
 
     Variable& rvalue() {
-        if (!ref) return *this;
-        _value = *(void**)_value;
-        ref = false;
+        if (!is_ref()) return *this;
+        void* storage = _value;
+        type.bits &= ~(uintptr_t)1;
+        _value = NULL;
+        memcpy(&_value, storage, type->value_size());
         return *this;
     }
     Variable& lvalue(void* storage) {
-        if (ref) return *this;
+        if (is_ref()) return *this;
         _value = storage;
-        ref = true;
+        type.bits |= 1;
         return *this;
     }
     Variable& retain() {
-        refcount++;
+        refcount()++;
         return *this;
     }
     bool release() {
-        refcount--;
-        if (refcount == 0) {
-            alloc->free(this);
+        if (--refcount() == 0) {
+            alloc->free(&refcount());
             return true;
         }
         return false;
     }
-
     String to_string() {
         if (type->kind == TypeKind_Pointer && type->pointer_info.base->kind == TypeKind_Int8 && !type->pointer_info.base->is_unsigned)
             return String::new_format("\"%s\"", unescape_string((char*)as<char*>()));
@@ -1013,6 +1561,8 @@ struct Variable {
     }
 };
 
+static_assert(sizeof(Variable) == 16, "Variable should stay two words");
+
 struct VarargsInfo {
     Variable* array;
     int num_args;
@@ -1031,10 +1581,62 @@ struct VarargsData {
     };
 };
 
-struct TypeCache: Map<uint64_t, Type*> {
-    TypeCache(): Map<uint64_t, Type*>(compare_int64) {}
+// every type is registered once, lookups compare the structure of a type against the registered ones
+struct TypeCache: HashMap<Type*, Type*> {
+    Type* primitives[TypeKind_Parent + 1] = {};
+    uint64_t defer_epoch = 0; // bumped whenever a name a defer could resolve to changes
+    uint64_t frame_ids = 0;
+    TypeCache* shared = NULL; // the sealed types of a program this context runs, looked up when a type isn't registered here
+
+    TypeCache(): HashMap<Type*, Type*>(hash_key, compare_types) {}
+    void invalidate_defers() {
+        __atomic_add_fetch(&defer_epoch, 1, __ATOMIC_RELAXED);
+    }
+    // derived types are read without the fork lock, a sealed type only remembers the ones every context can use
+    static Type* publish(Type* type, Type** slot, Type* derived) {
+        if (!type->sealed || derived->sealed) __atomic_store_n(slot, derived, __ATOMIC_RELEASE);
+        return derived;
+    }
     ~TypeCache() {
-        for (int i = 0; i < size; i++) pairs[i].value->destroy();
+        for (int i = 0; i < capacity; i++) if (pairs[i].used) pairs[i].value->destroy();
+    }
+    static uint64_t hash_key(void* ptr) {
+        return hash_int64(&(*(Type**)ptr)->hash);
+    }
+    static bool same_name(char* a, char* b) {
+        return a == b || (a && b && strcmp(a, b) == 0);
+    }
+    static int compare_types(const void* _a, const void* _b) {
+        Type* a = *(Type**)_a;
+        Type* b = *(Type**)_b;
+        if (a->hash != b->hash) return a->hash < b->hash ? -1 : 1;
+        if (a->kind != b->kind || a->is_const != b->is_const || a->is_atomic != b->is_atomic || a->is_unsigned != b->is_unsigned || a->lvalue_return != b->lvalue_return) return 1;
+        switch (a->kind) {
+            case TypeKind_Pointer:
+                return a->pointer_info.base.type != b->pointer_info.base.type;
+            case TypeKind_Struct:
+                if (a->struct_info.num_fields != b->struct_info.num_fields) return 1;
+                for (size_t i = 0; i < a->struct_info.num_fields; i++) {
+                    Type::Field* x = &a->struct_info.fields[i];
+                    Type::Field* y = &b->struct_info.fields[i];
+                    if (x->type.type != y->type.type || x->value != y->value || x->inline_size != y->inline_size || x->offset != y->offset) return 1;
+                    if (!same_name(x->name, y->name)) return 1;
+                }
+                return 0;
+            case TypeKind_Function:
+                if (a->function_info.return_type.type != b->function_info.return_type.type) return 1;
+                if (a->function_info.num_params != b->function_info.num_params) return 1;
+                for (size_t i = 0; i < a->function_info.num_params; i++) {
+                    if (a->function_info.params[i].type.type != b->function_info.params[i].type.type) return 1;
+                    if (!same_name(a->function_info.params[i].name, b->function_info.params[i].name)) return 1;
+                }
+                return 0;
+            case TypeKind_Deferred:
+                return !same_name(a->defer_info.name, b->defer_info.name);
+            case TypeKind_Parent:
+                return a->parent_info.offset != b->parent_info.offset;
+            default: return 0;
+        }
     }
     static uint64_t hash_mix(uint64_t a, uint64_t b) {
         return a ^ (b + 0x9E3779B97F4A7C15ULL + (a << 6) + (a >> 2));
@@ -1052,28 +1654,29 @@ struct TypeCache: Map<uint64_t, Type*> {
         uint64_t hash = 0xCBF29CE484222325ULL;
         hash = hash_mix(hash, type->kind);
         hash = hash_mix(hash, type->is_const);
+        hash = hash_mix(hash, type->is_atomic);
         hash = hash_mix(hash, type->is_unsigned);
         hash = hash_mix(hash, type->lvalue_return);
         switch (type->kind) {
             case TypeKind_Pointer:
-                hash = hash_mix(hash, hash_ptr(type->pointer_info.base));
+                hash = hash_mix(hash, hash_ptr(type->pointer_info.base.type));
                 break;
             case TypeKind_Struct:
                 hash = hash_mix(hash, type->struct_info.num_fields);
                 for (size_t i = 0; i < type->struct_info.num_fields; i++) {
                     hash = hash_mix(hash, type->struct_info.fields[i].value);
                     hash = hash_mix(hash, hash_str(type->struct_info.fields[i].name));
-                    hash = hash_mix(hash, hash_ptr(type->struct_info.fields[i].type));
+                    hash = hash_mix(hash, hash_ptr(type->struct_info.fields[i].type.type));
                     hash = hash_mix(hash, type->struct_info.fields[i].inline_size);
                     hash = hash_mix(hash, type->struct_info.fields[i].offset);
                 }
                 break;
             case TypeKind_Function:
-                hash = hash_mix(hash, hash_ptr(type->function_info.return_type));
+                hash = hash_mix(hash, hash_ptr(type->function_info.return_type.type));
                 hash = hash_mix(hash, type->function_info.num_params);
                 for (size_t i = 0; i < type->function_info.num_params; ++i) {
                     hash = hash_mix(hash, hash_str(type->function_info.params[i].name));
-                    hash = hash_mix(hash, hash_ptr(type->function_info.params[i].type));
+                    hash = hash_mix(hash, hash_ptr(type->function_info.params[i].type.type));
                 }
                 break;
             case TypeKind_Deferred:
@@ -1089,22 +1692,45 @@ struct TypeCache: Map<uint64_t, Type*> {
     }
     Type* register_type(Type* type, bool force_clean = false) {
         hash_type(type);
-        if (has(type->hash)) {
-            if ((!type->is_const && !type->is_unsigned) || force_clean) {
+        KeyValuePair* pair = find(type);
+        if (!pair && shared) pair = shared->find(type);
+        if (pair) {
+            if ((!type->is_const && !type->is_atomic && !type->is_unsigned) || force_clean) {
                 if (type->kind == TypeKind_Struct) alloc->free(type->struct_info.fields);
                 if (type->kind == TypeKind_Function) alloc->free(type->function_info.params);
             }
-            return get(type->hash);
+            return pair->value;
         }
         else {
-            type = add(type->hash, alloc->copy<Type>(type));
+            type = alloc->copy<Type>(type);
+            add(type, type);
+            type->field_table = NULL;
+            type->pointer_to = type->const_of = type->atomic_of = type->unsigned_of = type->resolved = NULL;
+            type->validated = false;
+            type->has_defers = contains_defers(type);
             if (type->kind == TypeKind_Pointer) type->pointer_info.base << type;
             if (type->kind == TypeKind_Struct) for (int i = 0; i < type->struct_info.num_fields; i++) type->struct_info.fields[i].type << type;
             if (type->kind == TypeKind_Function) for (int i = 0; i < type->function_info.num_params; i++) type->function_info.params[i].type << type;
             return type;
         }
     }
+    static bool contains_defers(Type* type) {
+        switch (type->kind) {
+            case TypeKind_Deferred: return true;
+            case TypeKind_Pointer: return type->pointer_info.base.type->has_defers;
+            case TypeKind_Struct:
+                for (int i = 0; i < type->struct_info.num_fields; i++) if (type->struct_info.fields[i].type.type->has_defers) return true;
+                return false;
+            case TypeKind_Function:
+                if (type->function_info.return_type.type->has_defers) return true;
+                for (int i = 0; i < type->function_info.num_params; i++) if (type->function_info.params[i].type.type->has_defers) return true;
+                return false;
+            default: return false;
+        }
+    }
     Type* primitive(TypeKind kind) {
+        if (primitives[kind]) return primitives[kind];
+        ForkLock lock;
         Type type;
         type.kind = kind;
         type.size = type.alignment =
@@ -1112,28 +1738,43 @@ struct TypeCache: Map<uint64_t, Type*> {
             kind == TypeKind_Int16   ? 2 :
             kind == TypeKind_Int32   ? 4 :
             kind == TypeKind_Float32 ? 4 : 8;
-        return register_type(&type);
+        return primitives[kind] = register_type(&type);
     }
     Type* unsign(Type* type) {
+        if (Type* cached = __atomic_load_n(&type->unsigned_of, __ATOMIC_ACQUIRE)) return cached;
+        ForkLock lock;
         Type unsigned_type = *type;
         unsigned_type.hash = 0;
         unsigned_type.is_unsigned = true;
-        return register_type(&unsigned_type);
+        return publish(type, &type->unsigned_of, register_type(&unsigned_type));
     }
     Type* constant(Type* type) {
+        if (Type* cached = __atomic_load_n(&type->const_of, __ATOMIC_ACQUIRE)) return cached;
+        ForkLock lock;
         Type const_type = *type;
         const_type.hash = 0;
         const_type.is_const = true;
-        return register_type(&const_type);
+        return publish(type, &type->const_of, register_type(&const_type));
+    }
+    Type* atomic(Type* type) {
+        if (Type* cached = __atomic_load_n(&type->atomic_of, __ATOMIC_ACQUIRE)) return cached;
+        ForkLock lock;
+        Type atomic_type = *type;
+        atomic_type.hash = 0;
+        atomic_type.is_atomic = true;
+        return publish(type, &type->atomic_of, register_type(&atomic_type));
     }
     Type* pointer(Type* type) {
+        if (Type* cached = __atomic_load_n(&type->pointer_to, __ATOMIC_ACQUIRE)) return cached;
+        ForkLock lock;
         Type ptr;
         ptr.kind = TypeKind_Pointer;
         ptr.size = ptr.alignment = 8;
         ptr.pointer_info.base = type;
-        return register_type(&ptr);
+        return publish(type, &type->pointer_to, register_type(&ptr));
     }
     Type* structure(List<Type::Field>* fields) {
+        ForkLock lock;
         Type type;
         type.kind = TypeKind_Struct;
         type.struct_info.num_fields = fields->size;
@@ -1143,6 +1784,7 @@ struct TypeCache: Map<uint64_t, Type*> {
         return register_type(&type);
     }
     Type* function(Type* ret, List<Type::Param>* params, bool lvalue_return) {
+        ForkLock lock;
         Type type;
         type.kind = TypeKind_Function;
         type.lvalue_return = lvalue_return;
@@ -1154,6 +1796,7 @@ struct TypeCache: Map<uint64_t, Type*> {
         return register_type(&type);
     }
     Type* deferred(char* name) {
+        ForkLock lock;
         Type type;
         type.kind = TypeKind_Deferred;
         type.defer_info.name = name;
@@ -1161,6 +1804,7 @@ struct TypeCache: Map<uint64_t, Type*> {
         return register_type(&type);
     }
     Type* parent_ref(int level) {
+        ForkLock lock;
         Type type;
         type.kind = TypeKind_Parent;
         type.parent_info.offset = level;
@@ -1168,11 +1812,13 @@ struct TypeCache: Map<uint64_t, Type*> {
     }
     Type* resolve_defers_inner(Type* orig, Context* context, Stack<Type*>* parent_stack);
     Type* resolve_single_defer(Type* orig, Context* context, Set<Type*>* visited);
-    Type* resolve_defers(Type* orig, Context* context) {
-        Stack<Type*> parent_stack;
-        Type* type = resolve_defers_inner(orig, context, &parent_stack);
+    Type* resolve_defers(Type* orig, Context* context);
+    Type* validate(Context* context, Type* type) {
+        if (type->validated) return type;
+        ForkLock lock;
         Set<Type*> visited(compare_int64);
         validate_type(context, type, &visited);
+        type->validated = true;
         return type;
     }
     void validate_type(Context* context, Type* type, Set<Type*>* visited) {
@@ -1187,6 +1833,86 @@ struct TypeCache: Map<uint64_t, Type*> {
             validate_type(context, field->type, visited);
         }
     }
+    // copies every type nothing can change anymore into a new cache in the bound allocator, for other contexts to share.
+    // types with defers depend on the bindings of a context and methods on its code, so those and whatever uses them stay here
+    TypeCache* seal(Context* context) {
+        TypeCache* sealed = new TypeCache;
+        HashMap<Type*, Type*> copies(hash_int64, compare_int64);
+        for (int i = 0; i < capacity; i++) if (pairs[i].used) sealed->seal_copy(context, pairs[i].value, &copies);
+        for (int i = 0; i < copies.capacity; i++) {
+            Type* type = copies.pairs[i].key;
+            Type* copy = copies.pairs[i].value;
+            if (!copies.pairs[i].used || !copy) continue;
+            copy->pointer_to = copies.getdef(type->pointer_to, NULL);
+            copy->const_of = copies.getdef(type->const_of, NULL);
+            copy->atomic_of = copies.getdef(type->atomic_of, NULL);
+            copy->unsigned_of = copies.getdef(type->unsigned_of, NULL);
+            if (copy->kind != TypeKind_Struct) continue;
+            copy->field_table = new Type::FieldTable;
+            copy->add_fields(copy->field_table, copy, NULL, 0);
+        }
+        for (int i = 0; i <= TypeKind_Parent; i++) sealed->primitives[i] = copies.getdef(primitives[i], NULL);
+        return sealed;
+    }
+    Type* seal_copy(Context* context, Type* type, HashMap<Type*, Type*>* copies) {
+        if (KeyValuePair* pair = copies->find(type)) return pair->value;
+        copies->add(type, NULL);
+        if (type->has_defers || type->kind == TypeKind_Parent) return NULL;
+        if (type->kind == TypeKind_Struct && !type->validated) {
+            try {
+                validate(context, type);
+            }
+            catch (Error* error) {
+                pawscript_destroy_error(error);
+                return NULL;
+            }
+        }
+        Type* copy = alloc->copy<Type>(type);
+        copy->parent = copy->pointer_to = copy->const_of = copy->atomic_of = copy->unsigned_of = copy->resolved = NULL;
+        copy->field_table = NULL;
+        copy->validated = copy->sealed = true;
+        copy->hash = 0;
+        bool closed = true;
+        switch (type->kind) {
+            case TypeKind_Pointer:
+                copy->pointer_info.base = Type::TypeHandle(seal_copy(context, type->pointer_info.base.type, copies), copy);
+                closed = copy->pointer_info.base.type;
+                break;
+            case TypeKind_Struct:
+                copy->struct_info.fields = alloc->copy(type->struct_info.fields, type->struct_info.num_fields);
+                for (size_t i = 0; i < copy->struct_info.num_fields; i++) {
+                    Type::Field* field = &copy->struct_info.fields[i];
+                    field->type = Type::TypeHandle(seal_copy(context, field->type.type, copies), copy);
+                    if (!field->type.type || (field->type.type->kind == TypeKind_Function && field->value)) closed = false;
+                }
+                break;
+            case TypeKind_Function:
+                copy->function_info.return_type = Type::TypeHandle(seal_copy(context, type->function_info.return_type.type, copies), copy);
+                copy->function_info.params = alloc->copy(type->function_info.params, type->function_info.num_params);
+                closed = copy->function_info.return_type.type;
+                for (size_t i = 0; i < copy->function_info.num_params; i++) {
+                    Type::Param* param = &copy->function_info.params[i];
+                    param->type = Type::TypeHandle(seal_copy(context, param->type.type, copies), copy);
+                    if (!param->type.type) closed = false;
+                }
+                break;
+            default: break;
+        }
+        if (!closed) {
+            copy->destroy();
+            return NULL;
+        }
+        // names can live in the code of the context that made the type
+        if (copy->kind == TypeKind_Struct) for (size_t i = 0; i < copy->struct_info.num_fields; i++) {
+            if (copy->struct_info.fields[i].name) copy->struct_info.fields[i].name = alloc->strdup(copy->struct_info.fields[i].name);
+        }
+        if (copy->kind == TypeKind_Function) for (size_t i = 0; i < copy->function_info.num_params; i++) {
+            if (copy->function_info.params[i].name) copy->function_info.params[i].name = alloc->strdup(copy->function_info.params[i].name);
+        }
+        hash_type(copy);
+        add(copy, copy);
+        return copies->add(type, copy);
+    }
 };
 
 struct Allocation {
@@ -1194,17 +1920,23 @@ struct Allocation {
     size_t size = -1;
     void(*cleanup)(void*, Context*, Type*);
     Type* type; Context* context;
+    Allocator* allocator; // a fork's allocations can come from its own allocator or its parent's
     Allocation(void* ptr): data(ptr) {}
     Allocation(size_t size, Context* context, Type* type, void(*cleanup)(void*, Context*, Type*)):
-        size(size), data(alloc->malloc<uint8_t>(size)), context(context), type(type), cleanup(cleanup) {}
-    ~Allocation() {
-        if (size == -1) return;
-        if (cleanup) cleanup(data, context, type);
-        alloc->free(data);
-    }
+        data(alloc->malloc<uint8_t>(size)), size(size), cleanup(cleanup), type(type), context(context), allocator(alloc) {}
+    ~Allocation();
 
     static void function_cleanup(void* ptr, Context* context, Type* type);
     static void struct_cleanup(void* ptr, Context* context, Type* type);
+    static void task_cleanup(void* ptr, Context* context, Type* type);
+    static void channel_cleanup(void* ptr, Context* context, Type* type);
+    static void generator_cleanup(void* ptr, Context* context, Type* type);
+};
+
+// a call in tail position, made by execute_function in place of the frame that returned it
+struct TailCall {
+    Variable function, this_ptr;
+    List<Variable> args;
 };
 
 struct Scope {
@@ -1212,6 +1944,21 @@ struct Scope {
     char* name;
     int row, col;
     int scope_id;
+    uint64_t id;
+    int num_captures;
+    char** capture_names;
+    Variable** captures;
+    bool owns_captures;
+    Function* function; // the script function the frame runs, NULL for the global one and includes
+    Type* signature; // the type it was called through
+    TailCall* tail;
+
+    Variable* captured(const char* name) {
+        for (int i = 0; i < num_captures; i++) {
+            if (captures[i] && strcmp(capture_names[i], name) == 0) return captures[i];
+        }
+        return NULL;
+    }
 };
 
 enum State {
@@ -1219,6 +1966,48 @@ enum State {
     State_Return,
     State_Continue,
     State_Break,
+    State_Throw, // a script throw unwinds like a return, the error waits in Context::error
+};
+
+// bytecode and the strings it interned, in an allocator of its own so it can outlive the context that compiled it.
+// bytecode only ever gets appended, contexts that share a program run it through shared readers
+struct Program {
+    struct Unit {
+        char* file;
+        char* source; // kept for snapshots, bytecode embeds addresses and is rebuilt from it instead
+        ByteReader* reader;
+    };
+    Allocator* allocator;
+    Set<char*>* strings;
+    List<Unit>* units; // in the order they were compiled
+    ByteReader* entry; // the compiled script, NULL for the code a context compiles for itself
+    TypeCache* types; // sealed by the first context that ran the script, the others look types up here before making their own
+    int refs;
+    int lock;
+
+    static Program* create() {
+        Allocator* allocator = new Allocator;
+        BindAllocator bind(allocator);
+        Program* program = alloc->malloc<Program>();
+        program->allocator = allocator;
+        program->strings = new Set<char*>(compare_int64);
+        program->units = new List<Unit>;
+        program->refs = 1;
+        return program;
+    }
+    Program* retain() {
+        __atomic_add_fetch(&refs, 1, __ATOMIC_RELAXED);
+        return this;
+    }
+    void release() {
+        if (__atomic_sub_fetch(&refs, 1, __ATOMIC_ACQ_REL) != 0) return;
+        Allocator* allocator = this->allocator;
+        BindAllocator bind(allocator);
+        for (int i = 0; i < units->size; i++) delete units->items[i].reader;
+        delete units;
+        delete strings;
+        delete allocator;
+    }
 };
 
 struct Context {
@@ -1233,29 +2022,49 @@ struct Context {
         }
     };
 
-    Set<char*>* strings;
-    Set<ByteReader*>* bytecodes;
+    Allocator* allocator;
+    Context* parent; // set on the forks parallel for iterations and tasks run on
+    int fork_base; // a fork's scopes below this one are its parent's
+    Program* code; // what pawscript_run compiles
+    List<Program*>* programs; // other code this context's functions can point into
     Stack<Scope*>* call_stack;
     Stack<Map<char*, Variable*>*>* variables;
     Stack<Set<Allocation*>*>* allocs;
     Map<void*, Function*>* function_cache;
+    Map<Type*, void*>* thunk_cache;
+    HashMap<void*, void*>* shared_sites;
+    CodeArena* code_arena;
     TypeCache* type_cache;
+    struct ParseFunction* parse_function;
     State state = State_Running;
-    Variable state_var, this_pointer;
-
+    uint64_t varying_nodes, type_reads; // counts nodes whose value can differ between runs, and loads of type variables
+    Error* error;
+    Error* jit_error; // raised by a helper called from compiled code, which returns through it instead of unwinding
+    TailCall* jit_tail; // the call compiled code returned, made by whatever ran the code
+    Variable state_var, this_pointer; // this_pointer is set by a method access and consumed by the call right after it
+
+    // caches embedded in the bytecode, shared bytecode stays read-only and its caches are kept on the side
+    template<typename T> T* site(ByteReader* reader) {
+        T* site = (T*)(reader->bytes + reader->ptr);
+        reader->skip(sizeof(T));
+        if (!reader->shared && !parent) return site; // forks run the same bytecode at once
+        void*& slot = shared_sites->get(site);
+        if (!slot) slot = alloc->malloc<uint8_t>(sizeof(T)); // the bytecode's own copy may hold another context's results
+        return (T*)slot;
+    }
     Variable* lookup_variable(const char* name) {
-        for (int i = variables->size - 1; i >= 0; i--) {
-            if (i != 0 && i < call_stack->peek()->scope_id) continue;
-            if (!variables->items[i]->has((char*)name)) continue;
-            Variable* var = variables->items[i]->get((char*)name);
-            Function* func = var->as<Function*>();
-            if (var->type->kind == TypeKind_Function && func && !func->is_native()) {
-                func->name = (char*)name;
-                func->this_ptr = NULL;
-            }
-            return var;
+        Variable* var = capture_variable(name);
+        if (!var) var = variables->items[0]->getdef((char*)name, NULL);
+        return var;
+    }
+    // local variables of the current frame, then the variables its function captured
+    Variable* capture_variable(const char* name) {
+        Scope* frame = call_stack->peek();
+        for (int i = variables->size - 1; i >= frame->scope_id && i > 0; i--) {
+            Variable* var = variables->items[i]->getdef((char*)name, NULL);
+            if (var) return var;
         }
-        return NULL;
+        return frame->captured(name);
     }
     Variable load(const char* name) {
         Variable* var = lookup_variable(name);
@@ -1265,17 +2074,19 @@ struct Context {
     }
     Variable store(const char* name, Variable var, void* symbol = NULL) {
         if (variables->peek()->has((char*)name)) return Variable();
-        Variable* copy = &alloc->copy(&var)->rvalue();
+        Variable* copy = &Variable::allocate(var)->rvalue();
         copy->retain();
         if (symbol) {
-            if (copy->type->kind == TypeKind_Function) copy->as<Function*>() = (Function*)symbol;
+            if (copy->type->kind == TypeKind_Function) copy->as<void*>() = symbol;
             else copy = &copy->lvalue(symbol);
         }
+        if (copy->type->kind == TypeKind_Type) type_cache->invalidate_defers();
         variables->peek()->add((char*)name, copy);
         return Variable(copy->type).lvalue(copy->ptr());
     }
     Variable store_ref(const char* name, Variable* var) {
         if (variables->peek()->has((char*)name)) return Variable();
+        if (var->type->kind == TypeKind_Type) type_cache->invalidate_defers();
         variables->peek()->add((char*)name, &var->retain());
         return Variable(var->type).lvalue(var->ptr());
     }
@@ -1290,6 +2101,7 @@ struct Context {
         Scope* scope = alloc->malloc<Scope>();
         scope->name = (char*)name;
         scope->scope_id = variables->size;
+        scope->id = __atomic_add_fetch(&type_cache->frame_ids, 1, __ATOMIC_RELAXED); // forks share the counter
         scope->file = call_stack->size > 0 ? call_stack->peek()->file : NULL;
         call_stack->push(scope);
         push_codeblock();
@@ -1297,6 +2109,11 @@ struct Context {
     void pop_stack_frame() {
         Scope* scope = call_stack->peek();
         while (variables->size > scope->scope_id) pop_codeblock();
+        if (scope->owns_captures) {
+            for (int i = 0; i < scope->num_captures; i++) if (scope->captures[i]) scope->captures[i]->release();
+            alloc->free(scope->captures);
+        }
+        delete scope->tail;
         call_stack->pop();
         alloc->free(scope);
     }
@@ -1306,70 +2123,105 @@ struct Context {
             Allocation* a = *(Allocation**)_a;
             Allocation* b = *(Allocation**)_b;
             int diff = (b->type->kind == TypeKind_Struct) - (a->type->kind == TypeKind_Struct);
-            return diff == 0 ? (uintptr_t)b - (uintptr_t)a : diff;
+            return diff == 0 ? ((uintptr_t)b > (uintptr_t)a) - ((uintptr_t)b < (uintptr_t)a) : diff;
         }));
     }
     void pop_codeblock() {
         Map<char*, Variable*>* map = variables->peek();
         Set<Allocation*>* scope = allocs->peek();
         for (int i = 0; i < scope->size; i++) delete scope->items[i];
-        for (int i = 0; i < map->size; i++) map->pairs[i].value->release();
+        for (int i = 0; i < map->size; i++) {
+            if (map->pairs[i].value->type->kind == TypeKind_Type) type_cache->invalidate_defers();
+            map->pairs[i].value->release();
+        }
         delete variables->pop();
         delete allocs->pop();
     }
+    // what popping and pushing the innermost codeblock would leave, except for the variable kept
+    void clear_codeblock(Variable* keep = NULL) {
+        Map<char*, Variable*>* map = variables->peek();
+        Set<Allocation*>* scope = allocs->peek();
+        if (map->size == (keep != NULL) && scope->size == 0) return;
+        for (int i = 0; i < scope->size; i++) delete scope->items[i];
+        scope->size = 0;
+        int kept = 0;
+        for (int i = 0; i < map->size; i++) {
+            if (map->pairs[i].value == keep) {
+                map->pairs[kept++] = map->pairs[i];
+                continue;
+            }
+            if (map->pairs[i].value->type->kind == TypeKind_Type) type_cache->invalidate_defers();
+            map->pairs[i].value->release();
+        }
+        map->size = kept;
+    }
     void pop_until(int scope) {
         scope++;
-        while (call_stack->peek()->scope_id > scope) pop_stack_frame();
+        while (call_stack->peek()->scope_id >= scope) pop_stack_frame();
         while (variables->size > scope) pop_codeblock();
     }
+    // raises a pending script throw as an exception, for callers that can't unwind by returning
+    void raise_pending() {
+        if (state != State_Throw) return;
+        Error* err = error;
+        state = State_Running;
+        error = NULL;
+        throw err;
+    }
     void* new_allocation(size_t size, bool scoped, Type* type, void(*cleanup)(void*, Context*, Type*) = NULL) {
+        ForkLock lock(!scoped); // the global scope is the parent's
         Set<Allocation*>* scope = allocs->items[0];
         if (scoped) scope = allocs->peek();
-        Allocation* alloc = new Allocation(size, this, type, cleanup);
+        Allocation* alloc = new Allocation(size, scoped || !parent ? this : parent, type, cleanup);
         scope->add(alloc);
         return alloc->data;
     }
+    // the scopes keep their allocations in the order they're cleaned up in, not by data, so they're looked through
+    Allocation* find_allocation(void* ptr, int* scope_id, int* index = NULL) {
+        for (int i = allocs->size - 1; i >= 0; i--) {
+            Set<Allocation*>* scope = allocs->items[i];
+            for (int j = 0; j < scope->size; j++) if (scope->items[j]->data == ptr) {
+                *scope_id = i;
+                if (index) *index = j;
+                return scope->items[j];
+            }
+        }
+        return NULL;
+    }
     void move_allocation(void* ptr, int new_scope) {
+        ForkLock lock;
         if (new_scope < 0) new_scope = 0;
         if (new_scope > variables->size - 1) new_scope = variables->size - 1;
-        for (int i = allocs->size - 1; i >= 0; i--) {
-            Set<Allocation*>* scope = allocs->items[i];
-            Allocation temp = ptr;
-            Allocation** alloc_ptr = scope->find(&temp);
-            if (!alloc_ptr) continue;
-            scope->remove(*alloc_ptr);
-            allocs->items[new_scope]->add(*alloc_ptr);
+        int scope_id, index;
+        Allocation* allocation = find_allocation(ptr, &scope_id, &index);
+        if (!allocation) return;
+        if (parent && new_scope < fork_base && allocation->allocator != parent->allocator) { // now outlives the fork
+            allocation->allocator->allocs.remove(allocation->data);
+            parent->allocator->allocs.add(allocation->data);
+            allocation->allocator = parent->allocator;
+            allocation->context = parent;
         }
+        allocs->items[scope_id]->remove_at(index);
+        allocs->items[new_scope]->add(allocation);
     }
     void delete_allocation(void* ptr) {
-        for (int i = allocs->size - 1; i >= 0; i--) {
-            Set<Allocation*>* scope = allocs->items[i];
-            Allocation temp = ptr;
-            Allocation** alloc_ptr = scope->find(&temp);
-            if (!alloc_ptr) continue;
-            delete *alloc_ptr;
-            scope->remove(*alloc_ptr);
-        }
+        ForkLock lock;
+        int scope_id, index;
+        Allocation* allocation = find_allocation(ptr, &scope_id, &index);
+        if (!allocation) return;
+        allocs->items[scope_id]->remove_at(index);
+        delete allocation;
     }
     int alloc_size(void* ptr) {
-        for (int i = allocs->size - 1; i >= 0; i--) {
-            Set<Allocation*>* scope = allocs->items[i];
-            Allocation temp = ptr;
-            Allocation** alloc_ptr = scope->find(&temp);
-            if (!alloc_ptr) continue;
-            return (*alloc_ptr)->size;
-        }
-        return -1;
+        ForkLock lock;
+        int scope_id;
+        Allocation* allocation = find_allocation(ptr, &scope_id);
+        return allocation ? allocation->size : -1;
     }
     int alloc_scope(void* ptr) {
-        for (int i = allocs->size - 1; i >= 0; i--) {
-            Set<Allocation*>* scope = allocs->items[i];
-            Allocation temp = ptr;
-            Allocation** alloc_ptr = scope->find(&temp);
-            if (!alloc_ptr) continue;
-            return i;
-        }
-        return -1;
+        ForkLock lock;
+        int scope_id;
+        return find_allocation(ptr, &scope_id) ? scope_id : -1;
     }
     bool is_allocated(void* ptr) {
         return alloc_size(ptr) != -1;
@@ -1392,28 +2244,103 @@ struct Context {
     }
 };
 
-Type* Type::unsign(Context* context) {
-    return context->type_cache->unsign(this);
+// the lock is the parent's allocator's, taken again by the same thread it only counts
+ForkLock::ForkLock(bool engage) {
+    if (!engage) return;
+    Allocator* owner = running_fork ? running_fork->parent->allocator : alloc;
+    if (!running_fork && !__atomic_load_n(&owner->shared, __ATOMIC_ACQUIRE)) return;
+    if (fork_lock_depth++ == 0) {
+        spin_lock(&owner->lock);
+        locked_allocator = owner;
+    }
+    held = true;
+    prev = alloc;
+    alloc = owner;
 }
 
-Type* Type::constant(Context* context) {
-    return context->type_cache->constant(this);
+ForkLock::~ForkLock() {
+    if (!held) return;
+    alloc = prev;
+    if (--fork_lock_depth > 0) return;
+    Allocator* owner = locked_allocator;
+    locked_allocator = NULL;
+    spin_unlock(&owner->lock);
 }
 
-Type* Type::pointer(Context* context) {
-    return context->type_cache->pointer(this);
+// a fault while holding the lock would leave it taken for good
+static void release_fork_lock() {
+    if (fork_lock_depth == 0) return;
+    fork_lock_depth = 0;
+    spin_unlock(&locked_allocator->lock);
+    locked_allocator = NULL;
 }
 
-Type* Type::function(Context* context, List<Type::Param>* params, bool lvalue_return) {
-    return context->type_cache->function(this, params, lvalue_return);
+Allocation::~Allocation() {
+    if (size == -1) return;
+    ForkLock lock(running_fork && allocator != running_fork->allocator); // made by the parent's allocator
+    BindAllocator bind(allocator);
+    if (cleanup) cleanup(data, context, type);
+    alloc->free(data);
 }
 
-Type* Type::resolve_defers(Context* context) {
-    return context->type_cache->resolve_defers(this, context);
+Type* TypeSite::lookup(Context* context, ByteReader* reader, Type* input) {
+    if (!result || this->input != input) return NULL;
+    if (bound && (epoch != context->type_cache->defer_epoch || frame != context->call_stack->peek()->id)) return NULL;
+    reader->seek(end);
+    return result;
 }
 
-Type* TypeCache::resolve_defers_inner(Type* orig, Context* context, Stack<Type*>* parent_stack) {
-    for (int i = parent_stack->size - 1; i >= 0; i--) {
+void TypeSite::store(Context* context, ByteReader* reader, Type* result, Type* input) {
+    this->input = input;
+    this->result = result;
+    this->epoch = context->type_cache->defer_epoch;
+    this->frame = context->call_stack->peek()->id;
+    this->end = reader->ptr;
+}
+
+Type* Type::unsign(Context* context) {
+    return context->type_cache->unsign(this);
+}
+
+Type* Type::constant(Context* context) {
+    return context->type_cache->constant(this);
+}
+
+Type* Type::atomic(Context* context) {
+    if (kind != TypeKind_Pointer && (kind < TypeKind_Int8 || kind > TypeKind_Int64))
+        throw Error::runtime(context, String::new_format("Type %s cannot be atomic", to_string()));
+    return context->type_cache->atomic(this);
+}
+
+Type* Type::pointer(Context* context) {
+    return context->type_cache->pointer(this);
+}
+
+Type* Type::function(Context* context, List<Type::Param>* params, bool lvalue_return) {
+    return context->type_cache->function(this, params, lvalue_return);
+}
+
+Type* Type::resolve_defers(Context* context) {
+    return context->type_cache->resolve_defers(this, context);
+}
+
+// the result only depends on the type bindings visible from the current frame,
+// so it is kept on the type until one of them changes or another frame asks
+Type* TypeCache::resolve_defers(Type* orig, Context* context) {
+    if (!orig->has_defers) return validate(context, orig);
+    ForkLock lock;
+    uint64_t frame = context->call_stack->peek()->id;
+    if (orig->resolved && orig->resolved_epoch == defer_epoch && orig->resolved_frame == frame) return orig->resolved;
+    Stack<Type*> parent_stack;
+    Type* type = validate(context, resolve_defers_inner(orig, context, &parent_stack));
+    orig->resolved = type;
+    orig->resolved_epoch = defer_epoch;
+    orig->resolved_frame = frame;
+    return type;
+}
+
+Type* TypeCache::resolve_defers_inner(Type* orig, Context* context, Stack<Type*>* parent_stack) {
+    for (int i = parent_stack->size - 1; i >= 0; i--) {
         if (parent_stack->items[i] == orig) return parent_ref(parent_stack->size - i);
     }
     switch (orig->kind) {
@@ -1472,7 +2399,7 @@ Type* TypeCache::resolve_single_defer(Type* type, Context* context, Set<Type*>*
 
 // == LEXER ==
 
-#define PROCESS_TOKENS(type) TOKENS(type##_KEYWORD, type##_SYMBOL, type##_SPECIAL)
+#define PROCESS_TOKENS(type) TOKENS(type##_KEYWORD, type##_SYMBOL, type##_SPECIAL, type##_CONTEXTUAL)
 
 #define ENUM_KEYWORD(x) TOKEN_##x,
 #define ENUM_SPECIAL(x) TOKEN_##x,
@@ -1480,13 +2407,20 @@ Type* TypeCache::resolve_single_defer(Type* type, Context* context, Set<Type*>*
 #define DECL_KEYWORD(x) #x,
 #define DECL_SPECIAL(x) NULL,
 #define DECL_SYMBOL(x, y) x,
-
-#define TOKENS(KEYWORD, SYMBOL, SPECIAL) \
+#define ENUM_CONTEXTUAL(x) TOKEN_##x,
+#define DECL_CONTEXTUAL(x) NULL,
+#define WORD_KEYWORD(x) NULL,
+#define WORD_SPECIAL(x) NULL,
+#define WORD_SYMBOL(x, y) NULL,
+#define WORD_CONTEXTUAL(x) #x,
+
+#define TOKENS(KEYWORD, SYMBOL, SPECIAL, CONTEXTUAL) \
     SPECIAL(END_OF_FILE) \
     KEYWORD(if) \
     KEYWORD(else) \
     KEYWORD(while) \
     KEYWORD(for) \
+    CONTEXTUAL(parallel) \
     KEYWORD(incl) \
     KEYWORD(excl) \
     KEYWORD(step) \
@@ -1506,6 +2440,20 @@ Type* TypeCache::resolve_single_defer(Type* type, Context* context, Set<Type*>*
     KEYWORD(scoped) \
     KEYWORD(delete) \
     KEYWORD(move) \
+    CONTEXTUAL(spawn) \
+    CONTEXTUAL(await) \
+    CONTEXTUAL(channel) \
+    CONTEXTUAL(send) \
+    CONTEXTUAL(receive) \
+    CONTEXTUAL(generator) \
+    CONTEXTUAL(yield) \
+    CONTEXTUAL(resume) \
+    CONTEXTUAL(finished) \
+    CONTEXTUAL(load) \
+    CONTEXTUAL(store) \
+    CONTEXTUAL(exchange) \
+    CONTEXTUAL(cas) \
+    CONTEXTUAL(fetch_add) \
     KEYWORD(defer) \
     KEYWORD(this) \
     KEYWORD(s8) \
@@ -1523,6 +2471,7 @@ Type* TypeCache::resolve_single_defer(Type* type, Context* context, Set<Type*>*
     KEYWORD(type) \
     KEYWORD(struct) \
     KEYWORD(const) \
+    CONTEXTUAL(atomic) \
     KEYWORD(extern) \
     KEYWORD(inline) \
     KEYWORD(true) \
@@ -1600,6 +2549,11 @@ static const char* token_table[] = {
 };
 static int num_token_table_entries = sizeof(token_table) / sizeof(*token_table);
 
+// the lexer leaves these as identifiers, the parser only reads them as keywords where their syntax follows
+static const char* contextual_table[] = {
+    PROCESS_TOKENS(WORD)
+};
+
 struct Token {
     int row, col;
     TokenKind type;
@@ -1627,13 +2581,20 @@ struct TokenQueue: Queue<Token*> {
     }
 };
 
+Error* Error::create(int num_frames, int extra) {
+    Error* err = (Error*)alloc->malloc<uint8_t>(sizeof(Error) + sizeof(ErrorFrame) * num_frames + extra);
+    err->allocator = alloc;
+    err->num_frames = num_frames;
+    err->frames = (ErrorFrame*)(err + 1);
+    return err;
+}
+
 Error* Error::syntax(const char* filename, int row, int col, String str) {
-    Error* err = alloc->malloc<Error>();
-    err->scope = alloc->malloc<ErrorScope>();
-    err->scope->name = alloc->strdup("<syntax>");
-    err->scope->file = alloc->strdup(filename);
-    err->scope->row = row;
-    err->scope->col = col;
+    int len = strlen(filename);
+    Error* err = create(1, len + 1);
+    char* file = (char*)(err->frames + 1);
+    memcpy(file, filename, len + 1);
+    err->frames[0] = { file, "<syntax>", row, col };
     err->msg = alloc->strdup(str.data);
     return err;
 }
@@ -1642,25 +2603,49 @@ Error* Error::parser(Token* token, String str) {
     return syntax(token->filename, token->row, token->col, str);
 }
 
-Error* Error::runtime(Context* context, String str) {
-    Error* err = alloc->malloc<Error>();
-    ErrorScope* last = NULL;
-    for (int i = context->call_stack->size - 1; i >= 0; i--) {
-        Scope* scope = context->call_stack->items[i];
-        ErrorScope* errscope = alloc->malloc<ErrorScope>();
-        if (!err->scope) err->scope = errscope;
-        if (last) last->parent = errscope;
-        errscope->row = scope->row;
-        errscope->col = scope->col;
-        errscope->name = scope->name;
-        errscope->file = scope->file;
-        last = errscope;
+Error* Error::runtime(Context* context, const char* text) {
+    int size = context->call_stack->size;
+    Error* err = create(size);
+    for (int i = 0; i < size; i++) {
+        Scope* scope = context->call_stack->items[size - 1 - i];
+        err->frames[i] = { scope->file, scope->name, scope->row, scope->col };
     }
-    err->msg = alloc->strdup(str.data);
+    err->text = text;
     context->state_var = Variable(context->type_cache->primitive(TypeKind_Void));
     return err;
 }
 
+Error* Error::runtime(Context* context, String str) {
+    Error* err = runtime(context, (const char*)NULL);
+    err->msg = alloc->strdup(str.data);
+    return err;
+}
+
+Error* Error::thrown(Context* context, Variable value) {
+    switch (value.type->kind) {
+        case TypeKind_Int8: case TypeKind_Int16: case TypeKind_Int32: case TypeKind_Int64:
+        case TypeKind_Float32: case TypeKind_Float64: {
+            Error* err = runtime(context, (const char*)NULL);
+            err->value_type = value.type;
+            err->value = value.as<uint64_t>();
+            return err;
+        }
+        // anything else may point at memory that is gone by the time the error is read
+        default: return runtime(context, value.to_string());
+    }
+}
+
+const char* Error::message() {
+    if (msg) return msg;
+    if (text) return text;
+    if (value_type) {
+        Variable var(value_type);
+        var.as<uint64_t>() = value;
+        return msg = alloc->strdup(var.to_string().data);
+    }
+    return "";
+}
+
 static bool is_alphanumeric(char c) {
     return (c >= '0' && c <= '9') || (c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z') || c == '_';
 }
@@ -1805,11 +2790,12 @@ static bool try_parse_flt(String* string, double* out) {
 }
 
 static char* append_string(Context* context, const char* str) {
-    char** ptr = (char**)bsearch(&str, context->strings->items, context->strings->size, sizeof(char*), compare_strings);
+    Set<char*>* strings = context->code->strings;
+    char** ptr = (char**)bsearch(&str, strings->items, strings->size, sizeof(char*), compare_strings);
     if (ptr) return *ptr;
     char* string = alloc->strdup(str);
-    context->strings->add(string);
-    qsort(context->strings->items, context->strings->size, sizeof(char*), compare_strings);
+    strings->add(string);
+    qsort(strings->items, strings->size, sizeof(char*), compare_strings);
     return string;
 }
 
@@ -1817,7 +2803,6 @@ static TokenQueue* lex(Context* context, const char* code, const char* filename)
     char c;
     size_t ptr = 0;
     bool no_increment = false;
-    bool zero = false;
     int digit = 0;
     int row = 1, col = 0;
     char* file = append_string(context, filename);
@@ -2062,16 +3047,20 @@ typedef enum: uint8_t {
     AST_ELSE,
     AST_WHILE,
     AST_FOR,
+    AST_PARALLEL_FOR,
+    AST_FOR_GENERATOR,
     AST_RETURN,
     AST_CONTINUE,
     AST_BREAK,
     AST_TRY,
     AST_THROW,
+    AST_YIELD,
     AST_CODEBLOCK,
     AST_EXPR,
 
     // suffix unary operators
     AST_CONST,
+    AST_ATOMIC,
     AST_SUFFIX_INCREMENT,
     AST_SUFFIX_DECREMENT,
     AST_POINTER,
@@ -2101,6 +3090,7 @@ typedef enum: uint8_t {
     AST_TRUTHY,
     AST_NULL,
     AST_VARIABLE,
+    AST_CAPTURE,
     AST_PAREN,
     AST_DEFER,
     AST_VARARGS,
@@ -2110,9 +3100,24 @@ typedef enum: uint8_t {
     AST_NEW,
     AST_DELETE,
     AST_MOVE,
+    AST_SPAWN,
+    AST_AWAIT,
+    AST_CHANNEL,
+    AST_SEND,
+    AST_RECEIVE,
+    AST_GENERATOR,
+    AST_RESUME,
+    AST_FINISHED,
+    AST_LOAD,
+    AST_STORE,
+    AST_EXCHANGE,
+    AST_CAS,
+    AST_FETCH_ADD,
     AST_TERNARY,
     AST_DECL,
     AST_INCLUDE,
+    AST_STATIC,
+    AST_TAIL_CALL, // an AST_CALL a return hands back to execute_function
 
     // operators
     AST_POWER,
@@ -2162,13 +3167,148 @@ enum AllocType: uint8_t {
     AllocType_Array,
 };
 
-static bool parse_expression(Context* context, ByteWriter* buf, TokenQueue* tokens, bool operand_only = false);
+// the type of a value as far as the parser can tell without running anything, kind Void if it can't
+struct StaticType {
+    TypeKind kind = TypeKind_Void;
+    bool is_unsigned = false;
+    bool is_const = false;
+    bool assignable = false;
+
+    bool is_integer() { return kind >= TypeKind_Int8 && kind <= TypeKind_Int64; }
+    bool is_number() { return kind >= TypeKind_Int8 && kind <= TypeKind_Float64; }
+};
+
+// lexical state of a function body being parsed, used to find the variables it has to capture
+// and the types of the ones it declares
+struct ParseFunction {
+    Context* context;
+    ParseFunction* parent;
+    CaptureMode capture_mode;
+    List<char*> declared;
+    List<StaticType> types; // of the declared variables
+    Stack<int> blocks;
+    List<char*> captures;
+    int call = -1; // where the call the last expression parsed ends with is, -1 if it ends with something else
+    int tries = 0; // try blocks being parsed, a call inside one can't leave the frame early
+    int parallel = 0; // parallel for bodies being parsed, nothing in them can return
+    int loops = 0;    // loops being parsed inside the innermost of those, which a break can leave
+
+    ParseFunction(Context* context, CaptureMode capture_mode): context(context), parent(context->parse_function), capture_mode(capture_mode) {
+        context->parse_function = this;
+    }
+    ~ParseFunction() {
+        context->parse_function = parent;
+    }
+    // index into the environment, or -1 if the name isn't captured
+    int reference(char* name) {
+        if (capture_mode == CaptureMode_None || strcmp(name, "this") == 0) return -1;
+        for (int i = declared.size - 1; i >= 0; i--) if (strcmp(declared.items[i], name) == 0) return -1;
+        int index = captures.indexof(name, compare_strings);
+        if (index != -1) return index;
+        captures.add(name);
+        if (parent) parent->reference(name);
+        return captures.size - 1;
+    }
+    // only variables declared in this function itself are known to hold what they were declared as
+    StaticType type_of(char* name) {
+        for (int i = declared.size - 1; i >= 0; i--) {
+            if (strcmp(declared.items[i], name) != 0) continue;
+            StaticType type = types.items[i];
+            type.assignable = type.is_number() && !type.is_const;
+            return type;
+        }
+        return StaticType();
+    }
+};
+
+static void parse_declare(Context* context, char* name, StaticType type = StaticType()) {
+    if (!context->parse_function) return;
+    context->parse_function->declared.add(name);
+    context->parse_function->types.add(type);
+}
+
+static void parse_push_block(Context* context) {
+    if (context->parse_function) context->parse_function->blocks.push(context->parse_function->declared.size);
+}
+
+static void parse_pop_block(Context* context) {
+    if (context->parse_function) context->parse_function->declared.size = context->parse_function->types.size = context->parse_function->blocks.pop();
+}
+
+// the type a type expression stands for, if it's a plain primitive
+static StaticType parse_static_type(ByteWriter* buf, int start) {
+    StaticType type;
+    int header = sizeof(AST_Node) + 2 * sizeof(int32_t) + sizeof(TypeSite);
+    int size = buf->size - start;
+    if (size != header + 4 && !(size == header + 5 && buf->bytes[buf->size - 1] == AST_END)) return type;
+    uint8_t* bytes = buf->bytes + start;
+    if (bytes[0] != AST_TYPE || bytes[header + 1]) return type; // atomics only change through the atomic operations
+    TypeKind kind = (TypeKind)bytes[header + 2];
+    if (kind < TypeKind_Int8 || kind > TypeKind_Float64) return type;
+    type.kind = kind;
+    type.is_const = bytes[header];
+    type.is_unsigned = bytes[header + 3];
+    return type;
+}
+
+static bool parse_expression(Context* context, ByteWriter* buf, TokenQueue* tokens, bool operand_only = false, StaticType* type = NULL);
 static void parse_command(Context* context, ByteWriter* buf, TokenQueue* tokens);
 static void parse_codeblock(Context* context, ByteWriter* buf, TokenQueue* tokens, Token* start);
+static void parse_function_body(Context* context, ByteWriter* buf, TokenQueue* tokens, Token* start, CaptureMode capture_mode);
+
+// -1 if the order doesn't exist or the operation can't take it
+static int memory_order(AST_Node node, const char* name) {
+    if (strcmp(name, "relaxed") == 0) return __ATOMIC_RELAXED;
+    if (strcmp(name, "seq_cst") == 0) return __ATOMIC_SEQ_CST;
+    if (strcmp(name, "acquire") == 0) return node != AST_STORE ? __ATOMIC_ACQUIRE : -1;
+    if (strcmp(name, "release") == 0) return node != AST_LOAD  ? __ATOMIC_RELEASE : -1;
+    if (strcmp(name, "acq_rel") == 0) return node != AST_LOAD && node != AST_STORE ? __ATOMIC_ACQ_REL : -1;
+    return -1;
+}
+
+// whether a variable of this name is declared in the code parsed so far or already exists as a global
+static bool parse_shadowed(Context* context, char* name) {
+    for (ParseFunction* function = context->parse_function; function; function = function->parent)
+        for (int i = 0; i < function->declared.size; i++) if (strcmp(function->declared.items[i], name) == 0) return true;
+    return context->variables->items[0]->has(name);
+}
+
+// turns the identifier about to be parsed into the contextual keyword it spells, if that keyword's syntax follows
+// and no variable takes the name. After an operand (suffix) only a type can go on, with atomic
+static void parse_contextual(Context* context, TokenQueue* tokens, bool suffix = false) {
+    Token* token = tokens->peek();
+    if (!token || token->type != TOKEN_IDENTIFIER) return;
+    TokenKind kind = TOKEN_IDENTIFIER;
+    for (int i = 0; i < num_token_table_entries; i++) if (contextual_table[i] && strcmp(contextual_table[i], token->value.string) == 0) kind = (TokenKind)i;
+    if (kind == TOKEN_IDENTIFIER) return;
+    Token* next = tokens->peek(1);
+    TokenKind follows = next ? next->type : TOKEN_END_OF_FILE;
+    if (suffix) { // a name declared with the type is followed by '=', ';', ',' or ')' instead
+        if (kind == TOKEN_atomic && (follows == TOKEN_IDENTIFIER || follows == TOKEN_HASHTAG || follows == TOKEN_const || follows == TOKEN_BRACKET_CLOSE)) token->type = kind;
+        return;
+    }
+    bool matches;
+    switch (kind) {
+        case TOKEN_parallel: // a variable can't be followed by 'for' either
+            if (follows == TOKEN_for) token->type = kind;
+            return;
+        case TOKEN_channel:
+        case TOKEN_generator: matches = follows == TOKEN_BRACKET_OPEN; break;
+        case TOKEN_yield: // then its value, of the symbols only those an operand can start with
+            matches = follows < TOKEN_PARENTHESIS_OPEN ? follows != TOKEN_END_OF_FILE :
+                follows == TOKEN_PARENTHESIS_OPEN || follows == TOKEN_MINUS || follows == TOKEN_PLUS || follows == TOKEN_EXCLAMATION_MARK ||
+                follows == TOKEN_TILDE || follows == TOKEN_HASHTAG || follows == TOKEN_DOLLAR || follows == TOKEN_DOUBLE_PLUS || follows == TOKEN_DOUBLE_MINUS;
+            break;
+        case TOKEN_atomic:    matches = (follows >= TOKEN_s8 && follows <= TOKEN_atomic) || follows == TOKEN_defer || follows == TOKEN_IDENTIFIER; break;
+        default:              matches = follows == TOKEN_PARENTHESIS_OPEN; break;
+    }
+    if (matches && !parse_shadowed(context, token->value.string)) token->type = kind;
+}
 
-static void parse_operand(Context* context, ByteWriter* buf, TokenQueue* tokens) {
+static StaticType parse_operand(Context* context, ByteWriter* buf, TokenQueue* tokens) {
     Stack<ByteWriter*>* prefix_stack = new Stack<ByteWriter*>;
     Token* token = NULL;
+    StaticType type;
     while (true) {
         ByteWriter* prefix = new ByteWriter;
         if      ((token = tokens->expect(TOKEN_DOUBLE_PLUS)))      prefix->write(AST_PREFIX_INCREMENT)->write<int32_t>(token->row)->write<int32_t>(token->col);
@@ -2185,21 +3325,29 @@ static void parse_operand(Context* context, ByteWriter* buf, TokenQueue* tokens)
         }
         prefix_stack->push(prefix);
     }
+    parse_contextual(context, tokens);
     if ((token = tokens->expect(TOKEN_INTEGER))) {
         buf->write(AST_INTEGER)->write<int32_t>(token->row)->write<int32_t>(token->col);
         buf->write(token->value.integer);
+        type.kind = token->value.integer < 2147483648ULL ? TypeKind_Int32 : TypeKind_Int64;
+        type.is_unsigned = token->value.integer >= 9223372036854775808ULL;
     }
     else if ((token = tokens->expect(TOKEN_FLOAT))) {
         buf->write(AST_FLOAT)->write<int32_t>(token->row)->write<int32_t>(token->col);
         buf->write(token->value.floating);
+        type.kind = TypeKind_Float64;
     }
     else if ((token = tokens->expect(TOKEN_STRING))) {
         buf->write(AST_STRING)->write<int32_t>(token->row)->write<int32_t>(token->col);
         buf->write(token->value.string);
     }
     else if ((token = tokens->expect(TOKEN_IDENTIFIER)) || (token = tokens->expect(TOKEN_this))) {
-        buf->write(AST_VARIABLE)->write<int32_t>(token->row)->write<int32_t>(token->col);
-        buf->write(token->type == TOKEN_IDENTIFIER ? token->value.string : "this");
+        char* name = token->type == TOKEN_IDENTIFIER ? token->value.string : (char*)"this";
+        int capture = context->parse_function ? context->parse_function->reference(name) : -1;
+        if (capture != -1) buf->write(AST_CAPTURE)->write<int32_t>(token->row)->write<int32_t>(token->col)->write<int32_t>(capture);
+        else buf->write(AST_VARIABLE)->write<int32_t>(token->row)->write<int32_t>(token->col);
+        buf->write(name);
+        if (capture == -1 && token->type == TOKEN_IDENTIFIER && context->parse_function) type = context->parse_function->type_of(name);
     }
     else if (
         (token = tokens->expect(TOKEN_true)) ||
@@ -2213,7 +3361,8 @@ static void parse_operand(Context* context, ByteWriter* buf, TokenQueue* tokens)
     }
     else if ((token = tokens->expect(TOKEN_PARENTHESIS_OPEN))) {
         buf->write(AST_PAREN)->write<int32_t>(token->row)->write<int32_t>(token->col);
-        parse_expression(context, buf, tokens);
+        parse_expression(context, buf, tokens, false, &type);
+        type.assignable = false;
         if (!tokens->expect(TOKEN_PARENTHESIS_CLOSE)) throw Error::parser(tokens->pop(), "Expected ')'");
     }
     else if ((token = tokens->expect(TOKEN_defer))) {
@@ -2280,19 +3429,17 @@ static void parse_operand(Context* context, ByteWriter* buf, TokenQueue* tokens)
         else {
             if (tokens->expect(TOKEN_EQUALS_ARROW)) {
                 buf->write(AllocType_Function);
+                CaptureMode capture_mode = CaptureMode_None;
                 if (tokens->expect(TOKEN_BRACKET_OPEN)) {
-                    if (tokens->expect(TOKEN_EQUALS)) buf->write(CaptureMode_CopyPerCall);
-                    else if (tokens->expect(TOKEN_TILDE)) buf->write(CaptureMode_CopyOnce);
-                    else if (tokens->expect(TOKEN_DOLLAR)) buf->write(CaptureMode_Shared);
+                    if (tokens->expect(TOKEN_EQUALS)) capture_mode = CaptureMode_CopyPerCall;
+                    else if (tokens->expect(TOKEN_TILDE)) capture_mode = CaptureMode_CopyOnce;
+                    else if (tokens->expect(TOKEN_DOLLAR)) capture_mode = CaptureMode_Shared;
                     else throw Error::parser(tokens->pop(), "Expected '=', `~` or '$'");
                     if (!tokens->expect(TOKEN_BRACKET_CLOSE)) throw Error::parser(tokens->pop(), "Expected ']'");
                 }
-                else buf->write(CaptureMode_None);
-                if (!tokens->expect(TOKEN_BRACE_OPEN)) throw Error::parser(tokens->pop(), "Expected '{'");
-                buf->push();
-                while (!tokens->expect(TOKEN_BRACE_CLOSE)) parse_command(context, buf, tokens);
-                buf->write(AST_END);
-                buf->pop();
+                buf->write(capture_mode);
+                if (!(token = tokens->expect(TOKEN_BRACE_OPEN))) throw Error::parser(tokens->pop(), "Expected '{'");
+                parse_function_body(context, buf, tokens, token, capture_mode);
             }
             else if (tokens->expect(TOKEN_BRACE_OPEN)) {
                 if (tokens->expect(TOKEN_BRACE_CLOSE)) buf->write(AllocType_None);
@@ -2333,6 +3480,89 @@ static void parse_operand(Context* context, ByteWriter* buf, TokenQueue* tokens)
         parse_expression(context, buf, tokens);
         if (!tokens->expect(TOKEN_BRACKET_CLOSE)) throw Error::parser(tokens->pop(), "Expected ']'");
     }
+    else if ((token = tokens->expect(TOKEN_spawn))) {
+        buf->write(AST_SPAWN)->write<int32_t>(token->row)->write<int32_t>(token->col);
+        if (!tokens->expect(TOKEN_PARENTHESIS_OPEN)) throw Error::parser(tokens->pop(), "Expected '('");
+        parse_expression(context, buf, tokens);
+        while (!tokens->expect(TOKEN_PARENTHESIS_CLOSE)) {
+            if (!tokens->expect(TOKEN_COMMA)) throw Error::parser(tokens->pop(), "Expected ',' or ')'");
+            parse_expression(context, buf, tokens);
+        }
+        buf->write(AST_END);
+    }
+    else if (
+        (token = tokens->expect(TOKEN_await)) ||
+        (token = tokens->expect(TOKEN_receive)) ||
+        (token = tokens->expect(TOKEN_resume)) ||
+        (token = tokens->expect(TOKEN_finished))
+    ) {
+        AST_Node node =
+            token->type == TOKEN_await   ? AST_AWAIT   :
+            token->type == TOKEN_receive ? AST_RECEIVE :
+            token->type == TOKEN_resume  ? AST_RESUME  : AST_FINISHED;
+        buf->write(node)->write<int32_t>(token->row)->write<int32_t>(token->col);
+        if (!tokens->expect(TOKEN_PARENTHESIS_OPEN)) throw Error::parser(tokens->pop(), "Expected '('");
+        parse_expression(context, buf, tokens);
+        if (!tokens->expect(TOKEN_PARENTHESIS_CLOSE)) throw Error::parser(tokens->pop(), "Expected ')'");
+    }
+    else if ((token = tokens->expect(TOKEN_channel))) {
+        buf->write(AST_CHANNEL)->write<int32_t>(token->row)->write<int32_t>(token->col);
+        if (!tokens->expect(TOKEN_BRACKET_OPEN)) throw Error::parser(tokens->pop(), "Expected '['");
+        parse_expression(context, buf, tokens);
+        if (!tokens->expect(TOKEN_BRACKET_CLOSE)) throw Error::parser(tokens->pop(), "Expected ']'");
+        if (!tokens->expect(TOKEN_PARENTHESIS_OPEN)) throw Error::parser(tokens->pop(), "Expected '('");
+        parse_expression(context, buf, tokens);
+        if (!tokens->expect(TOKEN_PARENTHESIS_CLOSE)) throw Error::parser(tokens->pop(), "Expected ')'");
+    }
+    else if ((token = tokens->expect(TOKEN_generator))) {
+        buf->write(AST_GENERATOR)->write<int32_t>(token->row)->write<int32_t>(token->col);
+        if (!tokens->expect(TOKEN_BRACKET_OPEN)) throw Error::parser(tokens->pop(), "Expected '['");
+        parse_expression(context, buf, tokens);
+        if (!tokens->expect(TOKEN_BRACKET_CLOSE)) throw Error::parser(tokens->pop(), "Expected ']'");
+        if (!tokens->expect(TOKEN_PARENTHESIS_OPEN)) throw Error::parser(tokens->pop(), "Expected '('");
+        parse_expression(context, buf, tokens);
+        while (!tokens->expect(TOKEN_PARENTHESIS_CLOSE)) {
+            if (!tokens->expect(TOKEN_COMMA)) throw Error::parser(tokens->pop(), "Expected ',' or ')'");
+            parse_expression(context, buf, tokens);
+        }
+        buf->write(AST_END);
+    }
+    else if ((token = tokens->expect(TOKEN_send))) {
+        buf->write(AST_SEND)->write<int32_t>(token->row)->write<int32_t>(token->col);
+        if (!tokens->expect(TOKEN_PARENTHESIS_OPEN)) throw Error::parser(tokens->pop(), "Expected '('");
+        parse_expression(context, buf, tokens);
+        if (!tokens->expect(TOKEN_COMMA)) throw Error::parser(tokens->pop(), "Expected ','");
+        parse_expression(context, buf, tokens);
+        if (!tokens->expect(TOKEN_PARENTHESIS_CLOSE)) throw Error::parser(tokens->pop(), "Expected ')'");
+    }
+    else if (
+        (token = tokens->expect(TOKEN_load)) ||
+        (token = tokens->expect(TOKEN_store)) ||
+        (token = tokens->expect(TOKEN_exchange)) ||
+        (token = tokens->expect(TOKEN_cas)) ||
+        (token = tokens->expect(TOKEN_fetch_add))
+    ) {
+        AST_Node node =
+            token->type == TOKEN_load     ? AST_LOAD     :
+            token->type == TOKEN_store    ? AST_STORE    :
+            token->type == TOKEN_exchange ? AST_EXCHANGE :
+            token->type == TOKEN_cas      ? AST_CAS      : AST_FETCH_ADD;
+        buf->write(node)->write<int32_t>(token->row)->write<int32_t>(token->col);
+        if (!tokens->expect(TOKEN_PARENTHESIS_OPEN)) throw Error::parser(tokens->pop(), "Expected '('");
+        int operands = node == AST_LOAD ? 1 : node == AST_CAS ? 3 : 2;
+        for (int i = 0; i < operands; i++) {
+            if (i > 0 && !tokens->expect(TOKEN_COMMA)) throw Error::parser(tokens->pop(), "Expected ','");
+            parse_expression(context, buf, tokens);
+        }
+        int order = __ATOMIC_SEQ_CST;
+        if (tokens->expect(TOKEN_COMMA)) {
+            if (!(token = tokens->expect(TOKEN_IDENTIFIER))) throw Error::parser(tokens->pop(), "Expected a memory order");
+            order = memory_order(node, token->value.string);
+            if (order == -1) throw Error::parser(token, String::new_format("Invalid memory order '%s'", token->value.string));
+        }
+        if (!tokens->expect(TOKEN_PARENTHESIS_CLOSE)) throw Error::parser(tokens->pop(), "Expected ')'");
+        buf->write<int32_t>(order);
+    }
     else if ((token = tokens->expect(TOKEN_if))) {
         buf->write(AST_TERNARY)->write<int32_t>(token->row)->write<int32_t>(token->col);
         parse_expression(context, buf, tokens);
@@ -2351,15 +3581,21 @@ static void parse_operand(Context* context, ByteWriter* buf, TokenQueue* tokens)
         buf->write(AST_INCLUDE)->write<int32_t>(token->row)->write<int32_t>(token->col);
         if (!(token = tokens->expect(TOKEN_STRING))) throw Error::parser(tokens->pop(), "Expected a string literal");
         buf->write(token->value.string);
+        // what it declares can shadow anything
+        if (context->parse_function) for (int i = 0; i < context->parse_function->types.size; i++) context->parse_function->types.items[i] = StaticType();
     }
     else {
         bool parsed = false;
-        buf->write(AST_TYPE)->write<int32_t>(tokens->peek()->row)->write<int32_t>(tokens->peek()->col);
-        if (tokens->expect(TOKEN_const)) {
-            buf->write(true);
+        buf->write(AST_TYPE)->write<int32_t>(tokens->peek()->row)->write<int32_t>(tokens->peek()->col)->write(TypeSite());
+        bool is_const = false, is_atomic = false;
+        while (true) {
+            parse_contextual(context, tokens);
+            if      (tokens->expect(TOKEN_const))  is_const = true;
+            else if (tokens->expect(TOKEN_atomic)) is_atomic = true;
+            else break;
             parsed = true;
         }
-        else buf->write(false);
+        buf->write(is_const)->write(is_atomic);
         if      (tokens->expect(TOKEN_s8))   { buf->write(TypeKind_Int8);    buf->write(false); }
         else if (tokens->expect(TOKEN_s16))  { buf->write(TypeKind_Int16);   buf->write(false); }
         else if (tokens->expect(TOKEN_s32))  { buf->write(TypeKind_Int32);   buf->write(false); }
@@ -2387,6 +3623,7 @@ static void parse_operand(Context* context, ByteWriter* buf, TokenQueue* tokens)
                 bool mandatory_name = false;
                 bool mandatory_codeblock = false;
                 if (tokens->expect(TOKEN_inline)) {
+                    inlined = true;
                     buf->write(true);
                     if (tokens->expect(TOKEN_PARENTHESIS_OPEN)) {
                         mandatory_name = true;
@@ -2432,9 +3669,7 @@ static void parse_operand(Context* context, ByteWriter* buf, TokenQueue* tokens)
                     if ((token = tokens->expect(TOKEN_BRACE_OPEN))) {
                         if (inlined) throw Error::parser(tokens->pop(), "Cannot pre-assign to an inline field");
                         buf->write(true)->write(true)->write(capture_mode);
-                        buf->push();
-                        parse_codeblock(context, buf, tokens, token);
-                        buf->pop();
+                        parse_function_body(context, buf, tokens, token, capture_mode);
                     }
                     else if (capture_mode != CaptureMode_None || mandatory_codeblock) throw Error::parser(tokens->pop(), "Expected '{'");
                     else buf->write(false);
@@ -2454,19 +3689,24 @@ static void parse_operand(Context* context, ByteWriter* buf, TokenQueue* tokens)
         }
         else throw Error::parser(tokens->pop(), parsed ? "Expected base type" : "Expected expression");
     }
+    int suffixes = buf->size, call = -1, call_end = -1;
     while (true) {
+        parse_contextual(context, tokens, true);
         if (
             (token = tokens->expect(TOKEN_DOUBLE_PLUS)) ||
             (token = tokens->expect(TOKEN_DOUBLE_MINUS)) ||
             (token = tokens->expect(TOKEN_HASHTAG)) ||
-            (token = tokens->expect(TOKEN_const))
+            (token = tokens->expect(TOKEN_const)) ||
+            (token = tokens->expect(TOKEN_atomic))
         ) buf->write(
             token->type == TOKEN_DOUBLE_PLUS  ? AST_SUFFIX_INCREMENT :
             token->type == TOKEN_DOUBLE_MINUS ? AST_SUFFIX_DECREMENT :
             token->type == TOKEN_HASHTAG      ? AST_POINTER          :
-            token->type == TOKEN_const        ? AST_CONST            : AST_END
+            token->type == TOKEN_const        ? AST_CONST            :
+            token->type == TOKEN_atomic       ? AST_ATOMIC           : AST_END
         )->write<int32_t>(token->row)->write<int32_t>(token->col);
         else if ((token = tokens->expect(TOKEN_PARENTHESIS_OPEN))) {
+            call = buf->size;
             buf->write(AST_CALL)->write<int32_t>(token->row)->write<int32_t>(token->col);
             if (!tokens->expect(TOKEN_PARENTHESIS_CLOSE)) while (true) {
                 parse_expression(context, buf, tokens);
@@ -2475,6 +3715,7 @@ static void parse_operand(Context* context, ByteWriter* buf, TokenQueue* tokens)
                 throw Error::parser(tokens->pop(), "Expected ',' or ')'");
             }
             buf->write(AST_END);
+            call_end = buf->size;
         }
         else if ((token = tokens->expect(TOKEN_BRACKET_OPEN))) {
             buf->write(AST_ARRAY)->write<int32_t>(token->row)->write<int32_t>(token->col);
@@ -2482,13 +3723,13 @@ static void parse_operand(Context* context, ByteWriter* buf, TokenQueue* tokens)
             if (!tokens->expect(TOKEN_BRACKET_CLOSE)) throw Error::parser(tokens->pop(), "Expected ']'");
         }
         else if ((token = tokens->expect(TOKEN_REVERSE_ARROW))) {
-            buf->write(AST_FUNCTION)->write<int32_t>(token->row)->write<int32_t>(token->col);
+            buf->write(AST_FUNCTION)->write<int32_t>(token->row)->write<int32_t>(token->col)->write(TypeSite());
             if (tokens->expect(TOKEN_DOLLAR)) buf->write(true);
             else buf->write(false);
             if (!tokens->expect(TOKEN_PARENTHESIS_OPEN)) throw Error::parser(tokens->pop(), "Expected '('");
             if (!tokens->expect(TOKEN_PARENTHESIS_CLOSE)) while (true) {
                 if ((token = tokens->expect(TOKEN_TRIPLE_DOT))) {
-                    buf->write(AST_TYPE)->write<int32_t>(token->row)->write<int32_t>(token->col)->write(false)->write(TypeKind_Varargs)->write(false);
+                    buf->write(AST_TYPE)->write<int32_t>(token->row)->write<int32_t>(token->col)->write(TypeSite())->write(false)->write(false)->write(TypeKind_Varargs)->write(false);
                     buf->write(AST_END)->write(false);
                     if (tokens->expect(TOKEN_PARENTHESIS_CLOSE)) break;
                     throw Error::parser(tokens->pop(), "Expected ')'");
@@ -2518,11 +3759,20 @@ static void parse_operand(Context* context, ByteWriter* buf, TokenQueue* tokens)
             buf->write(AST_WALK_STRUCT)->write<int32_t>(token->row)->write<int32_t>(token->col);
             if ((token = tokens->expect(TOKEN_IDENTIFIER))) buf->write(token->value.string);
             else throw Error::parser(tokens->pop(), "Expected identifier");
+            buf->write<Type::FieldEntry*>(NULL); // inline cache
         }
         else break;
     }
+    if (buf->size != suffixes) type = StaticType();
+    if (context->parse_function) context->parse_function->call = buf->size == call_end && prefix_stack->size == 0 ? call : -1;
+    for (int i = 0; i < prefix_stack->size; i++) {
+        AST_Node prefix = (AST_Node)prefix_stack->items[i]->bytes[0];
+        if (prefix != AST_ARITH_PLUS && prefix != AST_ARITH_NEGATE) type = StaticType();
+        type.assignable = false;
+    }
     while (prefix_stack->size > 0) buf->merge(prefix_stack->pop());
     delete prefix_stack;
+    return type;
 }
 
 #pragma clang diagnostic push
@@ -2594,6 +3844,7 @@ static struct OperatorInfo {
     [AST_POINTER]          = { TOKEN_HASHTAG,           OperatorInfo::OpFmt_Suffix },
     [AST_ARRAY]            = { TOKEN_BRACKET_OPEN,      OperatorInfo::OpFmt_Special_Array },
     [AST_CALL]             = { TOKEN_PARENTHESIS_OPEN,  OperatorInfo::OpFmt_Special_Call },
+    [AST_TAIL_CALL]        = { TOKEN_PARENTHESIS_OPEN,  OperatorInfo::OpFmt_Special_Call },
     [AST_FUNCTION]         = { TOKEN_REVERSE_ARROW,     OperatorInfo::OpFmt_Special_Function },
     [AST_GET_SIZE]         = { TOKEN_DOUBLE_COLON,      OperatorInfo::OpFmt_Special_GetSize },
     [AST_GET_LENGTH]       = { TOKEN_DOUBLE_COLON,      OperatorInfo::OpFmt_Special_GetLength },
@@ -2603,10 +3854,88 @@ static struct OperatorInfo {
 
 #pragma clang diagnostic pop
 
-static void infix_to_postfix(ByteWriter* outbuf, List<ByteWriter*>* list) {
+// the operator a compound assignment applies, AST_END for anything else
+static AST_Node compound_operator(AST_Node node) {
+    switch (node) {
+        case AST_ADD_ASSIGN:            return AST_ADDITION;
+        case AST_SUBTRACT_ASSIGN:       return AST_SUBTRACTION;
+        case AST_MULTIPLY_ASSIGN:       return AST_MULTIPLICATION;
+        case AST_DIVIDE_ASSIGN:         return AST_DIVISION;
+        case AST_POWER_ASSIGN:          return AST_POWER;
+        case AST_MODULO_ASSIGN:         return AST_MODULO;
+        case AST_BITSHIFT_LEFT_ASSIGN:  return AST_BITSHIFT_LEFT;
+        case AST_BITSHIFT_RIGHT_ASSIGN: return AST_BITSHIFT_RIGHT;
+        case AST_BITWISE_AND_ASSIGN:    return AST_BITWISE_AND;
+        case AST_BITWISE_OR_ASSIGN:     return AST_BITWISE_OR;
+        case AST_BITWISE_XOR_ASSIGN:    return AST_BITWISE_XOR;
+        default: return AST_END;
+    }
+}
+
+static bool is_comparison(AST_Node node) {
+    return node >= AST_LESS_THAN && node <= AST_NOT_EQUALS;
+}
+
+static bool is_bitwise(AST_Node node) {
+    return node == AST_BITSHIFT_LEFT || node == AST_BITSHIFT_RIGHT || (node >= AST_BITWISE_AND && node <= AST_BITWISE_XOR);
+}
+
+// what promote() will pick at runtime
+static StaticType promote(StaticType a, StaticType b) {
+    StaticType type;
+    if      (a.kind == TypeKind_Float64 || b.kind == TypeKind_Float64) type.kind = TypeKind_Float64;
+    else if (a.kind == TypeKind_Float32 || b.kind == TypeKind_Float32) type.kind = TypeKind_Float32;
+    else if (a.kind == TypeKind_Int64   || b.kind == TypeKind_Int64)   type.kind = TypeKind_Int64;
+    else type.kind = TypeKind_Int32;
+    type.is_unsigned = type.is_integer() && (a.is_unsigned || b.is_unsigned);
+    return type;
+}
+
+// turns a binary operator on numbers of known types into AST_STATIC, which carries the type the operands get promoted to
+// so that nothing has to be matched, promoted or cast when it runs, and pushes the type of its result
+static ByteWriter* infer_operator(ByteWriter* op, Stack<StaticType>* types) {
+    StaticType b = types->pop();
+    StaticType a = types->pop();
+    AST_Node node = (AST_Node)op->bytes[0];
+    AST_Node applied = compound_operator(node); // stays AST_END for a plain assignment
+    bool assignment = node == AST_ASSIGN || applied != AST_END;
+    if (!assignment) applied = node;
+    StaticType result;
+    bool inferred = a.is_number() && b.is_number() && (!assignment || a.assignable) && (
+        applied == AST_END ||
+        (applied >= AST_POWER && applied <= AST_SUBTRACTION) ||
+        is_comparison(applied) ||
+        (is_bitwise(applied) && a.is_integer() && b.is_integer())
+    );
+    if (!inferred) {
+        types->push(result);
+        return op;
+    }
+    StaticType promoted = applied == AST_END ? a : promote(a, b);
+    if (assignment) result = a;
+    else if (is_comparison(node)) {
+        result.kind = TypeKind_Int8;
+        result.is_unsigned = true;
+    }
+    else result = promoted;
+    result.is_const = result.assignable = false;
+    types->push(result);
+    ByteWriter* out = new ByteWriter;
+    out->write(AST_STATIC)->write(op->bytes + 1, 2 * sizeof(int32_t));
+    out->write(node)->write(promoted.kind)->write(promoted.is_unsigned);
+    delete op;
+    return out;
+}
+
+// merges the operand and operator buffers by precedence, types holds what's known of the operands and ends up with the result's
+static void infix_to_postfix(ByteWriter* outbuf, List<ByteWriter*>* list, List<StaticType>* types) {
     Stack<ByteWriter*>* op_stack = new Stack<ByteWriter*>;
+    Stack<StaticType>* type_stack = new Stack<StaticType>;
     for (int i = 0; i < list->size; i++) {
-        if (i % 2 == 0) outbuf->merge(list->items[i]);
+        if (i % 2 == 0) {
+            outbuf->merge(list->items[i]);
+            type_stack->push(types->items[i / 2]);
+        }
         else {
             AST_Node op = (AST_Node)list->items[i]->bytes[0];
             while (op_stack->size > 0) {
@@ -2615,31 +3944,42 @@ static void infix_to_postfix(ByteWriter* outbuf, List<ByteWriter*>* list) {
                     (!operator_info[op].right_associative && operator_info[op].precedence <= operator_info[top].precedence) ||
                     ( operator_info[op].right_associative && operator_info[op].precedence <  operator_info[top].precedence)
                 );
-                if (should_pop) outbuf->merge(op_stack->pop());
+                if (should_pop) outbuf->merge(infer_operator(op_stack->pop(), type_stack));
                 else break;
             }
             op_stack->push(list->items[i]);
         }
     }
-    while (op_stack->size > 0) outbuf->merge(op_stack->pop());
+    while (op_stack->size > 0) outbuf->merge(infer_operator(op_stack->pop(), type_stack));
+    types->size = 0;
+    types->add(type_stack->pop());
+    delete type_stack;
     delete op_stack;
     delete list;
 }
 
-static bool parse_expression(Context* context, ByteWriter* buf, TokenQueue* tokens, bool operand_only) {
+static bool parse_expression(Context* context, ByteWriter* buf, TokenQueue* tokens, bool operand_only, StaticType* type) {
     List<ByteWriter*>* buffers = new List<ByteWriter*>;
+    List<StaticType> types;
     bool require_semicolon = true;
+    int start = buf->size, call = -1;
     while (true) {
         ByteWriter* buffer = new ByteWriter;
         Token* extern_token = operand_only ? NULL : tokens->expect(TOKEN_extern);
         Token* token = NULL;
-        parse_operand(context, buffer, tokens);
+        types.add(parse_operand(context, buffer, tokens));
         buffers->add(buffer);
+        call = buffers->size == 1 && context->parse_function ? context->parse_function->call : -1;
         if (operand_only) break;
         if ((token = tokens->expect(TOKEN_IDENTIFIER))) {
+            StaticType declared = extern_token ? StaticType() : parse_static_type(buffer, 0);
+            declared.assignable = declared.is_number();
+            types.items[types.size - 1] = declared;
             buffer->write(AST_DECL)->write<int32_t>(token->row)->write<int32_t>(token->col);
+            call = -1;
             buffer->write(extern_token != NULL);
             buffer->write(token->value.string);
+            parse_declare(context, token->value.string, declared);
             CaptureMode capture_mode = CaptureMode_None;
             if (tokens->expect(TOKEN_PARENTHESIS_OPEN)) while (true) {
                 buffer->write(true);
@@ -2663,9 +4003,7 @@ static bool parse_expression(Context* context, ByteWriter* buf, TokenQueue* toke
                 require_semicolon = false;
                 buffer->write(true);
                 buffer->write(capture_mode);
-                buffer->push();
-                parse_codeblock(context, buffer, tokens, token);
-                buffer->pop();
+                parse_function_body(context, buffer, tokens, token, capture_mode);
             }
             else if (capture_mode != CaptureMode_None) throw Error::parser(tokens->pop(), "Expected '{'");
             else buffer->write(false);
@@ -2686,21 +4024,44 @@ static bool parse_expression(Context* context, ByteWriter* buf, TokenQueue* toke
         buffer->write(node)->write<int32_t>(token->row)->write<int32_t>(token->col);
         buffers->add(buffer);
     }
-    infix_to_postfix(buf, buffers);
+    infix_to_postfix(buf, buffers, &types);
     buf->write(AST_END);
+    if (context->parse_function) context->parse_function->call = call == -1 ? -1 : start + call;
+    if (type) *type = types.items[0];
     return require_semicolon;
 }
 
 static void parse_codeblock(Context* context, ByteWriter* buf, TokenQueue* tokens, Token* start) {
+    parse_push_block(context);
     if ((start && start->type == TOKEN_EQUALS_ARROW) || (!start && tokens->expect(TOKEN_EQUALS_ARROW))) parse_command(context, buf, tokens);
     else if ((start && start->type == TOKEN_BRACE_OPEN) || (!start && tokens->expect(TOKEN_BRACE_OPEN)))
         while (!tokens->expect(TOKEN_BRACE_CLOSE)) parse_command(context, buf, tokens);
     else throw Error::parser(tokens->pop(), "Expected '=>' or '{'");
+    parse_pop_block(context);
     buf->write(AST_END);
 }
 
+// writes the names of the captured variables, followed by the body
+static void parse_function_body(Context* context, ByteWriter* buf, TokenQueue* tokens, Token* start, CaptureMode capture_mode) {
+    ByteWriter* body = new ByteWriter;
+    ParseFunction function(context, capture_mode);
+    try {
+        body->push();
+        parse_codeblock(context, body, tokens, start);
+        body->pop();
+    }
+    catch (Error* error) {
+        delete body;
+        throw error;
+    }
+    buf->write<uint32_t>(function.captures.size);
+    for (int i = 0; i < function.captures.size; i++) buf->write(function.captures.items[i]);
+    buf->merge(body);
+}
+
 static void parse_command(Context* context, ByteWriter* buf, TokenQueue* tokens) {
     Token* token = NULL;
+    parse_contextual(context, tokens);
     if ((token = tokens->expect(TOKEN_if))) while (true) {
         buf->write(AST_IF)->write<int32_t>(token->row)->write<int32_t>(token->col);
         parse_expression(context, buf, tokens);
@@ -2723,17 +4084,37 @@ static void parse_command(Context* context, ByteWriter* buf, TokenQueue* tokens)
         buf->write(AST_WHILE)->write<int32_t>(token->row)->write<int32_t>(token->col);
         parse_expression(context, buf, tokens);
         buf->push();
+        context->parse_function->loops++;
         if (!tokens->expect(TOKEN_SEMICOLON)) parse_codeblock(context, buf, tokens, NULL);
         else buf->write(AST_END);
+        context->parse_function->loops--;
         buf->pop();
     }
-    else if ((token = tokens->expect(TOKEN_for))) {
-        buf->write(AST_FOR)->write<int32_t>(token->row)->write<int32_t>(token->col);
+    else if ((token = tokens->expect(TOKEN_for)) || (token = tokens->expect(TOKEN_parallel))) {
+        bool parallel = token->type == TOKEN_parallel;
+        if (parallel && !tokens->expect(TOKEN_for)) throw Error::parser(tokens->pop(), "Expected 'for'");
+        int node = buf->size;
+        buf->write(parallel ? AST_PARALLEL_FOR : AST_FOR)->write<int32_t>(token->row)->write<int32_t>(token->col);
+        int iterator_type = buf->size;
         parse_expression(context, buf, tokens, true);
-        if ((token = tokens->expect(TOKEN_IDENTIFIER))) buf->write(token->value.string);
+        StaticType type = parse_static_type(buf, iterator_type);
+        Token* iterator = tokens->expect(TOKEN_IDENTIFIER);
+        if (iterator) buf->write(iterator->value.string);
         else throw Error::parser(tokens->pop(), "Expected identifier");
         if (!tokens->expect(TOKEN_COLON)) throw Error::parser(tokens->pop(), "Expected ':'");
         parse_expression(context, buf, tokens);
+        if (!parallel && tokens->peek()->type == TOKEN_BRACE_OPEN) { // the values a generator yields
+            buf->bytes[node] = AST_FOR_GENERATOR;
+            parse_push_block(context);
+            parse_declare(context, iterator->value.string, type);
+            buf->push();
+            context->parse_function->loops++;
+            parse_codeblock(context, buf, tokens, NULL);
+            context->parse_function->loops--;
+            buf->pop();
+            parse_pop_block(context);
+            return;
+        }
         if (tokens->expect(TOKEN_excl)) buf->write(true);
         else if (tokens->expect(TOKEN_incl) || true) buf->write(false);
         if (!tokens->expect(TOKEN_EQUALS_ARROW)) throw Error::parser(tokens->pop(), "Expected '=>'");
@@ -2745,16 +4126,28 @@ static void parse_command(Context* context, ByteWriter* buf, TokenQueue* tokens)
             parse_expression(context, buf, tokens);
         }
         else buf->write(false);
+        parse_push_block(context);
+        parse_declare(context, iterator->value.string, type);
         buf->push();
+        ParseFunction* function = context->parse_function;
+        int loops = function->loops; // each iteration of a parallel for runs on its own, a break can't stop the others
+        function->loops = parallel ? 0 : loops + 1;
+        function->parallel += parallel;
         parse_codeblock(context, buf, tokens, NULL);
+        function->parallel -= parallel;
+        function->loops = loops;
         buf->pop();
+        parse_pop_block(context);
     }
     else if ((token = tokens->expect(TOKEN_return))) {
+        if (context->parse_function->parallel) throw Error::parser(token, "'return' inside a parallel for");
         buf->write(AST_RETURN)->write<int32_t>(token->row)->write<int32_t>(token->col);
         if (tokens->expect(TOKEN_SEMICOLON)) buf->write(false);
         else {
             buf->write(true);
             parse_expression(context, buf, tokens);
+            ParseFunction* function = context->parse_function;
+            if (function && function->call != -1 && function->tries == 0) buf->bytes[function->call] = AST_TAIL_CALL;
             if (!tokens->expect(TOKEN_SEMICOLON)) throw Error::parser(tokens->pop(), "Expected ';'");
         }
     }
@@ -2763,23 +4156,29 @@ static void parse_command(Context* context, ByteWriter* buf, TokenQueue* tokens)
         if (!tokens->expect(TOKEN_SEMICOLON)) throw Error::parser(tokens->pop(), "Expected ';'");
     }
     else if ((token = tokens->expect(TOKEN_break))) {
+        ParseFunction* function = context->parse_function;
+        if (function->parallel && !function->loops) throw Error::parser(token, "'break' inside a parallel for, only 'continue' ends an iteration early");
         buf->write(AST_BREAK)->write<int32_t>(token->row)->write<int32_t>(token->col);
         if (!tokens->expect(TOKEN_SEMICOLON)) throw Error::parser(tokens->pop(), "Expected ';'");
     }
     else if ((token = tokens->expect(TOKEN_try))) {
         buf->write(AST_TRY)->write<int32_t>(token->row)->write<int32_t>(token->col);
         buf->push();
+        if (context->parse_function) context->parse_function->tries++;
         parse_codeblock(context, buf, tokens, NULL);
+        if (context->parse_function) context->parse_function->tries--;
         buf->pop();
         if (tokens->expect(TOKEN_catch)) {
             buf->write(true);
             bool silently = tokens->expect(TOKEN_silently);
             buf->write(silently);
+            parse_push_block(context);
             if (tokens->expect(TOKEN_as)) {
                 silently = false;
                 buf->write(true);
                 if ((token = tokens->expect(TOKEN_IDENTIFIER))) buf->write(token->value.string);
                 else throw Error::parser(tokens->pop(), "Expected identifier");
+                parse_declare(context, token->value.string);
             }
             else buf->write(false);
             if (silently && tokens->expect(TOKEN_SEMICOLON)) buf->push()->write(AST_END)->pop();
@@ -2788,6 +4187,7 @@ static void parse_command(Context* context, ByteWriter* buf, TokenQueue* tokens)
                 parse_codeblock(context, buf, tokens, NULL);
                 buf->pop();
             }
+            parse_pop_block(context);
         }
         else buf->write(false);
     }
@@ -2802,6 +4202,11 @@ static void parse_command(Context* context, ByteWriter* buf, TokenQueue* tokens)
         else buf->write(false);
         if (!tokens->expect(TOKEN_SEMICOLON)) throw Error::parser(tokens->pop(), "Expected ';'");
     }
+    else if ((token = tokens->expect(TOKEN_yield))) {
+        buf->write(AST_YIELD)->write<int32_t>(token->row)->write<int32_t>(token->col);
+        parse_expression(context, buf, tokens);
+        if (!tokens->expect(TOKEN_SEMICOLON)) throw Error::parser(tokens->pop(), "Expected ';'");
+    }
     else if ((token = tokens->expect(TOKEN_EQUALS_ARROW)) || (token = tokens->expect(TOKEN_BRACE_OPEN))) {
         buf->write(AST_CODEBLOCK)->write<int32_t>(token->row)->write<int32_t>(token->col);
         parse_codeblock(context, buf, tokens, token);
@@ -2814,6 +4219,301 @@ static void parse_command(Context* context, ByteWriter* buf, TokenQueue* tokens)
     }
 }
 
+// == SCRIPT STACKS ==
+
+// script calls run on the thread's own stack until it runs low, then carry on in a segment mapped for them, so how deep they go is only
+// bounded by PAWSCRIPT_STACK. a segment can also be left halfway and entered again later, which suspends whatever runs on it
+static const size_t STACK_SEGMENT_SIZE = 1024 * 1024;
+static const size_t STACK_GUARD = 64 * 1024;
+static const size_t STACK_MARGIN = 128 * 1024; // what a call may take before the next check, native code it calls included
+static const size_t SIGNAL_STACK_SIZE = 64 * 1024;
+
+// address sanitizer has to be told about every switch, or it takes the segments for overflowing stack frames
+#ifndef _WIN32
+#if defined(__has_feature)
+#if __has_feature(address_sanitizer)
+#define STACK_SANITIZER
+#endif
+#endif
+#ifdef __SANITIZE_ADDRESS__
+#define STACK_SANITIZER
+#endif
+#endif
+#ifdef STACK_SANITIZER
+extern "C" void __sanitizer_start_switch_fiber(void** fake_stack_save, const void* bottom, size_t size);
+extern "C" void __sanitizer_finish_switch_fiber(void* fake_stack_save, const void** bottom_old, size_t* size_old);
+extern "C" void __asan_unpoison_memory_region(const volatile void* addr, size_t size);
+#endif
+
+struct StackSegment {
+    uint8_t* base; // the lowest usable address, the guard is below it
+    StackSegment* prev; // the segment it was entered from, NULL for the thread's own stack
+    void* caller; // where leaving it carries on
+#ifdef _WIN32
+    void* fiber;
+#else
+    void* sp; // where entering it carries on
+#endif
+    void (*run)(void* data);
+    void* data;
+    Error* error; // what the run threw, raised again on the stack that entered it
+    bool counted; // against the thread's PAWSCRIPT_STACK budget, a generator's own segment isn't
+#ifdef STACK_SANITIZER
+    void* fake_stack;
+    void* caller_fake_stack;
+    const void* caller_bottom;
+    size_t caller_size;
+#endif
+};
+
+struct ThreadStack {
+    uint8_t* low = NULL; // the lowest usable address of the thread's own stack
+    uint8_t* limit = NULL; // of the one running now
+    StackSegment* segment = NULL; // running now, NULL on the thread's own stack
+    StackSegment* spare = NULL; // so recursion going back and forth over a boundary doesn't map a segment every time
+    size_t mapped = 0;
+    void* signal_stack = NULL; // an overflow is reported from it, the stack that overflowed has no room left
+#ifdef _WIN32
+    bool converted = false;
+#endif
+    void init();
+    ~ThreadStack();
+};
+
+static thread_local ThreadStack thread_stack;
+
+static size_t stack_budget() {
+    static size_t budget = (getenv("PAWSCRIPT_STACK") && *getenv("PAWSCRIPT_STACK") ? strtoull(getenv("PAWSCRIPT_STACK"), NULL, 10) : 512) << 20;
+    return budget;
+}
+
+#ifndef _WIN32
+// saves the callee saved registers on the running stack, stores where they are in *from, then restores the ones at to
+static void __attribute__((naked)) switch_stack(void** from, void* to) { asm(
+    "push %rbp\n"
+    "push %rbx\n"
+    "push %r12\n"
+    "push %r13\n"
+    "push %r14\n"
+    "push %r15\n"
+    "sub $8, %rsp\n"
+    "stmxcsr (%rsp)\n"
+    "fnstcw 4(%rsp)\n"
+    "mov %rsp, (%rdi)\n"
+
+    "mov %rsi, %rsp\n"
+    "ldmxcsr (%rsp)\n"
+    "fldcw 4(%rsp)\n"
+    "add $8, %rsp\n"
+    "pop %r15\n"
+    "pop %r14\n"
+    "pop %r13\n"
+    "pop %r12\n"
+    "pop %rbx\n"
+    "pop %rbp\n"
+    "ret\n"
+); }
+#endif
+
+void ThreadStack::init() {
+    uint8_t* sp = (uint8_t*)__builtin_frame_address(0);
+    low = sp - STACK_MARGIN; // unless the thread's stack can be found, the next call moves to a segment
+#ifdef _WIN32
+    ULONG_PTR stack_low, stack_high;
+    GetCurrentThreadStackLimits(&stack_low, &stack_high);
+    low = (uint8_t*)stack_low + STACK_GUARD;
+#elif defined(__APPLE__)
+    pthread_t self = pthread_self();
+    low = (uint8_t*)pthread_get_stackaddr_np(self) - pthread_get_stacksize_np(self) + STACK_GUARD;
+#else
+    pthread_attr_t attr;
+    if (pthread_getattr_np(pthread_self(), &attr) == 0) {
+        void* addr;
+        size_t size;
+        if (pthread_attr_getstack(&attr, &addr, &size) == 0 && (uint8_t*)addr < sp) low = (uint8_t*)addr;
+        pthread_attr_destroy(&attr);
+    }
+#endif
+    limit = low;
+#ifndef _WIN32
+    stack_t current;
+    if (sigaltstack(NULL, &current) == 0 && (current.ss_flags & SS_DISABLE)) { // unless the host set up one already
+        stack_t alternate = {};
+        alternate.ss_sp = signal_stack = mmap(NULL, SIGNAL_STACK_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        alternate.ss_size = SIGNAL_STACK_SIZE;
+        if (signal_stack == MAP_FAILED || sigaltstack(&alternate, NULL) != 0) {
+            if (signal_stack != MAP_FAILED) munmap(signal_stack, SIGNAL_STACK_SIZE);
+            signal_stack = NULL;
+        }
+    }
+#endif
+}
+
+static void free_stack_segment(StackSegment* segment) {
+#ifdef _WIN32
+    DeleteFiber(segment->fiber);
+#else
+#ifdef STACK_SANITIZER
+    // frames of a run that was dropped suspended never returned, the next mapping here mustn't inherit their redzones
+    __asan_unpoison_memory_region(segment->base, STACK_SEGMENT_SIZE - STACK_GUARD);
+#endif
+    munmap(segment->base - STACK_GUARD, STACK_SEGMENT_SIZE);
+#endif
+    if (segment->counted) thread_stack.mapped -= STACK_SEGMENT_SIZE;
+    delete segment;
+}
+
+ThreadStack::~ThreadStack() {
+    if (spare) free_stack_segment(spare);
+#ifdef _WIN32
+    if (converted) ConvertFiberToThread();
+#else
+    if (signal_stack) {
+        stack_t none = {};
+        none.ss_flags = SS_DISABLE;
+        sigaltstack(&none, NULL);
+        munmap(signal_stack, SIGNAL_STACK_SIZE);
+    }
+#endif
+}
+
+static inline bool stack_low() {
+    ThreadStack* stack = &thread_stack;
+    if (!stack->limit) stack->init();
+    return (uint8_t*)__builtin_frame_address(0) < stack->limit + STACK_MARGIN;
+}
+
+// a run suspended from a segment it went on to from this one carries on at top when entered again
+static void leave_stack_segment(StackSegment* segment, StackSegment* top = NULL) {
+    if (!top) top = segment;
+#ifdef _WIN32
+    SwitchToFiber(segment->caller);
+#else
+#ifdef STACK_SANITIZER
+    __sanitizer_start_switch_fiber(&top->fake_stack, segment->caller_bottom, segment->caller_size);
+#endif
+    switch_stack(&top->sp, segment->caller);
+#ifdef STACK_SANITIZER
+    __sanitizer_finish_switch_fiber(top->fake_stack, &segment->caller_bottom, &segment->caller_size);
+#endif
+#endif
+}
+
+// where every segment starts, runs what it's entered for each time
+#ifdef _WIN32
+static VOID CALLBACK run_stack_segment(LPVOID) {
+    ULONG_PTR stack_low, stack_high;
+    GetCurrentThreadStackLimits(&stack_low, &stack_high);
+    thread_stack.segment->base = (uint8_t*)stack_low + STACK_GUARD;
+    thread_stack.limit = thread_stack.segment->base;
+#else
+static void run_stack_segment() {
+#ifdef STACK_SANITIZER
+    __sanitizer_finish_switch_fiber(NULL, &thread_stack.segment->caller_bottom, &thread_stack.segment->caller_size);
+#endif
+#endif
+    while (true) {
+        StackSegment* segment = thread_stack.segment;
+        try {
+            segment->run(segment->data);
+        }
+        catch (Error* error) {
+            segment->error = error;
+        }
+        leave_stack_segment(segment);
+    }
+}
+
+static StackSegment* new_stack_segment(Context* context, bool counted = true) {
+    ThreadStack* stack = &thread_stack;
+    if (counted && stack->mapped + STACK_SEGMENT_SIZE > stack_budget()) throw Error::runtime(context, "Stack overflow");
+    StackSegment* segment = new StackSegment();
+    segment->counted = counted;
+#ifdef _WIN32
+    if (!stack->converted && !IsThreadAFiber()) stack->converted = ConvertThreadToFiberEx(NULL, FIBER_FLAG_FLOAT_SWITCH) != NULL;
+    segment->fiber = CreateFiberEx(0, STACK_SEGMENT_SIZE, FIBER_FLAG_FLOAT_SWITCH, run_stack_segment, NULL);
+    if (!segment->fiber) {
+        delete segment;
+        throw Error::runtime(context, "Stack overflow");
+    }
+#else
+    uint8_t* memory = (uint8_t*)mmap(NULL, STACK_SEGMENT_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (memory == MAP_FAILED) {
+        delete segment;
+        throw Error::runtime(context, "Stack overflow");
+    }
+    mprotect(memory, STACK_GUARD, PROT_NONE);
+    segment->base = memory + STACK_GUARD;
+    // what switch_stack restores the first time: default control words, zeroed registers, then a return into run_stack_segment,
+    // which sees a null return address above it as if it had been called
+    uint64_t* top = (uint64_t*)(memory + STACK_SEGMENT_SIZE);
+    *--top = 0;
+    *--top = (uint64_t)(uintptr_t)run_stack_segment;
+    for (int i = 0; i < 6; i++) *--top = 0;
+    *--top = 0x037F00001F80;
+    segment->sp = top;
+#endif
+    if (counted) stack->mapped += STACK_SEGMENT_SIZE;
+    return segment;
+}
+
+// returns once the segment is left, by finishing the run or by suspending it. a suspended run carries on at top
+static void enter_stack_segment(StackSegment* segment, StackSegment* top = NULL) {
+    ThreadStack* stack = &thread_stack;
+    if (!top) top = segment;
+    segment->prev = stack->segment;
+    stack->segment = top;
+    stack->limit = top->base;
+#ifdef _WIN32
+    segment->caller = GetCurrentFiber();
+    SwitchToFiber(top->fiber);
+#else
+#ifdef STACK_SANITIZER
+    __sanitizer_start_switch_fiber(&segment->caller_fake_stack, top->base, STACK_SEGMENT_SIZE - STACK_GUARD);
+#endif
+    switch_stack(&segment->caller, top->sp);
+#ifdef STACK_SANITIZER
+    __sanitizer_finish_switch_fiber(segment->caller_fake_stack, NULL, NULL);
+#endif
+#endif
+    stack->segment = segment->prev;
+    stack->limit = segment->prev ? segment->prev->base : stack->low;
+}
+
+// runs body on a segment, for a call that would go past the margin on the one running now
+template<typename F> static void on_new_stack(Context* context, F& body) {
+    ThreadStack* stack = &thread_stack;
+    StackSegment* segment = stack->spare ? stack->spare : new_stack_segment(context);
+    stack->spare = NULL;
+    segment->run = [](void* data) { (*(F*)data)(); };
+    segment->data = &body;
+    segment->error = NULL;
+    enter_stack_segment(segment);
+    if (stack->spare) free_stack_segment(stack->spare);
+    stack->spare = segment;
+    if (segment->error) throw segment->error;
+}
+
+// a segfault jumps back to where the code was entered, past the segments it may have been running on
+static void release_abandoned_segments() {
+    ThreadStack* stack = &thread_stack;
+    uint8_t* sp = (uint8_t*)__builtin_frame_address(0);
+    while (stack->segment && (sp < stack->segment->base || sp >= stack->segment->base + STACK_SEGMENT_SIZE)) {
+        StackSegment* segment = stack->segment;
+        stack->segment = segment->prev;
+#ifndef _WIN32
+        free_stack_segment(segment); // a fiber can't be deleted while the thread still counts as running on it
+#endif
+    }
+    if (stack->limit) stack->limit = stack->segment ? stack->segment->base : stack->low;
+}
+
+// a fault just under the stack that was running is it running out rather than a bad pointer
+static bool stack_overflow_at(void* addr) {
+    uint8_t* limit = thread_stack.limit;
+    return limit && (uint8_t*)addr < limit && (uint8_t*)addr >= limit - STACK_MARGIN - STACK_GUARD;
+}
+
 // == INTERPRETER ==
 
 static bool execute_operator(Context* context, ByteReader* reader, Stack<Variable>* stack, AST_Node node);
@@ -2822,9 +4522,24 @@ static Variable execute_expression(Context* context, ByteReader* reader);
 static Variable execute_codeblock(Context* context, ByteReader* reader, bool push_scope = true);
 static Variable execute_command(Context* context, ByteReader* reader);
 static Error* execute_file(Context* context, const char* filename);
+static void execute_parallel_for(Context* context, ByteReader* reader, Type* iter_type, char* name, uint64_t first, uint64_t step, uint64_t count);
+static Variable spawn_task(Context* context, Variable function, List<Variable>* args);
+static Variable await_task(Context* context, Variable handle);
+static Variable new_channel(Context* context, Type* type, uint64_t capacity);
+static void send_channel(Context* context, Variable handle, Variable value);
+static Variable receive_channel(Context* context, Variable handle);
+static Variable new_generator(Context* context, Type* type, Variable function, List<Variable>* args);
+static Variable resume_generator(Context* context, Variable handle);
+static Variable generator_finished(Context* context, Variable handle);
+static bool next_generator_value(Context* context, Variable handle, Variable* value);
+static void yield_generator(Context* context, Variable value);
+
+typedef uint64_t(*JitCode)(Context* context, uint64_t* args);
+static JitCode jit_lookup(Context* context, Function* func, Type* type);
+static Variable jit_execute(Context* context, JitCode code, Type* type, List<Variable>* args);
+static void jit_warm(Context* context);
 
 API void pawscript_log_error(Error* error, FILE* f);
-API void pawscript_destroy_error(Error* error);
 
 enum VariableType: uint8_t {
     VarType_Integer,
@@ -2866,60 +4581,65 @@ static bool matches(TypeKind kind, uint8_t type) {
 }
 
 static bool matches(Variable* variable, uint8_t type) {
-    if ((type & VarType_Assignable) && !variable->ref) return false;
+    if ((type & VarType_Assignable) && !variable->is_ref()) return false;
     return matches(variable->type->kind, type);
 }
 
 static Variable cast(Context* context, Type* type, Variable var, bool bitcast = false, bool implicit = true) {
     type = type->resolve_defers(context);
     Variable out(type);
-    if (bitcast) out << var;
+    if (type == var.type) out._value = var.rvalue()._value;
+    else if (bitcast) out << var;
     else if (type->kind == TypeKind_Float32) {
-        if      (type->kind == TypeKind_Float32) out.as<float>() = var.as<float>();
-        else if (type->kind == TypeKind_Float64) out.as<float>() = var.as<double>();
+        if      (var.type->kind == TypeKind_Float32) out.as<float>() = var.as<float>();
+        else if (var.type->kind == TypeKind_Float64) out.as<float>() = var.as<double>();
         else {
-            if (type->is_unsigned) out.as<float>() = out.as<uint64_t>();
-            else out.as<float>() = out.as<int64_t>();
+            if (var.type->is_unsigned) out.as<float>() = var.as<uint64_t>();
+            else out.as<float>() = var.as<int64_t>();
         }
     }
     else if (type->kind == TypeKind_Float64) {
-        if      (type->kind == TypeKind_Float32) out.as<double>() = var.as<float>();
-        else if (type->kind == TypeKind_Float64) out.as<double>() = var.as<double>();
+        if      (var.type->kind == TypeKind_Float32) out.as<double>() = var.as<float>();
+        else if (var.type->kind == TypeKind_Float64) out.as<double>() = var.as<double>();
         else {
-            if (type->is_unsigned) out.as<double>() = out.as<uint64_t>();
-            else out.as<double>() = out.as<int64_t>();
+            if (var.type->is_unsigned) out.as<double>() = var.as<uint64_t>();
+            else out.as<double>() = var.as<int64_t>();
         }
     }
     else {
-        uint64_t value = 0;
-        if      (type->kind == TypeKind_Float32) out.as<uint64_t>() = var.as<float>();
-        else if (type->kind == TypeKind_Float64) out.as<uint64_t>() = var.as<double>();
+        if      (var.type->kind == TypeKind_Float32) out.as<uint64_t>() = var.as<float>();
+        else if (var.type->kind == TypeKind_Float64) out.as<uint64_t>() = var.as<double>();
         else out << var;
     }
     return out;
 }
 
-static Type* promote(Context* context, Variable* a, Variable* b) {
+static Type* promote(Context* context, Type* a, Type* b) {
     TypeKind kind = TypeKind_Int32;
-    bool is_unsigned = a->type->is_unsigned || b->type->is_unsigned;
+    bool is_unsigned = a->is_unsigned || b->is_unsigned;
     if (
-        a->type->kind == TypeKind_Int64 ||
-        b->type->kind == TypeKind_Int64
+        a->kind == TypeKind_Int64 ||
+        b->kind == TypeKind_Int64
     ) kind = TypeKind_Int64;
     if (
-        a->type->kind == TypeKind_Float32 ||
-        b->type->kind == TypeKind_Float32
+        a->kind == TypeKind_Float32 ||
+        b->kind == TypeKind_Float32
     ) { kind = TypeKind_Float32; is_unsigned = false; }
     if (
-        a->type->kind == TypeKind_Float64 ||
-        b->type->kind == TypeKind_Float64
+        a->kind == TypeKind_Float64 ||
+        b->kind == TypeKind_Float64
     ) { kind = TypeKind_Float64; is_unsigned = false; }
     if (
-        a->type->kind == TypeKind_Pointer ||
-        b->type->kind == TypeKind_Pointer
+        a->kind == TypeKind_Pointer ||
+        b->kind == TypeKind_Pointer
     ) { kind = TypeKind_Int64; is_unsigned = true; }
     Type* type = context->type_cache->primitive(kind);
     if (is_unsigned) type = type->unsign(context);
+    return type;
+}
+
+static Type* promote(Context* context, Variable* a, Variable* b) {
+    Type* type = promote(context, a->type, b->type);
     *a = cast(context, type, *a);
     *b = cast(context, type, *b);
     return type;
@@ -2941,92 +4661,170 @@ static void execute_params(Context* context, ByteReader* reader, List<Type::Para
     }
 }
 
-static Variable execute_function(Context* context, Variable* function, List<Variable>* args) {
-    if (function->type->kind != TypeKind_Function) throw Error::runtime(context, "Attempt to call a non-function value");
-    Type::Param* params = function->type->function_info.params;
-    size_t num_params = function->type->function_info.num_params;
-    int varargs_index = num_params > 0 && params[num_params - 1].type->kind == TypeKind_Varargs ? num_params - 1 : -1;
-    if (varargs_index == -1 && num_params != args->size) throw Error::runtime(context, String::new_format("Non-matching number of arguments (expected %d, got %d)", num_params, args->size));
-    else if (args->size < varargs_index) throw Error::runtime(context, String::new_format("Non-matching number of arguments (expected >=%d, got %d)", varargs_index, args->size));
-    for (int i = 0; i < num_params; i++) {
-        if (params[i].type->kind == TypeKind_Varargs) break;
-        args->get(i) = cast(context, params[i].type, args->get(i), false, true);
-    }
-    if (function->as<Function*>() == NULL) throw Error::runtime(context, "Calling an unset function");
-    if (function->as<Function*>()->is_native()) {
-        if (function->type->lvalue_return) throw Error::runtime(context, "Cannot call a native assignable function");
-        FFI ffi;
-        for (int i = 0; i < args->size; i++) {
-            if (!ffi.varargs && params[i].type->kind == TypeKind_Varargs) ffi.varargs = true;
-            if      (args->get(i).type->kind == TypeKind_Float32) ffi.push_f32(args->get(i).as<float>());
-            else if (args->get(i).type->kind == TypeKind_Float64) ffi.push_f64(args->get(i).as<double>());
-            else ffi.push_int(args->get(i).as<uint64_t>());
-        }
-        ffi.call(function->as<void*>());
-        Variable retval(function->type->function_info.return_type);
-        if      (retval.type->kind == TypeKind_Float32) retval.as<float>() = ffi.get_f32();
-        else if (retval.type->kind == TypeKind_Float64) retval.as<double>() = ffi.get_f64();
-        else retval.as<uint64_t>() = ffi.get_int();
-        return retval;
-    }
-    else {
-        Function* func = function->as<Function*>();
-        context->push_stack_frame(func->name);
-        context->set_file_location(func->file);
-        if (func->capture_mode != CaptureMode_None) for (int i = 0; i < func->variables->size; i++) {
-            if (func->capture_mode == CaptureMode_Shared || func->capture_mode == CaptureMode_CopyOnce)
-                context->store_ref(func->variables->pairs[i].key, func->variables->pairs[i].value);
-            if (func->capture_mode == CaptureMode_CopyPerCall)
-                context->store(func->variables->pairs[i].key, *func->variables->pairs[i].value);
-        }
-        for (int i = 0; i < num_params; i++) {
-            if (params[i].type->kind == TypeKind_Varargs) break;
-            char* name = params[i].name;
-            Variable var = context->store(name, args->get(i));
-            if (!var.type) {
-                if (func->variables->has(name))
-                     throw Error::runtime(context, String::new_format("Cannot create parameter '%s' because a variable of the same name was captured", name));
-                else throw Error::runtime(context, String::new_format("Duplicate parameter name '%s'", name));
-            }
-        }
-        if (func->this_ptr) {
-            Variable const_this = Variable(func->this_ptr_type);
-            const_this.as<void*>() = func->this_ptr;
-            const_this.type = const_this.type->constant(context);
-            context->store("this", const_this);
-        }
-        VarargsInfo* varargs_info = NULL;
-        if (varargs_index != -1) {
-            Variable varargs = Variable(context->type_cache->primitive(TypeKind_Varargs));
-            varargs.as<VarargsInfo*>() = new VarargsInfo(args->items + varargs_index, args->size - varargs_index);
-            context->store("...", varargs);
+static Variable* copy_variable(Variable* var) {
+    if (!var) return NULL;
+    return &Variable::allocate(*var)->retain();
+}
+
+// whether a call the frame returns can run once the frame is gone. the frame's scoped allocations and
+// variables go with it, so nothing the call gets may point into them
+static bool can_tail_call(Context* context, Scope* frame, Variable* function, List<Variable>* args) {
+    if (!frame->function || frame->scope_id < context->fork_base) return false; // not a frame execute_function runs here
+    if (function->type->kind != TypeKind_Function || function->type->lvalue_return || frame->signature->lvalue_return) return false;
+    if (function->type->function_info.return_type != frame->signature->function_info.return_type) return false; // the frame would convert the result
+    for (int i = frame->scope_id; i < context->allocs->size; i++) if (context->allocs->items[i]->size > 0) return false;
+    auto points_into = [](Variable* var, uintptr_t address) {
+        return var && address >= (uintptr_t)var->ptr() && address < (uintptr_t)var->ptr() + var->type->value_size();
+    };
+    for (int i = 0; i < args->size; i++) {
+        if (args->items[i].type->kind != TypeKind_Pointer) continue;
+        uintptr_t address = args->items[i].as<uintptr_t>();
+        for (int j = frame->scope_id; j < context->variables->size; j++) {
+            Map<char*, Variable*>* map = context->variables->items[j];
+            for (int k = 0; k < map->size; k++) if (points_into(map->pairs[k].value, address)) return false;
         }
-        ByteReader reader(func->entry, func->length);
-        execute_codeblock(context, &reader, false);
-        Variable var(context->type_cache->primitive(TypeKind_Void));
-        if (context->state == State_Return) {
-            if (function->type->lvalue_return) {
-                Type* rettype = function->type->function_info.return_type;
-                if (!context->state_var.ref) throw Error::runtime(context, "Return value is not assignable");
-                if (rettype != context->state_var.type) throw Error::runtime(context, String::new_format("Types %s and %s aren't the same", rettype->to_string(), context->state_var.type->to_string()));
-                var = context->state_var;
-            }
-            else var = cast(context, function->type->function_info.return_type, context->state_var);
-        }
-        else if (context->state == State_Running) {
-            if (function->type->function_info.return_type->kind != TypeKind_Void)
-                throw Error::runtime(context, "No return specified in a non-void return function");
-        }
-        else throw Error::runtime(context, String::new_format("'%s' outside of loop %d", context->state == State_Break ? "break" : "continue"));
-        context->state = State_Running;
-        context->pop_stack_frame();
-        delete varargs_info;
-        return var;
+        if (frame->owns_captures) for (int j = 0; j < frame->num_captures; j++) if (points_into(frame->captures[j], address)) return false;
     }
+    return true;
 }
 
-static uint64_t call_driver(Context* context, Type* type, Function* function, uint64_t* args) {
-    List<Variable> variables;
+static Variable execute_function(Context* context, Variable* function, List<Variable>* args, Variable* this_ptr = NULL) {
+    if (stack_low()) {
+        Variable result;
+        auto call = [&] { result = execute_function(context, function, args, this_ptr); };
+        on_new_stack(context, call);
+        return result;
+    }
+    struct TailGuard {
+        TailCall* call = NULL;
+        ~TailGuard() { delete call; }
+    } tail; // the call being run in place of a frame that returned it
+    while (true) {
+        if (function->type->kind != TypeKind_Function) throw Error::runtime(context, "Attempt to call a non-function value");
+        Type::Param* params = function->type->function_info.params;
+        size_t num_params = function->type->function_info.num_params;
+        int varargs_index = num_params > 0 && params[num_params - 1].type->kind == TypeKind_Varargs ? num_params - 1 : -1;
+        if (varargs_index == -1 && num_params != args->size) throw Error::runtime(context, String::new_format("Non-matching number of arguments (expected %d, got %d)", num_params, args->size));
+        else if (args->size < varargs_index) throw Error::runtime(context, String::new_format("Non-matching number of arguments (expected >=%d, got %d)", varargs_index, args->size));
+        for (int i = 0; i < num_params; i++) {
+            if (params[i].type->kind == TypeKind_Varargs) break;
+            args->get(i) = cast(context, params[i].type, args->get(i), false, true);
+        }
+        if (function->as<void*>() == NULL) throw Error::runtime(context, "Calling an unset function");
+        Function* func = Function::from(context->code_arena, function->as<void*>());
+        if (!func) {
+            if (function->type->lvalue_return) throw Error::runtime(context, "Cannot call a native assignable function");
+            FFI ffi;
+            for (int i = 0; i < args->size; i++) {
+                if (!ffi.varargs && params[i].type->kind == TypeKind_Varargs) ffi.varargs = true;
+                if      (args->get(i).type->kind == TypeKind_Float32) ffi.push_f32(args->get(i).as<float>());
+                else if (args->get(i).type->kind == TypeKind_Float64) ffi.push_f64(args->get(i).as<double>());
+                else ffi.push_int(args->get(i).as<uint64_t>());
+            }
+            {
+                ForkLock lock;
+                context->code_arena->seal();
+            }
+            ffi.call(function->as<void*>());
+            Variable retval(function->type->function_info.return_type);
+            if      (retval.type->kind == TypeKind_Float32) retval.as<float>() = ffi.get_f32();
+            else if (retval.type->kind == TypeKind_Float64) retval.as<double>() = ffi.get_f64();
+            else retval.as<uint64_t>() = ffi.get_int();
+            return retval;
+        }
+        else {
+            JitCode code = this_ptr ? NULL : jit_lookup(context, func, function->type);
+            if (code) {
+                Variable result = jit_execute(context, code, function->type, args);
+                if (!context->jit_tail) return result;
+                delete tail.call;
+                tail.call = context->jit_tail;
+                context->jit_tail = NULL;
+                function = &tail.call->function;
+                args = &tail.call->args;
+                this_ptr = NULL;
+                continue;
+            }
+            context->push_stack_frame(func->name);
+            context->set_file_location(func->file);
+            Scope* frame = context->call_stack->peek();
+            frame->function = func;
+            frame->signature = function->type;
+            frame->num_captures = func->num_captures;
+            frame->capture_names = func->capture_names;
+            frame->captures = func->captures;
+            if (func->capture_mode == CaptureMode_CopyPerCall && func->num_captures > 0) {
+                frame->captures = alloc->malloc<Variable*>(func->num_captures);
+                frame->owns_captures = true;
+                for (int i = 0; i < func->num_captures; i++) frame->captures[i] = copy_variable(func->captures[i]);
+            }
+            for (int i = 0; i < num_params; i++) {
+                if (params[i].type->kind == TypeKind_Varargs) break;
+                char* name = params[i].name;
+                Variable var = context->store(name, args->get(i));
+                if (!var.type) throw Error::runtime(context, String::new_format("Duplicate parameter name '%s'", name));
+            }
+            if (this_ptr) {
+                Variable const_this = Variable(this_ptr->type);
+                const_this.as<void*>() = this_ptr->as<void*>();
+                const_this.type = const_this.type->constant(context);
+                context->store("this", const_this);
+            }
+            VarargsInfo* varargs_info = NULL;
+            if (varargs_index != -1) {
+                Variable varargs = Variable(context->type_cache->primitive(TypeKind_Varargs));
+                varargs.as<VarargsInfo*>() = varargs_info = new VarargsInfo(args->items + varargs_index, args->size - varargs_index);
+                context->store("...", varargs);
+            }
+            ByteReader reader(func->entry, func->length);
+            reader.shared = func->shared;
+            execute_codeblock(context, &reader, false);
+            if (frame->tail && context->state == State_Return) {
+                // the frame is gone before the call it returned runs, so recursion through tail calls doesn't grow any stack
+                TailCall* next = frame->tail;
+                frame->tail = NULL;
+                context->state = State_Running;
+                context->pop_stack_frame();
+                delete varargs_info;
+                delete tail.call;
+                tail.call = next;
+                function = &next->function;
+                args = &next->args;
+                this_ptr = next->this_ptr.type ? &next->this_ptr : NULL;
+                continue;
+            }
+            Variable var(context->type_cache->primitive(TypeKind_Void));
+            if (context->state == State_Return) {
+                if (function->type->lvalue_return) {
+                    Type* rettype = function->type->function_info.return_type;
+                    if (!context->state_var.is_ref()) throw Error::runtime(context, "Return value is not assignable");
+                    if (rettype != context->state_var.type) throw Error::runtime(context, String::new_format("Types %s and %s aren't the same", rettype->to_string(), context->state_var.type->to_string()));
+                    var = context->state_var;
+                }
+                else var = cast(context, function->type->function_info.return_type, context->state_var);
+            }
+            else if (context->state == State_Running) {
+                if (function->type->function_info.return_type->kind != TypeKind_Void)
+                    throw Error::runtime(context, "No return specified in a non-void return function");
+            }
+            else if (context->state == State_Throw) {
+                context->pop_stack_frame();
+                delete varargs_info;
+                return var;
+            }
+            else throw Error::runtime(context, String::new_format("'%s' outside of loop %d", context->state == State_Break ? "break" : "continue"));
+            context->state = State_Running;
+            context->pop_stack_frame();
+            delete varargs_info;
+            return var;
+        }
+    }
+}
+
+static uint64_t call_driver(Context* context, Type* type, Function* function, uint64_t* args) {
+    if (running_fork && running_fork->parent == context) context = running_fork; // the thunk only knows the context that made it
+    BindAllocator bind(context->allocator); // native code may call back from any thread
+    List<Variable> variables;
     for (int i = 0; i < type->function_info.num_params; i++) {
         if (type->function_info.params[i].type->kind == TypeKind_Varargs) {
             VarargsData* data = (VarargsData*)(uintptr_t)args[i];
@@ -3043,18 +4841,22 @@ static uint64_t call_driver(Context* context, Type* type, Function* function, ui
         variables.add(var);
     }
     Variable var(type);
-    var.as<Function*>() = function;
+    var.as<void*>() = function->code;
     var = execute_function(context, &var, &variables);
+    context->raise_pending();
+    ForkLock lock;
+    context->code_arena->seal(); // returning into native code
     return var.as<uint64_t>();
 }
 
 #define bytes(...) write((uint8_t[]){__VA_ARGS__}, sizeof((uint8_t[]){__VA_ARGS__}))
 #define ALIGN(x, a) (((x) + ((a) - 1)) / (a) * (a))
 
-static Function* generate_function(Context* context, ByteReader* reader, Type* type, const char* name, const char* file, bool scoped, CaptureMode capture_mode) {
-    void* func_ptr = reader->bytes + reader->ptr;
-    Function* func = context->function_cache->get(func_ptr);
-    if (capture_mode == CaptureMode_None && func) return func;
+// one thunk per signature, the Function* is passed in %r10 by its trampoline
+static void* generate_thunk(Context* context, Type* type) {
+    void* code = context->thunk_cache->getdef(type, NULL);
+    if (code) return code;
+    Context* owner = context->parent ? context->parent : context; // outlives the fork, call_driver finds the fork again
     ByteWriter* buf = new ByteWriter;
 
     buf->bytes(0x55);             // push %rbp
@@ -3110,16 +4912,15 @@ static Function* generate_function(Context* context, ByteReader* reader, Type* t
     // call the driver with func meta and arg array
 #ifdef _WIN32
     buf->bytes(0x49, 0x89, 0xE1);                    // mov %rsp, %r9   << 4th arg
-    buf->bytes(0x48, 0xB9); buf->write(context);     // mov $x, %rcx    << 1st arg
+    buf->bytes(0x48, 0xB9); buf->write(owner);       // mov $x, %rcx    << 1st arg
     buf->bytes(0x48, 0xBA); buf->write(type);        // mov $x, %rdx    << 2nd arg
-    buf->bytes(0x49, 0xB8);                          // mov $x, %r8     << 3rd arg (to be filled in later)
+    buf->bytes(0x4D, 0x89, 0xD0);                    // mov %r10, %r8   << 3rd arg
 #else
     buf->bytes(0x48, 0x89, 0xE1);                    // mov %rsp, %rcx   << 4th arg
-    buf->bytes(0x48, 0xBF); buf->write(context);     // mov $x, %rdi     << 1st arg
+    buf->bytes(0x48, 0xBF); buf->write(owner);       // mov $x, %rdi     << 1st arg
     buf->bytes(0x48, 0xBE); buf->write(type);        // mov $x, %rsi     << 2nd arg
-    buf->bytes(0x48, 0xBA);                          // mov $x, %rdx     << 3rd arg (to be filled in later)
+    buf->bytes(0x4C, 0x89, 0xD2);                    // mov %r10, %rdx   << 3rd arg
 #endif
-    int off = buf->size; buf->write<uint64_t>(0);
 #ifdef _WIN32
     buf->bytes(0x48, 0x83, 0xEC, 0x20);              // sub $20, %rsp    << allocate shadow space
 #endif
@@ -3129,66 +4930,75 @@ static Function* generate_function(Context* context, ByteReader* reader, Type* t
     buf->bytes(0xC9);                                // leave
     buf->bytes(0xC3);                                // ret
 
-    func = (Function*)context->new_allocation(sizeof(Function) + buf->size, scoped, type, Allocation::function_cleanup);
-    memcpy(buf->bytes + off, &func, sizeof(Function*));
-    memcpy((char*)func + sizeof(Function), buf->bytes, buf->size);
+    code = context->code_arena->allocate(buf->size);
+    if (code) {
+        memcpy(code, buf->bytes, buf->size);
+        context->thunk_cache->add(type, code);
+    }
+    delete buf;
+    return code;
+}
+
+static Function* generate_function(Context* context, ByteReader* reader, Type* type, const char* name, const char* file, bool scoped, CaptureMode capture_mode) {
+    ForkLock lock;
+    bool cached = capture_mode == CaptureMode_None && !(scoped && context->parent); // another fork could still be using a scoped one
+    void* func_ptr = reader->bytes + reader->ptr;
+    int num_captures = reader->read<uint32_t>();
+    char** capture_names = (char**)(reader->bytes + reader->ptr);
+    reader->skip(num_captures * sizeof(char*));
+    Function* func = cached ? context->function_cache->getdef(func_ptr, NULL) : NULL;
+    if (func) {
+        reader->skip();
+        return func;
+    }
+    if (capture_mode != CaptureMode_None) context->varying_nodes++;
+    void* thunk = generate_thunk(context, type);
+    if (!thunk) throw Error::runtime(context, "Cannot allocate executable memory");
+    func = (Function*)context->new_allocation(sizeof(Function), scoped, type, Allocation::function_cleanup);
+    func->code = context->code_arena->trampoline(func, thunk);
+    if (!func->code) throw Error::runtime(context, "Cannot allocate executable memory");
+    func->site = func_ptr;
     func->name = (char*)name;
     func->file = (char*)file;
     func->length = reader->read<uint32_t>();
     func->entry = reader->bytes + reader->ptr;
+    func->shared = reader->shared;
     func->capture_mode = capture_mode;
-    func->variables = new Map<char*, Variable*>(compare_strings);
-    if (capture_mode != CaptureMode_None) for (int i = context->call_stack->peek()->scope_id; i < context->variables->size; i++) {
-        if (i == 0) continue;
-        Map<char*, Variable*>* vars = context->variables->items[i];
-        for (int j = 0; j < vars->size; j++) {
-            Variable* var;
-            if (capture_mode == CaptureMode_Shared) var = &vars->pairs[j].value->retain();
-            else var = &alloc->copy(vars->pairs[j].value)->retain();
-            func->variables->add(vars->pairs[j].key, var);
-        }
-    }
-    func->jmp[0] = 0xE9;
-    *(uint32_t*)(func->jmp + 1) = sizeof(Function) - 5;
-    make_executable(func, sizeof(Function) + buf->size);
+    func->num_captures = num_captures;
+    func->capture_names = capture_names;
+    func->captures = alloc->malloc<Variable*>(num_captures);
+    for (int i = 0; i < num_captures; i++) {
+        bool is_param = false;
+        for (int j = 0; j < type->function_info.num_params && !is_param; j++) {
+            char* param = type->function_info.params[j].name;
+            is_param = param && strcmp(param, capture_names[i]) == 0;
+        }
+        Variable* var = is_param ? NULL : context->capture_variable(capture_names[i]);
+        if (!var) continue;
+        func->captures[i] = capture_mode == CaptureMode_Shared ? &var->retain() : copy_variable(var);
+    }
     reader->skip(func->length);
-    if (capture_mode == CaptureMode_None) context->function_cache->add(func_ptr, func);
-    delete buf;
+    if (cached) context->function_cache->add(func_ptr, func);
     return func;
 }
 
-static Variable walk_struct(Variable str, const char* name) {
-    Type::Field* field = NULL;
-    for (int i = 0; i < str.type->struct_info.num_fields && !field; i++) {
-        Type::Field* f = &str.type->struct_info.fields[i];
-        if (f->inline_size != -1 && !f->name) {
-            Variable inlined(f->type);
-            inlined.as<void*>() = str.as<char*>() + f->offset;
-            Variable var = walk_struct(inlined, name);
-            if (!var.type) continue;
-            return var;
-        }
-        if (strcmp(f->name, name) == 0) field = f;
-    }
-    if (!field) return Variable();
-    if (field->inline_size != -1) {
-        Variable var = Variable(field->type);
-        var.as<void*>() = str.as<char*>() + field->offset;
+static Variable walk_struct(Variable str, Type::FieldEntry* entry) {
+    if (entry->field->inline_size != -1) {
+        Variable var = Variable(entry->type());
+        var.as<void*>() = str.as<char*>() + entry->offset;
         return var;
     }
-    Variable var = Variable(field->type).lvalue(str.as<char*>() + field->offset);
+    Variable var = Variable(entry->type()).lvalue(str.as<char*>() + entry->offset);
     if (var.type->is_const) var.rvalue();
-    if (field->type->kind == TypeKind_Function) {
-        Function* func = var.as<Function*>();
-        if (func && !func->is_native()) {
-            func->name = field->name;
-            func->this_ptr = str.as<void*>();
-            func->this_ptr_type = str.type;
-        }
-    }
     return var;
 }
 
+static Variable walk_struct(Variable str, const char* name) {
+    Type::FieldEntry* entry = str.type->find_field(name);
+    if (!entry) return Variable();
+    return walk_struct(str, entry);
+}
+
 static void init_struct(Context* context, Variable* str) {
     for (int i = 0; i < str->type->struct_info.num_fields; i++) {
         Type::Field* field = &str->type->struct_info.fields[i];
@@ -3231,7 +5041,7 @@ static void init_struct(Context* context, Variable* str) {
     Variable result(promote(context, &var1, &var2)); \
     if (result.type->kind == TypeKind_Float32) \
         result.as<float>() = flt_op(var1.as<float>(), var2.as<float>()); \
-    if (result.type->kind == TypeKind_Float64) \
+    else if (result.type->kind == TypeKind_Float64) \
         result.as<double>() = flt_op(var1.as<double>(), var2.as<double>()); \
     else \
         result.as<uint64_t>() = int_op((uint64_t)var1.as<uint64_t>(), (uint64_t)var2.as<uint64_t>()); \
@@ -3267,9 +5077,9 @@ static void init_struct(Context* context, Variable* str) {
     Variable var1 = stack->pop(); \
     Variable result(context->type_cache->primitive(TypeKind_Int8)->unsign(context)); \
     Type* type = promote(context, &var1, &var2); \
-    if (result.type->kind == TypeKind_Float32) \
+    if (type->kind == TypeKind_Float32) \
         result.as<bool>() = var1.as<float>() op var2.as<float>(); \
-    if (result.type->kind == TypeKind_Float64) \
+    else if (type->kind == TypeKind_Float64) \
         result.as<bool>() = var1.as<double>() op var2.as<double>(); \
     else result.as<uint8_t>() = INTEGER_COMPARE(var1, op, var2); \
     stack->push(result); \
@@ -3288,6 +5098,7 @@ static void init_struct(Context* context, Variable* str) {
     Variable var1 = stack->pop(); \
     eval(node) \
     var2 = cast(context, var1.type, var2); \
+    if (var1.type->kind == TypeKind_Type) context->type_cache->invalidate_defers(); \
     var1 << var2; \
     stack->push(var2); \
 }
@@ -3435,6 +5246,12 @@ static struct {
         out.as<Type*>() = type.as<Type*>()->constant(context);
         stack->push(out);
     }),
+    UNARY(AST_ATOMIC, VarType_Type, {
+        Variable type = stack->pop();
+        Variable out(context->type_cache->primitive(TypeKind_Type));
+        out.as<Type*>() = type.as<Type*>()->resolve_defers(context)->atomic(context);
+        stack->push(out);
+    }),
     UNARY(AST_SUFFIX_INCREMENT, VarType_Number | VarType_Assignable, INCREMENT(+1, EVAL, EXEC)),
     UNARY(AST_SUFFIX_DECREMENT, VarType_Number | VarType_Assignable, INCREMENT(-1, EVAL, EXEC)),
     UNARY(AST_POINTER, VarType_Type, {
@@ -3459,17 +5276,47 @@ static struct {
     }),
     UNARY(AST_CALL, VarType_Function, {
         Variable var = stack->pop();
+        Variable this_ptr = context->this_pointer;
+        context->this_pointer = Variable();
         List<Variable> args;
         execute_expressions(context, reader, &args);
-        stack->push(execute_function(context, &var, &args));
+        stack->push(execute_function(context, &var, &args, this_ptr.type ? &this_ptr : NULL));
+        context->raise_pending();
+    }),
+    UNARY(AST_TAIL_CALL, VarType_Function, {
+        Variable var = stack->pop().rvalue();
+        Variable this_ptr = context->this_pointer;
+        context->this_pointer = Variable();
+        List<Variable> args;
+        execute_expressions(context, reader, &args);
+        for (int i = 0; i < args.size; i++) args.items[i].rvalue(); // the variables they refer to may go with the frame
+        Scope* frame = context->call_stack->peek();
+        if (!can_tail_call(context, frame, &var, &args)) {
+            stack->push(execute_function(context, &var, &args, this_ptr.type ? &this_ptr : NULL));
+            context->raise_pending();
+            return;
+        }
+        frame->tail = new TailCall{ var, this_ptr, {} };
+        for (int i = 0; i < args.size; i++) frame->tail->args.add(args.items[i]);
+        stack->push(Variable(context->type_cache->primitive(TypeKind_Void)));
     }),
     UNARY(AST_FUNCTION, VarType_Type, {
         Variable type = stack->pop();
+        TypeSite* site = context->site<TypeSite>(reader);
+        Variable out(context->type_cache->primitive(TypeKind_Type));
+        if ((out.as<Type*>() = site->lookup(context, reader, type.as<Type*>()))) {
+            stack->push(out);
+            return;
+        }
+        uint64_t varying = context->varying_nodes, type_reads = context->type_reads;
         List<Type::Param> params;
         bool lvalue_return = reader->read<bool>();
         execute_params(context, reader, &params);
-        Variable out(context->type_cache->primitive(TypeKind_Type));
         out.as<Type*>() = type.as<Type*>()->function(context, &params, lvalue_return);
+        if (context->varying_nodes == varying) {
+            site->bound = context->type_reads != type_reads;
+            site->store(context, reader, out.as<Type*>(), type.as<Type*>());
+        }
         stack->push(out);
     }),
     UNARY(AST_GET_SIZE, VarType_Pointer, {
@@ -3493,23 +5340,31 @@ static struct {
     UNARY(AST_WALK_STRUCT, VarType_Struct, {
         Variable str = stack->pop();
         char* name = reader->read<char*>();
+        Type::FieldEntry** cache = context->site<Type::FieldEntry*>(reader);
         if (!str.as<void*>()) throw Error::runtime(context, "Struct is unset");
-        Variable var = walk_struct(str, name);
-        if (!var.type) throw Error::runtime(context, String::new_format("Field '%s' not found", name));
-        else stack->push(var);
+        Type::FieldEntry* entry = *cache;
+        if (!entry || entry->owner != str.type) {
+            entry = str.type->find_field(name);
+            if (!entry) throw Error::runtime(context, String::new_format("Field '%s' not found", name));
+            *cache = entry;
+        }
+        Variable var = walk_struct(str, entry);
+        if (var.type->kind == TypeKind_Function && reader->ptr < reader->size && (reader->bytes[reader->ptr] == AST_CALL || reader->bytes[reader->ptr] == AST_TAIL_CALL)) context->this_pointer = str;
+        stack->push(var);
     }),
     UNARY(AST_WALK_STRUCT, VarType_Type, {
         Variable vartype = stack->pop();
         Type* type = vartype.as<Type*>()->resolve_defers(context);
         Type* result = NULL;
         char* name = reader->read<char*>();
-        if (type->kind == TypeKind_Struct) for (int i = 0; i < type->struct_info.num_fields && !result; i++) {
-            Type::Field* field = &type->struct_info.fields[i];
-            if (strcmp(field->name, name) == 0) result = field->type;
+        reader->skip(sizeof(Type::FieldEntry*));
+        if (type->kind == TypeKind_Struct) {
+            Type::FieldEntry* entry = type->find_field(name);
+            if (entry) result = entry->type();
         }
-        else if (type->kind == TypeKind_Function) for (int i = 0; i < type->struct_info.num_fields && !result; i++) {
-            Type::Field* field = &type->struct_info.fields[i];
-            if (strcmp(field->name, name) == 0) result = field->type;
+        else if (type->kind == TypeKind_Function) for (int i = 0; i < type->function_info.num_params && !result; i++) {
+            Type::Param* param = &type->function_info.params[i];
+            if (param->name && strcmp(param->name, name) == 0) result = param->type;
         }
         else throw Error::runtime(context, "Not a function or struct");
         if (!result) throw Error::runtime(context, String::new_format("%s '%s' not found", type->kind == TypeKind_Struct ? "Field" : "Parameter", name));
@@ -3551,18 +5406,210 @@ static bool execute_operator(Context* context, ByteReader* reader, Stack<Variabl
         "(%2$s%1$slength)", // length
         "(%2$s%1$sscope)",  // scope
     }[info->format], token_table[info->token],
-        left .type->to_string().concat(left .ref ? "=" : ""),
-        right.type->to_string().concat(right.ref ? "=" : "")
+        left .type->to_string().concat(left .is_ref() ? "=" : ""),
+        right.type->to_string().concat(right.is_ref() ? "=" : "")
     ));
     return false;
 }
 
+// an operand of AST_STATIC converted the way promote() would, the parser made sure it's a number
+static uint64_t static_integer(Variable* var, TypeKind kind, bool is_unsigned) {
+    uint64_t value = var->as<uint64_t>();
+    if (kind == TypeKind_Int32) return is_unsigned ? (uint64_t)(uint32_t)value : (uint64_t)(int32_t)value;
+    return value;
+}
+
+template<typename T> static T static_float(Variable* var) {
+    if (var->type->kind == TypeKind_Float32) return var->as<float>();
+    if (var->type->kind == TypeKind_Float64) return var->as<double>();
+    return var->type->is_unsigned ? (T)var->as<uint64_t>() : (T)var->as<int64_t>();
+}
+
+template<typename T> static T static_arith(AST_Node op, T a, T b) {
+    switch (op) {
+        case AST_ADDITION:       return a + b;
+        case AST_SUBTRACTION:    return a - b;
+        case AST_MULTIPLICATION: return a * b;
+        case AST_DIVISION:       return a / b;
+        case AST_MODULO:         return fmod(a, b);
+        case AST_POWER:          return pow(a, b);
+        default: return 0;
+    }
+}
+
+static uint64_t static_arith(AST_Node op, uint64_t a, uint64_t b) {
+    switch (op) {
+        case AST_ADDITION:       return a + b;
+        case AST_SUBTRACTION:    return a - b;
+        case AST_MULTIPLICATION: return a * b;
+        case AST_DIVISION:       return a / b;
+        case AST_MODULO:         return a % b;
+        case AST_POWER:          return pow(a, b);
+        case AST_BITSHIFT_LEFT:  return a << b;
+        case AST_BITSHIFT_RIGHT: return a >> b;
+        case AST_BITWISE_AND:    return a & b;
+        case AST_BITWISE_OR:     return a | b;
+        case AST_BITWISE_XOR:    return a ^ b;
+        default: return 0;
+    }
+}
+
+template<typename T> static bool static_compare(AST_Node op, T a, T b) {
+    switch (op) {
+        case AST_LESS_THAN:                return a <  b;
+        case AST_GREATER_THAN:             return a >  b;
+        case AST_LESS_THAN_OR_EQUAL_TO:    return a <= b;
+        case AST_GREATER_THAN_OR_EQUAL_TO: return a >= b;
+        case AST_EQUALS:                   return a == b;
+        case AST_NOT_EQUALS:               return a != b;
+        default: return false;
+    }
+}
+
+// cast() between numbers
+static void static_convert(Variable* out, Variable* var) {
+    TypeKind kind = out->type->kind;
+    if      (kind == TypeKind_Float32) out->as<float>() = static_float<float>(var);
+    else if (kind == TypeKind_Float64) out->as<double>() = static_float<double>(var);
+    else if (var->type->kind == TypeKind_Float32) out->as<uint64_t>() = var->as<float>();
+    else if (var->type->kind == TypeKind_Float64) out->as<uint64_t>() = var->as<double>();
+    else *out << *var;
+}
+
+// a binary operator the parser knows the operand types of, carrying the type they get promoted to
+static void execute_static(Context* context, ByteReader* reader, Stack<Variable>* stack) {
+    AST_Node node = reader->read<AST_Node>();
+    TypeKind kind = reader->read<TypeKind>();
+    bool is_unsigned = reader->read<bool>();
+    Variable var2 = stack->pop();
+    Variable var1 = stack->pop();
+    AST_Node op = compound_operator(node);
+    if (node != AST_ASSIGN && op == AST_END) op = node;
+    Variable result = var2;
+    if (is_comparison(op)) {
+        result = Variable(context->type_cache->primitive(TypeKind_Int8)->unsign(context));
+        if      (kind == TypeKind_Float32) result.as<bool>() = static_compare(op, static_float<float>(&var1), static_float<float>(&var2));
+        else if (kind == TypeKind_Float64) result.as<bool>() = static_compare(op, static_float<double>(&var1), static_float<double>(&var2));
+        else {
+            uint64_t a = static_integer(&var1, kind, is_unsigned), b = static_integer(&var2, kind, is_unsigned);
+            bool neg_a = !is_unsigned && a >> 63, neg_b = !is_unsigned && b >> 63;
+            result.as<bool>() = neg_a != neg_b ? static_compare<bool>(op, neg_b, neg_a) : static_compare(op, a, b);
+        }
+    }
+    else if (op != AST_END) {
+        Type* type = context->type_cache->primitive(kind);
+        if (is_unsigned) type = type->unsign(context);
+        result = Variable(type);
+        if      (kind == TypeKind_Float32) result.as<float>() = static_arith(op, static_float<float>(&var1), static_float<float>(&var2));
+        else if (kind == TypeKind_Float64) result.as<double>() = static_arith(op, static_float<double>(&var1), static_float<double>(&var2));
+        else result.as<uint64_t>() = static_arith(op, static_integer(&var1, kind, is_unsigned), static_integer(&var2, kind, is_unsigned));
+    }
+    if (node == AST_ASSIGN || op != node) {
+        Variable value((Type*)var1.type);
+        static_convert(&value, &result);
+        var1 << value;
+        result = value;
+    }
+    stack->push(result);
+}
+
+// the builtins compile to lock prefixed instructions (a plain mov for loads and non seq_cst stores) on x86-64,
+// they only honor the memory order when it's a constant, hence the instantiation per order
+template<typename T, int order> static uint64_t atomic_operation(AST_Node node, T* ptr, T a, T b) {
+    constexpr int load_order = order == __ATOMIC_RELEASE || order == __ATOMIC_ACQ_REL ? __ATOMIC_SEQ_CST : order;
+    constexpr int store_order = order == __ATOMIC_ACQUIRE || order == __ATOMIC_ACQ_REL ? __ATOMIC_SEQ_CST : order;
+    constexpr int failure_order = order == __ATOMIC_RELEASE ? __ATOMIC_RELAXED : order == __ATOMIC_ACQ_REL ? __ATOMIC_ACQUIRE : order;
+    switch (node) {
+        case AST_LOAD:      return __atomic_load_n(ptr, load_order);
+        case AST_STORE:     __atomic_store_n(ptr, a, store_order); return 0;
+        case AST_EXCHANGE:  return __atomic_exchange_n(ptr, a, order);
+        case AST_CAS:       return __atomic_compare_exchange_n(ptr, &a, b, false, order, failure_order);
+        case AST_FETCH_ADD: return __atomic_fetch_add(ptr, a, order);
+        default: return 0;
+    }
+}
+
+template<typename T> static uint64_t atomic_operation(AST_Node node, void* ptr, uint64_t a, uint64_t b, int order) {
+    switch (order) {
+        case __ATOMIC_RELAXED: return atomic_operation<T, __ATOMIC_RELAXED>(node, (T*)ptr, a, b);
+        case __ATOMIC_ACQUIRE: return atomic_operation<T, __ATOMIC_ACQUIRE>(node, (T*)ptr, a, b);
+        case __ATOMIC_RELEASE: return atomic_operation<T, __ATOMIC_RELEASE>(node, (T*)ptr, a, b);
+        case __ATOMIC_ACQ_REL: return atomic_operation<T, __ATOMIC_ACQ_REL>(node, (T*)ptr, a, b);
+        default:               return atomic_operation<T, __ATOMIC_SEQ_CST>(node, (T*)ptr, a, b);
+    }
+}
+
+static Variable execute_atomic(Context* context, ByteReader* reader, AST_Node node) {
+    Variable target = execute_expression(context, reader);
+    if (!target.is_ref() || !target.type->is_atomic) throw Error::runtime(context, "Not an assignable atomic");
+    int size = target.type->value_size();
+    if ((uintptr_t)target.ptr() % size) throw Error::runtime(context, "Atomic is not aligned");
+    // pointers get offset by bytes, like with +
+    Type* operand_type = node == AST_FETCH_ADD && target.type->kind == TypeKind_Pointer ? context->type_cache->primitive(TypeKind_Int64) : (Type*)target.type;
+    uint64_t a = 0, b = 0;
+    if (node != AST_LOAD) a = cast(context, operand_type, execute_expression(context, reader)).as<uint64_t>();
+    if (node == AST_CAS)  b = cast(context, target.type, execute_expression(context, reader)).as<uint64_t>();
+    int order = reader->read<int32_t>();
+    uint64_t result = 0;
+    switch (size) {
+        case 1: result = atomic_operation<uint8_t> (node, target.ptr(), a, b, order); break;
+        case 2: result = atomic_operation<uint16_t>(node, target.ptr(), a, b, order); break;
+        case 4: result = atomic_operation<uint32_t>(node, target.ptr(), a, b, order); break;
+        case 8: result = atomic_operation<uint64_t>(node, target.ptr(), a, b, order); break;
+    }
+    if (node == AST_STORE) return Variable(context->type_cache->primitive(TypeKind_Void));
+    if (node == AST_CAS) {
+        Variable out(context->type_cache->primitive(TypeKind_Int8)->unsign(context));
+        out.as<bool>() = result;
+        return out;
+    }
+    Variable out(target.type);
+    Variable::store(out.ptr(), size, result);
+    return out;
+}
+
+// nodes that give the same value every time they run, given operands that do
+static bool is_constant_node(AST_Node node) {
+    if (node >= AST_POWER && node <= AST_LOGICAL_OR) return true;
+    switch (node) {
+        case AST_CONST:
+        case AST_ATOMIC:
+        case AST_POINTER:
+        case AST_FUNCTION:
+        case AST_WALK_STRUCT:
+        case AST_ARITH_PLUS:
+        case AST_ARITH_NEGATE:
+        case AST_LOGIC_NEGATE:
+        case AST_BINARY_NEGATE:
+        case AST_INTEGER:
+        case AST_FLOAT:
+        case AST_STRING:
+        case AST_TYPE:
+        case AST_TRUTHY:
+        case AST_NULL:
+        case AST_VARIABLE: // counted by the node itself
+        case AST_CAPTURE:
+        case AST_PAREN:
+        case AST_DEFER:
+        case AST_SIZEOF:
+        case AST_TYPEOF:
+        case AST_TERNARY:
+        case AST_CAST:
+        case AST_BITCAST:
+        case AST_STATIC:
+            return true;
+        default:
+            return false;
+    }
+}
+
 static Variable execute_expression_node(Context* context, ByteReader* reader, Stack<Variable>* stack) {
     Variable var;
     AST_Node node = reader->read<AST_Node>();
     if (node == AST_END) return var;
     Context::LocationHook hook;
     context->set_location(reader, &hook);
+    if (!is_constant_node(node)) context->varying_nodes++;
     switch (node) {
         case AST_INTEGER: {
             uint64_t value = reader->read<uint64_t>();
@@ -3585,7 +5632,12 @@ static Variable execute_expression_node(Context* context, ByteReader* reader, St
             return stack ? stack->push(var)->peek() : var;
         } break;
         case AST_TYPE: {
+            TypeSite* site = context->site<TypeSite>(reader);
+            var = Variable(context->type_cache->primitive(TypeKind_Type));
+            if ((var.as<Type*>() = site->lookup(context, reader))) return stack ? stack->push(var)->peek() : var;
+            uint64_t varying = context->varying_nodes, type_reads = context->type_reads;
             bool is_const = reader->read<bool>();
+            bool is_atomic = reader->read<bool>();
             TypeKind kind = reader->read<TypeKind>();
             Type* type = NULL;
             if (kind == TypeKind_Struct) {
@@ -3625,7 +5677,7 @@ static Variable execute_expression_node(Context* context, ByteReader* reader, St
                     if (reader->read<bool>()) {
                         if (reader->read<bool>()) {
                             CaptureMode capture_mode = reader->read<CaptureMode>();
-                            field.value = (uintptr_t)generate_function(context, reader, field.type, field.name, context->call_stack->peek()->file, false, capture_mode);
+                            field.value = (uintptr_t)generate_function(context, reader, field.type, field.name, context->call_stack->peek()->file, false, capture_mode)->code;
                         }
                         else field.value = cast(context, field.type, execute_expression(context, reader)).as<uint64_t>();
                     }
@@ -3649,8 +5701,12 @@ static Variable execute_expression_node(Context* context, ByteReader* reader, St
                 type = context->type_cache->primitive(kind);
                 if (reader->read<bool>()) type = type->unsign(context);
             }
+            if (is_atomic) type = type->atomic(context);
             if (is_const) type = type->constant(context);
-            var = Variable(context->type_cache->primitive(TypeKind_Type));
+            if (context->varying_nodes == varying) {
+                site->bound = context->type_reads != type_reads;
+                site->store(context, reader, type);
+            }
             var.as<Type*>() = type;
             return stack ? stack->push(var)->peek() : var;
         } break;
@@ -3667,6 +5723,21 @@ static Variable execute_expression_node(Context* context, ByteReader* reader, St
             const char* name = reader->read<char*>();
             var = context->load(name);
             if (!var.type) throw Error::runtime(context, String::new_format("Variable '%s' not found", name));
+            if (var.type->kind == TypeKind_Type) context->type_reads++;
+            else context->varying_nodes++;
+            return stack ? stack->push(var)->peek() : var;
+        } break;
+        case AST_CAPTURE: {
+            int index = reader->read<int32_t>();
+            const char* name = reader->read<char*>();
+            Scope* frame = context->call_stack->peek();
+            Variable* captured = index < frame->num_captures && frame->capture_names[index] == name ? frame->captures[index] : NULL;
+            if (!captured) var = context->load(name);
+            else if (captured->type->is_const) var = *captured;
+            else var = Variable(captured->type).lvalue(captured->ptr());
+            if (!var.type) throw Error::runtime(context, String::new_format("Variable '%s' not found", name));
+            if (var.type->kind == TypeKind_Type) context->type_reads++;
+            else context->varying_nodes++;
             return stack ? stack->push(var)->peek() : var;
         } break;
         case AST_VARARGS: {
@@ -3691,6 +5762,7 @@ static Variable execute_expression_node(Context* context, ByteReader* reader, St
         } break;
         case AST_SIZEOF: {
             bool varargs = reader->read<bool>();
+            if (varargs) context->varying_nodes++;
             Variable var = varargs ? context->load("...") : execute_expression(context, reader);
             if (!var.type) throw Error::runtime(context, "No varargs available in current context");
             Type* type = matches(&var, VarType_Type) ? var.as<Type*>() : var.type;
@@ -3753,7 +5825,7 @@ static Variable execute_expression_node(Context* context, ByteReader* reader, St
                 case AllocType_Function: {
                     if (!matches(type->kind, VarType_Function)) throw Error::runtime(context, "Not a function");
                     CaptureMode capture_mode = reader->read<CaptureMode>();
-                    out.as<Function*>() = generate_function(context, reader, type, "<anonymous>", context->call_stack->peek()->file, scoped, capture_mode);
+                    out.as<void*>() = generate_function(context, reader, type, "<anonymous>", context->call_stack->peek()->file, scoped, capture_mode)->code;
                 } break;
                 case AllocType_Struct: {
                     if (!matches(type->kind, VarType_Struct)) throw Error::runtime(context, "Not a struct");
@@ -3776,7 +5848,8 @@ static Variable execute_expression_node(Context* context, ByteReader* reader, St
                 Variable constructor = walk_struct(out, "new");
                 if (constructor.type) {
                     List<Variable> args;
-                    execute_function(context, &constructor, &args);
+                    execute_function(context, &constructor, &args, &out);
+                    context->raise_pending();
                 }
                 delete struct_data;
                 return stack ? stack->push(out)->peek() : out;
@@ -3788,7 +5861,8 @@ static Variable execute_expression_node(Context* context, ByteReader* reader, St
             Variable var = execute_expression(context, reader);
             if (!matches(&var, VarType_Pointer) && !matches(&var, VarType_Struct) && !matches(&var, VarType_Function))
                 throw Error::runtime(context, "Not a pointer, struct or function");
-            context->delete_allocation(var.as<void*>());
+            Function* func = matches(&var, VarType_Function) ? Function::from(context->code_arena, var.as<void*>()) : NULL;
+            context->delete_allocation(func ? func : var.as<void*>());
             var = Variable(context->type_cache->primitive(TypeKind_Void));
             return stack ? stack->push(var)->peek() : var;
         } break;
@@ -3798,7 +5872,62 @@ static Variable execute_expression_node(Context* context, ByteReader* reader, St
                 throw Error::runtime(context, "Not a pointer, struct or function");
             Variable scope = execute_expression(context, reader);
             if (!matches(&scope, VarType_Integer)) throw Error::runtime(context, "Not an integer");
-            context->move_allocation(var.as<void*>(), scope.as<uint64_t>());
+            Function* func = matches(&var, VarType_Function) ? Function::from(context->code_arena, var.as<void*>()) : NULL;
+            context->move_allocation(func ? func : var.as<void*>(), scope.as<uint64_t>());
+            return stack ? stack->push(var)->peek() : var;
+        } break;
+        case AST_SPAWN: {
+            Variable function = execute_expression(context, reader);
+            List<Variable> args;
+            execute_expressions(context, reader, &args);
+            Variable var = spawn_task(context, function, &args);
+            return stack ? stack->push(var)->peek() : var;
+        } break;
+        case AST_AWAIT: {
+            Variable var = await_task(context, execute_expression(context, reader));
+            return stack ? stack->push(var)->peek() : var;
+        } break;
+        case AST_CHANNEL: {
+            Variable vartype = execute_expression(context, reader);
+            if (!matches(&vartype, VarType_Type)) throw Error::runtime(context, "Not a type");
+            Variable capacity = execute_expression(context, reader);
+            if (!matches(&capacity, VarType_Integer)) throw Error::runtime(context, "Channel capacity is not an integer");
+            Variable var = new_channel(context, vartype.as<Type*>()->resolve_defers(context), capacity.as<uint64_t>());
+            return stack ? stack->push(var)->peek() : var;
+        } break;
+        case AST_SEND: {
+            Variable handle = execute_expression(context, reader);
+            send_channel(context, handle, execute_expression(context, reader));
+            Variable var = Variable(context->type_cache->primitive(TypeKind_Void));
+            return stack ? stack->push(var)->peek() : var;
+        } break;
+        case AST_RECEIVE: {
+            Variable var = receive_channel(context, execute_expression(context, reader));
+            return stack ? stack->push(var)->peek() : var;
+        } break;
+        case AST_GENERATOR: {
+            Variable vartype = execute_expression(context, reader);
+            if (!matches(&vartype, VarType_Type)) throw Error::runtime(context, "Not a type");
+            Variable function = execute_expression(context, reader);
+            List<Variable> args;
+            execute_expressions(context, reader, &args);
+            Variable var = new_generator(context, vartype.as<Type*>()->resolve_defers(context), function, &args);
+            return stack ? stack->push(var)->peek() : var;
+        } break;
+        case AST_RESUME: {
+            Variable var = resume_generator(context, execute_expression(context, reader));
+            return stack ? stack->push(var)->peek() : var;
+        } break;
+        case AST_FINISHED: {
+            Variable var = generator_finished(context, execute_expression(context, reader));
+            return stack ? stack->push(var)->peek() : var;
+        } break;
+        case AST_LOAD:
+        case AST_STORE:
+        case AST_EXCHANGE:
+        case AST_CAS:
+        case AST_FETCH_ADD: {
+            Variable var = execute_atomic(context, reader, node);
             return stack ? stack->push(var)->peek() : var;
         } break;
         case AST_TERNARY: {
@@ -3850,10 +5979,14 @@ static Variable execute_expression_node(Context* context, ByteReader* reader, St
             if (reader->read<bool>()) {
                 if (!matches(&var, VarType_Function)) throw Error::runtime(context, "Cannot attach code to a non-function variable");
                 CaptureMode capture_mode = reader->read<CaptureMode>();
-                var.as<Function*>() = generate_function(context, reader, var.type, name, context->call_stack->peek()->file, true, capture_mode);
+                var.as<void*>() = generate_function(context, reader, var.type, name, context->call_stack->peek()->file, true, capture_mode)->code;
             }
             return stack ? stack->push(var)->peek() : var;
         } break;
+        case AST_STATIC:
+            execute_static(context, reader, stack);
+            var = stack->peek();
+            break;
         default:
             execute_operator(context, reader, stack, node);
             var = stack->peek();
@@ -3863,7 +5996,8 @@ static Variable execute_expression_node(Context* context, ByteReader* reader, St
 }
 
 static Variable execute_expression(Context* context, ByteReader* reader) {
-    Stack<Variable> stack;
+    Variable slots[8];
+    Stack<Variable> stack(slots, 8);
     while (true) {
         // todo: short circuiting
         Variable result = execute_expression_node(context, reader, &stack);
@@ -3908,13 +6042,15 @@ static Variable execute_command(Context* context, ByteReader* reader) {
             int start_ptr = reader->ptr;
             while (true) {
                 Variable cond = execute_expression(context, reader->seek(start_ptr));
+                int body_ptr = reader->ptr;
                 var = Variable(context->type_cache->primitive(TypeKind_Void));
                 if (is_truthy(context, &cond)) {
+                    jit_warm(context);
                     var = execute_codeblock(context, reader->enter());
                     State state = context->state;
                     if (state == State_Break || state == State_Continue) context->state = State_Running;
-                    if (state == State_Break || state == State_Return) {
-                        reader->seek(start_ptr)->skip();
+                    if (state != State_Running && state != State_Continue) {
+                        reader->seek(body_ptr)->skip();
                         return var;
                     }
                 }
@@ -3924,7 +6060,8 @@ static Variable execute_command(Context* context, ByteReader* reader) {
                 }
             }
         } break;
-        case AST_FOR: {
+        case AST_FOR:
+        case AST_PARALLEL_FOR: {
             Variable iter_var = execute_expression(context, reader);
             if (!matches(&iter_var, VarType_Type)) throw Error::runtime(context, "Not a type");
             Type* iter_type = iter_var.as<Type*>()->resolve_defers(context);
@@ -3943,21 +6080,72 @@ static Variable execute_command(Context* context, ByteReader* reader) {
             int start_ptr = reader->ptr;
             iter << (reverse ? to : from);
             if (reverse ? to_exclusive : from_exclusive) iter.as<uint64_t>() += step.as<uint64_t>();
-            while (
-                (!reverse &&   (to_exclusive ? INTEGER_COMPARE(iter, <, to)   : INTEGER_COMPARE(iter, <=, to))) ||
-                ( reverse && (from_exclusive ? INTEGER_COMPARE(iter, >, from) : INTEGER_COMPARE(iter, >=, from)))
-            ) {
-                context->push_codeblock();
-                context->store(name, iter);
+            if (cmd == AST_PARALLEL_FOR) { // the iterations are numbered, so they can be handed out in any order
+                if (step.as<uint64_t>() == 0) throw Error::runtime(context, "Step of a parallel for is 0");
+                uint64_t first = iter.as<uint64_t>(), count = 0;
+                if (!reverse && (to_exclusive ? INTEGER_COMPARE(iter, <, to) : INTEGER_COMPARE(iter, <=, to)))
+                    count = (to.as<uint64_t>() - first - to_exclusive) / step.as<uint64_t>() + 1;
+                if (reverse && (from_exclusive ? INTEGER_COMPARE(iter, >, from) : INTEGER_COMPARE(iter, >=, from)))
+                    count = (first - from.as<uint64_t>() - from_exclusive) / -step.as<uint64_t>() + 1;
+                execute_parallel_for(context, reader, iter_type, name, first, step.as<uint64_t>(), count);
+                return var;
+            }
+            // signed values compare like unsigned ones with the sign bit flipped
+            uint64_t bias = iter_type->is_unsigned ? 0 : 1ULL << 63;
+            uint64_t bound = (reverse ? from : to).as<uint64_t>() ^ bias;
+            bool exclusive = reverse ? from_exclusive : to_exclusive;
+            // the iterator stays in the loop's scope and is stepped in place, the body gets a new one only if it kept a reference
+            Variable* slot = NULL;
+            context->push_codeblock();
+            while (true) {
+                uint64_t value = iter.as<uint64_t>() ^ bias;
+                if (reverse ? (exclusive ? value <= bound : value < bound) : (exclusive ? value >= bound : value > bound)) break;
+                jit_warm(context);
+                if (slot) slot->as<uint64_t>() = iter.as<uint64_t>();
+                else {
+                    context->store(name, iter);
+                    slot = context->variables->peek()->getdef(name, NULL);
+                }
                 context->state = State_Running;
                 reader->seek(start_ptr);
                 var = execute_codeblock(context, reader->enter(), false);
                 State state = context->state;
                 if (state == State_Break || state == State_Continue) context->state = State_Running;
-                if (state == State_Break || state == State_Return) break;
-                iter.as<uint64_t>() = context->load(name).as<uint64_t>() + step.as<uint64_t>();
-                context->pop_codeblock();
+                if (state != State_Running && state != State_Continue) break;
+                // a step past the end of the type wraps around, so the loop ends there, before it starts over
+                uint64_t current = slot->as<uint64_t>() ^ bias;
+                iter.as<uint64_t>() = slot->as<uint64_t>() + step.as<uint64_t>();
+                uint64_t stepped = iter.as<uint64_t>() ^ bias;
+                if (reverse ? stepped > current : stepped < current) break;
+                if (slot->refcount() > 1) slot = NULL;
+                context->clear_codeblock(slot);
+            }
+            context->pop_codeblock();
+            reader->seek(start_ptr)->skip();
+            return var;
+        } break;
+        case AST_FOR_GENERATOR: {
+            Variable iter_var = execute_expression(context, reader);
+            if (!matches(&iter_var, VarType_Type)) throw Error::runtime(context, "Not a type");
+            Type* iter_type = iter_var.as<Type*>()->resolve_defers(context);
+            char* name = reader->read<char*>();
+            Variable handle = execute_expression(context, reader).rvalue();
+            Variable var(context->type_cache->primitive(TypeKind_Void));
+            Variable value;
+            int start_ptr = reader->ptr;
+            context->push_codeblock();
+            while (next_generator_value(context, handle, &value)) {
+                jit_warm(context);
+                context->store(name, cast(context, iter_type, value));
+                context->state = State_Running;
+                reader->seek(start_ptr);
+                var = execute_codeblock(context, reader->enter(), false);
+                State state = context->state;
+                if (state == State_Break || state == State_Continue) context->state = State_Running;
+                if (state != State_Running && state != State_Continue) break;
+                context->clear_codeblock();
             }
+            context->pop_codeblock();
             reader->seek(start_ptr)->skip();
             return var;
         } break;
@@ -3975,35 +6163,50 @@ static Variable execute_command(Context* context, ByteReader* reader) {
         } break;
         case AST_TRY: {
             Variable var(context->type_cache->primitive(TypeKind_Void));
-            int scope = context->variables->size;
+            int scope = context->variables->size - 1;
             int ptr = reader->ptr;
+            Error* error = NULL;
             try {
                 var = execute_codeblock(context, reader->enter());
+                if (context->state == State_Throw) {
+                    error = context->error;
+                    context->error = NULL;
+                    context->state = State_Running;
+                }
+            }
+            catch (Error* err) {
+                error = err;
+                context->pop_until(scope);
+            }
+            reader->seek(ptr)->skip();
+            if (!error) {
                 if (reader->read<bool>()) {
                     reader->read<bool>(); // silently
                     if (reader->read<bool>()) reader->read<char*>(); // as
                     reader->skip(); // catch body
                 }
             }
-            catch (Error* error) {
-                context->pop_until(scope);
-                reader->seek(ptr)->skip();
-                if (reader->read<bool>()) {
-                    if (reader->read<bool>()) pawscript_destroy_error(error);
-                    else pawscript_log_error(error, stderr);
-                    context->push_codeblock();
-                    if (reader->read<bool>()) context->store(reader->read<char*>(), context->state_var);
-                    var = execute_codeblock(context, reader->enter(), false);
-                    context->pop_codeblock();
-                }
+            else if (reader->read<bool>()) {
+                if (reader->read<bool>()) pawscript_destroy_error(error);
                 else pawscript_log_error(error, stderr);
+                context->push_codeblock();
+                if (reader->read<bool>()) context->store(reader->read<char*>(), context->state_var);
+                var = execute_codeblock(context, reader->enter(), false);
+                context->pop_codeblock();
             }
+            else pawscript_log_error(error, stderr);
             return var;
         } break;
         case AST_THROW: {
-            context->state_var = execute_expression(context, reader);
-            if (reader->read<bool>()) throw Error::runtime(context, reader->read<char*>());
-            else throw Error::runtime(context, var.to_string());
+            Variable value = execute_expression(context, reader).rvalue();
+            Error* error = reader->read<bool>() ? Error::runtime(context, (const char*)reader->read<char*>()) : Error::thrown(context, value);
+            context->state_var = value;
+            context->error = error;
+            context->state = State_Throw;
+        } break;
+        case AST_YIELD: {
+            yield_generator(context, execute_expression(context, reader));
+            var = Variable(context->type_cache->primitive(TypeKind_Void));
         } break;
         case AST_CODEBLOCK: return execute_codeblock(context, reader);
         case AST_EXPR: return execute_expression(context, reader);
@@ -4012,203 +6215,5189 @@ static Variable execute_command(Context* context, ByteReader* reader) {
     return var;
 }
 
-void Allocation::function_cleanup(void* ptr, Context* context, Type* type) {
-    Function* func = (Function*)ptr;
-    for (int i = 0; i < func->variables->size; i++) func->variables->pairs[i].value->release();
-    delete func->variables;
+// == JIT ==
+
+// a call made by compiled code, the callee it saw last spares the trampoline lookup
+struct JitCallSite {
+    Type* type;
+    void* code;
+    bool tail; // the call a return makes, handed to whoever called the code instead of made from it
+};
+
+static uint64_t jit_threshold() {
+    static uint64_t threshold = getenv("PAWSCRIPT_JIT") ? strtoull(getenv("PAWSCRIPT_JIT"), NULL, 10) : 1000;
+    return threshold;
 }
 
-void Allocation::struct_cleanup(void* ptr, Context* context, Type* type) {
-    int prev_scope = context->variables->size - 1;
-    try {
-        Variable str = Variable(type);
-        str.as<void*>() = ptr;
-        Variable destructor = walk_struct(str, "delete");
-        if (!destructor.type) return;
-        List<Variable> args;
-        execute_function(context, &destructor, &args);
-    }
-    catch (Error* error) {
-        pawscript_log_error(error, stderr);
-        context->pop_until(prev_scope);
-    }
+static bool jit_float(Type* type) {
+    return type->kind == TypeKind_Float32 || type->kind == TypeKind_Float64;
 }
 
-static void(*user_segfault_handler)(void* addr);
-static Context* curr_context;
+static bool jit_integer(Type* type) {
+    return type->kind >= TypeKind_Int8 && type->kind <= TypeKind_Int64;
+}
 
-static Error* execute(Context* context, const char* code, const char* file) {
-    TokenQueue* tokens = NULL;
-    ByteWriter* writer = new ByteWriter;
-    Error* err = NULL;
-    Variable var(context->type_cache->primitive(TypeKind_Void));
-    try {
-        tokens = lex(context, code, file);
-        writer->write(tokens->peek()->filename);
-        while (!tokens->expect(TOKEN_END_OF_FILE)) parse_command(context, writer, tokens);
-        ByteReader* reader = writer->read();
-        /*printf("--------------- PAWSCRIPT BYTECODE DUMP ---------------\n");
-        printf("       x0 x1 x2 x3 x4 x5 x6 x7 x8 x9 xA xB xC xD xE xF");
-        for (int i = 0; i < reader->size; i++) {
-            if (i % 16 == 0) printf("\n%04X   ", i);
-            printf("%02X ", reader->bytes[i]);
-        }
-        printf("\n");*/
-        context->set_file_location(reader->read<char*>());
-        context->bytecodes->add(reader);
-        while (reader->ptr < reader->size) {
-            var = execute_command(context, reader);
-            switch (context->state) {
-                case State_Running: break;
-                case State_Return:
-                    var = context->state_var;
-                    reader->ptr = reader->size;
-                    break;
-                case State_Continue: throw Error::runtime(context, "'continue' outside of loop");
-                case State_Break: throw Error::runtime(context, "'break' outside of loop");
-            }
-        }
-    }
-    catch (Error* error) {
-        err = error;
-    }
-    *context->lookup_variable("@RESULT@") = var;
-    context->call_stack->peek()->file = NULL;
-    delete tokens;
-    return err;
+// the values compiled code keeps in a register
+static bool jit_scalar(Type* type) {
+    return type->kind >= TypeKind_Int8 && type->kind <= TypeKind_Pointer && !type->has_defers;
 }
 
-static Error* execute_file(Context* context, const char* filename) {
-    FILE* f = fopen(context->resource(filename).data, "r");
-    if (!f) return Error::syntax(filename, 1, 1, String::new_format("Cannot open '%s' for reading: %s", filename, strerror(errno)));
-    fseek(f, 0, SEEK_END);
-    size_t size = ftell(f);
-    fseek(f, 0, SEEK_SET);
-    char* data = alloc->malloc<char>(size + 1);
-    fread(data, size, 1, f);
-    data[size] = 0;
-    fclose(f);
-    Error* error = execute(context, data, filename);
-    alloc->free(data);
-    return error;
+// whether the canonical value of from is already canonical for to
+static bool jit_fits(Type* from, Type* to) {
+    if (to->kind == TypeKind_Int64 || to->kind == TypeKind_Pointer) return true;
+    if (!jit_integer(from) || from->kind == TypeKind_Int64) return false;
+    if (from->is_unsigned) return from->size < to->size || (from->size == to->size && to->is_unsigned);
+    return !to->is_unsigned && from->size <= to->size;
 }
 
-static jmp_buf segfault_jump_buffer;
-static bool in_code = false;
-static void* segfault_addr = NULL;
+static void jit_warm(Context* context) {
+    Function* func = context->call_stack->peek()->function;
+    if (!func || func->jit_failed || jit_threshold() == 0) return;
+    __atomic_store_n(&func->heat, __atomic_load_n(&func->heat, __ATOMIC_RELAXED) + 1, __ATOMIC_RELAXED);
+}
 
-#ifndef _WIN32
-#undef setjmp
-#define longjmp siglongjmp
-#define setjmp(x) sigsetjmp(x, 1)
-#endif
+static void jit_seal(Context* context) {
+    if (!context->code_arena->dirty) return;
+    ForkLock lock;
+    context->code_arena->seal();
+}
 
-#ifdef _WIN32
-static LONG WINAPI handle_segfault(EXCEPTION_POINTERS* exception) { \
-    segfault_addr = (void*)(uintptr_t)exception->ExceptionRecord->ExceptionInformation[1];
-#else
-static void handle_segfault(int signum, siginfo_t* info) { \
-    segfault_addr = info->si_addr;
-#endif
-    if (in_code) longjmp(segfault_jump_buffer, 1);
-    else if (user_segfault_handler) user_segfault_handler(segfault_addr);
-    else printf("[PawScript Segfault Handler] Uncaught segmentation fault outside of script\n");
-    abort();
+// helpers called by compiled code, with the conversions the interpreter does in C++
+static uint64_t jit_f32_to_u64(float value) { return value; }
+static uint64_t jit_f64_to_u64(double value) { return value; }
+static uint64_t jit_pow_int(uint64_t a, uint64_t b) { return pow(a, b); }
+static float jit_powf(float a, float b) { return pow(a, b); }
+static double jit_pow(double a, double b) { return pow(a, b); }
+static float jit_fmodf(float a, float b) { return fmod(a, b); }
+static double jit_fmod(double a, double b) { return fmod(a, b); }
+
+static void jit_missing_return(Context* context) {
+    context->jit_error = Error::runtime(context, "No return specified in a non-void return function");
 }
 
-static Error* segfault_handler(Context* context) {
+static void jit_misaligned_atomic(Context* context) {
+    context->jit_error = Error::runtime(context, "Atomic is not aligned");
+}
+
+static void jit_unset_struct(Context* context) {
+    context->jit_error = Error::runtime(context, "Struct is unset");
+}
+
+// a variadic call into C only C makes, jit_call takes a fixed number of arguments
+static void jit_replaced_native(Context* context) {
+    context->jit_error = Error::runtime(context, "Variadic function was replaced");
+}
+
+// the arguments compiled code passes, as the interpreter takes them
+static void jit_arguments(Type* type, uint64_t* args, List<Variable>* values) {
+    for (int i = 0; i < type->function_info.num_params; i++) {
+        Variable value(type->function_info.params[i].type);
+        value.as<uint64_t>() = args[i];
+        values->add(value);
+    }
+}
+
+// errors can't unwind through compiled code, they're left in jit_error for it to return through
+static uint64_t jit_call(Context* context, JitCallSite* site, void* code, uint64_t* args) {
+    int scope = context->variables->size - 1;
+    TailCall* tail = NULL;
+    try {
+        if (stack_low()) {
+            uint64_t value;
+            auto call = [&] { value = jit_call(context, site, code, args); };
+            on_new_stack(context, call);
+            return value;
+        }
+        if (!code) throw Error::runtime(context, "Calling an unset function");
+        if (site->tail) { // made once the calling code returned, by whatever ran it
+            tail = new TailCall{ Variable(site->type), Variable(), {} };
+            tail->function.as<void*>() = code;
+            jit_arguments(site->type, args, &tail->args);
+            context->jit_tail = tail;
+            return 0;
+        }
+        Function* func;
+        if (code == __atomic_load_n(&site->code, __ATOMIC_RELAXED)) func = (Function*)CodeArena::trampoline_owner(code);
+        else if ((func = Function::from(context->code_arena, code))) __atomic_store_n(&site->code, code, __ATOMIC_RELAXED);
+        JitCode entry = func && __atomic_load_n(&func->jit, __ATOMIC_ACQUIRE) ? jit_lookup(context, func, site->type) : NULL;
+        if (entry) {
+            jit_seal(context);
+            uint64_t value = entry(context, args);
+            if (!context->jit_tail) return value;
+        }
+        Variable result;
+        if ((tail = context->jit_tail)) { // the callee returned a call to make in its place
+            context->jit_tail = NULL;
+            result = execute_function(context, &tail->function, &tail->args);
+            delete tail;
+            tail = NULL;
+        }
+        else {
+            Variable function(site->type);
+            function.as<void*>() = code;
+            List<Variable> values;
+            jit_arguments(site->type, args, &values);
+            result = execute_function(context, &function, &values);
+        }
+        context->raise_pending();
+        jit_seal(context); // returning into compiled code
+        if (result.type->kind == TypeKind_Void) return 0;
+        return result.as<uint64_t>();
+    }
+    catch (Error* error) {
+        delete tail;
+        context->pop_until(scope);
+        context->jit_error = error;
+        return 0;
+    }
+}
+
+enum JitOp: uint8_t {
+    // expressions
+    JitOp_Const,
+    JitOp_Type,
+    JitOp_Local,
+    JitOp_Global,
+    JitOp_Deref,
+    JitOp_Current,
+    JitOp_Assign,
+    JitOp_Increment,
+    JitOp_Address,
+    JitOp_Convert,
+    JitOp_Binary,
+    JitOp_Compare,
+    JitOp_Offset,
+    JitOp_And,
+    JitOp_Not,
+    JitOp_Negate,
+    JitOp_Complement,
+    JitOp_Ternary,
+    JitOp_Call,
+    JitOp_Atomic,
+    JitOp_Field,
+
+    // commands
+    JitOp_Block,
+    JitOp_If,
+    JitOp_While,
+    JitOp_For,
+    JitOp_Return,
+    JitOp_Break,
+    JitOp_Continue,
+};
+
+// a function body with the names resolved and the types known. an lvalue is a place, read by whatever consumes it,
+// at the point the interpreter would read it
+struct JitNode {
+    JitOp op;
+    AST_Node node;  // the operator of a binary, compare, compound assignment or atomic operation
+    bool flag;      // declaration, suffix, bitcast, swapped operands, compound assignment, exclusive start or a call into C
+    bool flag2;     // exclusive end of a for, a ternary with a place on one side only
+    bool lvalue;
+    Type* type;
+    Type* target;   // the type a type expression stands for, the signature of a call
+    Variable value;
+    int slot;
+    int64_t amount; // increment, scale, loop step, call site, memory order or field offset
+    void* address;
+    JitNode *a, *b, *c, *d;
+    List<JitNode*>* list;
+};
+
+static bool jit_impure(JitNode* node) {
+    if (!node || node->op == JitOp_Current) return false;
+    if (node->op == JitOp_Assign || node->op == JitOp_Increment || node->op == JitOp_Call || node->op == JitOp_Atomic) return true;
+    if (node->op == JitOp_Local) return node->flag;
+    return jit_impure(node->a) || jit_impure(node->b) || jit_impure(node->c);
+}
+
+static JitNode* jit_strip(JitNode* node) {
+    while (node->op == JitOp_Convert) node = node->a;
+    return node;
+}
+
+// a hash of a type that's the same in every process, TypeCache hashes the addresses of the types it's made of
+static uint64_t jit_fingerprint(Type* type, int depth = 0) {
+    if (!type) return 0;
+    uint64_t hash = TypeCache::hash_mix(type->kind, type->is_const | type->is_atomic << 1 | type->is_unsigned << 2 | type->lvalue_return << 3);
+    hash = TypeCache::hash_mix(hash, type->size);
+    if (depth > 4) return hash;
+    switch (type->kind) {
+        case TypeKind_Pointer: return TypeCache::hash_mix(hash, jit_fingerprint(type->pointer_info.base, depth + 1));
+        case TypeKind_Function:
+            hash = TypeCache::hash_mix(hash, jit_fingerprint(type->function_info.return_type, depth + 1));
+            for (size_t i = 0; i < type->function_info.num_params; i++) {
+                hash = TypeCache::hash_mix(hash, TypeCache::hash_str(type->function_info.params[i].name));
+                hash = TypeCache::hash_mix(hash, jit_fingerprint(type->function_info.params[i].type, depth + 1));
+            }
+            return hash;
+        case TypeKind_Struct:
+            for (size_t i = 0; i < type->struct_info.num_fields; i++) hash = TypeCache::hash_mix(hash, TypeCache::hash_str(type->struct_info.fields[i].name));
+            return hash;
+        default: return hash;
+    }
+}
+
+static uint64_t jit_cpu_features() {
+    uint32_t regs[4] = {};
+#ifdef _WIN32
+    __cpuid((int*)regs, 1);
+#else
+    __get_cpuid(1, &regs[0], &regs[1], &regs[2], &regs[3]);
+#endif
+    return (uint64_t)regs[2] << 32 | regs[3];
+}
+
+// reads the bytecode of a function into JitNodes, throws on anything compiled code wouldn't do the same way
+struct JitBuilder {
+    struct Local {
+        char* name;
+        Type* type;
+        int slot;
+        JitNode* value; // a constant it was declared with
+    };
+    Context* context;
+    Function* func;
+    Type* signature;
+    bool second_tier; // hoists loop invariant operations and folds constant const locals
+    bool translating; // for the C emitter, which also passes structs around and calls C functions directly
+    List<JitNode*> nodes;
+    List<Local> locals;
+    Stack<int> scopes;
+    List<JitCallSite> calls; // the signature of each call site, and whether a return makes it
+    List<void*> globals;   // the address of each global read, in the order they're found
+    List<char*> strings;   // string literals, these and the globals are all the code refers to in this process
+    List<void*> natives;   // the C function each call site calls directly, NULL for the ones left to jit_call
+    uint64_t inputs = 0;   // the globals' names and types and the literals
+    int num_slots = 0;
+    int loops = 0, conditional = 0;
+    bool addresses_locals = false; // then a call can't outlive the frame
+    bool* escaped = NULL;          // the locals something may change through a pointer, while hoisting
+
+    JitBuilder(Context* context, Function* func, Type* signature, bool second_tier, bool translating = false):
+        context(context), func(func), signature(signature), second_tier(second_tier), translating(translating) {}
+    ~JitBuilder() {
+        for (int i = 0; i < nodes.size; i++) {
+            delete nodes.items[i]->list;
+            alloc->free(nodes.items[i]);
+        }
+    }
+    JitNode* build() {
+        if (func->capture_mode != CaptureMode_None || func->num_captures > 0) throw Error::runtime(context, "Closures aren't compiled");
+        if (signature->has_defers || signature->lvalue_return) throw Error::runtime(context, "Unsupported signature");
+        Type* ret = signature->function_info.return_type;
+        if (ret->kind != TypeKind_Void && !passed(ret)) throw Error::runtime(context, "Unsupported return type");
+        scopes.push(0);
+        for (int i = 0; i < signature->function_info.num_params; i++) {
+            Type::Param* param = &signature->function_info.params[i];
+            if (!param->name || !passed(param->type)) throw Error::runtime(context, "Unsupported parameter");
+            declare(param->name, param->type);
+        }
+        ByteReader reader(func->entry, func->length);
+        JitNode* body = codeblock(&reader, false);
+        if (reader.ptr != reader.size) throw Error::runtime(context, "Malformed function body");
+        if (second_tier && num_slots > 0) {
+            escaped = alloc->malloc<bool>(num_slots);
+            escapes(body);
+            body = hoist(body);
+            alloc->free(escaped);
+            escaped = NULL;
+        }
+        if (addresses_locals) for (int i = 0; i < calls.size; i++) calls.items[i].tail = false;
+        return body;
+    }
+    // identifies the code compiled from body across processes, along with the engine and the CPU it runs on.
+    // C translated from body depends on neither, it gets a portable key
+    uint64_t key(JitNode* body, bool portable = false) {
+        uint64_t key = TypeCache::hash_mix(inputs, jit_fingerprint(signature));
+        key = TypeCache::hash_mix(key, second_tier);
+        if (!portable) {
+            key = TypeCache::hash_mix(key, offsetof(Context, jit_error));
+            key = TypeCache::hash_mix(key, NUM_INT_REGS);
+            key = TypeCache::hash_mix(key, jit_cpu_features());
+        }
+        return hash(key, body);
+    }
+    uint64_t hash(uint64_t hash, JitNode* node) {
+        if (!node) return TypeCache::hash_mix(hash, 0);
+        hash = TypeCache::hash_mix(hash, node->op | node->node << 8 | node->flag << 24 | node->flag2 << 25 | node->lvalue << 26);
+        hash = TypeCache::hash_mix(hash, jit_fingerprint(node->type));
+        hash = TypeCache::hash_mix(hash, jit_fingerprint(node->target));
+        hash = TypeCache::hash_mix(hash, node->slot);
+        hash = TypeCache::hash_mix(hash, node->amount);
+        if (node->op == JitOp_Const) hash = TypeCache::hash_mix(hash, literal(node->value.as<uint64_t>()));
+        if (node->list) for (int i = 0; i < node->list->size; i++) hash = this->hash(hash, node->list->items[i]);
+        hash = this->hash(hash, node->a);
+        hash = this->hash(hash, node->b);
+        return this->hash(hash, node->c);
+    }
+    uint64_t literal(uint64_t value) { // a string literal by its index, the address changes between processes
+        for (int i = 0; i < strings.size; i++) if ((uint64_t)strings.items[i] == value) return (1ULL << 63) | i;
+        return value;
+    }
+    bool passed(Type* type) { // a value compiled code holds, a struct is the pointer to it
+        return jit_scalar(type) || (translating && type->kind == TypeKind_Struct && !type->has_defers);
+    }
+    JitNode* node(JitOp op, Type* type = NULL) {
+        JitNode* node = nodes.add(alloc->malloc<JitNode>());
+        node->op = op;
+        node->type = type;
+        return node;
+    }
+    Type* primitive(TypeKind kind, bool is_unsigned = false) {
+        Type* type = context->type_cache->primitive(kind);
+        return is_unsigned ? type->unsign(context) : type;
+    }
+    int declare(char* name, Type* type) {
+        for (int i = scopes.peek(); i < locals.size; i++) {
+            if (strcmp(locals.items[i].name, name) == 0) throw Error::runtime(context, String::new_format("Variable '%s' already exists", name));
+        }
+        locals.add(Local{ name, type, num_slots, NULL });
+        return num_slots++;
+    }
+    JitNode* constant(Variable value) {
+        value.rvalue();
+        JitNode* node = this->node(JitOp_Const, value.type);
+        node->value = value;
+        return node;
+    }
+    JitNode* type_node(Type* type) {
+        JitNode* node = this->node(JitOp_Type, primitive(TypeKind_Type));
+        node->target = type;
+        return node;
+    }
+    JitNode* pop(Stack<JitNode*>* stack) {
+        if (stack->size == 0) throw Error::runtime(context, "Malformed expression");
+        return stack->pop();
+    }
+    JitNode* condition(JitNode* node) {
+        if (!jit_scalar(node->type)) throw Error::runtime(context, "Unsupported condition");
+        return node;
+    }
+    // a place on one side of a ternary only is read right away, the interpreter reads it after the right operand
+    void ordered(JitNode* a, JitNode* b) {
+        a = jit_strip(a);
+        if (a->op == JitOp_Ternary && a->flag2 && jit_impure(b)) throw Error::runtime(context, "Unsupported evaluation order");
+    }
+
+    JitNode* codeblock(ByteReader* reader, bool scoped = true) {
+        JitNode* node = this->node(JitOp_Block);
+        node->list = new List<JitNode*>;
+        if (scoped) scopes.push(locals.size);
+        while (reader->ptr < reader->size && reader->bytes[reader->ptr] != AST_END) node->list->add(command(reader));
+        if (reader->ptr >= reader->size) throw Error::runtime(context, "Malformed block");
+        reader->skip(1);
+        if (scoped) locals.size = scopes.pop();
+        return node;
+    }
+    // a block the interpreter steps over by its length, which has to end right where the length says
+    JitNode* pushed(ByteReader* reader, bool is_expression, bool scoped = true) {
+        int32_t length = reader->read<int32_t>();
+        int end = reader->ptr + length;
+        if (length < 0 || end > reader->size) throw Error::runtime(context, "Malformed block");
+        ByteReader block(reader->bytes, end);
+        block.ptr = reader->ptr;
+        JitNode* node = is_expression ? expression(&block) : codeblock(&block, scoped);
+        if (block.ptr != end) throw Error::runtime(context, "Malformed block");
+        reader->seek(end);
+        return node;
+    }
+    JitNode* command(ByteReader* reader) {
+        AST_Node cmd = reader->read<AST_Node>();
+        reader->skip(2 * sizeof(int32_t));
+        switch (cmd) {
+            case AST_IF: {
+                JitNode* node = this->node(JitOp_If);
+                node->a = condition(expression(reader));
+                node->b = pushed(reader, false);
+                if (reader->read<bool>()) node->c = pushed(reader, false);
+                return node;
+            }
+            case AST_WHILE: {
+                JitNode* node = this->node(JitOp_While);
+                conditional++; // runs again in the same scope
+                node->a = condition(expression(reader));
+                conditional--;
+                loops++;
+                node->b = pushed(reader, false);
+                loops--;
+                return node;
+            }
+            case AST_FOR: {
+                JitNode* type = expression(reader);
+                if (type->op != JitOp_Type || !jit_integer(type->target) || type->target->has_defers) throw Error::runtime(context, "Unsupported iterator type");
+                JitNode* node = this->node(JitOp_For, type->target);
+                char* name = reader->read<char*>();
+                node->a = convert(expression(reader), node->type);
+                node->flag = reader->read<bool>();
+                node->b = convert(expression(reader), node->type);
+                node->flag2 = reader->read<bool>();
+                node->amount = 1;
+                if (reader->read<bool>()) {
+                    JitNode* step = convert(expression(reader), primitive(TypeKind_Int64));
+                    if (step->op != JitOp_Const) throw Error::runtime(context, "Loop step is not a constant");
+                    node->amount = step->value.as<int64_t>();
+                }
+                scopes.push(locals.size);
+                node->slot = declare(name, node->type);
+                num_slots += 2; // the next value and the bound
+                loops++;
+                node->c = pushed(reader, false, false);
+                loops--;
+                locals.size = scopes.pop();
+                return node;
+            }
+            case AST_RETURN: {
+                JitNode* node = this->node(JitOp_Return);
+                if (reader->read<bool>()) {
+                    Type* ret = signature->function_info.return_type;
+                    node->a = expression(reader);
+                    if (ret->kind != TypeKind_Void) node->a = convert(node->a, ret);
+                }
+                return node;
+            }
+            case AST_CONTINUE:
+            case AST_BREAK:
+                if (!loops) throw Error::runtime(context, "'break' or 'continue' outside of a loop");
+                return node(cmd == AST_BREAK ? JitOp_Break : JitOp_Continue);
+            case AST_CODEBLOCK: return codeblock(reader);
+            case AST_EXPR: {
+                JitNode* node = expression(reader);
+                if (second_tier && node->op == JitOp_Assign && !node->flag && node->a->op == JitOp_Local && node->a->flag && node->a->type->is_const && node->b->op == JitOp_Const) {
+                    for (int i = locals.size - 1; i >= 0; i--) if (locals.items[i].slot == node->a->slot) locals.items[i].value = node->b;
+                }
+                return node;
+            }
+            default: throw Error::runtime(context, "Unsupported command");
+        }
+    }
+
+    JitNode* expression(ByteReader* reader) {
+        Stack<JitNode*> stack;
+        while (true) {
+            AST_Node node = reader->read<AST_Node>();
+            if (node == AST_END) break;
+            reader->skip(2 * sizeof(int32_t));
+            stack.push(operand(node, reader, &stack));
+        }
+        if (stack.size != 1) throw Error::runtime(context, "Malformed expression");
+        return stack.pop();
+    }
+    JitNode* operand(AST_Node node, ByteReader* reader, Stack<JitNode*>* stack) {
+        switch (node) {
+            case AST_INTEGER: {
+                uint64_t value = reader->read<uint64_t>();
+                Variable var(primitive(value < 2147483648ULL ? TypeKind_Int32 : TypeKind_Int64, value >= 9223372036854775808ULL));
+                var.as<uint64_t>() = value;
+                return constant(var);
+            }
+            case AST_FLOAT: {
+                Variable var(primitive(TypeKind_Float64));
+                var.as<double>() = reader->read<double>();
+                return constant(var);
+            }
+            case AST_STRING: {
+                Variable var(primitive(TypeKind_Int8)->constant(context)->pointer(context));
+                var.as<char*>() = reader->read<char*>();
+                strings.add(var.as<char*>());
+                inputs = TypeCache::hash_mix(inputs, TypeCache::hash_str(var.as<char*>()));
+                return constant(var);
+            }
+            case AST_TRUTHY: {
+                Variable var(primitive(TypeKind_Int8, true));
+                var.as<bool>() = reader->read<bool>();
+                return constant(var);
+            }
+            case AST_NULL: return constant(Variable(primitive(TypeKind_Void)->pointer(context)));
+            case AST_TYPE: {
+                reader->skip(sizeof(TypeSite));
+                bool is_const = reader->read<bool>();
+                bool is_atomic = reader->read<bool>();
+                TypeKind kind = reader->read<TypeKind>();
+                if (kind == TypeKind_Struct) throw Error::runtime(context, "Unsupported type");
+                Type* type = primitive(kind, reader->read<bool>());
+                if (is_atomic) type = type->atomic(context);
+                return type_node(is_const ? type->constant(context) : type);
+            }
+            case AST_VARIABLE: return variable(reader->read<char*>());
+            case AST_PAREN: return expression(reader);
+            case AST_SIZEOF:
+            case AST_TYPEOF: {
+                if (node == AST_SIZEOF && reader->read<bool>()) throw Error::runtime(context, "Unsupported expression");
+                JitNode* value = expression(reader);
+                if (value->op != JitOp_Type && jit_impure(value)) throw Error::runtime(context, "Unsupported expression");
+                if (node == AST_TYPEOF) return type_node(value->type);
+                Variable var(primitive(TypeKind_Int64, true));
+                var.as<uint64_t>() = (value->op == JitOp_Type ? value->target : value->type)->size;
+                return constant(var);
+            }
+            case AST_TERNARY: {
+                JitNode* node = this->node(JitOp_Ternary);
+                node->a = condition(expression(reader));
+                conditional++;
+                node->b = pushed(reader, true);
+                node->c = pushed(reader, true);
+                conditional--;
+                if (node->b->type != node->c->type || !jit_scalar(node->b->type)) throw Error::runtime(context, "Unsupported ternary");
+                node->type = node->b->type;
+                node->lvalue = node->b->lvalue && node->c->lvalue;
+                node->flag2 = node->b->lvalue != node->c->lvalue;
+                return node;
+            }
+            case AST_DECL: {
+                bool is_extern = reader->read<bool>();
+                char* name = reader->read<char*>();
+                JitNode* type = pop(stack);
+                if (is_extern || type->op != JitOp_Type || reader->read<bool>()) throw Error::runtime(context, "Unsupported declaration");
+                if (!passed(type->target) || reader->read<bool>()) throw Error::runtime(context, "Unsupported declaration");
+                if (conditional) throw Error::runtime(context, "Declaration in a conditional expression");
+                JitNode* node = this->node(JitOp_Local, type->target);
+                node->slot = declare(name, type->target);
+                node->flag = node->lvalue = true;
+                return node;
+            }
+            default: return operation(node, reader, stack);
+        }
+    }
+    JitNode* variable(char* name) {
+        for (int i = locals.size - 1; i >= 0; i--) {
+            if (strcmp(locals.items[i].name, name) != 0) continue;
+            if (locals.items[i].value) return constant(locals.items[i].value->value);
+            JitNode* node = this->node(JitOp_Local, locals.items[i].type);
+            node->slot = locals.items[i].slot;
+            node->lvalue = !node->type->is_const;
+            return node;
+        }
+        Variable* var = context->variables->items[0]->getdef(name, NULL);
+        if (!var) throw Error::runtime(context, String::new_format("Variable '%s' not found", name));
+        Type* type = var->type;
+        if (translating && type->kind == TypeKind_Type) { // the struct types the function uses, as they are now
+            Type* value = var->as<Type*>();
+            if (!value || value->has_defers || value->kind != TypeKind_Struct) throw Error::runtime(context, "Unsupported variable");
+            inputs = TypeCache::hash_mix(inputs, TypeCache::hash_mix(TypeCache::hash_str(name), jit_fingerprint(value)));
+            return type_node(value);
+        }
+        if (!passed(type) && type->kind != TypeKind_Function) throw Error::runtime(context, "Unsupported variable");
+        JitNode* node = this->node(JitOp_Global, type);
+        node->address = var->ptr();
+        node->lvalue = !type->is_const;
+        node->slot = globals.size;
+        globals.add(node->address);
+        inputs = TypeCache::hash_mix(inputs, TypeCache::hash_mix(TypeCache::hash_str(name), jit_fingerprint(type)));
+        return node;
+    }
+    JitNode* operation(AST_Node node, ByteReader* reader, Stack<JitNode*>* stack) {
+        switch (node) {
+            case AST_ARRAY: {
+                JitNode* pointer = pop(stack);
+                JitNode* index = convert(expression(reader), primitive(TypeKind_Int64, true));
+                if (pointer->type->kind != TypeKind_Pointer) throw Error::runtime(context, "Operand type mismatch");
+                return deref(offset(pointer, index, pointer->type->pointer_info.base->value_size(), false));
+            }
+            case AST_CALL:
+            case AST_TAIL_CALL: return call(pop(stack), reader, node == AST_TAIL_CALL);
+            case AST_WALK_STRUCT: {
+                JitNode* str = pop(stack);
+                char* name = reader->read<char*>();
+                reader->skip(sizeof(Type::FieldEntry*));
+                if (!translating || str->type->kind != TypeKind_Struct) throw Error::runtime(context, "Unsupported expression");
+                Type::FieldEntry* entry = str->type->find_field(name);
+                if (!entry) throw Error::runtime(context, String::new_format("Field '%s' not found", name));
+                return field(str, entry);
+            }
+            case AST_LOAD:
+            case AST_STORE:
+            case AST_EXCHANGE:
+            case AST_CAS:
+            case AST_FETCH_ADD: return atomic(node, reader);
+            case AST_STATIC: {
+                AST_Node op = reader->read<AST_Node>();
+                reader->skip(sizeof(TypeKind) + sizeof(bool));
+                return operation(op, reader, stack);
+            }
+            case AST_CAST:
+            case AST_BITCAST: {
+                JitNode* type = pop(stack);
+                JitNode* value = pop(stack);
+                if (type->op != JitOp_Type) throw Error::runtime(context, "Operand type mismatch");
+                return rvalue(convert(value, type->target, node == AST_BITCAST));
+            }
+            case AST_CONST:
+            case AST_ATOMIC:
+            case AST_POINTER: {
+                JitNode* type = pop(stack);
+                if (type->op != JitOp_Type) throw Error::runtime(context, "Operand type mismatch");
+                if (node == AST_ATOMIC) return type_node(type->target->atomic(context));
+                return type_node(node == AST_CONST ? type->target->constant(context) : type->target->pointer(context));
+            }
+            case AST_DEREFERENCE: {
+                JitNode* pointer = pop(stack);
+                if (pointer->type->kind != TypeKind_Pointer) throw Error::runtime(context, "Unsupported dereference");
+                return deref(pointer);
+            }
+            case AST_ADDRESS: {
+                JitNode* place = pop(stack);
+                if (!place->lvalue) throw Error::runtime(context, "Operand type mismatch");
+                JitNode* node = this->node(JitOp_Address, place->type->pointer(context));
+                node->a = place;
+                if (jit_strip(place)->op == JitOp_Local) addresses_locals = true;
+                return node;
+            }
+            case AST_PREFIX_INCREMENT:
+            case AST_PREFIX_DECREMENT:
+            case AST_SUFFIX_INCREMENT:
+            case AST_SUFFIX_DECREMENT: {
+                JitNode* place = pop(stack);
+                if (!place->lvalue || place->type->kind == TypeKind_Pointer) throw Error::runtime(context, "Operand type mismatch");
+                JitNode* result = this->node(JitOp_Increment, place->type);
+                result->a = place;
+                result->amount = node == AST_PREFIX_INCREMENT || node == AST_SUFFIX_INCREMENT ? 1 : -1;
+                result->flag = node == AST_SUFFIX_INCREMENT || node == AST_SUFFIX_DECREMENT;
+                return result;
+            }
+            case AST_ARITH_PLUS:
+            case AST_ARITH_NEGATE:
+            case AST_LOGIC_NEGATE:
+            case AST_BINARY_NEGATE: return unary(node, pop(stack));
+            case AST_ASSIGN:
+            case AST_ADD_ASSIGN:
+            case AST_SUBTRACT_ASSIGN:
+            case AST_MULTIPLY_ASSIGN:
+            case AST_DIVIDE_ASSIGN:
+            case AST_POWER_ASSIGN:
+            case AST_MODULO_ASSIGN:
+            case AST_BITSHIFT_LEFT_ASSIGN:
+            case AST_BITSHIFT_RIGHT_ASSIGN:
+            case AST_BITWISE_AND_ASSIGN:
+            case AST_BITWISE_OR_ASSIGN:
+            case AST_BITWISE_XOR_ASSIGN: {
+                JitNode* value = pop(stack);
+                JitNode* place = pop(stack);
+                return assign(place, value, node);
+            }
+            default:
+                if (node < AST_POWER || node > AST_LOGICAL_OR) throw Error::runtime(context, "Unsupported expression");
+                JitNode* b = pop(stack);
+                JitNode* a = pop(stack);
+                return binary(node, a, b);
+        }
+    }
+
+    JitNode* fold(AST_Node op, JitNode* a, JitNode* b) {
+        Stack<Variable> stack;
+        stack.push(a->value);
+        if (b) stack.push(b->value);
+        execute_operator(context, NULL, &stack, op);
+        return constant(stack.pop());
+    }
+    JitNode* convert(JitNode* value, Type* type, bool bitcast = false) {
+        if (value->type == type && passed(type)) return value;
+        if (!jit_scalar(value->type) || !jit_scalar(type)) throw Error::runtime(context, "Unsupported conversion");
+        if (value->op == JitOp_Const) return constant(cast(context, type, value->value, bitcast));
+        JitNode* node = this->node(JitOp_Convert, type);
+        node->a = value;
+        node->flag = bitcast;
+        return node;
+    }
+    JitNode* rvalue(JitNode* value) {
+        if (!value->lvalue) return value;
+        JitNode* node = this->node(JitOp_Convert, value->type);
+        node->a = value;
+        return node;
+    }
+    JitNode* deref(JitNode* pointer) {
+        Type* base = pointer->type->pointer_info.base;
+        if (!passed(base)) throw Error::runtime(context, "Unsupported dereference");
+        JitNode* node = this->node(JitOp_Deref, base);
+        node->a = pointer;
+        node->lvalue = !base->is_const;
+        return node;
+    }
+    // the field at the offset build_struct_layout gave it, like walk_struct() finds it. An inline one is its address
+    JitNode* field(JitNode* str, Type::FieldEntry* entry) {
+        Type* type = entry->type();
+        bool inlined = entry->field->inline_size != -1;
+        if (!inlined && !passed(type)) throw Error::runtime(context, "Unsupported field");
+        JitNode* node = this->node(JitOp_Field, inlined ? type : type->pointer(context));
+        node->a = str;
+        node->amount = entry->offset;
+        return inlined ? node : deref(node);
+    }
+    JitNode* offset(JitNode* a, JitNode* b, int64_t scale, bool swapped) {
+        ordered(a, b);
+        if (a->op == JitOp_Const && b->op == JitOp_Const) return fold(AST_ADDITION, a, b);
+        JitNode* node = this->node(JitOp_Offset, (swapped ? b : a)->type);
+        node->a = a;
+        node->b = b;
+        node->amount = scale;
+        node->flag = swapped;
+        return node;
+    }
+    JitNode* unary(AST_Node op, JitNode* a) {
+        if (!jit_scalar(a->type) || (op != AST_LOGIC_NEGATE && a->type->kind == TypeKind_Pointer) || (op == AST_BINARY_NEGATE && !jit_integer(a->type))) throw Error::runtime(context, "Operand type mismatch");
+        if (a->op == JitOp_Const) return fold(op, a, NULL);
+        if (op == AST_ARITH_PLUS) return rvalue(a);
+        JitNode* node = this->node(op == AST_ARITH_NEGATE ? JitOp_Negate : op == AST_BINARY_NEGATE ? JitOp_Complement : JitOp_Not, op == AST_LOGIC_NEGATE ? primitive(TypeKind_Int8, true) : a->type);
+        node->a = a;
+        return node;
+    }
+    JitNode* binary(AST_Node op, JitNode* a, JitNode* b) {
+        if (!jit_scalar(a->type) || !jit_scalar(b->type)) throw Error::runtime(context, "Operand type mismatch");
+        bool pointers = a->type->kind == TypeKind_Pointer || b->type->kind == TypeKind_Pointer;
+        switch (op) {
+            case AST_ADDITION:
+                if (!pointers) break;
+                if (a->type->kind == TypeKind_Pointer && jit_integer(b->type)) return offset(a, b, a->type->pointer_info.base->size, false);
+                if (jit_integer(a->type) && b->type->kind == TypeKind_Pointer) return offset(a, b, b->type->pointer_info.base->size, true);
+                throw Error::runtime(context, "Operand type mismatch");
+            case AST_SUBTRACTION: // the interpreter adds pointers on '-' too, left to it
+            case AST_MULTIPLICATION:
+            case AST_DIVISION:
+            case AST_MODULO:
+            case AST_POWER:
+            case AST_LESS_THAN:
+            case AST_GREATER_THAN:
+            case AST_LESS_THAN_OR_EQUAL_TO:
+            case AST_GREATER_THAN_OR_EQUAL_TO:
+                if (pointers) throw Error::runtime(context, "Operand type mismatch");
+                break;
+            case AST_BITSHIFT_LEFT:
+            case AST_BITSHIFT_RIGHT:
+            case AST_BITWISE_AND:
+            case AST_BITWISE_OR:
+            case AST_BITWISE_XOR:
+                if (!jit_integer(a->type) || !jit_integer(b->type)) throw Error::runtime(context, "Operand type mismatch");
+                break;
+            case AST_EQUALS:
+            case AST_NOT_EQUALS: break;
+            case AST_LOGICAL_AND: {
+                ordered(a, b);
+                if (a->op == JitOp_Const && b->op == JitOp_Const) return fold(op, a, b);
+                JitNode* node = this->node(JitOp_And, primitive(TypeKind_Int8, true));
+                node->a = a;
+                node->b = b;
+                return node;
+            }
+            default: throw Error::runtime(context, "Unsupported operator");
+        }
+        Type* type = promote(context, a->type, b->type);
+        a = convert(a, type);
+        b = convert(b, type);
+        ordered(a, b);
+        bool compare = op >= AST_LESS_THAN && op <= AST_NOT_EQUALS;
+        bool traps = !jit_float(type) && (op == AST_DIVISION || op == AST_MODULO);
+        if (a->op == JitOp_Const && b->op == JitOp_Const && (!traps || b->value.as<uint64_t>() != 0)) return fold(op, a, b);
+        JitNode* node = this->node(compare ? JitOp_Compare : JitOp_Binary, compare ? primitive(TypeKind_Int8, true) : type);
+        node->node = op;
+        node->a = a;
+        node->b = b;
+        return node;
+    }
+    JitNode* assign(JitNode* place, JitNode* value, AST_Node op) {
+        if (!place->lvalue || !passed(value->type)) throw Error::runtime(context, "Operand type mismatch");
+        JitNode* node = this->node(JitOp_Assign, place->type);
+        node->a = place;
+        if (op != AST_ASSIGN) {
+            op = compound_operator(op);
+            if (value->type->kind == TypeKind_Pointer || (place->type->kind == TypeKind_Pointer && op != AST_ADDITION)) throw Error::runtime(context, "Operand type mismatch");
+            JitNode* current = this->node(JitOp_Current, place->type);
+            current->a = place;
+            current->d = node;
+            value = binary(op, current, value);
+            node->flag = true;
+        }
+        node->b = convert(value, place->type);
+        return node;
+    }
+    // the operands in the order execute_atomic() evaluates them, the target as a place
+    JitNode* atomic(AST_Node op, ByteReader* reader) {
+        JitNode* place = expression(reader);
+        Type* type = place->type;
+        if (!place->lvalue || !type->is_atomic || (place->op != JitOp_Local && place->op != JitOp_Global && place->op != JitOp_Deref)) throw Error::runtime(context, "Unsupported atomic");
+        if (!jit_integer(type) && type->kind != TypeKind_Pointer) throw Error::runtime(context, "Unsupported atomic");
+        JitNode* node = this->node(JitOp_Atomic, op == AST_STORE ? primitive(TypeKind_Void) : op == AST_CAS ? primitive(TypeKind_Int8, true) : type);
+        node->node = op;
+        node->a = place;
+        if (op != AST_LOAD) node->b = convert(expression(reader), op == AST_FETCH_ADD && type->kind == TypeKind_Pointer ? primitive(TypeKind_Int64) : type);
+        if (op == AST_CAS) node->c = convert(expression(reader), type);
+        node->amount = reader->read<int32_t>();
+        return node;
+    }
+    JitNode* call(JitNode* callee, ByteReader* reader, bool tail = false) {
+        Type* type = callee->type;
+        if (callee->op != JitOp_Global || type->kind != TypeKind_Function || type->has_defers || type->lvalue_return) throw Error::runtime(context, "Unsupported call");
+        Type* ret = type->function_info.return_type;
+        if (ret->kind != TypeKind_Void && !passed(ret)) throw Error::runtime(context, "Unsupported call");
+        // an extern holds the C function itself, called straight from C for as long as the global still holds it
+        void* native = translating ? Variable::read<void*>(callee->address) : NULL;
+        if (native && Function::from(context->code_arena, native)) native = NULL;
+        int num_params = type->function_info.num_params;
+        bool varargs = num_params > 0 && type->function_info.params[num_params - 1].type->kind == TypeKind_Varargs;
+        if (varargs && (!native || num_params == 1)) throw Error::runtime(context, "Unsupported call");
+        if (varargs) num_params--;
+        JitNode* node = this->node(JitOp_Call, ret);
+        node->a = callee;
+        node->target = type;
+        node->flag = native != NULL;
+        node->list = new List<JitNode*>;
+        while (reader->ptr < reader->size && reader->bytes[reader->ptr] != AST_END) node->list->add(expression(reader));
+        reader->skip(1);
+        if (varargs ? node->list->size < num_params : node->list->size != num_params) throw Error::runtime(context, "Non-matching number of arguments");
+        for (int i = 0; i < node->list->size; i++) {
+            JitNode* arg = node->list->items[i];
+            if (i < num_params) arg = convert(arg, type->function_info.params[i].type);
+            else if (arg->type->kind == TypeKind_Float32) arg = convert(arg, primitive(TypeKind_Float64)); // promoted, as C does
+            else if (!passed(arg->type)) throw Error::runtime(context, "Unsupported argument");
+            node->list->items[i] = arg;
+            for (int j = 0; j < i; j++) ordered(node->list->items[j], node->list->items[i]);
+        }
+        node->slot = num_slots;
+        num_slots += node->list->size;
+        node->amount = calls.size;
+        calls.add(JitCallSite{ type, NULL, !native && tail && ret == signature->function_info.return_type });
+        natives.add(native);
+        return node;
+    }
+
+    // loop invariant code motion: an operation in a loop whose operands the loop never changes runs once in front
+    // of it, into a new local. Only operations that can't fail move, the loop may not run at all
+    JitNode* hoist(JitNode* node) {
+        if (!node) return NULL;
+        switch (node->op) {
+            case JitOp_Block:
+                for (int i = 0; i < node->list->size; i++) node->list->items[i] = hoist(node->list->items[i]);
+                return node;
+            case JitOp_If:
+                node->b = hoist(node->b);
+                node->c = hoist(node->c);
+                return node;
+            case JitOp_While:
+            case JitOp_For: break;
+            default: return node;
+        }
+        bool* written = alloc->malloc<bool>(num_slots);
+        bool globals = true;
+        if (node->op == JitOp_For) for (int i = 0; i < 3; i++) written[node->slot + i] = true;
+        writes(node->op == JitOp_For ? node->c : node, written, &globals);
+        JitNode* block = this->node(JitOp_Block);
+        block->list = new List<JitNode*>;
+        if (node->op == JitOp_While) node->a = lift(node->a, written, globals, block->list);
+        JitNode*& body = node->op == JitOp_For ? node->c : node->b;
+        body = lift(body, written, globals, block->list);
+        alloc->free(written);
+        body = hoist(body);
+        if (block->list->size == 0) return node;
+        block->list->add(node);
+        return block;
+    }
+    void writes(JitNode* node, bool* written, bool* globals) {
+        if (!node) return;
+        switch (node->op) {
+            case JitOp_Local:
+                if (node->flag) written[node->slot] = true;
+                return;
+            case JitOp_Assign:
+            case JitOp_Increment:
+            case JitOp_Atomic: {
+                JitNode* place = jit_strip(node->a);
+                if (place->op == JitOp_Local) written[place->slot] = true;
+                else *globals = false; // a global or anything a pointer reaches
+                if (node->op == JitOp_Atomic) *globals = false;
+                break;
+            }
+            case JitOp_Call: *globals = false; break;
+            case JitOp_For:
+                for (int i = 0; i < 3; i++) written[node->slot + i] = true;
+                break;
+            case JitOp_Current: return;
+            default: break;
+        }
+        if (node->list) for (int i = 0; i < node->list->size; i++) writes(node->list->items[i], written, globals);
+        writes(node->a, written, globals);
+        writes(node->b, written, globals);
+        writes(node->c, written, globals);
+    }
+    bool invariant(JitNode* node, bool* written, bool globals) {
+        if (jit_float(node->type) || node->type->is_atomic) return false;
+        switch (node->op) {
+            case JitOp_Const: return true;
+            case JitOp_Local: return !node->flag && !written[node->slot] && !escaped[node->slot];
+            case JitOp_Global: return globals && node->type->kind != TypeKind_Function;
+            case JitOp_Convert:
+            case JitOp_Not:
+            case JitOp_Negate:
+            case JitOp_Complement: return invariant(node->a, written, globals);
+            case JitOp_Binary:
+                if (node->node == AST_DIVISION || node->node == AST_MODULO || node->node == AST_POWER) return false;
+                // fallthrough
+            case JitOp_Compare:
+            case JitOp_Offset:
+            case JitOp_And: return invariant(node->a, written, globals) && invariant(node->b, written, globals);
+            default: return false;
+        }
+    }
+    // replaces the invariant operations under node with locals declared in hoisted
+    JitNode* lift(JitNode* node, bool* written, bool globals, List<JitNode*>* hoisted) {
+        if (!node || node->op == JitOp_Current) return node;
+        bool operation = node->op == JitOp_Binary || node->op == JitOp_Compare || node->op == JitOp_Offset || node->op == JitOp_And
+            || node->op == JitOp_Not || node->op == JitOp_Negate || node->op == JitOp_Complement;
+        if (operation && invariant(node, written, globals)) {
+            JitNode* local = this->node(JitOp_Local, node->type);
+            local->slot = num_slots++;
+            local->flag = local->lvalue = true;
+            escaped = alloc->realloc(escaped, num_slots);
+            escaped[local->slot] = false;
+            JitNode* assign = this->node(JitOp_Assign, node->type);
+            assign->a = local;
+            assign->b = node;
+            hoisted->add(assign);
+            JitNode* read = this->node(JitOp_Local, node->type);
+            read->slot = local->slot;
+            read->lvalue = true;
+            return read;
+        }
+        if (node->list) for (int i = 0; i < node->list->size; i++) node->list->items[i] = lift(node->list->items[i], written, globals, hoisted);
+        node->a = lift(node->a, written, globals, hoisted);
+        node->b = lift(node->b, written, globals, hoisted);
+        node->c = lift(node->c, written, globals, hoisted);
+        return node;
+    }
+    void escapes(JitNode* node) { // locals something may change through a pointer
+        if (!node) return;
+        switch (node->op) {
+            case JitOp_Address:
+            case JitOp_Atomic:
+                if (node->a->op == JitOp_Local) escaped[node->a->slot] = true;
+                break;
+            case JitOp_Ternary:
+                if (node->b->op == JitOp_Local) escaped[node->b->slot] = true;
+                if (node->c->op == JitOp_Local) escaped[node->c->slot] = true;
+                break;
+            case JitOp_Current: return;
+            default: break;
+        }
+        if (node->list) for (int i = 0; i < node->list->size; i++) escapes(node->list->items[i]);
+        escapes(node->a);
+        escapes(node->b);
+        escapes(node->c);
+    }
+};
+
+enum JitReg: uint8_t {
+    Reg_Rax, Reg_Rcx, Reg_Rdx, Reg_Rbx, Reg_Rsp, Reg_Rbp, Reg_Rsi, Reg_Rdi,
+    Reg_R8, Reg_R9, Reg_R10, Reg_R11, Reg_R12, Reg_R13, Reg_R14, Reg_R15,
+};
+
+// the low nibble of jcc/setcc, floats compare equal only when the parity flag is clear
+enum JitCond: uint8_t {
+    Cond_B = 0x2, Cond_AE, Cond_E, Cond_NE, Cond_BE, Cond_A,
+    Cond_P = 0xA, Cond_NP, Cond_L, Cond_GE, Cond_LE, Cond_G,
+    Cond_FloatEqual, Cond_FloatNotEqual,
+};
+
+static JitCond jit_invert(JitCond cond) {
+    if (cond == Cond_FloatEqual) return Cond_FloatNotEqual;
+    if (cond == Cond_FloatNotEqual) return Cond_FloatEqual;
+    return (JitCond)(cond ^ 1);
+}
+
+// everything compiled code calls, cached code refers to them by their index
+static void* const jit_helpers[] = {
+    (void*)jit_call, (void*)jit_missing_return, (void*)jit_f32_to_u64, (void*)jit_f64_to_u64,
+    (void*)jit_pow_int, (void*)jit_powf, (void*)jit_pow, (void*)jit_fmodf, (void*)jit_fmod, (void*)jit_misaligned_atomic,
+    (void*)jit_unset_struct, (void*)jit_replaced_native,
+};
+
+// an address in the code that's different in another process
+enum JitRelocKind: uint8_t {
+    JitReloc_Helper, // jit_helpers[index]
+    JitReloc_Site,   // the function's call site index
+    JitReloc_Global, // the address of JitBuilder::globals[index]
+    JitReloc_String, // JitBuilder::strings[index]
+    JitReloc_Heat,   // the function's heat
+};
+
+struct JitReloc {
+    uint32_t offset;
+    JitRelocKind kind;
+    uint32_t index;
+};
+
+// x86-64 encoding for the JIT, jumps go to labels that are patched once all the code is there
+struct JitAssembler {
+    struct Addr {
+        JitReg base;
+        int32_t disp;
+    };
+    struct Fixup {
+        int offset, label;
+    };
+    ByteWriter* buf = new ByteWriter;
+    List<int> labels;
+    List<Fixup> fixups;
+    List<JitReloc> relocs;
+    bool relocatable = true; // whether relocs covers every address in the code
+    int depth = 0; // bytes pushed below the frame, calls have to keep the stack 16 byte aligned
+
+    ~JitAssembler() { delete buf; }
+
+    // encoding
+    void rex(bool wide, int reg, int base) {
+        uint8_t prefix = 0x40 | wide << 3 | (reg >> 3) << 2 | base >> 3;
+        if (prefix != 0x40) buf->write<uint8_t>(prefix);
+    }
+    void modrm(int reg, Addr addr) { // disp32(base)
+        buf->write<uint8_t>(0x80 | (reg & 7) << 3 | (addr.base & 7));
+        if ((addr.base & 7) == Reg_Rsp) buf->bytes(0x24);
+        buf->write<int32_t>(addr.disp);
+    }
+    void modrm(int reg, int rm) {
+        buf->write<uint8_t>(0xC0 | (reg & 7) << 3 | (rm & 7));
+    }
+    void mov(JitReg dst, JitReg src) {
+        rex(true, src, dst);
+        buf->bytes(0x89); // mov %src, %dst
+        modrm(src, dst);
+    }
+    void mov_imm(JitReg dst, uint64_t value) {
+        rex(value > 0xFFFFFFFF, 0, dst);
+        if (value <= 0xFFFFFFFF) {
+            buf->write<uint8_t>(0xB8 | (dst & 7)); // mov $x, %r32
+            buf->write<uint32_t>(value);
+        }
+        else if ((int64_t)value < 0 && (int64_t)value >= INT32_MIN) {
+            buf->bytes(0xC7); // mov $x, %r64 (sign extended)
+            modrm(0, dst);
+            buf->write<int32_t>(value);
+        }
+        else {
+            buf->write<uint8_t>(0xB8 | (dst & 7)); // movabs $x, %r64
+            buf->write<uint64_t>(value);
+        }
+    }
+    void mov_addr(JitReg dst, void* ptr, JitRelocKind kind, uint32_t index) { // always a movabs, so it can be patched
+        rex(true, 0, dst);
+        buf->write<uint8_t>(0xB8 | (dst & 7));
+        relocs.add(JitReloc{ (uint32_t)buf->size, kind, index });
+        buf->write(ptr);
+    }
+    void lea(JitReg dst, Addr addr) {
+        rex(true, dst, addr.base);
+        buf->bytes(0x8D);
+        modrm(dst, addr);
+    }
+    void load_raw(JitReg dst, Addr addr) {
+        rex(true, dst, addr.base);
+        buf->bytes(0x8B);
+        modrm(dst, addr);
+    }
+    void store_raw(Addr addr, JitReg src) {
+        rex(true, src, addr.base);
+        buf->bytes(0x89);
+        modrm(src, addr);
+    }
+    void push(JitReg reg) {
+        rex(false, 0, reg);
+        buf->write<uint8_t>(0x50 | (reg & 7));
+        depth += 8;
+    }
+    void pop(JitReg reg) {
+        rex(false, 0, reg);
+        buf->write<uint8_t>(0x58 | (reg & 7));
+        depth -= 8;
+    }
+    void to_xmm(int xmm, JitReg reg, bool wide) { // movd/movq %reg, %xmm
+        buf->bytes(0x66);
+        rex(wide, xmm, reg);
+        buf->bytes(0x0F, 0x6E);
+        modrm(xmm, reg);
+    }
+    void from_xmm(JitReg reg, int xmm, bool wide) { // movd/movq %xmm, %reg
+        buf->bytes(0x66);
+        rex(wide, xmm, reg);
+        buf->bytes(0x0F, 0x7E);
+        modrm(xmm, reg);
+    }
+    void sse(bool single, uint8_t op, int dst, int src) { // addss, mulsd, ...
+        buf->write<uint8_t>(single ? 0xF3 : 0xF2);
+        buf->bytes(0x0F);
+        buf->write<uint8_t>(op);
+        modrm(dst, src);
+    }
+    void ucomis(Type* type, int a, int b) {
+        if (type->kind == TypeKind_Float64) buf->bytes(0x66);
+        buf->bytes(0x0F, 0x2E); // ucomiss/ucomisd %b, %a
+        modrm(a, b);
+    }
+    // calls a C function with the stack aligned, anything live has to be on the stack
+    void call(void* function) {
+        int pad = depth % 16;
+#ifdef _WIN32
+        pad += 32; // shadow space
+#endif
+        if (pad) buf->bytes(0x48, 0x83, 0xEC)->write<uint8_t>(pad); // sub $x, %rsp
+        uint32_t index = 0;
+        while (index < sizeof(jit_helpers) / sizeof(void*) && jit_helpers[index] != function) index++;
+        relocatable = relocatable && index < sizeof(jit_helpers) / sizeof(void*);
+        mov_addr(Reg_R11, function, JitReloc_Helper, index);
+        buf->bytes(0x41, 0xFF, 0xD3);                                // call *%r11
+        if (pad) buf->bytes(0x48, 0x83, 0xC4)->write<uint8_t>(pad); // add $x, %rsp
+    }
+    int label() {
+        labels.add(-1);
+        return labels.size - 1;
+    }
+    void bind(int label) {
+        labels.items[label] = buf->size;
+    }
+    void jump(int label, int cond = -1) {
+        if (cond == -1) buf->bytes(0xE9);                               // jmp rel32
+        else buf->bytes(0x0F)->write<uint8_t>(0x80 | cond);             // jcc rel32
+        fixups.add(Fixup{ buf->size, label });
+        buf->write<int32_t>(0);
+    }
+    void jump_if(JitCond cond, int label, bool when) {
+        if (cond == Cond_FloatEqual) {
+            cond = Cond_FloatNotEqual;
+            when = !when;
+        }
+        if (cond != Cond_FloatNotEqual) return jump(label, when ? cond : cond ^ 1);
+        if (when) {
+            jump(label, Cond_P);
+            jump(label, Cond_NE);
+        }
+        else {
+            int skip = this->label();
+            jump(skip, Cond_P);
+            jump(label, Cond_E);
+            bind(skip);
+        }
+    }
+    void set(JitCond cond) { // %eax = cond
+        if (cond == Cond_FloatEqual) {
+            buf->bytes(0x0F, 0x94, 0xC0); // sete %al
+            buf->bytes(0x0F, 0x9B, 0xC1); // setnp %cl
+            buf->bytes(0x20, 0xC8);       // and %cl, %al
+        }
+        else if (cond == Cond_FloatNotEqual) {
+            buf->bytes(0x0F, 0x95, 0xC0); // setne %al
+            buf->bytes(0x0F, 0x9A, 0xC1); // setp %cl
+            buf->bytes(0x08, 0xC8);       // or %cl, %al
+        }
+        else buf->bytes(0x0F)->write<uint8_t>(0x90 | cond)->bytes(0xC0); // setcc %al
+        buf->bytes(0x0F, 0xB6, 0xC0); // movzx %al, %eax
+    }
+
+    // values
+    void load(Type* type, Addr addr, int reg = 0) { // the canonical value at addr into %rax/%xmm0 (reg 0) or %rcx/%xmm1 (reg 1)
+        switch (type->kind) {
+            case TypeKind_Int8:    rex(!type->is_unsigned, reg, addr.base); buf->bytes(0x0F)->write<uint8_t>(type->is_unsigned ? 0xB6 : 0xBE); break; // movzx/movsx
+            case TypeKind_Int16:   rex(!type->is_unsigned, reg, addr.base); buf->bytes(0x0F)->write<uint8_t>(type->is_unsigned ? 0xB7 : 0xBF); break; // movzx/movsx
+            case TypeKind_Int32:   rex(!type->is_unsigned, reg, addr.base); buf->write<uint8_t>(type->is_unsigned ? 0x8B : 0x63); break;           // mov/movsxd
+            case TypeKind_Float32: buf->bytes(0xF3); rex(false, reg, addr.base); buf->bytes(0x0F, 0x10); break; // movss
+            case TypeKind_Float64: buf->bytes(0xF2); rex(false, reg, addr.base); buf->bytes(0x0F, 0x10); break; // movsd
+            default:               rex(true, reg, addr.base); buf->bytes(0x8B); break;                         // mov
+        }
+        modrm(reg, addr);
+    }
+    void store(Type* type, Addr addr, int reg = 0) {
+        switch (type->kind) {
+            case TypeKind_Int8:    rex(false, reg, addr.base); buf->bytes(0x88); break;
+            case TypeKind_Int16:   buf->bytes(0x66); rex(false, reg, addr.base); buf->bytes(0x89); break;
+            case TypeKind_Int32:   rex(false, reg, addr.base); buf->bytes(0x89); break;
+            case TypeKind_Float32: buf->bytes(0xF3); rex(false, reg, addr.base); buf->bytes(0x0F, 0x11); break; // movss
+            case TypeKind_Float64: buf->bytes(0xF2); rex(false, reg, addr.base); buf->bytes(0x0F, 0x11); break; // movsd
+            default:               rex(true, reg, addr.base); buf->bytes(0x89); break;
+        }
+        modrm(reg, addr);
+    }
+    // xchg (0x87), or lock prefixed xadd (0xC1) or cmpxchg (0xB1), of %reg and the value at addr, on the value's width
+    void rmw(Type* type, uint8_t op, int reg, Addr addr) {
+        int size = type->value_size();
+        bool locked = op != 0x87; // xchg with memory always is
+        if (locked) buf->bytes(0xF0);
+        if (size == 2) buf->bytes(0x66);
+        rex(size == 8, reg, addr.base);
+        if (locked) buf->bytes(0x0F);
+        buf->write<uint8_t>(size == 1 ? op - 1 : op);
+        modrm(reg, addr);
+    }
+    void canonical(Type* type) {
+        switch (type->kind) {
+            case TypeKind_Int8:  type->is_unsigned ? buf->bytes(0x0F, 0xB6, 0xC0) : buf->bytes(0x48, 0x0F, 0xBE, 0xC0); break; // movzx/movsx %al, %rax
+            case TypeKind_Int16: type->is_unsigned ? buf->bytes(0x0F, 0xB7, 0xC0) : buf->bytes(0x48, 0x0F, 0xBF, 0xC0); break; // movzx/movsx %ax, %rax
+            case TypeKind_Int32: type->is_unsigned ? buf->bytes(0x89, 0xC0) : buf->bytes(0x48, 0x63, 0xC0); break;             // mov %eax, %eax/movsxd %eax, %rax
+            default: break;
+        }
+    }
+    void patch() {
+        for (int i = 0; i < fixups.size; i++) {
+            Fixup fixup = fixups.items[i];
+            int32_t rel = labels.items[fixup.label] - (fixup.offset + 4);
+            memcpy(buf->bytes + fixup.offset, &rel, 4);
+        }
+    }
+};
+
+// a single pass over the JitNodes, values live in %rax or %xmm0, the right operand of a binary in %rcx or %xmm1.
+// %rbx holds the context, locals are 8 byte slots below %rbp. The second tier keeps integer locals in
+// %r12-%r15 instead, shared by locals that aren't live at the same time, and leaves out code that can never run.
+// Both tiers compile the same tree with the types it has, nothing is specialized on the values seen at run time
+struct JitCompiler: JitAssembler {
+    struct Range {
+        int first, last;
+    };
+    enum Pending {
+        Pending_Static,  // a variable, read when it's finished
+        Pending_Address, // a place whose address is on the stack
+        Pending_Value,   // on the stack
+    };
+    JitBuilder* builder;
+    Context* context;
+    Function* func;
+    Type* signature;
+    JitCallSite* sites;
+    bool second_tier;
+    int8_t* regs = NULL; // the register each slot lives in, or -1 for its place in the frame
+    List<JitReg> saved;
+    Stack<int> breaks, continues;
+    int num_slots, exit, leave;
+
+    JitCompiler(JitBuilder* builder, JitCallSite* sites): builder(builder), context(builder->context), func(builder->func),
+        signature(builder->signature), sites(sites), second_tier(builder->second_tier) {}
+    ~JitCompiler() { alloc->free(regs); }
+
+    void compile(JitNode* body, int num_slots) {
+        this->num_slots = num_slots;
+        allocate(body);
+        exit = label();
+        leave = label();
+        buf->bytes(0x55);             // push %rbp
+        buf->bytes(0x48, 0x89, 0xE5); // mov %rsp, %rbp
+        buf->bytes(0x53);             // push %rbx
+        buf->bytes(0x48, 0x81, 0xEC); // sub $x, %rsp
+        buf->write<uint32_t>(ALIGN((num_slots + saved.size) * 8 + 8, 16) - 8);
+        for (int i = 0; i < saved.size; i++) store_raw(local(num_slots + i), saved.items[i]);
+#ifdef _WIN32
+        JitReg context_reg = Reg_Rcx, args = Reg_Rdx;
+#else
+        JitReg context_reg = Reg_Rdi, args = Reg_Rsi;
+#endif
+        mov(Reg_Rbx, context_reg);
+        for (int i = 0; i < signature->function_info.num_params; i++) {
+            if (regs[i] >= 0) {
+                load(signature->function_info.params[i].type, Addr{ args, i * 8 });
+                mov((JitReg)regs[i], Reg_Rax);
+                continue;
+            }
+            load_raw(Reg_Rax, Addr{ args, i * 8 });
+            store_raw(local(i), Reg_Rax);
+        }
+        statement(body);
+        if (signature->function_info.return_type->kind != TypeKind_Void) {
+            mov(context_reg, Reg_Rbx);
+            call((void*)jit_missing_return);
+        }
+        bind(exit);
+        buf->bytes(0x31, 0xC0);             // xor %eax, %eax
+        bind(leave);
+        for (int i = 0; i < saved.size; i++) load_raw(saved.items[i], local(num_slots + i));
+        buf->bytes(0x48, 0x8B, 0x5D, 0xF8); // mov -8(%rbp), %rbx
+        buf->bytes(0xC9);                   // leave
+        buf->bytes(0xC3);                   // ret
+        patch();
+    }
+
+    // a linear scan over where the integer locals are live, counted in statements, hands out %r12-%r15. When
+    // more are live at once, the ones read or written most stay in registers, a use inside a loop counts 8
+    // times one outside it. A local whose address is taken stays in the frame
+    void allocate(JitNode* body) {
+        regs = alloc->malloc<int8_t>(num_slots);
+        memset(regs, -1, num_slots);
+        if (!second_tier) return;
+        uint64_t* weights = alloc->malloc<uint64_t>(num_slots);
+        bool* pinned = alloc->malloc<bool>(num_slots);
+        Range* ranges = alloc->malloc<Range>(num_slots);
+        for (int i = 0; i < num_slots; i++) ranges[i] = Range{ -1, -1 };
+        for (int i = 0; i < signature->function_info.num_params; i++) {
+            weights[i]++;
+            use(ranges, i, 0);
+        }
+        count(body, 1, weights, pinned);
+        List<Range> loops;
+        int position = 0;
+        live(body, ranges, &loops, &position);
+        for (int i = 0; i < loops.size; i++) { // inner loops come first
+            Range loop = loops.items[i];
+            for (int slot = 0; slot < num_slots; slot++) {
+                Range* range = &ranges[slot];
+                if (range->first >= 0 && range->first < loop.first && range->last >= loop.first && range->last < loop.last) range->last = loop.last;
+            }
+        }
+        List<int> order; // by where they start
+        for (int slot = 0; slot < num_slots; slot++) {
+            if (pinned[slot] || !weights[slot] || ranges[slot].first < 0) continue;
+            int i = order.size;
+            order.add(slot);
+            for (; i > 0 && ranges[order.items[i - 1]].first > ranges[slot].first; i--) order.items[i] = order.items[i - 1];
+            order.items[i] = slot;
+        }
+        static const JitReg candidates[] = { Reg_R12, Reg_R13, Reg_R14, Reg_R15 };
+        int active[4] = { -1, -1, -1, -1 }; // the slot each register holds
+        for (int i = 0; i < order.size; i++) {
+            int slot = order.items[i], free = -1, cheapest = -1;
+            for (int reg = 0; reg < 4; reg++) {
+                if (active[reg] >= 0 && ranges[active[reg]].last < ranges[slot].first) active[reg] = -1;
+                if (active[reg] < 0) {
+                    if (free < 0) free = reg;
+                }
+                else if (cheapest < 0 || weights[active[reg]] < weights[active[cheapest]]) cheapest = reg;
+            }
+            if (free < 0) {
+                if (weights[active[cheapest]] >= weights[slot]) continue;
+                regs[active[cheapest]] = -1; // nothing was generated yet, it lives in the frame all along
+                free = cheapest;
+            }
+            active[free] = slot;
+            regs[slot] = candidates[free];
+        }
+        for (int reg = 0; reg < 4; reg++) {
+            for (int slot = 0; slot < num_slots; slot++) {
+                if (regs[slot] != candidates[reg]) continue;
+                saved.add(candidates[reg]);
+                break;
+            }
+        }
+        alloc->free(weights);
+        alloc->free(pinned);
+        alloc->free(ranges);
+    }
+    void use(Range* ranges, int slot, int position) {
+        if (ranges[slot].first < 0 || ranges[slot].first > position) ranges[slot].first = position;
+        if (ranges[slot].last < position) ranges[slot].last = position;
+    }
+    // every statement takes a position and the locals in it are live there. A local used in a loop but declared
+    // before it lives through the whole loop, which live() leaves to allocate() with the loops it lists
+    void live(JitNode* node, Range* ranges, List<Range>* loops, int* position) {
+        if (!node) return;
+        switch (node->op) {
+            case JitOp_Local:
+                use(ranges, node->slot, *position);
+                return;
+            case JitOp_Current: return;
+            case JitOp_Block:
+                for (int i = 0; i < node->list->size; i++) {
+                    ++*position;
+                    live(node->list->items[i], ranges, loops, position);
+                }
+                return;
+            case JitOp_While: {
+                int first = ++*position;
+                live(node->a, ranges, loops, position);
+                live(node->b, ranges, loops, position);
+                loops->add(Range{ first, ++*position });
+                return;
+            }
+            case JitOp_For: {
+                int first = ++*position;
+                live(node->a, ranges, loops, position);
+                live(node->b, ranges, loops, position);
+                live(node->c, ranges, loops, position);
+                int last = ++*position;
+                for (int i = 0; i < 3; i++) {
+                    use(ranges, node->slot + i, first);
+                    use(ranges, node->slot + i, last);
+                }
+                loops->add(Range{ first, last });
+                return;
+            }
+            default: break;
+        }
+        if (node->list) for (int i = 0; i < node->list->size; i++) live(node->list->items[i], ranges, loops, position);
+        live(node->a, ranges, loops, position);
+        live(node->b, ranges, loops, position);
+        live(node->c, ranges, loops, position);
+    }
+    void count(JitNode* node, uint64_t weight, uint64_t* weights, bool* pinned) {
+        if (!node) return;
+        uint64_t inner = weight < (1ULL << 48) ? weight * 8 : weight;
+        switch (node->op) {
+            case JitOp_Local:
+                weights[node->slot] += weight;
+                if (jit_float(node->type)) pinned[node->slot] = true;
+                return;
+            case JitOp_Address:
+            case JitOp_Atomic:
+                if (node->a->op == JitOp_Local) pinned[node->a->slot] = true;
+                break;
+            case JitOp_Ternary: // a place on both sides is taken by its address
+                if (node->b->op == JitOp_Local) pinned[node->b->slot] = true;
+                if (node->c->op == JitOp_Local) pinned[node->c->slot] = true;
+                break;
+            case JitOp_Current: return;
+            case JitOp_While:
+                count(node->a, inner, weights, pinned);
+                count(node->b, inner, weights, pinned);
+                return;
+            case JitOp_For:
+                count(node->a, weight, weights, pinned);
+                count(node->b, weight, weights, pinned);
+                for (int i = 0; i < 3; i++) weights[node->slot + i] += inner * 2;
+                count(node->c, inner, weights, pinned);
+                return;
+            default: break;
+        }
+        if (node->list) for (int i = 0; i < node->list->size; i++) count(node->list->items[i], weight, weights, pinned);
+        count(node->a, weight, weights, pinned);
+        count(node->b, weight, weights, pinned);
+        count(node->c, weight, weights, pinned);
+    }
+
+    Addr local(int slot) {
+        return Addr{ Reg_Rbp, -16 - slot * 8 };
+    }
+    void zero(int slot) {
+        if (regs[slot] >= 0) { // xor %r32, %r32
+            rex(false, regs[slot], regs[slot]);
+            buf->bytes(0x31);
+            modrm(regs[slot], regs[slot]);
+            return;
+        }
+        rex(true, 0, Reg_Rbp);
+        buf->bytes(0xC7); // movq $0, x(%rbp)
+        modrm(0, local(slot));
+        buf->write<int32_t>(0);
+    }
+    void constant(Variable value, int reg) {
+        uint64_t bits = value.as<uint64_t>();
+        if (value.type->kind == TypeKind_Pointer && bits) {
+            uint64_t literal = builder->literal(bits);
+            if (literal != bits) return mov_addr(reg ? Reg_Rcx : Reg_Rax, (void*)bits, JitReloc_String, (uint32_t)literal);
+            relocatable = false;
+        }
+        if (!jit_float(value.type)) return mov_imm(reg ? Reg_Rcx : Reg_Rax, bits);
+        bool wide = value.type->kind == TypeKind_Float64;
+        mov_imm(Reg_Rdx, wide ? bits : (uint32_t)bits);
+        to_xmm(reg, Reg_Rdx, wide);
+    }
+    // a slot into %rax (reg 0) or %rcx (reg 1), or back from %rax which has to be canonical already
+    void load_slot(Type* type, int slot, int reg = 0) {
+        if (regs[slot] < 0) return load(type, local(slot), reg);
+        mov(reg ? Reg_Rcx : Reg_Rax, (JitReg)regs[slot]);
+    }
+    void store_slot(Type* type, int slot) {
+        if (regs[slot] < 0) return store(type, local(slot));
+        mov((JitReg)regs[slot], Reg_Rax);
+    }
+    Addr global(JitNode* node) { // through %rdx
+        mov_addr(Reg_Rdx, node->address, JitReloc_Global, node->slot);
+        return Addr{ Reg_Rdx, 0 };
+    }
+    void read(JitNode* node, int reg) { // a variable or the current value of an assignment's target
+        if (node->op == JitOp_Local) return load_slot(node->type, node->slot, reg);
+        if (node->op != JitOp_Current) return load(node->type, global(node), reg);
+        JitNode* assign = node->d;
+        if (assign->slot < 0) return read(node->a, reg);
+        load_raw(Reg_Rdx, Addr{ Reg_Rsp, depth - assign->slot });
+        load(node->type, Addr{ Reg_Rdx, 0 }, reg);
+    }
+    void write(JitNode* node) { // %rax/%xmm0 into a variable
+        if (node->op == JitOp_Local) return store_slot(node->type, node->slot);
+        store(node->type, global(node));
+    }
+    // converts %rax/%xmm0 like cast() does, clobbers %rdx, %xmm2 and %r11 only
+    void convert(Type* from, Type* to, bool bitcast) {
+        if (bitcast) {
+            if (from->kind == TypeKind_Float32) {
+                from_xmm(Reg_Rax, 0, false);
+                buf->bytes(0x48, 0x63, 0xC0); // movsxd %eax, %rax
+            }
+            else if (from->kind == TypeKind_Float64) from_xmm(Reg_Rax, 0, true);
+            if (jit_float(to)) to_xmm(0, Reg_Rax, to->kind == TypeKind_Float64);
+            else canonical(to);
+            return;
+        }
+        if (jit_float(to)) {
+            bool single = to->kind == TypeKind_Float32;
+            if (jit_float(from)) {
+                if (from->kind != to->kind) sse(!single, 0x5A, 0, 0); // cvtss2sd/cvtsd2ss %xmm0, %xmm0
+            }
+            else if (from->is_unsigned && from->kind == TypeKind_Int64) { // above 2^63, halve it rounding to odd and double it again
+                int big = label(), done = label();
+                buf->bytes(0x48, 0x85, 0xC0);                  // test %rax, %rax
+                jump(big, Cond_L);
+                buf->write<uint8_t>(single ? 0xF3 : 0xF2)->bytes(0x48, 0x0F, 0x2A, 0xC0); // cvtsi2s %rax, %xmm0
+                jump(done);
+                bind(big);
+                buf->bytes(0x48, 0x89, 0xC2);                  // mov %rax, %rdx
+                buf->bytes(0x48, 0xD1, 0xEA);                  // shr %rdx
+                buf->bytes(0x83, 0xE0, 0x01);                  // and $1, %eax
+                buf->bytes(0x48, 0x09, 0xC2);                  // or %rax, %rdx
+                buf->write<uint8_t>(single ? 0xF3 : 0xF2)->bytes(0x48, 0x0F, 0x2A, 0xC2); // cvtsi2s %rdx, %xmm0
+                sse(single, 0x58, 0, 0);                       // adds %xmm0, %xmm0
+                bind(done);
+            }
+            else buf->write<uint8_t>(single ? 0xF3 : 0xF2)->bytes(0x48, 0x0F, 0x2A, 0xC0); // cvtsi2s %rax, %xmm0
+            return;
+        }
+        if (jit_float(from)) {
+            push(Reg_Rcx); // the other operand may be live
+            buf->bytes(0x48, 0x83, 0xEC, 0x08);       // sub $8, %rsp
+            buf->bytes(0xF2, 0x0F, 0x11, 0x0C, 0x24); // movsd %xmm1, (%rsp)
+            depth += 8;
+            call(from->kind == TypeKind_Float32 ? (void*)jit_f32_to_u64 : (void*)jit_f64_to_u64);
+            buf->bytes(0xF2, 0x0F, 0x10, 0x0C, 0x24); // movsd (%rsp), %xmm1
+            buf->bytes(0x48, 0x83, 0xC4, 0x08);       // add $8, %rsp
+            depth -= 8;
+            pop(Reg_Rcx);
+            canonical(to);
+            return;
+        }
+        if (!jit_fits(from, to)) canonical(to);
+    }
+    void converts(JitNode* node, JitNode* base) { // the conversions between a place and its consumer
+        if (node == base) return;
+        converts(node->a, base);
+        convert(node->a->type, node->type, node->flag);
+    }
+
+    // a left operand goes first but places in it are read after the right one
+    Pending prepare(JitNode* node) {
+        JitNode* base = jit_strip(node);
+        if (base->op == JitOp_Current || ((base->op == JitOp_Local || base->op == JitOp_Global) && base->lvalue)) {
+            if (base->op == JitOp_Local && base->flag) zero(base->slot);
+            return Pending_Static;
+        }
+        if (base->lvalue) {
+            address(base);
+            push(Reg_Rax);
+            return Pending_Address;
+        }
+        gen(node);
+        if (jit_float(node->type)) from_xmm(Reg_Rax, 0, true);
+        push(Reg_Rax);
+        return Pending_Value;
+    }
+    void finish(JitNode* node, Pending pending) {
+        JitNode* base = jit_strip(node);
+        if (pending == Pending_Value) {
+            pop(Reg_Rax);
+            if (jit_float(node->type)) to_xmm(0, Reg_Rax, true);
+            return;
+        }
+        if (pending == Pending_Static) read(base, 0);
+        else {
+            pop(Reg_Rdx);
+            load(base->type, Addr{ Reg_Rdx, 0 });
+        }
+        converts(node, base);
+    }
+    bool simple(JitNode* node) {
+        return node->op == JitOp_Const || (node->op == JitOp_Local && !node->flag) || node->op == JitOp_Global;
+    }
+    void operands(JitNode* a, JitNode* b) {
+        if (simple(b)) {
+            gen(a);
+            if (b->op == JitOp_Const) constant(b->value, 1);
+            else read(b, 1);
+            return;
+        }
+        Pending pending = prepare(a);
+        gen(b);
+        if (jit_float(b->type)) buf->bytes(0x0F, 0x28, 0xC8); // movaps %xmm0, %xmm1
+        else mov(Reg_Rcx, Reg_Rax);
+        finish(a, pending);
+    }
+
+    void address(JitNode* node) { // into %rax
+        switch (node->op) {
+            case JitOp_Local:
+                if (regs[node->slot] >= 0) throw Error::runtime(context, "Not a place");
+                if (node->flag) zero(node->slot);
+                lea(Reg_Rax, local(node->slot));
+                break;
+            case JitOp_Global: mov_addr(Reg_Rax, node->address, JitReloc_Global, node->slot); break;
+            case JitOp_Deref: gen(node->a); break;
+            case JitOp_Ternary: ternary(node, true); break;
+            default: throw Error::runtime(context, "Not a place");
+        }
+    }
+    void gen(JitNode* node) {
+        switch (node->op) {
+            case JitOp_Const: constant(node->value, 0); break;
+            case JitOp_Local:
+                if (node->flag) zero(node->slot);
+                load_slot(node->type, node->slot);
+                break;
+            case JitOp_Global:
+            case JitOp_Current: read(node, 0); break;
+            case JitOp_Deref:
+                gen(node->a);
+                load(node->type, Addr{ Reg_Rax, 0 });
+                break;
+            case JitOp_Assign: assign(node); break;
+            case JitOp_Increment: increment(node); break;
+            case JitOp_Address: address(node->a); break;
+            case JitOp_Convert:
+                gen(node->a);
+                convert(node->a->type, node->type, node->flag);
+                break;
+            case JitOp_Binary: binary(node); break;
+            case JitOp_Compare: set(compare(node)); break;
+            case JitOp_Offset: {
+                operands(node->a, node->b);
+                int index = node->flag ? Reg_Rax : Reg_Rcx;
+                if (node->amount != 1) {
+                    rex(true, index, index);
+                    buf->bytes(0x69); // imul $x, %index, %index
+                    modrm(index, index);
+                    buf->write<int32_t>(node->amount);
+                }
+                buf->bytes(0x48, 0x01, 0xC8); // add %rcx, %rax
+                break;
+            }
+            case JitOp_And:
+                operands(node->a, node->b);
+                truth(node->b->type, 1);
+                truth(node->a->type, 0);
+                buf->bytes(0x20, 0xD0);       // and %dl, %al
+                buf->bytes(0x0F, 0xB6, 0xC0); // movzx %al, %eax
+                break;
+            case JitOp_Not:
+                gen(node->a);
+                set(jit_invert(test(node->a->type)));
+                break;
+            case JitOp_Negate:
+                gen(node->a);
+                if (node->type->kind == TypeKind_Float32) {
+                    from_xmm(Reg_Rax, 0, false);
+                    buf->bytes(0x35, 0x00, 0x00, 0x00, 0x80); // xor $0x80000000, %eax
+                    to_xmm(0, Reg_Rax, false);
+                }
+                else if (node->type->kind == TypeKind_Float64) {
+                    from_xmm(Reg_Rax, 0, true);
+                    buf->bytes(0x48, 0x0F, 0xBA, 0xF8, 0x3F); // btc $63, %rax
+                    to_xmm(0, Reg_Rax, true);
+                }
+                else {
+                    buf->bytes(0x48, 0xF7, 0xD8); // neg %rax
+                    canonical(node->type);
+                }
+                break;
+            case JitOp_Complement:
+                gen(node->a);
+                buf->bytes(0x48, 0xF7, 0xD0); // not %rax
+                canonical(node->type);
+                break;
+            case JitOp_Ternary:
+                ternary(node, node->lvalue);
+                if (node->lvalue) load(node->type, Addr{ Reg_Rax, 0 });
+                break;
+            case JitOp_Call: invoke(node); break;
+            case JitOp_Atomic: atomic(node); break;
+            default: throw Error::runtime(context, "Not a value");
+        }
+    }
+    void ternary(JitNode* node, bool as_address) {
+        int other = label(), end = label();
+        branch(node->a, other, false);
+        as_address ? address(node->b) : gen(node->b);
+        jump(end);
+        bind(other);
+        as_address ? address(node->c) : gen(node->c);
+        bind(end);
+    }
+    void assign(JitNode* node) {
+        JitNode* target = node->a;
+        if (target->op == JitOp_Local || target->op == JitOp_Global) {
+            if (target->op == JitOp_Local && target->flag) zero(target->slot);
+            node->slot = -1;
+            gen(node->b);
+            write(target);
+            return;
+        }
+        address(target);
+        push(Reg_Rax);
+        node->slot = depth; // for the compound operator reading it
+        gen(node->b);
+        pop(Reg_Rdx);
+        store(node->type, Addr{ Reg_Rdx, 0 });
+    }
+    // loads are plain moves and so are stores, unless they're seq_cst and take an xchg. x86 orders everything else
+    // the way the weaker memory orders ask for already
+    void atomic(JitNode* node) {
+        Type* type = node->a->type;
+        int size = type->value_size();
+        address(node->a);
+        if (size > 1) { // before the operands run, like the interpreter checks it
+            int aligned = label();
+            buf->bytes(0xA8)->write<uint8_t>(size - 1); // test $x, %al
+            jump(aligned, Cond_E);
+#ifdef _WIN32
+            mov(Reg_Rcx, Reg_Rbx);
+#else
+            mov(Reg_Rdi, Reg_Rbx);
+#endif
+            call((void*)jit_misaligned_atomic);
+            jump(exit);
+            bind(aligned);
+        }
+        if (node->node == AST_LOAD) return load(type, Addr{ Reg_Rax, 0 });
+        push(Reg_Rax);
+        gen(node->b);
+        if (node->node == AST_CAS) {
+            push(Reg_Rax);
+            gen(node->c);
+            mov(Reg_Rcx, Reg_Rax);
+            pop(Reg_Rax);
+        }
+        pop(Reg_Rdx);
+        Addr target = Addr{ Reg_Rdx, 0 };
+        switch (node->node) {
+            case AST_STORE:
+                if (node->amount == __ATOMIC_SEQ_CST) rmw(type, 0x87, Reg_Rax, target);
+                else store(type, target);
+                break;
+            case AST_EXCHANGE:
+            case AST_FETCH_ADD:
+                rmw(type, node->node == AST_EXCHANGE ? 0x87 : 0xC1, Reg_Rax, target);
+                canonical(type);
+                break;
+            default: // compares with %rax
+                rmw(type, 0xB1, Reg_Rcx, target);
+                set(Cond_E);
+                break;
+        }
+    }
+    void increment(JitNode* node) {
+        JitNode* target = node->a;
+        bool variable = target->op == JitOp_Local || target->op == JitOp_Global;
+        if (variable) {
+            if (target->op == JitOp_Local && target->flag) zero(target->slot);
+            read(target, 0);
+        }
+        else {
+            address(target);
+            mov(Reg_Rdx, Reg_Rax);
+            load(node->type, Addr{ Reg_Rdx, 0 });
+        }
+        if (jit_float(node->type)) {
+            bool single = node->type->kind == TypeKind_Float32;
+            buf->bytes(0x0F, 0x28, 0xC8); // movaps %xmm0, %xmm1
+            Variable amount(node->type);
+            if (single) amount.as<float>() = node->amount;
+            else amount.as<double>() = node->amount;
+            mov_imm(Reg_Rax, single ? (uint32_t)amount.as<uint64_t>() : amount.as<uint64_t>());
+            to_xmm(2, Reg_Rax, !single);
+            sse(single, 0x58, 0, 2);      // adds %xmm2, %xmm0
+            variable ? write(target) : store(node->type, Addr{ Reg_Rdx, 0 });
+            if (node->flag) buf->bytes(0x0F, 0x28, 0xC1); // movaps %xmm1, %xmm0
+            return;
+        }
+        mov(Reg_Rcx, Reg_Rax);
+        buf->bytes(0x48, 0x83)->write<uint8_t>(node->amount > 0 ? 0xC0 : 0xE8)->bytes(0x01); // add/sub $1, %rax
+        canonical(node->type);
+        variable ? write(target) : store(node->type, Addr{ Reg_Rdx, 0 });
+        if (node->flag) mov(Reg_Rax, Reg_Rcx);
+    }
+    void binary(JitNode* node) {
+        operands(node->a, node->b);
+        Type* type = node->type;
+        if (jit_float(type)) {
+            bool single = type->kind == TypeKind_Float32;
+            switch (node->node) {
+                case AST_ADDITION:       sse(single, 0x58, 0, 1); break;
+                case AST_SUBTRACTION:    sse(single, 0x5C, 0, 1); break;
+                case AST_MULTIPLICATION: sse(single, 0x59, 0, 1); break;
+                case AST_DIVISION:       sse(single, 0x5E, 0, 1); break;
+                case AST_MODULO:         call(single ? (void*)jit_fmodf : (void*)jit_fmod); break;
+                case AST_POWER:          call(single ? (void*)jit_powf : (void*)jit_pow); break;
+                default: throw Error::runtime(context, "Unsupported operator");
+            }
+            return;
+        }
+        switch (node->node) {
+            case AST_ADDITION:       buf->bytes(0x48, 0x01, 0xC8); break;       // add %rcx, %rax
+            case AST_SUBTRACTION:    buf->bytes(0x48, 0x29, 0xC8); break;       // sub %rcx, %rax
+            case AST_MULTIPLICATION: buf->bytes(0x48, 0x0F, 0xAF, 0xC1); break; // imul %rcx, %rax
+            case AST_DIVISION:
+            case AST_MODULO:
+                buf->bytes(0x31, 0xD2);       // xor %edx, %edx
+                buf->bytes(0x48, 0xF7, 0xF1); // div %rcx
+                if (node->node == AST_MODULO) buf->bytes(0x48, 0x89, 0xD0); // mov %rdx, %rax
+                break;
+            case AST_POWER:
+#ifdef _WIN32
+                buf->bytes(0x48, 0x89, 0xCA); // mov %rcx, %rdx
+                buf->bytes(0x48, 0x89, 0xC1); // mov %rax, %rcx
+#else
+                buf->bytes(0x48, 0x89, 0xC7); // mov %rax, %rdi
+                buf->bytes(0x48, 0x89, 0xCE); // mov %rcx, %rsi
+#endif
+                call((void*)jit_pow_int);
+                break;
+            case AST_BITSHIFT_LEFT:  buf->bytes(0x48, 0xD3, 0xE0); break; // shl %cl, %rax
+            case AST_BITSHIFT_RIGHT: buf->bytes(0x48, 0xD3, 0xE8); break; // shr %cl, %rax
+            case AST_BITWISE_AND:    buf->bytes(0x48, 0x21, 0xC8); break; // and %rcx, %rax
+            case AST_BITWISE_OR:     buf->bytes(0x48, 0x09, 0xC8); break; // or %rcx, %rax
+            case AST_BITWISE_XOR:    buf->bytes(0x48, 0x31, 0xC8); break; // xor %rcx, %rax
+            default: throw Error::runtime(context, "Unsupported operator");
+        }
+        canonical(type);
+    }
+    JitCond compare(JitNode* node) { // sets the flags, returns the condition that holds when it's true
+        operands(node->a, node->b);
+        Type* type = node->a->type;
+        if (jit_float(type)) switch (node->node) { // only above/above-or-equal are false on unordered
+            case AST_LESS_THAN:                ucomis(type, 1, 0); return Cond_A;
+            case AST_LESS_THAN_OR_EQUAL_TO:    ucomis(type, 1, 0); return Cond_AE;
+            case AST_GREATER_THAN:             ucomis(type, 0, 1); return Cond_A;
+            case AST_GREATER_THAN_OR_EQUAL_TO: ucomis(type, 0, 1); return Cond_AE;
+            case AST_EQUALS:                   ucomis(type, 0, 1); return Cond_FloatEqual;
+            default:                           ucomis(type, 0, 1); return Cond_FloatNotEqual;
+        }
+        buf->bytes(0x48, 0x39, 0xC8); // cmp %rcx, %rax
+        bool is_signed = !type->is_unsigned;
+        switch (node->node) {
+            case AST_LESS_THAN:                return is_signed ? Cond_L : Cond_B;
+            case AST_LESS_THAN_OR_EQUAL_TO:    return is_signed ? Cond_LE : Cond_BE;
+            case AST_GREATER_THAN:             return is_signed ? Cond_G : Cond_A;
+            case AST_GREATER_THAN_OR_EQUAL_TO: return is_signed ? Cond_GE : Cond_AE;
+            case AST_EQUALS:                   return Cond_E;
+            default:                           return Cond_NE;
+        }
+    }
+    JitCond test(Type* type) { // the condition that holds when %rax/%xmm0 is truthy
+        if (!jit_float(type)) {
+            buf->bytes(0x48, 0x85, 0xC0); // test %rax, %rax
+            return Cond_NE;
+        }
+        buf->bytes(0x0F, 0x57, 0xD2); // xorps %xmm2, %xmm2
+        ucomis(type, 0, 2);
+        return Cond_FloatNotEqual;
+    }
+    void truth(Type* type, int reg) { // %dl (reg 1) or %al (reg 0) = whether %rcx/%xmm1 or %rax/%xmm0 is truthy
+        int out = reg ? Reg_Rdx : Reg_Rax;
+        if (jit_float(type)) {
+            buf->bytes(0x0F, 0x57, 0xD2); // xorps %xmm2, %xmm2
+            ucomis(type, reg, 2);
+            buf->bytes(0x0F, 0x95)->write<uint8_t>(0xC0 | out); // setne
+            buf->bytes(0x0F, 0x9A, 0xC1);                      // setp %cl
+            buf->bytes(0x08)->write<uint8_t>(0xC8 | out);      // or %cl
+        }
+        else {
+            buf->bytes(0x48, 0x85); // test
+            modrm(reg, reg);
+            buf->bytes(0x0F, 0x95)->write<uint8_t>(0xC0 | out); // setne
+        }
+    }
+    void branch(JitNode* node, int label, bool when) { // jumps when the truthiness of node is when
+        if (node->op == JitOp_Compare) return jump_if(compare(node), label, when);
+        if (node->op == JitOp_Not) return branch(node->a, label, !when);
+        if (node->op == JitOp_Const) {
+            if (is_truthy(context, &node->value) == when) jump(label);
+            return;
+        }
+        gen(node);
+        jump_if(test(node->type), label, when);
+    }
+    void invoke(JitNode* node) {
+        List<JitNode*>* args = node->list;
+        int count = args->size;
+        Pending pending[count + 1];
+        auto slot = [&](int i) { return local(node->slot + count - 1 - i); }; // ascending addresses
+        for (int i = 0; i < count; i++) { // a place is cast after the arguments following it ran
+            JitNode* arg = args->items[i];
+            JitNode* base = jit_strip(arg);
+            bool late = false;
+            for (int j = i + 1; j < count; j++) late = late || jit_impure(args->items[j]);
+            if (late && base->lvalue && (base->op == JitOp_Local || base->op == JitOp_Global)) {
+                if (base->op == JitOp_Local && base->flag) zero(base->slot);
+                pending[i] = Pending_Static;
+            }
+            else if (late && base->lvalue) {
+                address(base);
+                store_raw(slot(i), Reg_Rax);
+                pending[i] = Pending_Address;
+            }
+            else {
+                gen(arg);
+                store(arg->type, slot(i));
+                pending[i] = Pending_Value;
+            }
+        }
+        for (int i = 0; i < count; i++) {
+            if (pending[i] == Pending_Value) continue;
+            JitNode* base = jit_strip(args->items[i]);
+            if (pending[i] == Pending_Static) read(base, 0);
+            else {
+                load_raw(Reg_Rdx, slot(i));
+                load(base->type, Addr{ Reg_Rdx, 0 });
+            }
+            converts(args->items[i], base);
+            store(args->items[i]->type, slot(i));
+        }
+        gen(node->a); // the callee is read last
+        JitCallSite* site = &sites[node->amount];
+#ifdef _WIN32
+        mov(Reg_R8, Reg_Rax);
+        mov(Reg_Rcx, Reg_Rbx);
+        mov_addr(Reg_Rdx, site, JitReloc_Site, node->amount);
+        lea(Reg_R9, slot(0));
+#else
+        mov(Reg_Rdx, Reg_Rax);
+        mov(Reg_Rdi, Reg_Rbx);
+        mov_addr(Reg_Rsi, site, JitReloc_Site, node->amount);
+        lea(Reg_Rcx, slot(0));
+#endif
+        call((void*)jit_call);
+        buf->bytes(0x48, 0x83); // cmpq $0, jit_error(%rbx)
+        modrm(7, Addr{ Reg_Rbx, (int32_t)offsetof(Context, jit_error) });
+        buf->bytes(0x00);
+        jump(exit, Cond_NE);
+        if (jit_float(node->type)) to_xmm(0, Reg_Rax, node->type->kind == TypeKind_Float64);
+    }
+
+    void effect(JitNode* node) {
+        if (node->op == JitOp_Type) return;
+        if (node->op == JitOp_Local) {
+            if (node->flag) zero(node->slot);
+            return;
+        }
+        if (node->lvalue) address(node);
+        else gen(node);
+    }
+    void statement(JitNode* node) {
+        switch (node->op) {
+            case JitOp_Block:
+                for (int i = 0; i < node->list->size; i++) {
+                    JitNode* child = node->list->items[i];
+                    statement(child);
+                    if (second_tier && (child->op == JitOp_Return || child->op == JitOp_Break || child->op == JitOp_Continue)) break;
+                }
+                break;
+            case JitOp_If: {
+                if (second_tier && node->a->op == JitOp_Const) {
+                    if (is_truthy(context, &node->a->value)) statement(node->b);
+                    else if (node->c) statement(node->c);
+                    break;
+                }
+                int other = label(), end = label();
+                branch(node->a, other, false);
+                statement(node->b);
+                if (node->c) jump(end);
+                bind(other);
+                if (node->c) statement(node->c);
+                bind(end);
+                break;
+            }
+            case JitOp_While: {
+                if (second_tier && node->a->op == JitOp_Const && !is_truthy(context, &node->a->value)) break;
+                int top = label(), end = label();
+                bind(top);
+                branch(node->a, end, false);
+                breaks.push(end);
+                continues.push(top);
+                statement(node->b);
+                breaks.pop();
+                continues.pop();
+                heat();
+                jump(top);
+                bind(end);
+                break;
+            }
+            case JitOp_For: {
+                Type* type = node->type;
+                int iter = node->slot, next = node->slot + 1, bound = node->slot + 2;
+                bool reverse = node->amount < 0, is_signed = !type->is_unsigned;
+                int top = label(), step = label(), end = label();
+                gen(node->a);
+                store_slot(type, reverse ? bound : next);
+                gen(node->b);
+                store_slot(type, reverse ? next : bound);
+                if (reverse ? node->flag2 : node->flag) {
+                    load_slot(type, next);
+                    add_step(type, node->amount);
+                    store_slot(type, next);
+                }
+                bind(top);
+                load_slot(type, next, 0);
+                load_slot(type, bound, 1);
+                buf->bytes(0x48, 0x39, 0xC8); // cmp %rcx, %rax
+                if (!reverse) jump(end, node->flag2 ? (is_signed ? Cond_GE : Cond_AE) : (is_signed ? Cond_G : Cond_A));
+                else jump(end, node->flag ? (is_signed ? Cond_LE : Cond_BE) : (is_signed ? Cond_L : Cond_B));
+                store_slot(type, iter);
+                breaks.push(end);
+                continues.push(step);
+                statement(node->c);
+                breaks.pop();
+                continues.pop();
+                bind(step);
+                load_slot(type, iter);
+                add_step(type, node->amount);
+                store_slot(type, next);
+                load_slot(type, iter, 1);
+                buf->bytes(0x48, 0x39, 0xC8); // cmp %rcx, %rax, a step that wraps around ends the loop
+                if (!reverse) jump(end, is_signed ? Cond_L : Cond_B);
+                else jump(end, is_signed ? Cond_G : Cond_A);
+                heat();
+                jump(top);
+                bind(end);
+                break;
+            }
+            case JitOp_Return: {
+                Type* ret = signature->function_info.return_type;
+                if (node->a && ret->kind == TypeKind_Void) effect(node->a);
+                else if (node->a) {
+                    gen(node->a);
+                    if (jit_float(ret)) from_xmm(Reg_Rax, 0, ret->kind == TypeKind_Float64);
+                }
+                else buf->bytes(0x31, 0xC0); // xor %eax, %eax
+                jump(leave);
+                break;
+            }
+            case JitOp_Break: jump(breaks.peek()); break;
+            case JitOp_Continue: jump(continues.peek()); break;
+            default: effect(node);
+        }
+    }
+    void heat() { // loop iterations count towards the second tier while the baseline runs
+        if (second_tier) return;
+        mov_addr(Reg_Rdx, &func->heat, JitReloc_Heat, 0);
+        buf->bytes(0x48, 0x83, 0x02, 0x01); // addq $1, (%rdx)
+    }
+    void add_step(Type* type, int64_t amount) {
+        mov_imm(Reg_Rcx, amount);
+        buf->bytes(0x48, 0x01, 0xC8); // add %rcx, %rax
+        canonical(type);
+    }
+};
+
+static JitCallSite* jit_sites(JitBuilder* builder) {
+    JitCallSite* sites = alloc->malloc<JitCallSite>(builder->calls.size);
+    for (int i = 0; i < builder->calls.size; i++) sites[i] = builder->calls.items[i];
+    return sites;
+}
+
+static void jit_install(Function* func, Type* type, void* code, JitCallSite* sites, uint8_t tier) {
+    func->jit_baseline = func->jit;
+    func->jit_baseline_sites = func->jit_sites;
+    func->jit_sites = sites;
+    func->jit_type = type;
+    func->jit_tier = tier;
+    __atomic_store_n(&func->jit, code, __ATOMIC_RELEASE);
+}
+
+static const char jit_cache_magic[8] = "PAWJIT2"; // changes whenever the generated code or the header does
+
+static const char* jit_cache_dir() {
+    static const char* dir = getenv("PAWSCRIPT_JIT_CACHE");
+    return dir && *dir ? dir : NULL;
+}
+
+static String jit_cache_path(uint64_t key) {
+    return String::new_format("%s%c%016llx.jit", jit_cache_dir(), PATH_SEPARATOR, (unsigned long long)key);
+}
+
+// the relocations and the code, a file cut short or changed on disk is never run
+static uint64_t jit_cache_checksum(JitReloc* relocs, uint32_t num_relocs, uint8_t* bytes, uint32_t size) {
+    return hash_bytes(bytes, size, hash_bytes(relocs, num_relocs * sizeof(JitReloc)));
+}
+
+// written under a name no other process or thread uses first and renamed, so they never see half of it
+static void jit_cache_store(JitCompiler* compiler, uint64_t key) {
+    String path = jit_cache_path(key);
+#ifdef _WIN32
+    unsigned long pid = GetCurrentProcessId();
+#else
+    unsigned long pid = getpid();
+#endif
+    String temp = String::new_format("%s.%lu.%p.tmp", path.data, pid, (void*)compiler);
+    FILE* f = fopen(temp.data, "wb");
+    if (!f) return;
+    uint32_t size = compiler->buf->size, num_relocs = compiler->relocs.size;
+    uint64_t checksum = jit_cache_checksum(compiler->relocs.items, num_relocs, compiler->buf->bytes, size);
+    bool written = fwrite(jit_cache_magic, 1, sizeof(jit_cache_magic), f) == sizeof(jit_cache_magic);
+    written = written && fwrite(&key, sizeof(key), 1, f) == 1 && fwrite(&size, sizeof(size), 1, f) == 1 && fwrite(&num_relocs, sizeof(num_relocs), 1, f) == 1;
+    written = written && fwrite(&checksum, sizeof(checksum), 1, f) == 1;
+    written = written && fwrite(compiler->relocs.items, sizeof(JitReloc), num_relocs, f) == num_relocs;
+    written = written && fwrite(compiler->buf->bytes, 1, size, f) == size;
+    written = fclose(f) == 0 && written;
+    if (!written || rename(temp.data, path.data) != 0) remove(temp.data);
+}
+
+// the code an earlier process compiled for the same JitNodes, with the addresses of this one patched in
+static void* jit_cache_load(JitBuilder* builder, JitCallSite* sites, uint64_t key) {
+    String path = jit_cache_path(key);
+    FILE* f = fopen(path.data, "rb");
+    if (!f) return NULL;
+    char magic[sizeof(jit_cache_magic)];
+    uint64_t stored, checksum;
+    uint32_t size, num_relocs;
+    bool valid = fread(magic, 1, sizeof(magic), f) == sizeof(magic) && memcmp(magic, jit_cache_magic, sizeof(magic)) == 0;
+    valid = valid && fread(&stored, sizeof(stored), 1, f) == 1 && stored == key;
+    valid = valid && fread(&size, sizeof(size), 1, f) == 1 && fread(&num_relocs, sizeof(num_relocs), 1, f) == 1;
+    valid = valid && fread(&checksum, sizeof(checksum), 1, f) == 1;
+    valid = valid && size >= 8 && size < (1 << 28) && num_relocs <= size / 8;
+    JitReloc* relocs = valid ? alloc->malloc<JitReloc>(num_relocs) : NULL;
+    uint8_t* bytes = valid ? alloc->malloc<uint8_t>(size) : NULL;
+    valid = valid && fread(relocs, sizeof(JitReloc), num_relocs, f) == num_relocs && fread(bytes, 1, size, f) == size;
+    valid = valid && fgetc(f) == EOF && jit_cache_checksum(relocs, num_relocs, bytes, size) == checksum;
+    fclose(f);
+    for (uint32_t i = 0; valid && i < num_relocs; i++) {
+        JitReloc reloc = relocs[i];
+        void* target = NULL;
+        switch (reloc.kind) {
+            case JitReloc_Helper: if (reloc.index < sizeof(jit_helpers) / sizeof(void*)) target = jit_helpers[reloc.index]; break;
+            case JitReloc_Site:   if (reloc.index < (uint32_t)builder->calls.size) target = &sites[reloc.index]; break;
+            case JitReloc_Global: if (reloc.index < (uint32_t)builder->globals.size) target = builder->globals.items[reloc.index]; break;
+            case JitReloc_String: if (reloc.index < (uint32_t)builder->strings.size) target = builder->strings.items[reloc.index]; break;
+            case JitReloc_Heat:   target = &builder->func->heat; break;
+        }
+        valid = target && reloc.offset <= size - 8;
+        if (valid) memcpy(bytes + reloc.offset, &target, sizeof(target));
+    }
+    void* code = valid ? builder->context->code_arena->allocate(size) : NULL;
+    if (code) {
+        memcpy(code, bytes, size);
+        builder->context->code_arena->seal();
+    }
+    alloc->free(relocs);
+    alloc->free(bytes);
+    return code;
+}
+
+// before a function is called the first time, the highest tier's code a cache has for it
+static JitCode jit_restore(Context* context, Function* func, Type* type) {
+    ForkLock lock;
+    if (!func->jit_cache_tried) {
+        func->jit_cache_tried = true;
+        Variable state_var = context->state_var;
+        for (uint8_t tier = 2; tier >= 1 && !func->jit; tier--) {
+            JitBuilder builder(context, func, type, tier == 2);
+            JitCallSite* sites = NULL;
+            try {
+                JitNode* body = builder.build();
+                sites = jit_sites(&builder);
+                void* code = jit_cache_load(&builder, sites, builder.key(body));
+                if (code) jit_install(func, type, code, sites, tier);
+                else alloc->free(sites);
+            }
+            catch (Error* error) { // compiling it would fail the same way
+                pawscript_destroy_error(error);
+                alloc->free(sites);
+                break;
+            }
+        }
+        context->state_var = state_var;
+    }
+    return func->jit_type == type ? (JitCode)func->jit : NULL;
+}
+
+static JitCode jit_compile(Context* context, Function* func, Type* type, bool second_tier) {
+    ForkLock lock;
+    uint8_t tier = second_tier ? 2 : 1;
+    if (func->jit_tier >= tier || func->jit_failed) return func->jit_type == type ? (JitCode)func->jit : NULL;
+    Variable state_var = context->state_var; // raising an error resets it
+    JitBuilder builder(context, func, type, second_tier);
+    JitCallSite* sites = NULL;
+    try {
+        JitNode* body = builder.build();
+        uint64_t key = jit_cache_dir() ? builder.key(body) : 0;
+        sites = jit_sites(&builder);
+        JitCompiler compiler(&builder, sites);
+        compiler.compile(body, builder.num_slots);
+        void* code = context->code_arena->allocate(compiler.buf->size);
+        if (!code) throw Error::runtime(context, "Cannot allocate executable memory");
+        memcpy(code, compiler.buf->bytes, compiler.buf->size);
+        context->code_arena->seal();
+        jit_install(func, type, code, sites, tier);
+        if (key && compiler.relocatable) jit_cache_store(&compiler, key);
+    }
+    catch (Error* error) { // stays interpreted, or on the baseline code
+        pawscript_destroy_error(error);
+        alloc->free(sites);
+        if (!second_tier) func->jit_failed = true;
+    }
+    func->jit_tier = tier;
+    context->state_var = state_var;
+    return (JitCode)func->jit;
+}
+
+static JitCode jit_lookup(Context* context, Function* func, Type* type) {
+    if (context->parent && context->variables->items[0] != context->parent->variables->items[0]) return NULL; // a task has its own copy of the globals
+    void* code = __atomic_load_n(&func->jit, __ATOMIC_ACQUIRE);
+    if (code && func->jit_type != type) return NULL;
+    if (func->jit_failed || jit_threshold() == 0) return NULL;
+    if (!code && !func->jit_cache_tried && jit_cache_dir()) code = (void*)jit_restore(context, func, type);
+    uint64_t heat = __atomic_load_n(&func->heat, __ATOMIC_RELAXED) + 1;
+    __atomic_store_n(&func->heat, heat, __ATOMIC_RELAXED);
+    if (!code) return heat < jit_threshold() ? NULL : jit_compile(context, func, type, false);
+    if (func->jit_tier < 2 && heat >= jit_threshold() * 10) return jit_compile(context, func, type, true);
+    return (JitCode)code;
+}
+
+static Variable jit_execute(Context* context, JitCode code, Type* type, List<Variable>* args) {
+    uint64_t values[args->size + 1];
+    for (int i = 0; i < args->size; i++) values[i] = args->get(i).as<uint64_t>();
+    jit_seal(context);
+    uint64_t value = code(context, values);
+    if (context->jit_error) {
+        Error* error = context->jit_error;
+        context->jit_error = NULL;
+        throw error;
+    }
+    Variable result(type->function_info.return_type);
+    if (result.type->kind != TypeKind_Void) result.as<uint64_t>() = value;
+    return result;
+}
+
+// == C TRANSLATION ==
+
+// an entry of paws_exports in a library built from paws --emit-c, PawsExport in pawscript_runtime.h
+struct JitExport {
+    const char* name;
+    uint64_t key;
+    void* function;
+};
+
+// where the C code finds the engine, mirrored by the PAWS_ constants in pawscript_runtime.h: the helpers, the
+// offset of jit_error, then the call sites, the addresses of the globals and the string literals
+static const int jit_links = sizeof(jit_helpers) / sizeof(void*) + 1;
+
+// translates the JitNodes into a C function that does what JitCompiler would compile them to, in the same order.
+// Every value gets a variable of its own, integers hold their canonical value and locals are 8 byte PawsSlots
+struct JitEmitter {
+    enum Pending {
+        Pending_Static,  // a variable, read when it's finished
+        Pending_Address, // a place whose address is in temp
+        Pending_Value,   // in temp
+    };
+    struct Prepared {
+        Pending pending;
+        int temp;
+    };
+    JitBuilder* builder;
+    Context* context;
+    Type* signature;
+    String code;
+    int temps = 0, indent = 1;
+
+    JitEmitter(JitBuilder* builder): builder(builder), context(builder->context), signature(builder->signature) {}
+
+    static const char* ctype(Type* type) { // of a value, NULL for an integer
+        if (type && type->kind == TypeKind_Float32) return "float";
+        if (type && type->kind == TypeKind_Float64) return "double";
+        return "uint64_t";
+    }
+    static const char* field(Type* type) { // of PawsSlot, and the suffix of paws_load_/paws_store_
+        switch (type->kind) {
+            case TypeKind_Int8:    return type->is_unsigned ? "u8" : "s8";
+            case TypeKind_Int16:   return type->is_unsigned ? "u16" : "s16";
+            case TypeKind_Int32:   return type->is_unsigned ? "u32" : "s32";
+            case TypeKind_Float32: return "f32";
+            case TypeKind_Float64: return "f64";
+            default:               return "u64";
+        }
+    }
+    static const char* storage(Type* type) {
+        switch (type->kind) {
+            case TypeKind_Int8:    return type->is_unsigned ? "uint8_t" : "int8_t";
+            case TypeKind_Int16:   return type->is_unsigned ? "uint16_t" : "int16_t";
+            case TypeKind_Int32:   return type->is_unsigned ? "uint32_t" : "int32_t";
+            default:               return ctype(type);
+        }
+    }
+    static String bits(Type* type, int temp) { // the 64 bits compiled code passes a value around in
+        if (type->kind == TypeKind_Float32) return String::new_format("paws_bits32(t%d)", temp);
+        if (type->kind == TypeKind_Float64) return String::new_format("paws_bits64(t%d)", temp);
+        return String::new_format("t%d", temp);
+    }
+
+    template<typename... Args> void line(const char* fmt, Args... args) {
+        for (int i = 0; i < indent; i++) code.concat("    ");
+        code.format(fmt, args...);
+        code.add('\n');
+    }
+    template<typename... Args> int value(Type* type, const char* fmt, Args... args) {
+        for (int i = 0; i < indent; i++) code.concat("    ");
+        code.format("%s t%d = ", ctype(type), temps);
+        code.format(fmt, args...);
+        code.concat(";\n");
+        return temps++;
+    }
+
+    void emit(JitNode* body) {
+        line("(void)context; (void)args; (void)links;");
+        if (builder->num_slots) line("PawsSlot l[%d];", builder->num_slots);
+        for (int i = 0; i < signature->function_info.num_params; i++) line("l[%d].u64 = args[%d];", i, i);
+        statement(body);
+        List<JitNode*>* list = body->list;
+        if (list->size && list->items[list->size - 1]->op == JitOp_Return) return;
+        if (signature->function_info.return_type->kind != TypeKind_Void) line("paws_missing_return(context, links);");
+        line("return 0;");
+    }
+
+    int site(int index) { return jit_links + index; }
+    int global(JitNode* node) { return value(NULL, "(uint64_t)links[%d]", jit_links + builder->calls.size + node->slot); }
+    int string(uint32_t index) { return jit_links + builder->calls.size + builder->globals.size + index; }
+    int native(int site) { return jit_links + builder->calls.size + builder->globals.size + builder->strings.size + site; }
+
+    void zero(int slot) {
+        line("l[%d].u64 = 0;", slot);
+    }
+    int constant(Variable value) {
+        uint64_t bits = value.as<uint64_t>();
+        if (value.type->kind == TypeKind_Float32) return this->value(value.type, "paws_f32(0x%08xu)", (uint32_t)bits);
+        if (value.type->kind == TypeKind_Float64) return this->value(value.type, "paws_f64(UINT64_C(0x%016llx))", (unsigned long long)bits);
+        if (value.type->kind == TypeKind_Pointer && bits) {
+            uint64_t literal = builder->literal(bits);
+            if (literal == bits) throw Error::runtime(context, "Unsupported constant");
+            return this->value(NULL, "(uint64_t)links[%d]", string((uint32_t)literal));
+        }
+        return this->value(NULL, "UINT64_C(0x%llx)", (unsigned long long)bits);
+    }
+    int load(Type* type, int address) {
+        return value(type, "paws_load_%s(t%d)", field(type), address);
+    }
+    void store(Type* type, int address, int value) {
+        line("paws_store_%s(t%d, t%d);", field(type), address, value);
+    }
+    int load_slot(Type* type, int slot) {
+        if (jit_float(type)) return value(type, "l[%d].%s", slot, field(type));
+        bool sign = jit_integer(type) && !type->is_unsigned && type->kind != TypeKind_Int64;
+        return value(NULL, "(uint64_t)%sl[%d].%s", sign ? "(int64_t)" : "", slot, field(type));
+    }
+    void store_slot(Type* type, int slot, int value) {
+        line("l[%d].%s = (%s)t%d;", slot, field(type), storage(type), value);
+    }
+    int read(JitNode* node) { // a variable or the current value of an assignment's target
+        if (node->op == JitOp_Local) return load_slot(node->type, node->slot);
+        if (node->op != JitOp_Current) return load(node->type, global(node));
+        JitNode* assign = node->d;
+        if (assign->slot < 0) return read(node->a);
+        return load(node->type, assign->slot);
+    }
+    void write(JitNode* node, int value) {
+        if (node->op == JitOp_Local) return store_slot(node->type, node->slot, value);
+        store(node->type, global(node), value);
+    }
+    int canonical(Type* type, int value) {
+        switch (type->kind) {
+            case TypeKind_Int8:
+            case TypeKind_Int16:
+            case TypeKind_Int32:
+                if (type->is_unsigned) return this->value(NULL, "(uint64_t)(%s)t%d", storage(type), value);
+                return this->value(NULL, "(uint64_t)(int64_t)(%s)t%d", storage(type), value);
+            default: return value;
+        }
+    }
+    int convert(Type* from, Type* to, bool bitcast, int value) { // like cast() does
+        if (bitcast) {
+            if (from->kind == TypeKind_Float32) value = this->value(NULL, "(uint64_t)(int64_t)(int32_t)paws_bits32(t%d)", value);
+            else if (from->kind == TypeKind_Float64) value = this->value(NULL, "paws_bits64(t%d)", value);
+            if (to->kind == TypeKind_Float32) return this->value(to, "paws_f32(t%d)", value);
+            if (to->kind == TypeKind_Float64) return this->value(to, "paws_f64(t%d)", value);
+            return canonical(to, value);
+        }
+        if (jit_float(to)) {
+            if (jit_float(from)) return from->kind == to->kind ? value : this->value(to, "(%s)t%d", ctype(to), value);
+            if (from->is_unsigned && from->kind == TypeKind_Int64) return this->value(to, "(%s)t%d", ctype(to), value);
+            return this->value(to, "(%s)(int64_t)t%d", ctype(to), value);
+        }
+        if (jit_float(from)) return canonical(to, this->value(NULL, "paws_%s_to_u64(links, t%d)", field(from), value));
+        return jit_fits(from, to) ? value : canonical(to, value);
+    }
+    int converts(JitNode* node, JitNode* base, int value) {
+        if (node == base) return value;
+        value = converts(node->a, base, value);
+        return convert(node->a->type, node->type, node->flag, value);
+    }
+
+    // a left operand goes first but places in it are read after the right one
+    Prepared prepare(JitNode* node) {
+        JitNode* base = jit_strip(node);
+        if (base->op == JitOp_Current || ((base->op == JitOp_Local || base->op == JitOp_Global) && base->lvalue)) {
+            if (base->op == JitOp_Local && base->flag) zero(base->slot);
+            return Prepared{ Pending_Static, -1 };
+        }
+        if (base->lvalue) return Prepared{ Pending_Address, address(base) };
+        return Prepared{ Pending_Value, gen(node) };
+    }
+    int finish(JitNode* node, Prepared prepared) {
+        JitNode* base = jit_strip(node);
+        if (prepared.pending == Pending_Value) return prepared.temp;
+        int value = prepared.pending == Pending_Static ? read(base) : load(base->type, prepared.temp);
+        return converts(node, base, value);
+    }
+    bool simple(JitNode* node) {
+        return node->op == JitOp_Const || (node->op == JitOp_Local && !node->flag) || node->op == JitOp_Global;
+    }
+    void operands(JitNode* a, JitNode* b, int* x, int* y) {
+        if (simple(b)) {
+            *x = gen(a);
+            *y = b->op == JitOp_Const ? constant(b->value) : read(b);
+            return;
+        }
+        Prepared prepared = prepare(a);
+        *y = gen(b);
+        *x = finish(a, prepared);
+    }
+
+    int address(JitNode* node) {
+        switch (node->op) {
+            case JitOp_Local:
+                if (node->flag) zero(node->slot);
+                return value(NULL, "(uint64_t)&l[%d]", node->slot);
+            case JitOp_Global: return global(node);
+            case JitOp_Deref: return gen(node->a);
+            case JitOp_Ternary: return ternary(node, true);
+            default: throw Error::runtime(context, "Not a place");
+        }
+    }
+    int gen(JitNode* node) {
+        int x, y;
+        switch (node->op) {
+            case JitOp_Const: return constant(node->value);
+            case JitOp_Local:
+                if (node->flag) zero(node->slot);
+                return read(node);
+            case JitOp_Global:
+            case JitOp_Current: return read(node);
+            case JitOp_Deref: return load(node->type, gen(node->a));
+            case JitOp_Assign: return assign(node);
+            case JitOp_Increment: return increment(node);
+            case JitOp_Address: return address(node->a);
+            case JitOp_Convert: return convert(node->a->type, node->type, node->flag, gen(node->a));
+            case JitOp_Binary: return binary(node);
+            case JitOp_Compare: return value(NULL, "(uint64_t)(%s)", compare(node));
+            case JitOp_Offset: {
+                operands(node->a, node->b, &x, &y);
+                int64_t scale = (int32_t)node->amount; // an imm32
+                if (scale != 1) *(node->flag ? &x : &y) = value(NULL, "t%d * UINT64_C(0x%llx)", node->flag ? x : y, (unsigned long long)scale);
+                return value(NULL, "t%d + t%d", x, y);
+            }
+            case JitOp_And:
+                operands(node->a, node->b, &x, &y);
+                return value(NULL, "(uint64_t)((t%d != 0) & (t%d != 0))", x, y);
+            case JitOp_Not: return value(NULL, "(uint64_t)(t%d == 0)", gen(node->a));
+            case JitOp_Negate:
+                x = gen(node->a);
+                if (jit_float(node->type)) return value(node->type, "-t%d", x);
+                return canonical(node->type, value(NULL, "-t%d", x));
+            case JitOp_Complement: return canonical(node->type, value(NULL, "~t%d", gen(node->a)));
+            case JitOp_Ternary:
+                x = ternary(node, node->lvalue);
+                return node->lvalue ? load(node->type, x) : x;
+            case JitOp_Call: return invoke(node);
+            case JitOp_Atomic: return atomic(node);
+            case JitOp_Field:
+                x = gen(node->a);
+                if (node->a->op != JitOp_Field) { // an inline struct is in one that's set
+                    line("if (!t%d) {", x);
+                    indent++;
+                    line("paws_unset_struct(context, links);");
+                    line("return 0;");
+                    indent--;
+                    line("}");
+                }
+                return value(NULL, "t%d + UINT64_C(0x%llx)", x, (unsigned long long)node->amount);
+            default: throw Error::runtime(context, "Not a value");
+        }
+    }
+    int ternary(JitNode* node, bool as_address) {
+        int result = temps++;
+        line("%s t%d;", as_address ? "uint64_t" : ctype(node->type), result);
+        String cond = condition(node->a);
+        line("if (%s) {", cond);
+        indent++;
+        line("t%d = t%d;", result, as_address ? address(node->b) : gen(node->b));
+        indent--;
+        line("} else {");
+        indent++;
+        line("t%d = t%d;", result, as_address ? address(node->c) : gen(node->c));
+        indent--;
+        line("}");
+        return result;
+    }
+    int assign(JitNode* node) {
+        JitNode* target = node->a;
+        if (target->op == JitOp_Local || target->op == JitOp_Global) {
+            if (target->op == JitOp_Local && target->flag) zero(target->slot);
+            node->slot = -1;
+            int value = gen(node->b);
+            write(target, value);
+            return value;
+        }
+        node->slot = address(target); // for the compound operator reading it
+        int value = gen(node->b);
+        store(node->type, node->slot, value);
+        return value;
+    }
+    static const char* memory_order(int order) {
+        switch (order) {
+            case __ATOMIC_RELAXED: return "__ATOMIC_RELAXED";
+            case __ATOMIC_ACQUIRE: return "__ATOMIC_ACQUIRE";
+            case __ATOMIC_RELEASE: return "__ATOMIC_RELEASE";
+            case __ATOMIC_ACQ_REL: return "__ATOMIC_ACQ_REL";
+            default:               return "__ATOMIC_SEQ_CST";
+        }
+    }
+    int atomic(JitNode* node) { // a store gives no value
+        Type* type = node->a->type;
+        int size = type->value_size(), order = node->amount;
+        int address = this->address(node->a);
+        if (size > 1) {
+            line("if (t%d & %d) {", address, size - 1);
+            indent++;
+            line("paws_misaligned_atomic(context, links);");
+            line("return 0;");
+            indent--;
+            line("}");
+        }
+        const char* sign = jit_integer(type) && !type->is_unsigned && type->kind != TypeKind_Int64 ? "(int64_t)" : "";
+        String target = String::new_format("(%s*)(uintptr_t)t%d", storage(type), address);
+        if (node->node == AST_LOAD) return value(NULL, "(uint64_t)%s__atomic_load_n(%s, %s)", sign, target, memory_order(order));
+        int x = gen(node->b);
+        switch (node->node) {
+            case AST_STORE:
+                line("__atomic_store_n(%s, (%s)t%d, %s);", target, storage(type), x, memory_order(order));
+                return -1;
+            case AST_EXCHANGE: return value(NULL, "(uint64_t)%s__atomic_exchange_n(%s, (%s)t%d, %s)", sign, target, storage(type), x, memory_order(order));
+            case AST_FETCH_ADD: return value(NULL, "(uint64_t)%s__atomic_fetch_add(%s, (%s)t%d, %s)", sign, target, storage(type), x, memory_order(order));
+            default: {
+                int y = gen(node->c), expected = temps++;
+                int failure = order == __ATOMIC_RELEASE ? __ATOMIC_RELAXED : order == __ATOMIC_ACQ_REL ? __ATOMIC_ACQUIRE : order;
+                line("%s t%d = (%s)t%d;", storage(type), expected, storage(type), x);
+                return value(NULL, "(uint64_t)__atomic_compare_exchange_n(%s, &t%d, (%s)t%d, 0, %s, %s)", target, expected, storage(type), y, memory_order(order), memory_order(failure));
+            }
+        }
+    }
+    int increment(JitNode* node) {
+        JitNode* target = node->a;
+        bool variable = target->op == JitOp_Local || target->op == JitOp_Global;
+        int address = -1, old;
+        if (variable) {
+            if (target->op == JitOp_Local && target->flag) zero(target->slot);
+            old = read(target);
+        }
+        else {
+            address = this->address(target);
+            old = load(node->type, address);
+        }
+        int next = jit_float(node->type) ? value(node->type, "t%d + %d", old, node->amount > 0 ? 1 : -1)
+                                        : canonical(node->type, value(NULL, "t%d %c 1", old, node->amount > 0 ? '+' : '-'));
+        variable ? write(target, next) : store(node->type, address, next);
+        return node->flag ? old : next;
+    }
+    int binary(JitNode* node) {
+        int x, y;
+        operands(node->a, node->b, &x, &y);
+        Type* type = node->type;
+        if (jit_float(type)) {
+            const char* suffix = type->kind == TypeKind_Float32 ? "f" : "";
+            switch (node->node) {
+                case AST_ADDITION:       return value(type, "t%d + t%d", x, y);
+                case AST_SUBTRACTION:    return value(type, "t%d - t%d", x, y);
+                case AST_MULTIPLICATION: return value(type, "t%d * t%d", x, y);
+                case AST_DIVISION:       return value(type, "t%d / t%d", x, y);
+                case AST_MODULO:         return value(type, "paws_fmod%s(links, t%d, t%d)", suffix, x, y);
+                case AST_POWER:          return value(type, "paws_pow%s(links, t%d, t%d)", suffix, x, y);
+                default: throw Error::runtime(context, "Unsupported operator");
+            }
+        }
+        int result;
+        switch (node->node) { // all of it on 64 bits, like the registers
+            case AST_ADDITION:       result = value(NULL, "t%d + t%d", x, y); break;
+            case AST_SUBTRACTION:    result = value(NULL, "t%d - t%d", x, y); break;
+            case AST_MULTIPLICATION: result = value(NULL, "t%d * t%d", x, y); break;
+            case AST_DIVISION:       result = value(NULL, "t%d / t%d", x, y); break;
+            case AST_MODULO:         result = value(NULL, "t%d %% t%d", x, y); break;
+            case AST_POWER:          result = value(NULL, "paws_pow_int(links, t%d, t%d)", x, y); break;
+            case AST_BITSHIFT_LEFT:  result = value(NULL, "t%d << (t%d & 63)", x, y); break;
+            case AST_BITSHIFT_RIGHT: result = value(NULL, "t%d >> (t%d & 63)", x, y); break;
+            case AST_BITWISE_AND:    result = value(NULL, "t%d & t%d", x, y); break;
+            case AST_BITWISE_OR:     result = value(NULL, "t%d | t%d", x, y); break;
+            case AST_BITWISE_XOR:    result = value(NULL, "t%d ^ t%d", x, y); break;
+            default: throw Error::runtime(context, "Unsupported operator");
+        }
+        return canonical(type, result);
+    }
+    String compare(JitNode* node) { // an expression that's true when the comparison is
+        int x, y;
+        operands(node->a, node->b, &x, &y);
+        Type* type = node->a->type;
+        const char* op;
+        switch (node->node) {
+            case AST_LESS_THAN:                op = "<";  break;
+            case AST_LESS_THAN_OR_EQUAL_TO:    op = "<="; break;
+            case AST_GREATER_THAN:             op = ">";  break;
+            case AST_GREATER_THAN_OR_EQUAL_TO: op = ">="; break;
+            case AST_EQUALS:                   op = "=="; break;
+            default:                           op = "!="; break;
+        }
+        if (jit_float(type) || type->is_unsigned) return String::new_format("t%d %s t%d", x, op, y);
+        return String::new_format("(int64_t)t%d %s (int64_t)t%d", x, op, y);
+    }
+    String condition(JitNode* node) { // an expression that's true when node is truthy
+        if (node->op == JitOp_Compare) return compare(node);
+        if (node->op == JitOp_Not) return String::new_format("!(%s)", condition(node->a));
+        if (node->op == JitOp_Const) return String(is_truthy(context, &node->value) ? "1" : "0");
+        return String::new_format("t%d != 0", gen(node));
+    }
+    int invoke(JitNode* node) {
+        List<JitNode*>* args = node->list;
+        int count = args->size;
+        Prepared pending[count + 1];
+        int slots = temps++;
+        line("uint64_t t%d[%d];", slots, count + 1);
+        for (int i = 0; i < count; i++) { // a place is cast after the arguments following it ran
+            JitNode* arg = args->items[i];
+            JitNode* base = jit_strip(arg);
+            bool late = false;
+            for (int j = i + 1; j < count; j++) late = late || jit_impure(args->items[j]);
+            if (late && base->lvalue && (base->op == JitOp_Local || base->op == JitOp_Global)) {
+                if (base->op == JitOp_Local && base->flag) zero(base->slot);
+                pending[i] = Prepared{ Pending_Static, -1 };
+            }
+            else if (late && base->lvalue) pending[i] = Prepared{ Pending_Address, address(base) };
+            else {
+                line("t%d[%d] = %s;", slots, i, bits(arg->type, gen(arg)));
+                pending[i] = Prepared{ Pending_Value, -1 };
+            }
+        }
+        for (int i = 0; i < count; i++) {
+            if (pending[i].pending == Pending_Value) continue;
+            line("t%d[%d] = %s;", slots, i, bits(args->items[i]->type, finish(args->items[i], pending[i])));
+        }
+        int callee = gen(node->a); // the callee is read last
+        int result;
+        if (node->flag) result = direct(node, callee, slots);
+        else {
+            result = value(NULL, "paws_call(context, links, %d, t%d, t%d)", site(node->amount), callee, slots);
+            line("if (paws_failed(context, links)) return 0;");
+        }
+        if (node->type->kind == TypeKind_Float32) return value(node->type, "paws_f32(t%d)", result);
+        if (node->type->kind == TypeKind_Float64) return value(node->type, "paws_f64(t%d)", result);
+        return result;
+    }
+    static const char* parameter(Type* type) { // in the C function's own signature
+        if (jit_float(type)) return ctype(type);
+        return jit_integer(type) ? storage(type) : "void*";
+    }
+    static String argument(Type* type, int slots, int i) {
+        if (jit_float(type)) return String::new_format("paws_%s(t%d[%d])", field(type), slots, i);
+        return String::new_format(jit_integer(type) ? "(%s)t%d[%d]" : "(%s)(uintptr_t)t%d[%d]", parameter(type), slots, i);
+    }
+    // the C function an extern held when the script was translated, called with its own signature while the
+    // global still holds it. A varargs one takes the rest as C would get them, a double or 64 bits
+    int direct(JitNode* node, int callee, int slots) {
+        Type* type = node->target;
+        Type* ret = type->function_info.return_type;
+        int num_params = type->function_info.num_params;
+        bool varargs = type->function_info.params[num_params - 1].type->kind == TypeKind_Varargs;
+        if (varargs) num_params--;
+        String signature, args;
+        for (int i = 0; i < node->list->size; i++) {
+            Type* arg = node->list->items[i]->type; // a parameter's type by now
+            if (i < num_params) signature.format("%s%s", i ? ", " : "", parameter(arg));
+            if (i < num_params || jit_float(arg)) args.format("%s%s", i ? ", " : "", argument(arg, slots, i));
+            else args.format("%st%d[%d]", i ? ", " : "", slots, i);
+        }
+        if (varargs) signature.concat(", ...");
+        if (!num_params) signature.concat("void");
+        const char* returns = ret->kind == TypeKind_Void ? "void" : parameter(ret);
+        String call = String::new_format("((%s (*)(%s))(uintptr_t)t%d)(%s)", returns, signature, callee, args);
+        int result = temps++;
+        line("uint64_t t%d;", result);
+        line("if (t%d == (uint64_t)(uintptr_t)links[%d]) {", callee, native(node->amount));
+        indent++;
+        if (ret->kind == TypeKind_Void) {
+            line("%s;", call);
+            line("t%d = 0;", result);
+        }
+        else if (jit_float(ret)) line("t%d = paws_bits%d(%s);", result, ret->kind == TypeKind_Float32 ? 32 : 64, call);
+        else if (jit_integer(ret) && !ret->is_unsigned) line("t%d = (uint64_t)(int64_t)%s;", result, call);
+        else line("t%d = (uint64_t)%s%s;", result, jit_integer(ret) ? "" : "(uintptr_t)", call);
+        indent--;
+        line("} else {");
+        indent++;
+        if (varargs) {
+            line("paws_replaced_native(context, links);");
+            line("return 0;");
+        }
+        else {
+            line("t%d = paws_call(context, links, %d, t%d, t%d);", result, site(node->amount), callee, slots);
+            line("if (paws_failed(context, links)) return 0;");
+        }
+        indent--;
+        line("}");
+        return result;
+    }
+
+    void effect(JitNode* node) {
+        if (node->op == JitOp_Type) return;
+        if (node->op == JitOp_Local) {
+            if (node->flag) zero(node->slot);
+            return;
+        }
+        int value = node->lvalue ? address(node) : gen(node);
+        if (value >= 0 && node->op != JitOp_Assign) line("(void)t%d;", value); // the C compiler would warn it's unused
+    }
+    void statement(JitNode* node) {
+        switch (node->op) {
+            case JitOp_Block:
+                for (int i = 0; i < node->list->size; i++) {
+                    JitNode* child = node->list->items[i];
+                    statement(child);
+                    if (child->op == JitOp_Return || child->op == JitOp_Break || child->op == JitOp_Continue) break;
+                }
+                break;
+            case JitOp_If: {
+                if (node->a->op == JitOp_Const) {
+                    if (is_truthy(context, &node->a->value)) statement(node->b);
+                    else if (node->c) statement(node->c);
+                    break;
+                }
+                String cond = condition(node->a);
+                line("if (%s) {", cond);
+                block(node->b);
+                if (node->c) {
+                    line("} else {");
+                    block(node->c);
+                }
+                line("}");
+                break;
+            }
+            case JitOp_While: {
+                if (node->a->op == JitOp_Const && !is_truthy(context, &node->a->value)) break;
+                line("for (;;) {");
+                indent++;
+                String cond = condition(node->a);
+                line("if (!(%s)) break;", cond);
+                statement(node->b);
+                indent--;
+                line("}");
+                break;
+            }
+            case JitOp_For: {
+                Type* type = node->type;
+                int iter = node->slot, next = node->slot + 1, bound = node->slot + 2;
+                bool reverse = node->amount < 0;
+                store_slot(type, reverse ? bound : next, gen(node->a));
+                store_slot(type, reverse ? next : bound, gen(node->b));
+                if (reverse ? node->flag2 : node->flag) store_slot(type, next, step(type, load_slot(type, next), node->amount));
+                const char* sign = type->is_unsigned ? "" : "(int64_t)"; // the step is where continue goes
+                int wrapped = temps++; // a step that wraps around ends the loop
+                line("for (int t%d = 0; !t%d; t%d = %s(l[%d].%s = (%s)((uint64_t)%sl[%d].%s + UINT64_C(0x%llx))) %s %sl[%d].%s) {", wrapped, wrapped, wrapped,
+                    sign, next, field(type), storage(type), sign, iter, field(type), (unsigned long long)node->amount, reverse ? ">" : "<", sign, iter, field(type));
+                indent++;
+                int current = load_slot(type, next), limit = load_slot(type, bound);
+                const char* op = !reverse ? (node->flag2 ? ">=" : ">") : (node->flag ? "<=" : "<");
+                if (type->is_unsigned) line("if (t%d %s t%d) break;", current, op, limit);
+                else line("if ((int64_t)t%d %s (int64_t)t%d) break;", current, op, limit);
+                store_slot(type, iter, current);
+                statement(node->c);
+                indent--;
+                line("}");
+                break;
+            }
+            case JitOp_Return: {
+                Type* ret = signature->function_info.return_type;
+                if (node->a && ret->kind == TypeKind_Void) {
+                    effect(node->a);
+                    line("return 0;");
+                }
+                else if (node->a) line("return %s;", bits(ret, gen(node->a)));
+                else line("return 0;");
+                break;
+            }
+            case JitOp_Break: line("break;"); break;
+            case JitOp_Continue: line("continue;"); break;
+            default: effect(node);
+        }
+    }
+    void block(JitNode* node) {
+        indent++;
+        statement(node);
+        indent--;
+    }
+    int step(Type* type, int value, int64_t amount) {
+        return canonical(type, this->value(NULL, "t%d + UINT64_C(0x%llx)", value, (unsigned long long)amount));
+    }
+};
+
+// calls the C a library translated the function to, once it checks out against the function as it is now
+static bool jit_native(Context* context, Function* func, Type* type, JitExport* entry) {
+    ForkLock lock;
+    if (func->jit || func->jit_failed) return false;
+    Variable state_var = context->state_var;
+    JitBuilder builder(context, func, type, true, true);
+    JitCallSite* sites = NULL;
+    bool bound = false;
+    try {
+        JitNode* body = builder.build();
+        if (builder.key(body, true) == entry->key) {
+            int num_sites = builder.calls.size, num_links = jit_links + 2 * num_sites + builder.globals.size + builder.strings.size;
+            sites = (JitCallSite*)alloc->malloc<uint8_t>(num_sites * sizeof(JitCallSite) + num_links * sizeof(void*)); // freed as the sites
+            void** links = (void**)(sites + num_sites);
+            memcpy(links, jit_helpers, sizeof(jit_helpers));
+            links[jit_links - 1] = (void*)offsetof(Context, jit_error);
+            for (int i = 0; i < num_sites; i++) {
+                sites[i] = builder.calls.items[i];
+                links[jit_links + i] = &sites[i];
+            }
+            for (int i = 0; i < builder.globals.size; i++) links[jit_links + num_sites + i] = builder.globals.items[i];
+            for (int i = 0; i < builder.strings.size; i++) links[jit_links + num_sites + builder.globals.size + i] = builder.strings.items[i];
+            for (int i = 0; i < num_sites; i++) links[jit_links + num_sites + builder.globals.size + builder.strings.size + i] = builder.natives.items[i];
+            JitAssembler stub; // the links go in as the third argument
+#ifdef _WIN32
+            stub.mov_imm(Reg_R8, (uint64_t)links);
+#else
+            stub.mov_imm(Reg_Rdx, (uint64_t)links);
+#endif
+            stub.mov_imm(Reg_R11, (uint64_t)entry->function);
+            stub.buf->bytes(0x41, 0xFF, 0xE3); // jmp *%r11
+            void* code = context->code_arena->allocate(stub.buf->size);
+            if (!code) throw Error::runtime(context, "Cannot allocate executable memory");
+            memcpy(code, stub.buf->bytes, stub.buf->size);
+            context->code_arena->seal();
+            jit_install(func, type, code, sites, 2);
+            bound = true;
+        }
+    }
+    catch (Error* error) {
+        pawscript_destroy_error(error);
+        alloc->free(sites);
+    }
+    context->state_var = state_var;
+    return bound;
+}
+
+void Allocation::function_cleanup(void* ptr, Context* context, Type* type) {
+    ForkLock lock;
+    Function* func = (Function*)ptr;
+    for (int i = 0; i < func->num_captures; i++) if (func->captures[i]) func->captures[i]->release();
+    alloc->free(func->captures);
+    if (context->function_cache->getdef(func->site, NULL) == func) context->function_cache->remove(func->site);
+    context->code_arena->free_trampoline(func->code);
+    context->code_arena->free(func->jit);
+    alloc->free(func->jit_sites);
+    context->code_arena->free(func->jit_baseline);
+    alloc->free(func->jit_baseline_sites);
+}
+
+void Allocation::struct_cleanup(void* ptr, Context* context, Type* type) {
+    int prev_scope = context->variables->size - 1;
+    // destructors also run while a return or throw unwinds, which has to carry on afterwards
+    State prev_state = context->state;
+    Variable prev_state_var = context->state_var;
+    context->state = State_Running;
+    try {
+        Variable str = Variable(type);
+        str.as<void*>() = ptr;
+        Variable destructor = walk_struct(str, "delete");
+        if (destructor.type) {
+            List<Variable> args;
+            execute_function(context, &destructor, &args, &str);
+            context->raise_pending();
+        }
+    }
+    catch (Error* error) {
+        pawscript_log_error(error, stderr);
+        context->pop_until(prev_scope);
+    }
+    context->state = prev_state;
+    context->state_var = prev_state_var;
+}
+
+static void(*user_segfault_handler)(void* addr);
+
+static ByteReader* compile(Context* context, const char* code, const char* file) {
+    TokenQueue* tokens = NULL;
+    ByteWriter* writer = new ByteWriter;
+    try {
+        ParseFunction unit(context, CaptureMode_None);
+        tokens = lex(context, code, file);
+        writer->write(tokens->peek()->filename);
+        while (!tokens->expect(TOKEN_END_OF_FILE)) parse_command(context, writer, tokens);
+    }
+    catch (Error*) {
+        delete tokens;
+        throw;
+    }
+    delete tokens;
+    ByteReader* reader = writer->read();
+    /*printf("--------------- PAWSCRIPT BYTECODE DUMP ---------------\n");
+    printf("       x0 x1 x2 x3 x4 x5 x6 x7 x8 x9 xA xB xC xD xE xF");
+    for (int i = 0; i < reader->size; i++) {
+        if (i % 16 == 0) printf("\n%04X   ", i);
+        printf("%02X ", reader->bytes[i]);
+    }
+    printf("\n");*/
+    return reader;
+}
+
+// compiles into the context's code, which keeps the source around
+static ByteReader* compile_unit(Context* context, const char* code, const char* file) {
+    ForkLock lock;
+    Program* program = context->code;
+    BindAllocator bind(program->allocator);
+    ByteReader* reader = compile(context, code, file);
+    program->units->add(Program::Unit{ append_string(context, file), alloc->strdup(code), reader });
+    return reader;
+}
+
+static Error* execute(Context* context, ByteReader* reader) {
+    Error* err = NULL;
+    Variable var(context->type_cache->primitive(TypeKind_Void));
+    try {
+        context->set_file_location(reader->read<char*>());
+        while (reader->ptr < reader->size) {
+            var = execute_command(context, reader);
+            switch (context->state) {
+                case State_Running: break;
+                case State_Return:
+                    var = context->state_var;
+                    reader->ptr = reader->size;
+                    break;
+                case State_Continue: throw Error::runtime(context, "'continue' outside of loop");
+                case State_Break: throw Error::runtime(context, "'break' outside of loop");
+                case State_Throw: context->raise_pending();
+            }
+        }
+    }
+    catch (Error* error) {
+        err = error;
+        var = Variable(context->type_cache->primitive(TypeKind_Void));
+    }
+    *context->lookup_variable("@RESULT@") = var;
+    context->call_stack->peek()->file = NULL;
+    return err;
+}
+
+static Error* execute(Context* context, const char* code, const char* file) {
+    ByteReader* reader;
+    try {
+        reader = compile_unit(context, code, file);
+    }
+    catch (Error* error) {
+        *context->lookup_variable("@RESULT@") = Variable(context->type_cache->primitive(TypeKind_Void));
+        return error;
+    }
+    return execute(context, reader);
+}
+
+static char* read_file(const char* path, size_t* length = NULL, const char* mode = "r") {
+    FILE* f = fopen(path, mode);
+    if (!f) return NULL;
+    fseek(f, 0, SEEK_END);
+    size_t size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    char* data = alloc->malloc<char>(size + 1);
+    size = fread(data, 1, size, f);
+    data[size] = 0;
+    fclose(f);
+    if (length) *length = size;
+    return data;
+}
+
+static Error* execute_file(Context* context, const char* filename) {
+    char* data = read_file(context->resource(filename).data);
+    if (!data) return Error::syntax(filename, 1, 1, String::new_format("Cannot open '%s' for reading: %s", filename, strerror(errno)));
+    Error* error = execute(context, data, filename);
+    alloc->free(data);
+    return error;
+}
+
+// compile errors outlive the program, so they get an allocator of their own
+static Error* orphan_error(const char* filename, int row, int col, const char* msg) {
+    Allocator* allocator = new Allocator;
+    BindAllocator bind(allocator);
+    Error* err = Error::syntax(filename, row, col, msg);
+    err->owns_allocator = true;
+    return err;
+}
+
+static Error* compile_program(const char* code, const char* file, Program** out) {
+    *out = NULL;
+    Program* program = Program::create();
+    BindAllocator bind(program->allocator);
+    Context* parser = alloc->malloc<Context>(); // lexing and parsing only intern strings into the context's code
+    parser->code = program;
+    try {
+        program->entry = compile_unit(parser, code, file);
+    }
+    catch (Error* error) {
+        Error* err = orphan_error(error->frames[0].file, error->frames[0].row, error->frames[0].col, error->message());
+        program->release();
+        return err;
+    }
+    alloc->free(parser);
+    *out = program;
+    return NULL;
+}
+
+// signals are delivered to the faulting thread, so recovery state is per thread
+static thread_local jmp_buf segfault_jump_buffer;
+static thread_local bool in_code = false;
+static thread_local void* segfault_addr = NULL;
+static thread_local bool segfault_overflow = false;
+
+#ifndef _WIN32
+#undef setjmp
+#define longjmp siglongjmp
+#define setjmp(x) sigsetjmp(x, 1)
+#endif
+
+#ifdef _WIN32
+static LONG WINAPI handle_segfault(EXCEPTION_POINTERS* exception) { \
+    segfault_addr = (void*)(uintptr_t)exception->ExceptionRecord->ExceptionInformation[1];
+#else
+static void handle_segfault(int signum, siginfo_t* info) { \
+    segfault_addr = info->si_addr;
+#endif
+    segfault_overflow = stack_overflow_at(segfault_addr);
+    if (in_code) longjmp(segfault_jump_buffer, 1);
+    else if (user_segfault_handler) user_segfault_handler(segfault_addr);
+    else printf("[PawScript Segfault Handler] Uncaught segmentation fault outside of script\n");
+    abort();
+}
+
+static Error* segfault_handler(Context* context) {
+    release_abandoned_segments();
+    context->state = State_Running; // a return faults once it's set, reading the value it returns
+    if (segfault_overflow) return Error::runtime(context, "Stack overflow");
     if (!segfault_addr) return Error::runtime(context, "Null pointer dereference");
     else return Error::runtime(context, String::new_format("Invalid memory access at %p", segfault_addr));
 }
 
+static bool install_segfault_handler() {
+#ifdef _WIN32
+    SetUnhandledExceptionFilter(handle_segfault);
+#else
+    struct sigaction signal_handler;
+    signal_handler.sa_handler = (typeof(signal_handler.sa_handler))handle_segfault;
+    sigemptyset(&signal_handler.sa_mask);
+    signal_handler.sa_flags = SA_SIGINFO | SA_ONSTACK;
+    sigaction(SIGSEGV, &signal_handler, NULL);
+#endif
+    return true;
+}
+
+// an empty context with just the global frame, in the bound allocator
+static Context* new_context(Allocator* allocator) {
+    static bool installed = install_segfault_handler(); // static initialization runs once, even with racing threads
+    (void)installed;
+    Context* context = alloc->malloc<Context>();
+    context->allocator = allocator;
+    context->code = Program::create();
+    context->programs = new List<Program*>;
+    context->type_cache = new TypeCache;
+    context->function_cache = new Map<void*, Function*>(compare_int64);
+    context->thunk_cache = new Map<Type*, void*>(compare_int64);
+    context->shared_sites = new HashMap<void*, void*>(hash_int64, compare_int64);
+    context->code_arena = new CodeArena;
+    context->call_stack = new Stack<Scope*>;
+    context->variables = new Stack<Map<char*, Variable*>*>;
+    context->allocs = new Stack<Set<Allocation*>*>;
+    context->push_stack_frame("<global>");
+    return context;
+}
+
+// == PARALLEL FOR AND TASKS ==
+
+// a fork shares its parent's caches, whatever it declares lives in its own allocator
+static Context* new_fork(Context* parent) {
+    Allocator* allocator = new Allocator;
+    BindAllocator bind(allocator);
+    Context* fork = alloc->malloc<Context>();
+    fork->allocator = allocator;
+    fork->parent = parent;
+    fork->code = parent->code;
+    fork->programs = parent->programs;
+    fork->type_cache = parent->type_cache;
+    fork->function_cache = parent->function_cache;
+    fork->thunk_cache = parent->thunk_cache;
+    fork->code_arena = parent->code_arena;
+    fork->parse_function = parent->parse_function;
+    fork->shared_sites = new HashMap<void*, void*>(hash_int64, compare_int64);
+    fork->call_stack = new Stack<Scope*>;
+    fork->variables = new Stack<Map<char*, Variable*>*>;
+    fork->allocs = new Stack<Set<Allocation*>*>;
+    return fork;
+}
+
+// a loop's fork reads the variables of the frame the loop runs in
+static Context* fork_context(Context* parent) {
+    Context* fork = new_fork(parent);
+    BindAllocator bind(fork->allocator);
+    for (int i = 0; i < parent->call_stack->size - 1; i++) fork->call_stack->push(parent->call_stack->items[i]);
+    Scope* frame = alloc->copy(parent->call_stack->peek()); // the location changes as the body runs
+    frame->owns_captures = false;
+    fork->call_stack->push(frame);
+    for (int i = 0; i < parent->variables->size; i++) {
+        fork->variables->push(parent->variables->items[i]);
+        fork->allocs->push(parent->allocs->items[i]);
+    }
+    fork->fork_base = parent->variables->size;
+    return fork;
+}
+
+// a task's fork starts from the global frame, with its own copy of the globals that exist when it's spawned
+static Context* fork_task(Context* context) {
+    Context* fork = new_fork(context->parent ? context->parent : context);
+    BindAllocator bind(fork->allocator);
+    Scope* frame = alloc->copy(context->call_stack->items[0]);
+    frame->name = (char*)"<task>";
+    frame->owns_captures = false;
+    fork->call_stack->push(frame);
+    fork->variables->push(context->variables->items[0]->copy()); // the spawner can keep declaring globals meanwhile
+    fork->allocs->push(context->allocs->items[0]);
+    fork->fork_base = 1;
+    return fork;
+}
+
+// a generator's fork starts from the global frame as well, but it only runs while whoever resumed it waits, so it can share the globals
+static Context* fork_generator(Context* context) {
+    Context* root = context->parent ? context->parent : context;
+    Context* fork = new_fork(root);
+    BindAllocator bind(fork->allocator);
+    Scope* frame = alloc->copy(root->call_stack->items[0]);
+    frame->name = (char*)"<generator>";
+    frame->owns_captures = false;
+    fork->call_stack->push(frame);
+    Map<char*, Variable*>* globals = context->variables->items[0];
+    fork->variables->push(globals == root->variables->items[0] ? globals : globals->copy()); // a task's own copy can't be shared
+    fork->allocs->push(context->allocs->items[0]);
+    fork->fork_base = 1;
+    return fork;
+}
+
+static void destroy_fork(Context* fork) {
+    Context* parent = fork->parent;
+    Allocator* allocator = fork->allocator;
+    {
+        BindAllocator bind(allocator);
+        while (fork->variables->size > fork->fork_base) fork->pop_codeblock();
+        for (int i = 0; i < fork->shared_sites->capacity; i++) if (fork->shared_sites->pairs[i].used) alloc->free(fork->shared_sites->pairs[i].value);
+        alloc->free(fork->call_stack->peek());
+        delete fork->shared_sites;
+        delete fork->call_stack;
+        delete fork->variables;
+        delete fork->allocs;
+        alloc->free(fork);
+    }
+    parent->allocator->adopt(allocator); // closures made in the body can keep its variables alive
+    delete allocator;
+}
+
+// a copy in the bound allocator, for an error that has to outlive the fork that raised it
+static Error* copy_error(Error* error) {
+    Error* copy = Error::create(error->num_frames);
+    memcpy(copy->frames, error->frames, sizeof(ErrorFrame) * copy->num_frames);
+    copy->text = error->text;
+    copy->value_type = error->value_type;
+    copy->value = error->value;
+    if (error->msg) copy->msg = alloc->strdup(error->msg);
+    return copy;
+}
+
+struct ParallelFor {
+    // the iterations a worker has left, it takes chunks from the front and the others steal from the back
+    struct Slice {
+        int lock;
+        uint64_t next, end;
+    };
+    Context** forks;
+    Slice* slices;
+    int num_workers;
+    uint8_t* bytes;
+    int size, start;
+    bool shared;
+    Type* iter_type;
+    char* name;
+    uint64_t first, step, chunk;
+    bool failed;
+    int lock;
+    Error* error; // the first one, anything after it is dropped
+    bool thrown;
+    Variable value;
+};
+
+static bool take_iterations(ParallelFor* job, int worker, uint64_t* from, uint64_t* to) {
+    ParallelFor::Slice* own = &job->slices[worker];
+    spin_lock(&own->lock);
+    *from = own->next;
+    *to = own->next = own->end - own->next > job->chunk ? own->next + job->chunk : own->end;
+    spin_unlock(&own->lock);
+    if (*from < *to) return true;
+    for (int i = 1; i < job->num_workers; i++) {
+        ParallelFor::Slice* victim = &job->slices[(worker + i) % job->num_workers];
+        spin_lock(&victim->lock);
+        uint64_t left = victim->end - victim->next;
+        *to = victim->end;
+        *from = victim->end -= left - left / 2;
+        spin_unlock(&victim->lock);
+        if (*from == *to) continue;
+        spin_lock(&own->lock); // what isn't run right away can be stolen again
+        own->next = *from + (*to - *from > job->chunk ? job->chunk : *to - *from);
+        own->end = *to;
+        *to = own->next;
+        spin_unlock(&own->lock);
+        return true;
+    }
+    return false;
+}
+
+static void fail_parallel_for(ParallelFor* job, Error* error, bool thrown, Variable value) {
+    spin_lock(&job->lock);
+    Error* dropped = job->error ? error : NULL;
+    if (!job->error) {
+        job->error = error;
+        job->thrown = thrown;
+        job->value = value;
+    }
+    spin_unlock(&job->lock);
+    __atomic_store_n(&job->failed, true, __ATOMIC_RELAXED);
+    if (dropped) pawscript_destroy_error(dropped);
+}
+
+static void run_iteration(ParallelFor* job, Context* context, uint64_t index) {
+    int scope = context->variables->size - 1;
+    try {
+        context->push_codeblock();
+        Variable iter(job->iter_type);
+        iter.as<uint64_t>() = job->first + index * job->step;
+        context->store(job->name, iter);
+        context->state = State_Running;
+        ByteReader reader(job->bytes, job->size);
+        reader.shared = job->shared;
+        execute_codeblock(context, reader.seek(job->start)->enter(), false);
+        State state = context->state;
+        context->state = State_Running;
+        if (state == State_Break) throw Error::runtime(context, "'break' inside a parallel for");
+        if (state == State_Return) throw Error::runtime(context, "'return' inside a parallel for");
+        if (state == State_Throw) {
+            fail_parallel_for(job, context->error, true, context->state_var);
+            context->error = NULL;
+        }
+        context->pop_codeblock();
+    }
+    catch (Error* error) {
+        context->state = State_Running;
+        context->pop_until(scope);
+        fail_parallel_for(job, error, false, context->state_var);
+    }
+}
+
+static void run_worker(ParallelFor* job, int worker) {
+    Context* fork = job->forks[worker];
+    int scope = fork->variables->size - 1;
+    jmp_buf outer;
+    memcpy(outer, segfault_jump_buffer, sizeof(jmp_buf));
+    bool was_in_code = in_code;
+    Context* outer_fork = running_fork;
+    if (fork->parent) running_fork = fork; // or the loop runs on its own context
+    BindAllocator bind(fork->allocator);
+    in_code = true;
+    while (setjmp(segfault_jump_buffer) != 0) { // signals arrive on the faulting thread, so every worker recovers on its own
+        release_fork_lock();
+        alloc = fork->allocator;
+        fork->state = State_Running;
+        fork->pop_until(scope);
+        fail_parallel_for(job, segfault_handler(fork), false, fork->state_var);
+    }
+    uint64_t from, to;
+    while (!__atomic_load_n(&job->failed, __ATOMIC_RELAXED) && take_iterations(job, worker, &from, &to)) {
+        for (uint64_t i = from; i < to && !__atomic_load_n(&job->failed, __ATOMIC_RELAXED); i++) run_iteration(job, fork, i);
+    }
+    in_code = was_in_code;
+    memcpy(segfault_jump_buffer, outer, sizeof(jmp_buf));
+    running_fork = outer_fork;
+}
+
+static const uint64_t task_tag = 0x4B534154535750; // tells the handles apart from other pointers
+static const uint64_t channel_tag = 0x4E414843535750;
+static const uint64_t generator_tag = 0x524E4547535750;
+
+// a spawned call, the handle the script gets is a non-scoped allocation holding it
+struct Task {
+    uint64_t tag;
+    Task* next; // in the pool's queue
+    Context* fork; // until the task is done
+    Variable function;
+    List<Variable>* args; // in the fork's allocator
+    Variable result; // or the value a throw carried
+    Error* error; // moved into the parent's allocator once done
+    bool done;
+};
+
+// a bounded ring any number of threads send into and receive from, each cell's sequence says whose turn it is
+struct Channel {
+    struct Cell {
+        uint64_t sequence;
+        uint64_t value;
+    };
+    uint64_t tag;
+    Type* type;
+    uint64_t mask;
+    int waiters; // threads blocked on it, only then does a send or receive wake anyone up
+    uint64_t head; // the next cell to send into
+    uint8_t padding[64]; // keeps senders and receivers off each other's cache line
+    uint64_t tail; // the next cell to receive from
+
+    Cell* cells() {
+        return (Cell*)(this + 1);
+    }
+    bool try_send(uint64_t value) {
+        uint64_t pos = __atomic_load_n(&head, __ATOMIC_RELAXED);
+        while (true) {
+            Cell* cell = &cells()[pos & mask];
+            int64_t diff = (int64_t)(__atomic_load_n(&cell->sequence, __ATOMIC_ACQUIRE) - pos);
+            if (diff < 0) return false; // full
+            if (diff > 0) pos = __atomic_load_n(&head, __ATOMIC_RELAXED);
+            else if (__atomic_compare_exchange_n(&head, &pos, pos + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                cell->value = value;
+                __atomic_store_n(&cell->sequence, pos + 1, __ATOMIC_RELEASE);
+                return true;
+            }
+        }
+    }
+    bool try_receive(uint64_t* value) {
+        uint64_t pos = __atomic_load_n(&tail, __ATOMIC_RELAXED);
+        while (true) {
+            Cell* cell = &cells()[pos & mask];
+            int64_t diff = (int64_t)(__atomic_load_n(&cell->sequence, __ATOMIC_ACQUIRE) - (pos + 1));
+            if (diff < 0) return false; // empty
+            if (diff > 0) pos = __atomic_load_n(&tail, __ATOMIC_RELAXED);
+            else if (__atomic_compare_exchange_n(&tail, &pos, pos + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                *value = cell->value;
+                __atomic_store_n(&cell->sequence, pos + mask + 1, __ATOMIC_RELEASE);
+                return true;
+            }
+        }
+    }
+};
+
+static void call_task(Task* task) {
+    Context* fork = task->fork;
+    try {
+        task->result = execute_function(fork, &task->function, task->args).rvalue();
+        if (fork->state == State_Throw) {
+            task->error = fork->error;
+            task->result = fork->state_var;
+            fork->error = NULL;
+            fork->state = State_Running;
+        }
+    }
+    catch (Error* error) {
+        fork->state = State_Running;
+        fork->pop_until(0);
+        task->error = error;
+        task->result = fork->state_var;
+    }
+}
+
+static void finish_task(Task* task);
+
+// runs on a pool thread, or on one that waits for something and helps out meanwhile
+static void run_task(Task* task) {
+    Context* fork = task->fork;
+    jmp_buf outer;
+    memcpy(outer, segfault_jump_buffer, sizeof(jmp_buf));
+    bool was_in_code = in_code;
+    Context* outer_fork = running_fork;
+    running_fork = fork;
+    {
+        BindAllocator bind(fork->allocator);
+        in_code = true;
+        if (setjmp(segfault_jump_buffer) == 0) call_task(task);
+        else {
+            release_fork_lock();
+            alloc = fork->allocator;
+            fork->state = State_Running;
+            fork->pop_until(0);
+            task->error = segfault_handler(fork);
+        }
+    }
+    in_code = was_in_code;
+    memcpy(segfault_jump_buffer, outer, sizeof(jmp_buf));
+    running_fork = outer_fork;
+    finish_task(task);
+}
+
+// one pool per process, a loop started while another one holds it runs on the calling thread alone
+struct WorkerPool {
+#ifdef _WIN32
+    typedef CONDITION_VARIABLE Condition;
+#else
+    typedef pthread_cond_t Condition;
+#endif
+    int size; // threads, at least one so tasks can run beside whoever spawns them
+    int processors; // how many threads a loop uses, counting the one that starts it
+    int idle;
+    int busy;
+    ParallelFor* job;
+    uint64_t generation;
+    int joined, running;
+    Task* queue; // tasks no thread has taken yet, oldest first
+    Task* last;
+#ifdef _WIN32
+    CRITICAL_SECTION mutex;
+#else
+    pthread_mutex_t mutex;
+#endif
+    Condition wake, done, changed; // there's work to take, a loop's workers are done, a task finished or a channel moved
+
+    void lock() {
+#ifdef _WIN32
+        EnterCriticalSection(&mutex);
+#else
+        pthread_mutex_lock(&mutex);
+#endif
+    }
+    void unlock() {
+#ifdef _WIN32
+        LeaveCriticalSection(&mutex);
+#else
+        pthread_mutex_unlock(&mutex);
+#endif
+    }
+    void wait(Condition* condition) {
+#ifdef _WIN32
+        SleepConditionVariableCS(condition, &mutex, INFINITE);
+#else
+        pthread_cond_wait(condition, &mutex);
+#endif
+    }
+    void signal(Condition* condition) {
+#ifdef _WIN32
+        WakeAllConditionVariable(condition);
+#else
+        pthread_cond_broadcast(condition);
+#endif
+    }
+    void work() {
+        uint64_t seen = 0;
+        lock();
+        while (true) {
+            while ((!job || generation == seen) && !queue) wait(&wake);
+            idle--;
+            if (!job || generation == seen) {
+                Task* task = queue;
+                queue = task->next;
+                run(task);
+            }
+            else {
+                seen = generation;
+                ParallelFor* job = this->job;
+                int worker = ++joined;
+                if (worker < job->num_workers) {
+                    running++;
+                    unlock();
+                    run_worker(job, worker);
+                    lock();
+                    if (--running == 0) signal(&done);
+                }
+            }
+            idle++;
+        }
+    }
+    // runs a task taken off the queue with the mutex released
+    void run(Task* task) {
+        unlock();
+        run_task(task);
+        lock();
+    }
+    void submit(Task* task) {
+        lock();
+        if (queue) last->next = task;
+        else queue = task;
+        last = task;
+        signal(&wake);
+        unlock();
+    }
+    // a task nobody has started yet is run by whoever waits for it, and the pool grows instead of letting
+    // queued tasks starve behind threads that are all blocked
+    template<typename F> void wait_until(F ready, int* waiters = NULL, Task* awaited = NULL) {
+        lock();
+        if (waiters) __atomic_add_fetch(waiters, 1, __ATOMIC_SEQ_CST);
+        while (!ready()) {
+            Task** link = &queue;
+            while (awaited && *link && *link != awaited) link = &(*link)->next;
+            if (awaited && *link) {
+                *link = awaited->next;
+                for (last = queue; last && last->next; last = last->next);
+                run(awaited);
+                continue;
+            }
+            if (queue && idle == 0) start_thread();
+            wait(&changed);
+        }
+        if (waiters) __atomic_sub_fetch(waiters, 1, __ATOMIC_SEQ_CST);
+        unlock();
+    }
+    void notify() {
+        lock();
+        signal(&changed);
+        unlock();
+    }
+#ifdef _WIN32
+    static DWORD WINAPI thread_main(void* pool) {
+#else
+    static void* thread_main(void* pool) {
+#endif
+        ((WorkerPool*)pool)->work();
+        return 0;
+    }
+    static WorkerPool* get() {
+        static WorkerPool* pool = create(); // static initialization runs once, even with racing threads
+        return pool;
+    }
+    static WorkerPool* create() {
+        WorkerPool* pool = (WorkerPool*)calloc(1, sizeof(WorkerPool));
+        const char* threads = getenv("PAWSCRIPT_THREADS");
+#ifdef _WIN32
+        SYSTEM_INFO info;
+        GetSystemInfo(&info);
+        pool->processors = threads ? atoi(threads) : (int)info.dwNumberOfProcessors;
+        InitializeCriticalSection(&pool->mutex);
+        InitializeConditionVariable(&pool->wake);
+        InitializeConditionVariable(&pool->done);
+        InitializeConditionVariable(&pool->changed);
+#else
+        pool->processors = threads ? atoi(threads) : (int)sysconf(_SC_NPROCESSORS_ONLN);
+        pthread_mutex_init(&pool->mutex, NULL);
+        pthread_cond_init(&pool->wake, NULL);
+        pthread_cond_init(&pool->done, NULL);
+        pthread_cond_init(&pool->changed, NULL);
+#endif
+        if (pool->processors < 1) pool->processors = 1;
+        while (pool->size < (pool->processors > 1 ? pool->processors - 1 : 1) && pool->start_thread());
+        if (pool->processors > pool->size + 1) pool->processors = pool->size + 1;
+        return pool;
+    }
+    bool start_thread() {
+#ifdef _WIN32
+        HANDLE thread = CreateThread(NULL, 0, thread_main, this, 0, NULL);
+        if (!thread) return false;
+        CloseHandle(thread);
+#else
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, thread_main, this) != 0) return false;
+        pthread_detach(thread);
+#endif
+        size++;
+        idle++; // until it takes its first piece of work
+        return true;
+    }
+    void run(ParallelFor* job) {
+        lock();
+        this->job = job;
+        joined = 0;
+        generation++;
+        signal(&wake);
+        unlock();
+        run_worker(job, 0);
+        lock();
+        this->job = NULL; // threads still busy with a task don't join anymore, their share was stolen
+        while (running > 0) wait(&done);
+        unlock();
+    }
+};
+
+static void finish_task(Task* task) {
+    Context* fork = task->fork;
+    Allocator* shared = fork->parent->allocator;
+    if (task->error) {
+        BindAllocator bind(shared);
+        Error* error = copy_error(task->error);
+        pawscript_destroy_error(task->error);
+        task->error = error;
+    }
+    {
+        BindAllocator bind(fork->allocator);
+        delete task->args;
+        delete fork->variables->items[0];
+    }
+    destroy_fork(fork);
+    WorkerPool* pool = WorkerPool::get();
+    pool->lock();
+    task->fork = NULL;
+    task->done = true;
+    __atomic_sub_fetch(&shared->shared, 1, __ATOMIC_ACQ_REL);
+    pool->signal(&pool->changed);
+    pool->unlock();
+}
+
+static void execute_parallel_for(Context* context, ByteReader* reader, Type* iter_type, char* name, uint64_t first, uint64_t step, uint64_t count) {
+    ParallelFor job = {};
+    job.bytes = reader->bytes;
+    job.size = reader->size;
+    job.start = reader->ptr;
+    job.shared = reader->shared;
+    job.iter_type = iter_type;
+    job.name = name;
+    job.first = first;
+    job.step = step;
+    reader->skip();
+    WorkerPool* pool = context->parent || count < 2 ? NULL : WorkerPool::get(); // a loop in a fork or a task runs where it is
+    if (pool && (pool->processors == 1 || __atomic_exchange_n(&pool->busy, 1, __ATOMIC_ACQUIRE))) pool = NULL;
+    if (!pool) {
+        ParallelFor::Slice slice = { 0, 0, count };
+        job.num_workers = 1;
+        job.chunk = count;
+        job.forks = &context;
+        job.slices = &slice;
+        run_worker(&job, 0);
+    }
+    else {
+        job.num_workers = count < (uint64_t)pool->processors ? (int)count : pool->processors;
+        job.chunk = count / job.num_workers / 8 + 1;
+        job.forks = alloc->malloc<Context*>(job.num_workers);
+        job.slices = alloc->malloc<ParallelFor::Slice>(job.num_workers);
+        for (int i = 0; i < job.num_workers; i++) {
+            job.forks[i] = fork_context(context);
+            job.slices[i].next = count * i / job.num_workers;
+            job.slices[i].end = count * (i + 1) / job.num_workers;
+        }
+        pool->run(&job);
+        __atomic_store_n(&pool->busy, 0, __ATOMIC_RELEASE);
+        if (job.error) { // moved into the parent before its fork goes away
+            Error* error = copy_error(job.error);
+            pawscript_destroy_error(job.error);
+            job.error = error;
+        }
+        for (int i = 0; i < job.num_workers; i++) destroy_fork(job.forks[i]);
+        alloc->free(job.forks);
+        alloc->free(job.slices);
+    }
+    if (!job.error) return;
+    context->state_var = job.value;
+    if (!job.thrown) throw job.error;
+    context->error = job.error;
+    context->state = State_Throw;
+}
+
+static Variable spawn_task(Context* context, Variable function, List<Variable>* args) {
+    if (!matches(&function, VarType_Function)) throw Error::runtime(context, "Not a function");
+    Allocator* shared = (context->parent ? context->parent : context)->allocator;
+    Variable handle(context->type_cache->primitive(TypeKind_Void)->pointer(context));
+    Task* task = (Task*)context->new_allocation(sizeof(Task), false, context->type_cache->primitive(TypeKind_Void), Allocation::task_cleanup);
+    task->tag = task_tag;
+    task->function = function.rvalue();
+    task->fork = fork_task(context);
+    {
+        BindAllocator bind(task->fork->allocator);
+        task->args = new List<Variable>;
+        for (int i = 0; i < args->size; i++) task->args->add(args->get(i).rvalue());
+    }
+    __atomic_add_fetch(&shared->shared, 1, __ATOMIC_ACQ_REL); // the parent takes its locks from here on
+    WorkerPool::get()->submit(task);
+    handle.as<void*>() = task;
+    return handle;
+}
+
+// a handle is only read once it's known to be one of the context's allocations of the right kind and size, any pointer can be
+// passed where one is expected
+static void* find_handle(Context* context, Variable handle, void(*cleanup)(void*, Context*, Type*), size_t size, uint64_t tag) {
+    void* ptr = handle.type->kind == TypeKind_Pointer ? handle.as<void*>() : NULL;
+    if (!ptr) return NULL;
+    {
+        ForkLock lock;
+        int scope_id;
+        Allocation* allocation = context->find_allocation(ptr, &scope_id);
+        if (!allocation || allocation->cleanup != cleanup || allocation->size < size) return NULL;
+    }
+    return *(uint64_t*)ptr == tag ? ptr : NULL;
+}
+
+static Task* find_task(Context* context, Variable handle) {
+    Task* task = (Task*)find_handle(context, handle, Allocation::task_cleanup, sizeof(Task), task_tag);
+    if (!task) throw Error::runtime(context, "Not a task");
+    return task;
+}
+
+static Variable await_task(Context* context, Variable handle) {
+    Task* task = find_task(context, handle);
+    WorkerPool::get()->wait_until([&] { return task->done; }, NULL, task);
+    if (task->error) { // every await raises its own copy
+        context->state_var = task->result;
+        throw copy_error(task->error);
+    }
+    return task->result;
+}
+
+static Variable new_channel(Context* context, Type* type, uint64_t capacity) {
+    if (type->kind == TypeKind_Void || type->kind == TypeKind_Varargs) throw Error::runtime(context, String::new_format("Channels can't carry %s", type->to_string()));
+    if (capacity == 0 || capacity > (1ULL << 32)) throw Error::runtime(context, "Channel capacity out of range");
+    uint64_t cells = 2;
+    while (cells < capacity) cells *= 2;
+    Variable handle(context->type_cache->primitive(TypeKind_Void)->pointer(context));
+    Channel* channel = (Channel*)context->new_allocation(sizeof(Channel) + cells * sizeof(Channel::Cell), false, context->type_cache->primitive(TypeKind_Void), Allocation::channel_cleanup);
+    channel->tag = channel_tag;
+    channel->type = type;
+    channel->mask = cells - 1;
+    for (uint64_t i = 0; i < cells; i++) channel->cells()[i].sequence = i;
+    handle.as<void*>() = channel;
+    return handle;
+}
+
+static Channel* find_channel(Context* context, Variable handle) {
+    Channel* channel = (Channel*)find_handle(context, handle, Allocation::channel_cleanup, sizeof(Channel), channel_tag);
+    if (!channel) throw Error::runtime(context, "Not a channel");
+    return channel;
+}
+
+static void wake_waiters(Channel* channel) {
+    __atomic_thread_fence(__ATOMIC_SEQ_CST); // pairs with the increment in wait_until
+    if (__atomic_load_n(&channel->waiters, __ATOMIC_RELAXED)) WorkerPool::get()->notify();
+}
+
+static void send_channel(Context* context, Variable handle, Variable value) {
+    Channel* channel = find_channel(context, handle);
+    uint64_t bits = 0;
+    Variable var = cast(context, channel->type, value).rvalue();
+    memcpy(&bits, var.ptr(), var.type->value_size());
+    if (!channel->try_send(bits)) WorkerPool::get()->wait_until([&] { return channel->try_send(bits); }, &channel->waiters);
+    wake_waiters(channel);
+}
+
+static Variable receive_channel(Context* context, Variable handle) {
+    Channel* channel = find_channel(context, handle);
+    uint64_t bits;
+    if (!channel->try_receive(&bits)) WorkerPool::get()->wait_until([&] { return channel->try_receive(&bits); }, &channel->waiters);
+    wake_waiters(channel);
+    Variable var(channel->type);
+    memcpy(var.ptr(), &bits, var.type->value_size());
+    return var;
+}
+
+// a function run a value at a time: between the values it yields it's suspended on a stack segment of its own, and carries on from there
+// when resumed. the script's handle is a non-scoped allocation pointing to it, which can go away while it runs
+struct Generator {
+    Type* type;
+    Context* fork; // until it's finished
+    Variable function;
+    List<Variable>* args; // in the fork's allocator
+    ThreadStack* owner; // the thread that made it, the only one that can run it
+    StackSegment* base; // mapped the first time it runs
+    StackSegment* top; // where it yielded from, past base if a call it made had moved on to another segment
+    uint64_t value; // yielded and not taken yet
+    bool has_value, finished, running, dropped;
+    Variable result; // the value a throw carried
+    Error* error; // raised again by whoever resumed it
+};
+
+struct GeneratorHandle {
+    uint64_t tag;
+    Generator* generator;
+};
+
+static thread_local Generator* running_generator = NULL;
+
+// what the thread runs script code with, swapped along with the stack when a generator is resumed or yields
+struct RunState {
+    Allocator* allocator;
+    Context* fork;
+    Generator* generator;
+    bool in_code;
+    jmp_buf jump;
+
+    void save() {
+        allocator = alloc;
+        fork = running_fork;
+        generator = running_generator;
+        in_code = ::in_code;
+        memcpy(jump, segfault_jump_buffer, sizeof(jmp_buf));
+    }
+    void restore() {
+        alloc = allocator;
+        running_fork = fork;
+        running_generator = generator;
+        ::in_code = in_code;
+        memcpy(segfault_jump_buffer, jump, sizeof(jmp_buf));
+    }
+};
+
+static void call_generator(Generator* gen) {
+    Context* fork = gen->fork;
+    try {
+        execute_function(fork, &gen->function, gen->args);
+        if (fork->state == State_Throw) {
+            gen->error = fork->error;
+            gen->result = fork->state_var;
+            fork->error = NULL;
+            fork->state = State_Running;
+        }
+    }
+    catch (Error* error) {
+        fork->state = State_Running;
+        fork->pop_until(0);
+        gen->error = error;
+        gen->result = fork->state_var;
+    }
+}
+
+// where a generator starts, on its own segment
+static void run_generator(void* data) {
+    Generator* gen = (Generator*)data;
+    Context* fork = gen->fork;
+    running_fork = fork;
+    running_generator = gen;
+    alloc = fork->allocator;
+    in_code = true;
+    if (setjmp(segfault_jump_buffer) == 0) call_generator(gen);
+    else {
+        release_fork_lock();
+        alloc = fork->allocator;
+        fork->state = State_Running;
+        fork->pop_until(0);
+        gen->error = segfault_handler(fork);
+    }
+    gen->finished = true;
+}
+
+static void release_generator_stack(Generator* gen) {
+    if (!gen->base) return;
+    bool owned = gen->owner == &thread_stack;
+    StackSegment* segment = gen->top ? gen->top : gen->base;
+    while (true) {
+        StackSegment* prev = segment->prev;
+        bool last = segment == gen->base;
+        if (!owned) segment->counted = false; // the thread it ran on keeps counting it, rather than this one miscounting
+        free_stack_segment(segment);
+        if (last) break;
+        segment = prev;
+    }
+    gen->base = gen->top = NULL;
+}
+
+static void finish_generator(Generator* gen) {
+    Context* fork = gen->fork;
+    if (gen->error) {
+        BindAllocator bind(fork->parent->allocator);
+        Error* error = copy_error(gen->error);
+        pawscript_destroy_error(gen->error);
+        gen->error = error;
+    }
+    {
+        BindAllocator bind(fork->allocator);
+        delete gen->args;
+        if (fork->variables->items[0] != fork->parent->variables->items[0]) delete fork->variables->items[0];
+    }
+    destroy_fork(fork);
+    gen->fork = NULL;
+}
+
+// once its handle is gone, one suspended halfway is dropped where it stands, without returning from the calls it's in
+static void drop_generator(Generator* gen) {
+    if (gen->fork) {
+        release_generator_stack(gen);
+        Context* fork = gen->fork;
+        Context* outer_fork = running_fork;
+        running_fork = fork;
+        {
+            BindAllocator bind(fork->allocator);
+            fork->pop_until(0);
+        }
+        running_fork = outer_fork;
+        finish_generator(gen);
+    }
+    if (gen->error) pawscript_destroy_error(gen->error);
+    ForkLock lock;
+    alloc->free(gen);
+}
+
+static Variable new_generator(Context* context, Type* type, Variable function, List<Variable>* args) {
+    if (type->kind == TypeKind_Void || type->kind == TypeKind_Varargs) throw Error::runtime(context, String::new_format("Generators can't yield %s", type->to_string()));
+    if (!matches(&function, VarType_Function)) throw Error::runtime(context, "Not a function");
+    Variable handle(context->type_cache->primitive(TypeKind_Void)->pointer(context));
+    GeneratorHandle* data = (GeneratorHandle*)context->new_allocation(sizeof(GeneratorHandle), false, context->type_cache->primitive(TypeKind_Void), Allocation::generator_cleanup);
+    Generator* gen;
+    {
+        ForkLock lock; // outlives the fork it's made in
+        gen = alloc->malloc<Generator>();
+    }
+    data->tag = generator_tag;
+    data->generator = gen;
+    gen->type = type;
+    gen->function = function.rvalue();
+    gen->owner = &thread_stack;
+    gen->fork = fork_generator(context);
+    {
+        BindAllocator bind(gen->fork->allocator);
+        gen->args = new List<Variable>;
+        for (int i = 0; i < args->size; i++) gen->args->add(args->get(i).rvalue());
+    }
+    handle.as<void*>() = data;
+    return handle;
+}
+
+static Generator* find_generator(Context* context, Variable handle) {
+    GeneratorHandle* data = (GeneratorHandle*)find_handle(context, handle, Allocation::generator_cleanup, sizeof(GeneratorHandle), generator_tag);
+    if (!data) throw Error::runtime(context, "Not a generator");
+    return data->generator;
+}
+
+// runs the generator up to its next value, unless one is waiting already, false if it finished instead
+static bool advance_generator(Context* context, Generator* gen) {
+    if (gen->has_value) return true;
+    if (gen->finished) return false;
+    if (gen->running) throw Error::runtime(context, "Generator is already running");
+    if (gen->owner != &thread_stack) throw Error::runtime(context, "Generator was made on another thread");
+    if (!gen->base) {
+        gen->base = new_stack_segment(context, false);
+        gen->base->run = run_generator;
+        gen->base->data = gen;
+    }
+    RunState state;
+    state.save();
+    gen->running = true;
+    enter_stack_segment(gen->base, gen->top);
+    state.restore();
+    gen->running = false;
+    if (gen->finished) {
+        gen->top = NULL;
+        release_generator_stack(gen);
+        finish_generator(gen);
+    }
+    if (gen->dropped) {
+        drop_generator(gen);
+        throw Error::runtime(context, "Generator was deleted while it ran");
+    }
+    if (gen->error) { // raised once, by whoever saw it finish
+        context->state_var = gen->result;
+        Error* error = copy_error(gen->error);
+        pawscript_destroy_error(gen->error);
+        gen->error = NULL;
+        throw error;
+    }
+    return gen->has_value;
+}
+
+static Variable take_generator_value(Generator* gen) {
+    gen->has_value = false;
+    Variable var(gen->type);
+    memcpy(var.ptr(), &gen->value, var.type->value_size());
+    return var;
+}
+
+static Variable resume_generator(Context* context, Variable handle) {
+    Generator* gen = find_generator(context, handle);
+    if (!advance_generator(context, gen)) throw Error::runtime(context, "Generator has finished");
+    return take_generator_value(gen);
+}
+
+static Variable generator_finished(Context* context, Variable handle) {
+    bool finished = !advance_generator(context, find_generator(context, handle));
+    Variable var(context->type_cache->primitive(TypeKind_Int8)->unsign(context));
+    var.as<bool>() = finished;
+    return var;
+}
+
+static bool next_generator_value(Context* context, Variable handle, Variable* value) {
+    Generator* gen = find_generator(context, handle);
+    if (!advance_generator(context, gen)) return false;
+    *value = take_generator_value(gen);
+    return true;
+}
+
+// back to whoever resumed the generator running on this thread, returns once it's resumed again
+static void suspend_generator(Generator* gen) {
+    RunState state;
+    state.save();
+    gen->top = thread_stack.segment;
+    leave_stack_segment(gen->base, gen->top);
+    state.restore();
+}
+
+static void yield_generator(Context* context, Variable value) {
+    Generator* gen = running_generator;
+    if (!gen || gen->fork != context) throw Error::runtime(context, "'yield' outside of a generator");
+    if (fork_lock_depth) throw Error::runtime(context, "Cannot yield here");
+    Variable var = cast(context, gen->type, value).rvalue();
+    gen->value = 0;
+    memcpy(&gen->value, var.ptr(), var.type->value_size());
+    gen->has_value = true;
+    suspend_generator(gen);
+}
+
+// the tasks a context spawned run against its caches, so it can't go away before them
+static void wait_for_tasks(Context* context) {
+    Allocator* allocator = context->allocator;
+    if (!__atomic_load_n(&allocator->shared, __ATOMIC_ACQUIRE)) return;
+    WorkerPool::get()->wait_until([&] { return __atomic_load_n(&allocator->shared, __ATOMIC_ACQUIRE) == 0; });
+}
+
+// cloning and snapshots only know plain data, a handle would point into the original
+static bool holds_handles(Context* context) {
+    Set<Allocation*>* globals = context->allocs->items[0];
+    for (int i = 0; i < globals->size; i++) {
+        void(*cleanup)(void*, Context*, Type*) = globals->items[i]->cleanup;
+        if (cleanup == Allocation::task_cleanup || cleanup == Allocation::channel_cleanup || cleanup == Allocation::generator_cleanup) return true;
+    }
+    return false;
+}
+
+void Allocation::task_cleanup(void* ptr, Context* context, Type* type) {
+    Task* task = (Task*)ptr;
+    if (task->error) pawscript_destroy_error(task->error);
+}
+
+void Allocation::channel_cleanup(void* ptr, Context* context, Type* type) {} // only marks the allocation as a channel
+
+void Allocation::generator_cleanup(void* ptr, Context* context, Type* type) {
+    Generator* gen = ((GeneratorHandle*)ptr)->generator;
+    if (gen->running) gen->dropped = true; // whoever resumed it drops it once it's back
+    else drop_generator(gen);
+}
+
+// calls visit(slot, type) on every value of a type that can hold an address: pointers, structs, functions and types
+template<typename F> static void each_address(uint8_t* data, size_t size, Type* type, F& visit) {
+    if (type->kind != TypeKind_Pointer && type->kind != TypeKind_Struct && type->kind != TypeKind_Function && type->kind != TypeKind_Type) return;
+    int step = type->value_size();
+    for (size_t offset = 0; offset + step <= size; offset += step) visit(data + offset, type);
+}
+
+template<typename F> static void each_field_address(uint8_t* data, Type* type, F& visit) {
+    for (int i = 0; i < type->struct_info.num_fields; i++) {
+        Type::Field* field = &type->struct_info.fields[i];
+        Type* field_type = field->type;
+        uint8_t* at = data + field->offset;
+        if (field->inline_size == -1) each_address(at, field_type->value_size(), field_type, visit);
+        else if (field_type->kind == TypeKind_Struct) {
+            for (int j = 0; j < field->inline_size; j++) each_field_address(at + j * field_type->size, field_type, visit);
+        } else each_address(at, field_type->size * field->inline_size, field_type->pointer_info.base, visit);
+    }
+}
+
+// a struct allocation holds the struct bodies, anything else an array of values
+template<typename F> static void each_address(Allocation* allocation, F visit) {
+    uint8_t* data = (uint8_t*)allocation->data;
+    Type* type = allocation->type;
+    if (type->kind != TypeKind_Struct) each_address(data, allocation->size, type, visit);
+    else if (type->size > 0) for (size_t offset = 0; offset + type->size <= allocation->size; offset += type->size) each_field_address(data + offset, type, visit);
+}
+
+// deep copies the globals of an idle context, the copy shares the code its functions point into but nothing it can write to
+struct ContextCloner {
+    struct Range {
+        uint8_t* from;
+        size_t size;
+        uint8_t* to;
+    };
+    Context* src;
+    Context* dst;
+    HashMap<void*, void*> remap = HashMap<void*, void*>(hash_int64, compare_int64); // types, field and param arrays, variables and code
+    List<Range> ranges; // global allocations, pointers can also point into the middle of one
+    List<Allocation*> allocations;
+
+    ContextCloner(Context* src, Context* dst): src(src), dst(dst) {}
+
+    template<typename T> T* map(T* ptr) {
+        return ptr ? (T*)remap.getdef(ptr, NULL) : NULL;
+    }
+    Type::TypeHandle map(Type::TypeHandle handle) {
+        return Type::TypeHandle(map(handle.type), map(handle.parent));
+    }
+    static int compare_ranges(const void* a, const void* b) {
+        uint8_t* x = ((Range*)a)->from;
+        uint8_t* y = ((Range*)b)->from;
+        return x < y ? -1 : x > y;
+    }
+    void* relocate(void* ptr) {
+        int lo = 0, hi = ranges.size;
+        while (lo < hi) { // the last range starting at or before ptr
+            int mid = (lo + hi) / 2;
+            if (ranges.items[mid].from <= (uint8_t*)ptr) lo = mid + 1;
+            else hi = mid;
+        }
+        if (lo == 0) return ptr;
+        Range* range = &ranges.items[lo - 1];
+        if ((uint8_t*)ptr >= range->from + range->size) return ptr;
+        return range->to + ((uint8_t*)ptr - range->from);
+    }
+
+    void clone_types() {
+        TypeCache* from = src->type_cache;
+        TypeCache* to = dst->type_cache;
+        to->shared = from->shared; // the clone holds on to the same programs
+        if (from->shared) for (int i = 0; i < from->shared->capacity; i++) {
+            if (from->shared->pairs[i].used) remap.add(from->shared->pairs[i].value, from->shared->pairs[i].value);
+        }
+        for (int i = 0; i < from->capacity; i++) {
+            if (!from->pairs[i].used) continue;
+            Type* type = from->pairs[i].value;
+            remap.add(type, alloc->copy(type));
+            if (type->kind == TypeKind_Struct && type->struct_info.fields && !remap.has(type->struct_info.fields))
+                remap.add(type->struct_info.fields, alloc->copy(type->struct_info.fields, type->struct_info.num_fields));
+            if (type->kind == TypeKind_Function && type->function_info.params && !remap.has(type->function_info.params))
+                remap.add(type->function_info.params, alloc->copy(type->function_info.params, type->function_info.num_params));
+        }
+        Set<void*> arrays(compare_int64);
+        for (int i = 0; i < from->capacity; i++) {
+            if (!from->pairs[i].used) continue;
+            Type* type = from->pairs[i].value;
+            Type* copy = map(type);
+            copy->parent = map(type->parent);
+            copy->pointer_to = map(type->pointer_to);
+            copy->const_of = map(type->const_of);
+            copy->atomic_of = map(type->atomic_of);
+            copy->unsigned_of = map(type->unsigned_of);
+            copy->resolved = NULL;
+            copy->field_table = NULL;
+            switch (type->kind) {
+                case TypeKind_Pointer:
+                    copy->pointer_info.base = map(type->pointer_info.base);
+                    break;
+                case TypeKind_Function:
+                    copy->function_info.return_type = map(type->function_info.return_type);
+                    copy->function_info.params = map(type->function_info.params);
+                    if (!copy->function_info.params || arrays.find(copy->function_info.params)) break;
+                    arrays.add(copy->function_info.params);
+                    for (int j = 0; j < type->function_info.num_params; j++)
+                        copy->function_info.params[j].type = map(type->function_info.params[j].type);
+                    break;
+                case TypeKind_Struct:
+                    copy->struct_info.fields = map(type->struct_info.fields);
+                    if (!copy->struct_info.fields || arrays.find(copy->struct_info.fields)) break;
+                    arrays.add(copy->struct_info.fields);
+                    for (int j = 0; j < type->struct_info.num_fields; j++)
+                        copy->struct_info.fields[j].type = map(type->struct_info.fields[j].type);
+                    break;
+                default: break;
+            }
+        }
+        for (int i = 0; i <= TypeKind_Parent; i++) to->primitives[i] = map(from->primitives[i]);
+        to->defer_epoch = from->defer_epoch;
+        if (to->frame_ids < from->frame_ids) to->frame_ids = from->frame_ids;
+    }
+    // field values hold the code of methods, so types can only be hashed once the functions moved
+    void register_types() {
+        TypeCache* from = src->type_cache;
+        Set<void*> arrays(compare_int64);
+        for (int i = 0; i < from->capacity; i++) {
+            if (!from->pairs[i].used) continue;
+            Type* type = from->pairs[i].value;
+            Type* copy = map(type);
+            if (type->kind != TypeKind_Struct || !copy->struct_info.fields || arrays.find(copy->struct_info.fields)) continue;
+            arrays.add(copy->struct_info.fields);
+            for (int j = 0; j < type->struct_info.num_fields; j++) {
+                Type::Field* field = &copy->struct_info.fields[j];
+                if (field->type.type->kind == TypeKind_Function) field->value = (uintptr_t)remap.getdef((void*)field->value, (void*)field->value);
+            }
+        }
+        for (int i = 0; i < from->capacity; i++) {
+            if (!from->pairs[i].used) continue;
+            Type* copy = map(from->pairs[i].value);
+            copy->hash = 0;
+            dst->type_cache->hash_type(copy);
+            dst->type_cache->add(copy, copy);
+        }
+    }
+
+    void clone_allocations() {
+        Set<Allocation*>* from = src->allocs->items[0];
+        for (int i = 0; i < from->size; i++) {
+            Allocation* orig = from->items[i];
+            Allocation* copy = new Allocation(orig->size, dst, map(orig->type), orig->cleanup);
+            memcpy(copy->data, orig->data, orig->size);
+            allocations.add(copy);
+            if (orig->cleanup != Allocation::function_cleanup) {
+                ranges.add(Range{ (uint8_t*)orig->data, orig->size, (uint8_t*)copy->data });
+                continue;
+            }
+            Function* func = (Function*)copy->data;
+            func->code = dst->code_arena->trampoline(func, generate_thunk(dst, copy->type));
+            if (!func->code) throw Error::runtime(dst, "Cannot allocate executable memory");
+            func->shared = true;
+            func->captures = alloc->malloc<Variable*>(func->num_captures);
+            func->jit = NULL; // embeds the source's addresses, the heat carries over so it's compiled again soon
+            func->jit_type = NULL;
+            func->jit_sites = NULL;
+            func->jit_baseline = NULL;
+            func->jit_baseline_sites = NULL;
+            func->jit_tier = 0;
+            func->jit_failed = false;
+            func->jit_cache_tried = false;
+            remap.add(((Function*)orig->data)->code, func->code);
+            if (func->capture_mode == CaptureMode_None) dst->function_cache->add(func->site, func);
+        }
+        qsort(ranges.items, ranges.size, sizeof(Range), compare_ranges);
+    }
+    Variable* clone_variable(Variable* var) {
+        Variable* copy = map(var);
+        if (copy) return &copy->retain();
+        copy = Variable::allocate(*var);
+        copy->type = map((Type*)var->type);
+        if (!copy->is_ref()) relocate_value(copy->ptr(), copy->type);
+        remap.add(var, copy);
+        return &copy->retain();
+    }
+    void clone_variables() {
+        Map<char*, Variable*>* from = src->variables->items[0];
+        for (int i = 0; i < from->size; i++) dst->variables->items[0]->add(from->pairs[i].key, clone_variable(from->pairs[i].value));
+        Set<Allocation*>* allocs = src->allocs->items[0];
+        for (int i = 0; i < allocs->size; i++) {
+            if (allocs->items[i]->cleanup != Allocation::function_cleanup) continue;
+            Function* orig = (Function*)allocs->items[i]->data;
+            Function* func = (Function*)allocations.items[i]->data;
+            for (int j = 0; j < func->num_captures; j++) if (orig->captures[j]) func->captures[j] = clone_variable(orig->captures[j]);
+        }
+    }
+
+    void relocate_value(void* ptr, Type* type) {
+        switch (type->kind) {
+            case TypeKind_Pointer:
+            case TypeKind_Struct:
+                Variable::write<void*>(ptr, relocate(Variable::read<void*>(ptr)));
+                break;
+            case TypeKind_Function: {
+                void* code = Variable::read<void*>(ptr);
+                Variable::write<void*>(ptr, remap.getdef(code, code));
+                break;
+            }
+            case TypeKind_Type:
+                Variable::write<Type*>(ptr, map(Variable::read<Type*>(ptr)));
+                break;
+            default: break;
+        }
+    }
+    void relocate_allocations() {
+        for (int i = 0; i < allocations.size; i++) {
+            Allocation* allocation = allocations.items[i];
+            if (allocation->cleanup == Allocation::function_cleanup) continue;
+            each_address(allocation, [&](uint8_t* slot, Type* type) { relocate_value(slot, type); });
+        }
+    }
+
+    void clone() {
+        dst->programs->add(src->code->retain());
+        for (int i = 0; i < src->programs->size; i++) dst->programs->add(src->programs->items[i]->retain());
+        clone_types();
+        clone_allocations();
+        register_types();
+        clone_variables();
+        relocate_allocations();
+        for (int i = 0; i < allocations.size; i++) dst->allocs->items[0]->add(allocations.items[i]);
+    }
+};
+
+// a pointer in a snapshot image, by what it points into
+enum SnapshotRefKind: uint8_t {
+    SnapshotRef_Raw, // not a pointer, offset is the value itself
+    SnapshotRef_Null,
+    SnapshotRef_Type,
+    SnapshotRef_Function,
+    SnapshotRef_Allocation,
+    SnapshotRef_Bytecode,
+    SnapshotRef_String,
+    SnapshotRef_Symbol,
+};
+
+struct SnapshotRef {
+    SnapshotRefKind kind;
+    uint32_t index, item;
+    uint64_t offset;
+};
+
+static const char snapshot_magic[8] = "PAWSNP2";
+
+// serializes an idle context. bytecode embeds addresses, so the image stores the source of every unit and the loader compiles it again
+struct SnapshotWriter {
+    struct Range {
+        uint8_t* from;
+        size_t size;
+        uint32_t index;
+    };
+    struct Interned {
+        char* string;
+        uint32_t program;
+    };
+    Context* context;
+    ByteWriter* out = new ByteWriter;
+    List<Program*> programs;
+    List<Interned> interned; // by address
+    List<Range> ranges;
+    List<Type*> types;
+    List<void*> arrays;
+    List<Variable*> variables;
+    List<char*> strings;
+    HashMap<void*, uint32_t> type_ids = HashMap<void*, uint32_t>(hash_int64, compare_int64); // all ids are index + 1, 0 is NULL
+    HashMap<void*, uint32_t> array_ids = HashMap<void*, uint32_t>(hash_int64, compare_int64);
+    HashMap<void*, uint32_t> variable_ids = HashMap<void*, uint32_t>(hash_int64, compare_int64);
+    HashMap<void*, uint32_t> function_ids = HashMap<void*, uint32_t>(hash_int64, compare_int64);
+    HashMap<char*, uint32_t> string_ids = HashMap<char*, uint32_t>(hash_string, compare_strings);
+
+    SnapshotWriter(Context* context): context(context) {}
+    ~SnapshotWriter() { delete out; }
+
+    static int compare_ranges(const void* a, const void* b) {
+        uint8_t* x = ((Range*)a)->from;
+        uint8_t* y = ((Range*)b)->from;
+        return x < y ? -1 : x > y;
+    }
+    static int compare_interned(const void* a, const void* b) {
+        char* x = ((Interned*)a)->string;
+        char* y = ((Interned*)b)->string;
+        return x < y ? -1 : x > y;
+    }
+    uint32_t string_id(const char* str) {
+        if (!str) return 0;
+        uint32_t& id = string_ids.get((char*)str);
+        if (!id) {
+            strings.add((char*)str);
+            id = strings.size;
+        }
+        return id;
+    }
+    uint32_t variable_id(Variable* var) {
+        if (!var) return 0;
+        uint32_t& id = variable_ids.get(var);
+        if (!id) {
+            variables.add(var);
+            id = variables.size;
+        }
+        return id;
+    }
+    void write_handle(Type::TypeHandle handle) {
+        out->write<uint32_t>(type_ids.getdef(handle.type, 0));
+        out->write<uint32_t>(type_ids.getdef(handle.parent, 0));
+    }
+    void write_ref(SnapshotRef ref) {
+        out->write<uint8_t>(ref.kind);
+        out->write<uint32_t>(ref.index);
+        out->write<uint32_t>(ref.item);
+        out->write<uint64_t>(ref.offset);
+    }
+    void write_ref(void* ptr) {
+        write_ref(ref(ptr));
+    }
+    // pointers to native memory that isn't a symbol can't survive a restart and come back as NULL
+    SnapshotRef ref(void* ptr) {
+        uint8_t* addr = (uint8_t*)ptr;
+        if (!ptr) return SnapshotRef{ SnapshotRef_Null, 0, 0, 0 };
+        if (uint32_t id = type_ids.getdef(ptr, 0)) return SnapshotRef{ SnapshotRef_Type, id - 1, 0, 0 };
+        if (uint32_t id = function_ids.getdef(ptr, 0)) return SnapshotRef{ SnapshotRef_Function, id - 1, 0, 0 };
+        int lo = 0, hi = ranges.size;
+        while (lo < hi) {
+            int mid = (lo + hi) / 2;
+            if (ranges.items[mid].from <= addr) lo = mid + 1;
+            else hi = mid;
+        }
+        if (lo > 0 && addr < ranges.items[lo - 1].from + ranges.items[lo - 1].size)
+            return SnapshotRef{ SnapshotRef_Allocation, ranges.items[lo - 1].index, 0, (uint64_t)(addr - ranges.items[lo - 1].from) };
+        for (int i = 0; i < programs.size; i++) {
+            List<Program::Unit>* units = programs.items[i]->units;
+            for (int j = 0; j < units->size; j++) {
+                ByteReader* reader = units->items[j].reader;
+                if (addr >= reader->bytes && addr <= reader->bytes + reader->size)
+                    return SnapshotRef{ SnapshotRef_Bytecode, (uint32_t)i, (uint32_t)j, (uint64_t)(addr - reader->bytes) };
+            }
+        }
+        lo = 0, hi = interned.size;
+        while (lo < hi) {
+            int mid = (lo + hi) / 2;
+            if (interned.items[mid].string <= (char*)addr) lo = mid + 1;
+            else hi = mid;
+        }
+        if (lo > 0) {
+            Interned* str = &interned.items[lo - 1];
+            if ((char*)addr <= str->string + strlen(str->string))
+                return SnapshotRef{ SnapshotRef_String, str->program, string_id(str->string) - 1, (uint64_t)((char*)addr - str->string) };
+        }
+        Dl_info info;
+        if (dladdr(ptr, &info) && info.dli_sname && info.dli_saddr)
+            return SnapshotRef{ SnapshotRef_Symbol, 0, string_id(info.dli_sname) - 1, (uint64_t)(addr - (uint8_t*)info.dli_saddr) };
+        return SnapshotRef{ SnapshotRef_Null, 0, 0, 0 };
+    }
+
+    void collect() {
+        programs.add(context->code);
+        for (int i = 0; i < context->programs->size; i++) programs.add(context->programs->items[i]);
+        for (int i = 0; i < programs.size; i++) {
+            Set<char*>* strings = programs.items[i]->strings;
+            for (int j = 0; j < strings->size; j++) interned.add(Interned{ strings->items[j], (uint32_t)i });
+        }
+        qsort(interned.items, interned.size, sizeof(Interned), compare_interned);
+        // sealed types are written like the context's own, the programs they belong to are compiled again
+        TypeCache* caches[] = { context->type_cache, context->type_cache->shared };
+        for (TypeCache* cache: caches) for (int i = 0; cache && i < cache->capacity; i++) {
+            if (!cache->pairs[i].used) continue;
+            Type* type = cache->pairs[i].value;
+            types.add(type);
+            type_ids.add(type, types.size);
+            void* array = type->kind == TypeKind_Struct ? (void*)type->struct_info.fields : type->kind == TypeKind_Function ? (void*)type->function_info.params : NULL;
+            if (!array || array_ids.has(array)) continue;
+            arrays.add(type);
+            array_ids.add(array, arrays.size);
+        }
+        Set<Allocation*>* allocs = context->allocs->items[0];
+        for (int i = 0; i < allocs->size; i++) {
+            Allocation* allocation = allocs->items[i];
+            if (allocation->cleanup == Allocation::function_cleanup) function_ids.add(((Function*)allocation->data)->code, i + 1);
+            else ranges.add(Range{ (uint8_t*)allocation->data, allocation->size, (uint32_t)i });
+        }
+        qsort(ranges.items, ranges.size, sizeof(Range), compare_ranges);
+        Map<char*, Variable*>* globals = context->variables->items[0];
+        for (int i = 0; i < globals->size; i++) variable_id(globals->pairs[i].value);
+        for (int i = 0; i < allocs->size; i++) {
+            if (allocs->items[i]->cleanup != Allocation::function_cleanup) continue;
+            Function* func = (Function*)allocs->items[i]->data;
+            for (int j = 0; j < func->num_captures; j++) variable_id(func->captures[j]);
+        }
+    }
+
+    void write_programs() {
+        out->write<uint32_t>(programs.size);
+        for (int i = 0; i < programs.size; i++) {
+            Program* program = programs.items[i];
+            out->write<bool>(program->entry != NULL);
+            out->write<uint32_t>(program->units->size);
+            for (int j = 0; j < program->units->size; j++) {
+                out->write<uint32_t>(string_id(program->units->items[j].file));
+                out->write<uint32_t>(string_id(program->units->items[j].source));
+            }
+        }
+    }
+    // arrays hold the type that owns them in the list, the type's kind says what the array is
+    void write_types() {
+        TypeCache* cache = context->type_cache;
+        out->write<uint32_t>(types.size);
+        out->write<uint32_t>(arrays.size);
+        for (int i = 0; i < arrays.size; i++) {
+            Type* type = (Type*)arrays.items[i];
+            bool is_struct = type->kind == TypeKind_Struct;
+            size_t count = is_struct ? type->struct_info.num_fields : type->function_info.num_params;
+            out->write<bool>(is_struct);
+            out->write<uint64_t>(count);
+            for (size_t j = 0; j < count; j++) {
+                Type::Param* param = is_struct ? &type->struct_info.fields[j] : &type->function_info.params[j];
+                write_handle(param->type);
+                out->write<uint32_t>(string_id(param->name));
+                if (!is_struct) continue;
+                Type::Field* field = &type->struct_info.fields[j];
+                out->write<uint64_t>(field->offset);
+                out->write<int64_t>(field->inline_size);
+                if (field->type.type->kind == TypeKind_Function) write_ref((void*)field->value);
+                else write_ref(SnapshotRef{ SnapshotRef_Raw, 0, 0, field->value });
+            }
+        }
+        for (int i = 0; i < types.size; i++) {
+            Type* type = types.items[i];
+            out->write<uint8_t>(type->kind);
+            out->write<uint8_t>(type->is_const | type->is_unsigned << 1 | type->lvalue_return << 2 | type->has_defers << 3 | type->validated << 4 | type->is_atomic << 5);
+            out->write<int32_t>(type->size);
+            out->write<int32_t>(type->alignment);
+            out->write<uint32_t>(type_ids.getdef(type->parent, 0));
+            out->write<uint32_t>(type_ids.getdef(type->pointer_to, 0));
+            out->write<uint32_t>(type_ids.getdef(type->const_of, 0));
+            out->write<uint32_t>(type_ids.getdef(type->atomic_of, 0));
+            out->write<uint32_t>(type_ids.getdef(type->unsigned_of, 0));
+            switch (type->kind) {
+                case TypeKind_Pointer:
+                    write_handle(type->pointer_info.base);
+                    break;
+                case TypeKind_Function:
+                    write_handle(type->function_info.return_type);
+                    out->write<uint64_t>(type->function_info.num_params);
+                    out->write<uint32_t>(array_ids.getdef(type->function_info.params, 0));
+                    break;
+                case TypeKind_Struct:
+                    out->write<uint64_t>(type->struct_info.num_fields);
+                    out->write<uint32_t>(array_ids.getdef(type->struct_info.fields, 0));
+                    break;
+                case TypeKind_Deferred:
+                    out->write<uint32_t>(string_id(type->defer_info.name));
+                    break;
+                case TypeKind_Parent:
+                    out->write<int32_t>(type->parent_info.offset);
+                    break;
+                default: break;
+            }
+        }
+        for (int i = 0; i <= TypeKind_Parent; i++) out->write<uint32_t>(type_ids.getdef(cache->primitives[i], 0));
+        out->write<uint64_t>(cache->defer_epoch);
+        out->write<uint64_t>(cache->frame_ids);
+    }
+    void write_variables() {
+        out->write<uint32_t>(variables.size);
+        for (int i = 0; i < variables.size; i++) {
+            Variable* var = variables.items[i];
+            Type* type = var->type;
+            out->write<uint32_t>(type_ids.getdef(type, 0));
+            out->write<bool>(var->is_ref());
+            bool address = var->is_ref() || type->kind == TypeKind_Pointer || type->kind == TypeKind_Struct || type->kind == TypeKind_Function || type->kind == TypeKind_Type;
+            if (address) write_ref(var->_value);
+            else write_ref(SnapshotRef{ SnapshotRef_Raw, 0, 0, (uint64_t)var->_value });
+        }
+        Map<char*, Variable*>* globals = context->variables->items[0];
+        out->write<uint32_t>(globals->size);
+        for (int i = 0; i < globals->size; i++) {
+            out->write<uint32_t>(string_id(globals->pairs[i].key));
+            out->write<uint32_t>(variable_ids.getdef(globals->pairs[i].value, 0));
+        }
+    }
+    void write_allocations() {
+        Set<Allocation*>* allocs = context->allocs->items[0];
+        out->write<uint32_t>(allocs->size);
+        for (int i = 0; i < allocs->size; i++) {
+            Allocation* allocation = allocs->items[i];
+            out->write<uint32_t>(type_ids.getdef(allocation->type, 0));
+            out->write<uint64_t>(allocation->size);
+            out->write<uint8_t>(allocation->cleanup == Allocation::function_cleanup ? 2 : allocation->cleanup == Allocation::struct_cleanup ? 1 : 0);
+            if (allocation->cleanup == Allocation::function_cleanup) {
+                Function* func = (Function*)allocation->data;
+                write_ref(func->site);
+                write_ref(func->entry);
+                out->write<uint64_t>(func->length);
+                out->write<uint32_t>(string_id(func->name));
+                out->write<uint32_t>(string_id(func->file));
+                out->write<uint8_t>(func->capture_mode);
+                out->write<int32_t>(func->num_captures);
+                write_ref(func->capture_names);
+                for (int j = 0; j < func->num_captures; j++) out->write<uint32_t>(variable_ids.getdef(func->captures[j], 0));
+                continue;
+            }
+            out->write((uint8_t*)allocation->data, allocation->size);
+            List<uint64_t> offsets;
+            each_address(allocation, [&](uint8_t* slot, Type* type) { offsets.add(slot - (uint8_t*)allocation->data); });
+            out->write<uint32_t>(offsets.size);
+            for (int j = 0; j < offsets.size; j++) {
+                out->write<uint64_t>(offsets.items[j]);
+                write_ref(Variable::read<void*>((uint8_t*)allocation->data + offsets.items[j]));
+            }
+        }
+    }
+
+    // the string table goes in front, the sections only get to know their strings while being written
+    ByteWriter* write() {
+        collect();
+        write_programs();
+        write_types();
+        write_variables();
+        write_allocations();
+        out->write(snapshot_magic, sizeof(snapshot_magic));
+        ByteWriter* image = new ByteWriter;
+        image->write(snapshot_magic, sizeof(snapshot_magic));
+        image->write<uint32_t>(strings.size);
+        for (int i = 0; i < strings.size; i++) {
+            uint32_t length = strlen(strings.items[i]);
+            image->write<uint32_t>(length);
+            image->write(strings.items[i], length + 1);
+        }
+        image->write(out->bytes, out->size);
+        return image;
+    }
+};
+
+// rebuilds a context from an image, every pointer is fixed up once everything it could point to exists
+struct SnapshotReader {
+    struct Fixup {
+        void* slot;
+        SnapshotRef ref;
+    };
+    Context* context;
+    ByteReader* in;
+    List<char*> strings;
+    List<Program*> programs;
+    List<Type*> types;
+    List<void*> arrays;
+    List<Variable*> variables;
+    List<Allocation*> allocations;
+    List<Fixup> fixups;
+    Context* parser = alloc->malloc<Context>(); // lexing and parsing only touch the code store
+
+    SnapshotReader(Context* context, ByteReader* in): context(context), in(in) {}
+    ~SnapshotReader() { alloc->free(parser); }
+
+    void corrupt() {
+        throw Error::runtime(context, "Corrupt snapshot");
+    }
+    template<typename T> T read() {
+        if (in->ptr + sizeof(T) > in->size) corrupt();
+        return in->read<T>();
+    }
+    char* string(uint32_t id) {
+        if (id > strings.size) corrupt();
+        return id ? strings.items[id - 1] : NULL;
+    }
+    // strings that outlive the image go into the context's own code store
+    char* name(uint32_t id) {
+        char* str = string(id);
+        return str ? intern(context->code, str) : NULL;
+    }
+    Type* type(uint32_t id) {
+        if (id > types.size) corrupt();
+        return id ? types.items[id - 1] : NULL;
+    }
+    Type::TypeHandle handle() {
+        Type* type = this->type(read<uint32_t>());
+        return Type::TypeHandle(type, this->type(read<uint32_t>()));
+    }
+    Variable* variable(uint32_t id) {
+        if (id > variables.size) corrupt();
+        return id ? &variables.items[id - 1]->retain() : NULL;
+    }
+    SnapshotRef ref() {
+        SnapshotRef ref;
+        ref.kind = (SnapshotRefKind)read<uint8_t>();
+        ref.index = read<uint32_t>();
+        ref.item = read<uint32_t>();
+        ref.offset = read<uint64_t>();
+        return ref;
+    }
+    void fixup(void* slot) {
+        fixups.add(Fixup{ slot, ref() });
+    }
+    // interned strings are looked up again, the program compiled them into its own store
+    char* intern(Program* program, const char* str) {
+        parser->code = program;
+        BindAllocator bind(program->allocator);
+        return append_string(parser, str);
+    }
+    void* resolve(SnapshotRef ref) {
+        switch (ref.kind) {
+            case SnapshotRef_Raw: return (void*)ref.offset;
+            case SnapshotRef_Null: return NULL;
+            case SnapshotRef_Type: return type(ref.index + 1);
+            case SnapshotRef_Function:
+                if (ref.index >= allocations.size || allocations.items[ref.index]->cleanup != Allocation::function_cleanup) corrupt();
+                return ((Function*)allocations.items[ref.index]->data)->code;
+            case SnapshotRef_Allocation:
+                if (ref.index >= allocations.size || ref.offset > allocations.items[ref.index]->size) corrupt();
+                return (uint8_t*)allocations.items[ref.index]->data + ref.offset;
+            case SnapshotRef_Bytecode: {
+                if (ref.index >= programs.size || ref.item >= programs.items[ref.index]->units->size) corrupt();
+                ByteReader* reader = programs.items[ref.index]->units->items[ref.item].reader;
+                if (ref.offset > reader->size) corrupt();
+                return reader->bytes + ref.offset;
+            }
+            case SnapshotRef_String: {
+                if (ref.index >= programs.size) corrupt();
+                char* str = intern(programs.items[ref.index], string(ref.item + 1));
+                if (ref.offset > strlen(str)) corrupt();
+                return str + ref.offset;
+            }
+            case SnapshotRef_Symbol: {
+                void* symbol = dlsym(NULL, string(ref.item + 1));
+                if (!symbol) throw Error::runtime(context, String::new_format("Cannot find symbol '%s'", string(ref.item + 1)));
+                return (uint8_t*)symbol + ref.offset;
+            }
+        }
+        corrupt();
+        return NULL;
+    }
+
+    void read_strings() {
+        if (in->size < sizeof(snapshot_magic) || memcmp(in->bytes, snapshot_magic, sizeof(snapshot_magic)) != 0) corrupt();
+        if (memcmp(in->bytes + in->size - sizeof(snapshot_magic), snapshot_magic, sizeof(snapshot_magic)) != 0) corrupt();
+        in->skip(sizeof(snapshot_magic));
+        in->size -= sizeof(snapshot_magic);
+        uint32_t count = read<uint32_t>();
+        for (uint32_t i = 0; i < count; i++) {
+            uint32_t length = read<uint32_t>();
+            if (in->ptr + length + 1 > in->size || in->bytes[in->ptr + length] != 0) corrupt();
+            strings.add((char*)in->bytes + in->ptr);
+            in->skip(length + 1);
+        }
+    }
+    void read_programs() {
+        uint32_t count = read<uint32_t>();
+        for (uint32_t i = 0; i < count; i++) {
+            bool has_entry = read<bool>();
+            uint32_t units = read<uint32_t>();
+            Program* program = i == 0 ? context->code : context->programs->add(Program::create());
+            parser->code = program;
+            for (uint32_t j = 0; j < units; j++) {
+                char* file = string(read<uint32_t>());
+                char* source = string(read<uint32_t>());
+                if (!file || !source) corrupt();
+                try {
+                    compile_unit(parser, source, file);
+                } catch (Error*) { // lives in the program's allocator
+                    corrupt();
+                }
+            }
+            if (has_entry && units > 0) program->entry = program->units->items[0].reader;
+            programs.add(program);
+        }
+    }
+    void read_types() {
+        uint32_t num_types = read<uint32_t>();
+        uint32_t num_arrays = read<uint32_t>();
+        for (uint32_t i = 0; i < num_types; i++) types.add(alloc->malloc<Type>());
+        List<size_t> sizes;
+        for (uint32_t i = 0; i < num_arrays; i++) {
+            bool is_struct = read<bool>();
+            size_t count = read<uint64_t>();
+            if (count > in->size) corrupt();
+            sizes.add(count);
+            if (is_struct) {
+                Type::Field* fields = alloc->malloc<Type::Field>(count);
+                arrays.add(fields);
+                for (size_t j = 0; j < count; j++) {
+                    fields[j].type = handle();
+                    fields[j].name = name(read<uint32_t>());
+                    fields[j].offset = read<uint64_t>();
+                    fields[j].inline_size = read<int64_t>();
+                    fixup(&fields[j].value);
+                }
+            } else {
+                Type::Param* params = alloc->malloc<Type::Param>(count);
+                arrays.add(params);
+                for (size_t j = 0; j < count; j++) {
+                    params[j].type = handle();
+                    params[j].name = name(read<uint32_t>());
+                }
+            }
+        }
+        auto array = [&](size_t count) -> void* {
+            uint32_t id = read<uint32_t>();
+            if (id > arrays.size || (id && sizes.items[id - 1] != count) || (!id && count)) corrupt();
+            return id ? arrays.items[id - 1] : NULL;
+        };
+        for (uint32_t i = 0; i < num_types; i++) {
+            Type* type = types.items[i];
+            type->kind = (TypeKind)read<uint8_t>();
+            uint8_t flags = read<uint8_t>();
+            type->is_const = flags & 1;
+            type->is_unsigned = flags & 2;
+            type->lvalue_return = flags & 4;
+            type->has_defers = flags & 8;
+            type->validated = flags & 16;
+            type->is_atomic = flags & 32;
+            type->size = read<int32_t>();
+            type->alignment = read<int32_t>();
+            type->parent = this->type(read<uint32_t>());
+            type->pointer_to = this->type(read<uint32_t>());
+            type->const_of = this->type(read<uint32_t>());
+            type->atomic_of = this->type(read<uint32_t>());
+            type->unsigned_of = this->type(read<uint32_t>());
+            switch (type->kind) {
+                case TypeKind_Pointer:
+                    type->pointer_info.base = handle();
+                    break;
+                case TypeKind_Function:
+                    type->function_info.return_type = handle();
+                    type->function_info.num_params = read<uint64_t>();
+                    type->function_info.params = (Type::Param*)array(type->function_info.num_params);
+                    break;
+                case TypeKind_Struct:
+                    type->struct_info.num_fields = read<uint64_t>();
+                    type->struct_info.fields = (Type::Field*)array(type->struct_info.num_fields);
+                    break;
+                case TypeKind_Deferred:
+                    type->defer_info.name = name(read<uint32_t>());
+                    break;
+                case TypeKind_Parent:
+                    type->parent_info.offset = read<int32_t>();
+                    break;
+                default:
+                    if (type->kind > TypeKind_Parent) corrupt();
+                    break;
+            }
+        }
+        TypeCache* cache = context->type_cache;
+        for (int i = 0; i <= TypeKind_Parent; i++) cache->primitives[i] = type(read<uint32_t>());
+        cache->defer_epoch = read<uint64_t>();
+        cache->frame_ids = read<uint64_t>();
+    }
+    void read_variables() {
+        uint32_t count = read<uint32_t>();
+        for (uint32_t i = 0; i < count; i++) {
+            Type* type = this->type(read<uint32_t>());
+            if (!type) corrupt();
+            Variable* var = variables.add(Variable::allocate(Variable(type)));
+            if (read<bool>()) var->type.bits |= 1;
+            fixup(&var->_value);
+        }
+        uint32_t globals = read<uint32_t>();
+        for (uint32_t i = 0; i < globals; i++) {
+            char* name = this->name(read<uint32_t>());
+            Variable* var = variable(read<uint32_t>());
+            if (!name || !var) corrupt();
+            context->variables->items[0]->add(name, var);
+        }
+    }
+    void read_allocations() {
+        uint32_t count = read<uint32_t>();
+        for (uint32_t i = 0; i < count; i++) {
+            Type* type = this->type(read<uint32_t>());
+            size_t size = read<uint64_t>();
+            uint8_t cleanup = read<uint8_t>();
+            if (!type || cleanup > 2 || size > in->size || (cleanup == 2 && (size != sizeof(Function) || type->kind != TypeKind_Function))) corrupt();
+            Allocation* allocation = allocations.add(new Allocation(size, context, type, cleanup == 2 ? Allocation::function_cleanup : cleanup == 1 ? Allocation::struct_cleanup : NULL));
+            if (cleanup == 2) {
+                Function* func = (Function*)allocation->data;
+                fixup(&func->site);
+                SnapshotRef entry = ref();
+                fixups.add(Fixup{ &func->entry, entry });
+                func->shared = entry.index != 0; // anything but the context's own code
+                func->length = read<uint64_t>();
+                func->name = name(read<uint32_t>());
+                func->file = name(read<uint32_t>());
+                func->capture_mode = (CaptureMode)read<uint8_t>();
+                func->num_captures = read<int32_t>();
+                if (func->num_captures < 0 || func->num_captures > in->size) corrupt();
+                fixup(&func->capture_names);
+                func->captures = alloc->malloc<Variable*>(func->num_captures);
+                for (int j = 0; j < func->num_captures; j++) func->captures[j] = variable(read<uint32_t>());
+                func->code = context->code_arena->trampoline(func, generate_thunk(context, type));
+                if (!func->code) throw Error::runtime(context, "Cannot allocate executable memory");
+                continue;
+            }
+            if (in->ptr + size > in->size) corrupt();
+            memcpy(allocation->data, in->bytes + in->ptr, size);
+            in->skip(size);
+            uint32_t slots = read<uint32_t>();
+            for (uint32_t j = 0; j < slots; j++) {
+                uint64_t offset = read<uint64_t>();
+                if (offset + sizeof(void*) > size) corrupt();
+                fixup((uint8_t*)allocation->data + offset);
+            }
+        }
+    }
+
+    void read() {
+        read_strings();
+        read_programs();
+        read_types();
+        read_variables();
+        read_allocations();
+        if (in->ptr != in->size) corrupt();
+        for (int i = 0; i < fixups.size; i++) Variable::write<void*>(fixups.items[i].slot, resolve(fixups.items[i].ref));
+        for (int i = 0; i < allocations.size; i++) {
+            Allocation* allocation = allocations.items[i];
+            if (allocation->cleanup != Allocation::function_cleanup) continue;
+            Function* func = (Function*)allocation->data;
+            if (func->capture_mode == CaptureMode_None) context->function_cache->add(func->site, func);
+        }
+        for (int i = 0; i < types.size; i++) {
+            context->type_cache->hash_type(types.items[i]);
+            context->type_cache->add(types.items[i], types.items[i]);
+        }
+        for (int i = 0; i < allocations.size; i++) context->allocs->items[0]->add(allocations.items[i]);
+    }
+};
+
 // == INTERPRETER API ==
 
 API Context* pawscript_create_context() {
-    static bool did_atexit = false;
-    if (!did_atexit) {
-        did_atexit = true;
-        //atexit([]() { delete alloc; });
-#ifdef _WIN32
-        SetUnhandledExceptionFilter(handle_segfault);
-#else
-        struct sigaction signal_handler;
-        signal_handler.sa_handler = (typeof(signal_handler.sa_handler))handle_segfault;
-        sigemptyset(&signal_handler.sa_mask);
-        signal_handler.sa_flags = SA_SIGINFO;
-        sigaction(SIGSEGV, &signal_handler, NULL);
-#endif
-    }
-    Context* context = alloc->malloc<Context>();
-    context->strings = new Set<char*>(compare_int64);
-    context->bytecodes = new Set<ByteReader*>(compare_int64);
-    context->type_cache = new TypeCache;
-    context->function_cache = new Map<void*, Function*>(compare_int64);
-    context->call_stack = new Stack<Scope*>;
-    context->variables = new Stack<Map<char*, Variable*>*>;
-    context->allocs = new Stack<Set<Allocation*>*>;
-    context->push_stack_frame("<global>");
+    Allocator* allocator = new Allocator;
+    BindAllocator bind(allocator);
+    Context* context = new_context(allocator);
     context->store("@RESULT@", Variable(context->type_cache->primitive(TypeKind_Void)));
     return context;
 }
 
 API void pawscript_destroy_context(Context *context) {
+    wait_for_tasks(context);
+    Allocator* allocator = context->allocator;
+    BindAllocator bind(allocator);
     context->call_stack->peek()->file = (char*)"<context destroy>";
     while (context->call_stack->size > 0) context->pop_stack_frame();
-    for (int i = 0; i < context->strings->size; i++) alloc->free(context->strings->items[i]);
-    for (int i = 0; i < context->bytecodes->size; i++) delete context->bytecodes->items[i];
-    delete context->strings;
-    delete context->bytecodes;
+    context->code->release();
+    for (int i = 0; i < context->programs->size; i++) context->programs->items[i]->release();
+    delete context->programs;
     delete context->type_cache;
     delete context->function_cache;
+    delete context->thunk_cache;
+    delete context->shared_sites;
+    delete context->code_arena;
     delete context->call_stack;
     delete context->variables;
     delete context->allocs;
     alloc->free(context);
+    delete allocator; // also releases whatever the script leaked
+}
+
+API Context* pawscript_clone_context(Context* src) {
+    if (src->call_stack->size != 1 || holds_handles(src)) return NULL; // only between runs
+    Allocator* allocator = new Allocator;
+    BindAllocator bind(allocator);
+    Context* dst = new_context(allocator);
+    Error* error = NULL;
+    {
+        ContextCloner cloner(src, dst);
+        try {
+            cloner.clone();
+        } catch (Error* err) {
+            error = err;
+        }
+    }
+    if (error) {
+        pawscript_destroy_error(error);
+        pawscript_destroy_context(dst);
+        return NULL;
+    }
+    dst->code_arena->seal();
+    return dst;
+}
+
+API Error* pawscript_save_context(Context* context, const char* filename) {
+    BindAllocator bind(context->allocator);
+    if (context->call_stack->size != 1) return Error::runtime(context, "Cannot save a context in the middle of a run");
+    if (holds_handles(context)) return Error::runtime(context, "Cannot save a context holding tasks, channels or generators");
+    SnapshotWriter writer(context);
+    ByteWriter* image = writer.write();
+    FILE* f = fopen(filename, "wb");
+    bool written = f && fwrite(image->bytes, 1, image->size, f) == image->size;
+    Error* error = written ? NULL : Error::syntax(filename, 1, 1, String::new_format("Cannot write '%s': %s", filename, strerror(errno)));
+    if (f) fclose(f);
+    delete image;
+    return error;
+}
+
+API Error* pawscript_load_context(const char* filename, Context** out) {
+    *out = NULL;
+    Allocator* allocator = new Allocator;
+    BindAllocator bind(allocator);
+    size_t size;
+    char* data = read_file(filename, &size, "rb");
+    if (!data) {
+        Error* error = orphan_error(filename, 1, 1, String::new_format("Cannot open '%s' for reading: %s", filename, strerror(errno)).data);
+        delete allocator;
+        return error;
+    }
+    Context* context = new_context(allocator);
+    Error* error = NULL;
+    {
+        ByteReader in((uint8_t*)data, size);
+        SnapshotReader reader(context, &in);
+        try {
+            reader.read();
+        } catch (Error* err) {
+            error = orphan_error(filename, 1, 1, err->message());
+            pawscript_destroy_error(err);
+        }
+    }
+    alloc->free(data);
+    if (error) {
+        pawscript_destroy_context(context);
+        return error;
+    }
+    context->code_arena->seal();
+    *out = context;
+    return NULL;
+}
+
+API Error* pawscript_emit_c(Context* context, const char* filename) {
+    BindAllocator bind(context->allocator);
+    Map<char*, Variable*>* globals = context->variables->items[0];
+    String functions, exports, skipped;
+    for (int i = 0; i < globals->size; i++) {
+        char* name = globals->pairs[i].key;
+        Variable* var = globals->pairs[i].value;
+        Function* func = var->type->kind == TypeKind_Function ? Function::from(context->code_arena, var->as<void*>()) : NULL;
+        if (!func || strcmp(name, "@RESULT@") == 0) continue;
+        Variable state_var = context->state_var; // raising an error resets it
+        JitBuilder builder(context, func, var->type, true, true);
+        try {
+            JitNode* body = builder.build();
+            uint64_t key = builder.key(body, true); // before the emitter numbers the assignments
+            JitEmitter emitter(&builder);
+            emitter.emit(body);
+            // the length keeps the names apart from each other and from the helpers in pawscript_runtime.h
+            functions.format("static uint64_t paws_fn_%d_%s(void* context, uint64_t* args, void** links) {\n%s}\n\n", (int)strlen(name), name, emitter.code);
+            exports.format("    { \"%s\", UINT64_C(0x%016llx), paws_fn_%d_%s },\n", name, (unsigned long long)key, (int)strlen(name), name);
+        }
+        catch (Error* error) { // stays interpreted
+            skipped.format(" * %s: %s\n", name, error->message());
+            pawscript_destroy_error(error);
+        }
+        context->state_var = state_var;
+    }
+    FILE* f = fopen(filename, "w");
+    if (!f) return Error::syntax(filename, 1, 1, String::new_format("Cannot write '%s': %s", filename, strerror(errno)));
+    fprintf(f, "// generated by paws --emit-c, build it with pawscript_runtime.h next to it:\n");
+    fprintf(f, "//     cc -O2 -shared -fPIC %s -o <library>\n", filename);
+    fprintf(f, "// and load it with paws --native <library> or pawscript_load_native() after the script ran\n\n");
+    fprintf(f, "#include \"pawscript_runtime.h\"\n\n");
+    if (skipped.length) fprintf(f, "/* left to the interpreter:\n%s */\n\n", skipped.data);
+    fprintf(f, "%sPAWS_EXPORT const PawsExport paws_exports[] = {\n%s    { 0, 0, 0 },\n};\n", functions.data, exports.data);
+    bool written = !ferror(f);
+    written = fclose(f) == 0 && written;
+    return written ? NULL : Error::syntax(filename, 1, 1, String::new_format("Cannot write '%s': %s", filename, strerror(errno)));
+}
+
+// the library stays loaded, the functions keep calling into it
+API Error* pawscript_load_native(Context* context, const char* filename) {
+    BindAllocator bind(context->allocator);
+    void* library = dlopen(filename, RTLD_NOW | RTLD_LOCAL);
+    if (!library) return Error::syntax(filename, 1, 1, String::new_format("Cannot load '%s': %s", filename, dlerror()));
+    JitExport* exports = (JitExport*)dlsym(library, "paws_exports");
+    if (!exports) return Error::syntax(filename, 1, 1, String::new_format("'%s' wasn't built from paws --emit-c", filename));
+    Map<char*, Variable*>* globals = context->variables->items[0];
+    for (JitExport* entry = exports; entry->name; entry++) {
+        Variable* var = globals->getdef((char*)entry->name, NULL);
+        Function* func = var && var->type->kind == TypeKind_Function ? Function::from(context->code_arena, var->as<void*>()) : NULL;
+        if (func) jit_native(context, func, var->type, entry); // one that changed since stays as it is
+    }
+    return NULL;
+}
+
+static bool same_frame(ErrorFrame* a, ErrorFrame* b) {
+    if (a->row != b->row || a->col != b->col) return false;
+    if (a->name != b->name && (!a->name || !b->name || strcmp(a->name, b->name) != 0)) return false;
+    return a->file == b->file || (a->file && b->file && strcmp(a->file, b->file) == 0);
 }
 
 API void pawscript_log_error(Error* error, FILE* f) {
-    ErrorScope* scope = error->scope;
-    fprintf(f, "Error: %s\n", error->msg);
-    while (scope) {
-        ErrorScope* parent = scope->parent;
-        fprintf(f, "  in %s at %s (%d:%d)\n", scope->name, scope->file, scope->row, scope->col);
-        alloc->free(scope);
-        scope = parent;
+    BindAllocator bind(error->allocator);
+    fprintf(f, "Error: %s\n", error->message());
+    for (int i = 0; i < error->num_frames; i++) {
+        ErrorFrame* frame = &error->frames[i];
+        fprintf(f, "  in %s at %s (%d:%d)\n", frame->name, frame->file, frame->row, frame->col);
+        int repeats = 0; // deep recursion would otherwise print one line per call
+        while (i + 1 < error->num_frames && same_frame(frame, &error->frames[i + 1])) {
+            repeats++;
+            i++;
+        }
+        if (repeats) fprintf(f, "  ... %d more time%s\n", repeats, repeats == 1 ? "" : "s");
     }
-    alloc->free(error);
+    pawscript_destroy_error(error);
 }
 
 API void pawscript_destroy_error(Error* error) {
-    ErrorScope* scope = error->scope;
-    while (scope) {
-        ErrorScope* parent = scope->parent;
-        alloc->free(scope);
-        scope = parent;
-    }
+    Allocator* allocator = error->owns_allocator ? error->allocator : NULL;
+    BindAllocator bind(error->allocator);
+    alloc->free(error->msg);
     alloc->free(error);
+    delete allocator;
 }
 
 API Error* pawscript_run(Context* context, const char* code) {
+    BindAllocator bind(context->allocator);
     Error* error;
     in_code = true;
     if (setjmp(segfault_jump_buffer) == 0) error = execute(context, code, "<memory>");
     else error = segfault_handler(context);
     context->pop_until(0);
+    {
+        ForkLock lock; // tasks can still be running
+        context->code_arena->seal();
+    }
     in_code = false;
     return error;
 }
 
 API Error* pawscript_run_file(Context* context, const char* filename) {
+    BindAllocator bind(context->allocator);
     Error* error;
     in_code = true;
     if (setjmp(segfault_jump_buffer) == 0) error = execute_file(context, filename);
     else error = segfault_handler(context);
     context->pop_until(0);
+    {
+        ForkLock lock; // tasks can still be running
+        context->code_arena->seal();
+    }
+    in_code = false;
+    return error;
+}
+
+API Error* pawscript_compile(const char* code, Program** program) {
+    return compile_program(code, "<memory>", program);
+}
+
+API Error* pawscript_compile_file(const char* filename, Program** program) {
+    Allocator scratch;
+    BindAllocator bind(&scratch);
+    char* data = read_file(filename);
+    if (!data) {
+        *program = NULL;
+        return orphan_error(filename, 1, 1, String::new_format("Cannot open '%s' for reading: %s", filename, strerror(errno)).data);
+    }
+    Error* error = compile_program(data, filename, program);
+    alloc->free(data);
+    return error;
+}
+
+// the first context to run a program leaves the types it made there, copied into the program's allocator
+static void share_types(Context* context, Program* program) {
+    if (context->type_cache->shared || __atomic_load_n(&program->types, __ATOMIC_ACQUIRE)) return;
+    ForkLock lock; // tasks can still be registering types
+    spin_lock(&program->lock);
+    if (!program->types) {
+        BindAllocator bind(program->allocator);
+        __atomic_store_n(&program->types, context->type_cache->seal(context), __ATOMIC_RELEASE);
+    }
+    spin_unlock(&program->lock);
+}
+
+API Error* pawscript_run_program(Context* context, Program* program) {
+    BindAllocator bind(context->allocator);
+    if (context->programs->indexof(program) == -1) context->programs->add(program->retain());
+    TypeCache* types = context->type_cache;
+    if (!types->shared) types->shared = __atomic_load_n(&program->types, __ATOMIC_ACQUIRE);
+    ByteReader reader(program->entry->bytes, program->entry->size);
+    reader.shared = true;
+    Error* error;
+    in_code = true;
+    if (setjmp(segfault_jump_buffer) == 0) error = execute(context, &reader);
+    else error = segfault_handler(context);
+    context->pop_until(0);
+    {
+        ForkLock lock; // tasks can still be running
+        context->code_arena->seal();
+    }
+    if (!error) share_types(context, program);
     in_code = false;
     return error;
 }
 
+API void pawscript_destroy_program(Program* program) {
+    program->release();
+}
+
+static Error* resume_from_host(Context* context, void* generator, void* value, bool* done) {
+    try {
+        Variable handle(context->type_cache->primitive(TypeKind_Void)->pointer(context));
+        handle.as<void*>() = generator;
+        Variable var;
+        *done = !next_generator_value(context, handle, &var);
+        if (!*done) memcpy(value, var.ptr(), var.type->value_size());
+        return NULL;
+    }
+    catch (Error* error) {
+        *done = true;
+        return error;
+    }
+}
+
+// native code can be running a script already, which carries on as it was once this returns
+API Error* pawscript_resume(Context* context, void* generator, void* value, bool* done) {
+    BindAllocator bind(context->allocator);
+    jmp_buf outer;
+    memcpy(outer, segfault_jump_buffer, sizeof(jmp_buf));
+    bool was_in_code = in_code;
+    Error* error;
+    in_code = true;
+    if (setjmp(segfault_jump_buffer) == 0) error = resume_from_host(context, generator, value, done);
+    else {
+        error = segfault_handler(context);
+        *done = true;
+    }
+    in_code = was_in_code;
+    memcpy(segfault_jump_buffer, outer, sizeof(jmp_buf));
+    return error;
+}
+
+API bool pawscript_yield(const void* value) {
+    Generator* gen = running_generator;
+    if (!gen || running_fork != gen->fork || fork_lock_depth) return false;
+    gen->value = 0;
+    memcpy(&gen->value, value, gen->type->value_size());
+    gen->has_value = true;
+    suspend_generator(gen);
+    return true;
+}
+
 API bool pawscript_print_variable(Context* context, FILE* f, const char* name) {
+    BindAllocator bind(context->allocator);
     Variable var = context->load(name);
     if (!var.type) return false;
     fprintf(f, "%s\n", var.to_string().data);
@@ -4216,6 +11405,7 @@ API bool pawscript_print_variable(Context* context, FILE* f, const char* name) {
 }
 
 API bool pawscript_print_type(Context* context, FILE* f, const char* name) {
+    BindAllocator bind(context->allocator);
     Variable var = context->load(name);
     if (!var.type) return false;
     fprintf(f, "%s\n", var.type->to_string().data);
@@ -4223,12 +11413,14 @@ API bool pawscript_print_type(Context* context, FILE* f, const char* name) {
 }
 
 API Type* pawscript_typeof(Context* context, const char* name) {
+    BindAllocator bind(context->allocator);
     Variable var = context->load(name);
     if (!var.type) return NULL;
     return var.type;
 }
 
 API bool pawscript_get(Context* context, const char* name, void* data) {
+    BindAllocator bind(context->allocator);
     Variable var = context->load(name);
     if (!var.type) return false;
     memcpy(data, var.ptr(), var.type->value_size());
@@ -4236,6 +11428,7 @@ API bool pawscript_get(Context* context, const char* name, void* data) {
 }
 
 API bool pawscript_set(Context* context, const char* name, void* data) {
+    BindAllocator bind(context->allocator);
     Variable var = context->load(name);
     if (!var.type) return false;
     if (var.type->kind == TypeKind_Function) var.as<void*>() = data;
@@ -0,0 +1,108 @@
+#ifndef PAWSCRIPT_RUNTIME_H
+#define PAWSCRIPT_RUNTIME_H
+
+// What the C from paws --emit-c is compiled against. Values are passed around the way compiled code holds them:
+// integers and pointers as their 64 bit canonical value, floats as float/double. Everything the engine provides
+// comes in through the links the library is loaded with
+
+#include <stdint.h>
+#include <string.h>
+
+#ifdef _WIN32
+#define PAWS_EXPORT __declspec(dllexport)
+#else
+#define PAWS_EXPORT __attribute__((visibility("default")))
+#endif
+
+// links[0..PAWS_ERROR_OFFSET), the engine's helpers in the order it keeps them
+enum {
+    PAWS_CALL,
+    PAWS_MISSING_RETURN,
+    PAWS_F32_TO_U64,
+    PAWS_F64_TO_U64,
+    PAWS_POW_INT,
+    PAWS_POWF,
+    PAWS_POW,
+    PAWS_FMODF,
+    PAWS_FMOD,
+    PAWS_MISALIGNED_ATOMIC,
+    PAWS_UNSET_STRUCT,
+    PAWS_REPLACED_NATIVE,
+    PAWS_ERROR_OFFSET, // where the pending error is in the context
+    PAWS_LINKS,        // the call sites, the addresses of the globals, the string literals and the C function
+                       // each call site calls directly follow
+};
+
+typedef uint64_t (*PawsFunction)(void* context, uint64_t* args, void** links);
+
+typedef struct PawsExport {
+    const char* name; // the global holding the function
+    uint64_t key;     // what the engine compares against the function it finds there
+    PawsFunction function;
+} PawsExport;
+
+// a local, compiled code keeps each in an 8 byte slot
+typedef union PawsSlot {
+    int8_t s8;
+    uint8_t u8;
+    int16_t s16;
+    uint16_t u16;
+    int32_t s32;
+    uint32_t u32;
+    uint64_t u64;
+    float f32;
+    double f64;
+} PawsSlot;
+
+static inline uint64_t paws_call(void* context, void** links, int site, uint64_t code, uint64_t* args) {
+    return ((uint64_t (*)(void*, void*, void*, uint64_t*))links[PAWS_CALL])(context, links[site], (void*)code, args);
+}
+static inline int paws_failed(void* context, void** links) {
+    void* error;
+    memcpy(&error, (char*)context + (uintptr_t)links[PAWS_ERROR_OFFSET], sizeof(error));
+    return error != 0;
+}
+static inline void paws_missing_return(void* context, void** links) {
+    ((void (*)(void*))links[PAWS_MISSING_RETURN])(context);
+}
+static inline void paws_misaligned_atomic(void* context, void** links) {
+    ((void (*)(void*))links[PAWS_MISALIGNED_ATOMIC])(context);
+}
+static inline void paws_unset_struct(void* context, void** links) {
+    ((void (*)(void*))links[PAWS_UNSET_STRUCT])(context);
+}
+static inline void paws_replaced_native(void* context, void** links) {
+    ((void (*)(void*))links[PAWS_REPLACED_NATIVE])(context);
+}
+static inline uint64_t paws_f32_to_u64(void** links, float a) { return ((uint64_t (*)(float))links[PAWS_F32_TO_U64])(a); }
+static inline uint64_t paws_f64_to_u64(void** links, double a) { return ((uint64_t (*)(double))links[PAWS_F64_TO_U64])(a); }
+static inline uint64_t paws_pow_int(void** links, uint64_t a, uint64_t b) { return ((uint64_t (*)(uint64_t, uint64_t))links[PAWS_POW_INT])(a, b); }
+static inline float paws_powf(void** links, float a, float b) { return ((float (*)(float, float))links[PAWS_POWF])(a, b); }
+static inline double paws_pow(void** links, double a, double b) { return ((double (*)(double, double))links[PAWS_POW])(a, b); }
+static inline float paws_fmodf(void** links, float a, float b) { return ((float (*)(float, float))links[PAWS_FMODF])(a, b); }
+static inline double paws_fmod(void** links, double a, double b) { return ((double (*)(double, double))links[PAWS_FMOD])(a, b); }
+
+// bit patterns
+static inline float paws_f32(uint64_t bits) { uint32_t low = (uint32_t)bits; float value; memcpy(&value, &low, 4); return value; }
+static inline double paws_f64(uint64_t bits) { double value; memcpy(&value, &bits, 8); return value; }
+static inline uint64_t paws_bits32(float value) { uint32_t bits; memcpy(&bits, &value, 4); return bits; }
+static inline uint64_t paws_bits64(double value) { uint64_t bits; memcpy(&bits, &value, 8); return bits; }
+
+// memory behind a pointer the script computed, which may alias anything
+#define PAWS_MEMORY(name, type, load) \
+    static inline uint64_t paws_load_##name(uint64_t address) { type value; memcpy(&value, (void*)(uintptr_t)address, sizeof(value)); return load; } \
+    static inline void paws_store_##name(uint64_t address, uint64_t value) { type bits = (type)value; memcpy((void*)(uintptr_t)address, &bits, sizeof(bits)); }
+PAWS_MEMORY(s8, int8_t, (uint64_t)(int64_t)value)
+PAWS_MEMORY(u8, uint8_t, value)
+PAWS_MEMORY(s16, int16_t, (uint64_t)(int64_t)value)
+PAWS_MEMORY(u16, uint16_t, value)
+PAWS_MEMORY(s32, int32_t, (uint64_t)(int64_t)value)
+PAWS_MEMORY(u32, uint32_t, value)
+PAWS_MEMORY(u64, uint64_t, value)
+#undef PAWS_MEMORY
+static inline float paws_load_f32(uint64_t address) { float value; memcpy(&value, (void*)(uintptr_t)address, 4); return value; }
+static inline double paws_load_f64(uint64_t address) { double value; memcpy(&value, (void*)(uintptr_t)address, 8); return value; }
+static inline void paws_store_f32(uint64_t address, float value) { memcpy((void*)(uintptr_t)address, &value, 4); }
+static inline void paws_store_f64(uint64_t address, double value) { memcpy((void*)(uintptr_t)address, &value, 8); }
+
+#endif
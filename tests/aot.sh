@@ -0,0 +1,14 @@
+# translates the functions of a script into C, builds a library from it and runs the script again with the library
+# loaded, it has to print the same as when it's interpreted. some of the names are those of helpers in
+# pawscript_runtime.h or of what they'd be mangled to
+paws=$1
+dir=$(mktemp -d)
+root=$(cd .. && pwd)
+cd lib
+PAWSCRIPT_JIT=0 "$paws" -f aot_defs.paw -f aot_main.paw > "$dir/interpreted.txt"
+"$paws" -f aot_defs.paw --emit-c "$dir/aot.c" > /dev/null
+grep -c '^static uint64_t paws_fn_' "$dir/aot.c"
+${CC:-clang} -O2 -Wall -Wextra -Werror -shared -fPIC -I"$root" "$dir/aot.c" -o "$dir/aot.so"
+"$paws" -f aot_defs.paw --native "$dir/aot.so" -f aot_main.paw > "$dir/native.txt"
+diff "$dir/interpreted.txt" "$dir/native.txt" && cat "$dir/native.txt"
+rm -rf "$dir"
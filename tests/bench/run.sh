@@ -0,0 +1,27 @@
+#!/bin/bash
+# times every script in this directory, best of 3 runs, with each build of paws given side by side
+# usage: tests/bench/run.sh [paws...], e.g. a build of the commit before a change and one of the change itself
+
+cd "$(dirname "$0")"
+builds=()
+for paws in "${@:-../../paws}"; do
+    [[ $paws == /* ]] || paws=$OLDPWD/$paws
+    builds+=("$paws")
+done
+
+TIMEFORMAT=%3R
+printf "%-10s" ""
+for paws in "${builds[@]}"; do printf " %10s" "$(basename "$(dirname "$paws")")"; done
+echo
+for script in *.paw; do
+    printf "%-10s" "${script%.paw}"
+    for paws in "${builds[@]}"; do
+        best=
+        for run in 1 2 3; do
+            time=$( { time LD_LIBRARY_PATH="$(dirname "$paws")" "$paws" -f "$script" > /dev/null 2>&1; } 2>&1 )
+            if [[ -z $best ]] || (( 10#${time/./} < 10#${best/./} )); then best=$time; fi
+        done
+        printf " %9ss" "$best"
+    done
+    echo
+done
@@ -0,0 +1,20 @@
+# a parallel for runs its iterations on their own, so 'break' and 'return' are rejected when the script is parsed.
+# a loop inside one can still be left, and a function defined inside one can still return
+paws=$1
+run() {
+    printf '%s\n' "$1" | "$paws" -f - 2>&1
+}
+run 'parallel for s32 i: 0 => 4 { if i == 2 => break; }'
+run 's32<-() f { parallel for s32 i: 0 => 4 { return i; } return 0; }'
+run 'parallel for s32 i: 0 => 4 { parallel for s32 j: 0 => 4 { break; } }'
+run 'extern s32<-(const s8#, ...) printf;
+atomic s32 total = 0;
+parallel for s32 i: 0 => 4 {
+    for s32 j: 0 => 10 { if j == i => break; fetch_add(total, 1); }
+    s32 k = 0;
+    while true { k++; if k > i => break; }
+    if i == 3 => continue;
+    s32<-() f { return 1; }
+    fetch_add(total, f() + k);
+}
+printf("%d\n", load(total));'
@@ -0,0 +1,17 @@
+# compiles functions into a cache directory in one process and runs them from it in the next. a file that changed
+# on disk is compiled again rather than run, here its last instruction becomes an int3
+paws=$1
+cache=$(mktemp -d)
+export PAWSCRIPT_JIT=1 PAWSCRIPT_JIT_CACHE="$cache"
+cd lib
+"$paws" -f cache.paw
+ls "$cache" | grep -c '\.jit$'
+"$paws" -f cache.paw
+for file in "$cache"/*.jit; do
+    size=$(wc -c < "$file")
+    printf '\314' | dd of="$file" bs=1 seek=$((size - 1)) conv=notrunc 2> /dev/null
+done
+"$paws" -f cache.paw
+"$paws" -f cache.paw
+ls "$cache" | grep -c '\.tmp$'
+rm -rf "$cache"
@@ -0,0 +1,115 @@
+// clones a context that ran a prelude, checks the clones share nothing with it, then clones it on several threads at once
+// usage: clone [threads] [rounds]
+
+#include "pawscript.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+static const char* prelude =
+    "extern void<-(void#, u64, u64, s32<-(const void#, const void#)) qsort;\n"
+    "type P = struct { s32 x; s32 y; s32<-() sum { return this.x + this.y; }; };\n"
+    "type Node = struct { s32 val; defer(Node) next; };\n"
+    "type Box = struct { s32 pad; inline P in; Node link; };\n"
+    "s32 total = 0;\n"
+    "s32 counter = 5;\n"
+    "s32<-() bump = new[s32<-()] => [$] { counter += 1; return counter; };\n"
+    "s32<-(s32 v) twice = new[s32<-(s32 v)] => [$] { return v * 2; };\n"
+    "P gp = new[P]{ .x = 3, .y = 4 };\n"
+    "Node n2 = new[Node]{ .val = 20 };\n"
+    "Node n1 = new[Node]{ .val = 10, .next = n2 };\n"
+    "type T = s32;\n"
+    "T t = 7;\n"
+    "Box gb = new[Box]{ .pad = 1, .link = n1 };\n"
+    "gb.in.x = 40;\n"
+    "s32<-(const void# a, const void# b) cmp = new[s32<-(const void# a, const void# b)] => [$] { return #(a -> const s32#) - #(b -> const s32#); };\n"
+    "s32# nums = new[s32](4) { 4, 2, 3, 1 };\n"
+    "for s32 i: 0 => 300 { s32<-() f = new[s32<-()] => [~] { return i; }; total += f(); }\n";
+
+static const char* body =
+    "qsort(nums, 4, 4, cmp);\n"
+    "total = gp.sum() + n1.next.val + n1.val + twice(bump()) + t + nums[0] + gb.link.val + gb.in.sum();\n"
+    "gp.x = 100;\n"
+    "n2.val = 200;\n";
+
+static PawScriptContext* base;
+static int rounds = 20;
+static int failed = 0;
+
+static int get(PawScriptContext* context, const char* name) {
+    int value = 0;
+    pawscript_get(context, name, &value);
+    return value;
+}
+
+static void run(PawScriptContext* context, const char* code) {
+    PawScriptError* error = pawscript_run(context, code);
+    if (error) {
+        pawscript_log_error(error, stdout);
+        failed = 1;
+    }
+}
+
+static void expect(const char* what, int value, int expected) {
+    if (value == expected) return;
+    printf("%s: %d, expected %d\n", what, value, expected);
+    failed = 1;
+}
+
+static void* worker(void* arg) {
+    (void)arg;
+    long ok = 0;
+    for (int round = 0; round < rounds; round++) {
+        PawScriptContext* context = pawscript_clone_context(base);
+        if (pawscript_run(context, body) == NULL && get(context, "total") == 107 && get(context, "counter") == 6) ok++;
+        pawscript_destroy_context(context);
+    }
+    return (void*)ok;
+}
+
+int main(int argc, char** argv) {
+    int threads = argc > 1 ? atoi(argv[1]) : 4;
+    if (argc > 2) rounds = atoi(argv[2]);
+    base = pawscript_create_context();
+    run(base, prelude);
+    expect("prelude", get(base, "total"), 44850);
+
+    PawScriptContext* clone = pawscript_clone_context(base);
+    run(clone, body);
+    expect("clone", get(clone, "total"), 107);
+    expect("clone counter", get(clone, "counter"), 6);
+    run(clone, body);
+    expect("clone run again", get(clone, "total"), 386);
+    expect("clone counter run again", get(clone, "counter"), 7);
+    run(base, "total = gp.x + n2.val + counter;");
+    expect("base after the clone ran", get(base, "total"), 28);
+    run(clone, "T = s8; T small = 300; total = small;");
+    expect("type alias changed in the clone", get(clone, "total"), 44);
+    run(base, "T wide = 300; total = wide;");
+    expect("type alias in the base", get(base, "total"), 300);
+    pawscript_destroy_context(clone);
+
+    run(base, body);
+    expect("base", get(base, "total"), 107);
+    clone = pawscript_clone_context(base);
+    run(clone, "total = gp.x + n2.val + counter;");
+    expect("clone of the changed base", get(clone, "total"), 306);
+    pawscript_destroy_context(clone);
+    pawscript_destroy_context(base);
+
+    base = pawscript_create_context();
+    run(base, prelude);
+    pthread_t* handles = malloc(sizeof(pthread_t) * threads);
+    for (int i = 0; i < threads; i++) pthread_create(&handles[i], NULL, worker, NULL);
+    long ok = 0;
+    for (int i = 0; i < threads; i++) {
+        void* result;
+        pthread_join(handles[i], &result);
+        ok += (long)result;
+    }
+    free(handles);
+    pawscript_destroy_context(base);
+    printf("%ld/%d clones ok\n", ok, threads * rounds);
+    return failed || ok != threads * rounds;
+}
@@ -0,0 +1,113 @@
+// drives generators from C: resumes script generators, streams values from a C function running as one, and leaves
+// some unfinished for delete and for the context to drop
+// usage: generator [count]
+
+#include "pawscript.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+static const char* prelude =
+    "void<-(s64 n) squares { for s64 i: 0 => n { yield i * i; } };\n"
+    "void#<-(s64 n) make { s64 m = n; return generator[s64](squares, m); };\n"
+    "void<-() failing { yield 1; throw 2 as \"failed\"; };\n"
+    "void<-(s64 n) produce;\n"
+    "s64 total = 0;\n";
+
+static int failed = 0;
+
+static void run(PawScriptContext* context, const char* code) {
+    PawScriptError* error = pawscript_run(context, code);
+    if (error) {
+        pawscript_log_error(error, stdout);
+        failed = 1;
+    }
+}
+
+static void expect(const char* what, int64_t value, int64_t expected) {
+    if (value == expected) return;
+    printf("%s: %lld, expected %lld\n", what, (long long)value, (long long)expected);
+    failed = 1;
+}
+
+static void produce(int64_t n) {
+    for (int64_t i = 0; i < n; i++) if (!pawscript_yield(&i)) return;
+}
+
+static void* handle(PawScriptContext* context, const char* name) {
+    void* value = NULL;
+    pawscript_get(context, name, &value);
+    return value;
+}
+
+int main(int argc, char** argv) {
+    int64_t count = argc > 1 ? atoll(argv[1]) : 100000;
+    int64_t squares = 0, sum = 0;
+    for (int64_t i = 0; i < count; i++) {
+        squares += i * i;
+        sum += i;
+    }
+    PawScriptContext* context = pawscript_create_context();
+    run(context, prelude);
+    int64_t value = 0;
+    expect("yield outside of a generator", pawscript_yield(&value), 0);
+
+    // made by a function that returned long before, and resumed by the host after the script that made it ran
+    char code[128];
+    snprintf(code, sizeof(code), "void# g = make(%lld);", (long long)count);
+    run(context, code);
+    void* g = handle(context, "g");
+    bool done = false;
+    int64_t total = 0, values = 0;
+    while (true) {
+        PawScriptError* error = pawscript_resume(context, g, &value, &done);
+        if (error) {
+            pawscript_log_error(error, stdout);
+            failed = 1;
+        }
+        if (done) break;
+        total += value;
+        values++;
+    }
+    expect("squares resumed from c", total, squares);
+    expect("values resumed from c", values, count);
+    PawScriptError* error = pawscript_resume(context, g, &value, &done);
+    expect("resuming a finished generator", error == NULL && done, 1);
+    if (error) pawscript_destroy_error(error);
+
+    // a c function running as a generator, consumed by the script
+    pawscript_set(context, "produce", (void*)produce);
+    snprintf(code, sizeof(code), "for s64 v: generator[s64](produce, %lld) { total += v; }", (long long)count);
+    run(context, code);
+    pawscript_get(context, "total", &total);
+    expect("values yielded from c", total, sum);
+
+    // a c function running as a generator, resumed by the host
+    run(context, "void# p = generator[s64](produce, 5);");
+    void* p = handle(context, "p");
+    total = 0;
+    while (!pawscript_resume(context, p, &value, &done) && !done) total = total * 10 + value;
+    expect("c to c", total, 1234);
+
+    run(context, "void# f = generator[s32](failing);");
+    void* f = handle(context, "f");
+    int32_t small = 0;
+    error = pawscript_resume(context, f, &small, &done);
+    expect("value before the throw", small, 1);
+    expect("error before the throw", error != NULL || done, 0);
+    if (error) pawscript_destroy_error(error);
+    error = pawscript_resume(context, f, &small, &done);
+    expect("throw through resume", error != NULL && done, 1);
+    if (error) pawscript_destroy_error(error);
+
+    // left halfway, one deleted by the script and one for the context to drop
+    run(context, "void# a = make(10); void# b = generator[s64](produce, 10); total = resume(a) + resume(a) + resume(b);");
+    pawscript_get(context, "total", &total);
+    expect("unfinished", total, 1);
+    run(context, "delete(a);");
+    pawscript_destroy_context(context);
+
+    printf("%s\n", failed ? "failed" : "ok");
+    return failed;
+}
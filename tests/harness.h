@@ -0,0 +1,81 @@
+// what the harnesses running contexts on several threads have in common: the workload a round runs, contexts seeded
+// for it and the threads running the rounds
+// usage of a harness built on it: <harness> [threads] [rounds]
+
+#include "pawscript.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+// adds workload_total(seed) to total: scoped structs with a method, throws and a closure called back from qsort
+#define WORKLOAD \
+    "extern void<-(void#, u64, u64, s32<-(const void#, const void#)) qsort;\n" \
+    "type P = struct { s32 x; s32 y; s32<-() sum { return this.x + this.y; }; };\n" \
+    "for s32 i: 0 => 200 {\n" \
+    "    P p = new scoped[P]{ .x = i, .y = seed };\n" \
+    "    total += p.sum();\n" \
+    "    try { throw i as \"t\"; } catch silently { total++; }\n" \
+    "}\n" \
+    "s32<-(const void# a, const void# b) cmp = new[s32<-(const void# a, const void# b)] => [$] { return #(a -> const s32#) - #(b -> const s32#); };\n" \
+    "s32# nums = new[s32](4) { 4, 2, 3, 1 };\n" \
+    "qsort(nums, 4, 4, cmp);\n" \
+    "total += nums[0];\n"
+
+static int workload_total(long seed) {
+    int total = 1;
+    for (int i = 0; i < 200; i++) total += i + seed + 1;
+    return total;
+}
+
+static int threads = 8;
+static int rounds = 20;
+
+// logs and drops the error, true if there was none
+static bool ran(PawScriptError* error) {
+    if (!error) return true;
+    pawscript_log_error(error, stdout);
+    pawscript_destroy_error(error);
+    return false;
+}
+
+// a context with seed and total declared, for the workload
+static PawScriptContext* seeded(long id) {
+    PawScriptContext* context = pawscript_create_context();
+    char code[64];
+    snprintf(code, sizeof(code), "s32 seed = %ld; s32 total = 0;", id);
+    ran(pawscript_run(context, code));
+    return context;
+}
+
+static void parse_args(int argc, char** argv) {
+    if (argc > 1) threads = atoi(argv[1]);
+    if (argc > 2) rounds = atoi(argv[2]);
+}
+
+// one round on the thread numbered id, true if it was ok
+typedef bool (*Round)(long id, int round);
+
+static Round harness_round;
+
+static void* harness_worker(void* arg) {
+    long id = (long)arg, ok = 0;
+    for (int round = 0; round < rounds; round++) ok += harness_round(id, round);
+    return (void*)ok;
+}
+
+// runs the rounds on all the threads at once, the exit status is 0 if every round was ok
+static int run_threads(Round round) {
+    harness_round = round;
+    pthread_t* handles = malloc(sizeof(pthread_t) * threads);
+    for (long i = 0; i < threads; i++) pthread_create(&handles[i], NULL, harness_worker, (void*)i);
+    long ok = 0;
+    for (int i = 0; i < threads; i++) {
+        void* result;
+        pthread_join(handles[i], &result);
+        ok += (long)result;
+    }
+    free(handles);
+    printf("%ld/%d rounds ok\n", ok, threads * rounds);
+    return ok == threads * rounds ? 0 : 1;
+}
@@ -0,0 +1,9 @@
+# recursion deeper than the thread's stack goes on in stack the engine maps, up to PAWSCRIPT_STACK megabytes. past
+# that it's a stack overflow error. the trace folds the repeated frames, how many depends on the build
+paws=$1
+cd lib
+for jit in 0 1; do
+    PAWSCRIPT_STACK=32 PAWSCRIPT_JIT=$jit "$paws" -f recursion.paw 2> recursion.err
+    grep -v ' more times$' recursion.err
+done
+rm -f recursion.err
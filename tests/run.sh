@@ -0,0 +1,39 @@
+#!/bin/sh
+# runs every script in this directory and compares what it prints with the .out file next to it. a .paw is run
+# with paws -f twice, interpreted and with every function compiled on its first call, so both have to print the same.
+# a .sh is run with sh and the path to paws, for tests that take more than one run. lib/ holds what they use
+# usage: tests/run.sh [paws]
+
+paws=${1:-$(dirname "$0")/../paws}
+paws=$(cd "$(dirname "$paws")" && pwd)/$(basename "$paws")
+export LD_LIBRARY_PATH="$(dirname "$paws")${LD_LIBRARY_PATH:+:$LD_LIBRARY_PATH}"
+cd "$(dirname "$0")"
+
+run() {
+    case $1 in
+        *.paw) PAWSCRIPT_JIT=$2 "$paws" -f "$1" 2>&1 ;;
+        *.sh) sh "$1" "$paws" 2>&1 ;;
+    esac
+}
+
+failed=0
+for test in *.paw *.sh; do
+    [ "$test" = run.sh ] && continue
+    name=${test%.*}
+    case $test in
+        *.paw) modes="0 1" ;;
+        *) modes=- ;;
+    esac
+    for jit in $modes; do
+        label=$name
+        [ "$jit" = 1 ] && label="$name (jit)"
+        if run "$test" "$jit" | diff -u "$name.out" - > /dev/null; then
+            echo "ok   $label"
+        else
+            echo "FAIL $label"
+            run "$test" "$jit" | diff -u "$name.out" - | head -20
+            failed=1
+        fi
+    done
+done
+exit $failed
@@ -0,0 +1,90 @@
+// compiles a script once and runs the one program in many contexts: several alive at once on each thread, twice in
+// each, and in one more after all the others are gone. every context after the first one finds the types that one
+// sealed
+// usage: shared [threads] [rounds]
+
+#include "harness.h"
+
+static const char* code =
+    "{\n"
+    "    pair = struct { u16 a; f32 b; };\n"
+    "    type Node = struct { s32 val; defer(Node)# next; };\n"
+    "    total = 0;\n"
+    WORKLOAD
+    "    s32<-(s32 v) twice = new[s32<-(s32 v)] => [$] { return v * 2; };\n"
+    "    Node n1 = new[Node]{ .val = 2 };\n"
+    "    total += n1.val + twice(seed);\n"
+    "}\n";
+
+static PawScriptProgram* program;
+static void* sealed_pair = NULL;
+
+// the pair the program assigns is declared by the context running it
+static PawScriptContext* declared(long id) {
+    PawScriptContext* context = seeded(id);
+    ran(pawscript_run(context, "type pair = void;"));
+    return context;
+}
+
+// runs the program once more in context, which has to add up and find the sealed pair
+static bool checked(PawScriptContext* context, long id, const char* what) {
+    bool ok = ran(pawscript_run_program(context, program));
+    int total = 0, expected = workload_total(id) + 2 + 2 * id;
+    pawscript_get(context, "total", &total);
+    if (total != expected) {
+        printf("%s: total %d, expected %d\n", what, total, expected);
+        ok = false;
+    }
+    void* pair = NULL;
+    void* first = NULL;
+    pawscript_get(context, "pair", &pair);
+    if (!__atomic_compare_exchange_n(&sealed_pair, &first, pair, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE) && first != pair) {
+        printf("%s: made its own copy of a sealed type\n", what);
+        ok = false;
+    }
+    return ok;
+}
+
+static bool round_ok(long id, int round) {
+    PawScriptContext* contexts[3];
+    for (int i = 0; i < 3; i++) contexts[i] = declared(id);
+    bool ok = true;
+    char what[64];
+    // the second run finds the caches the first one filled
+    for (int run = 0; run < 2; run++) {
+        for (int i = 0; i < 3; i++) {
+            snprintf(what, sizeof(what), "thread %ld, round %d, context %d, run %d", id, round, i, run);
+            ok &= checked(contexts[i], id, what);
+        }
+    }
+    for (int i = 0; i < 3; i++) pawscript_destroy_context(contexts[i]);
+    return ok;
+}
+
+int main(int argc, char** argv) {
+    parse_args(argc, argv);
+    PawScriptError* error;
+    if (!(error = pawscript_compile("s32 x = ;", &program))) {
+        printf("compiled a script with a syntax error\n");
+        return 1;
+    }
+    pawscript_destroy_error(error);
+    if (!(error = pawscript_compile_file("/nonexistent.paw", &program))) {
+        printf("compiled a file that doesn't exist\n");
+        return 1;
+    }
+    pawscript_destroy_error(error);
+    if (!ran(pawscript_compile(code, &program))) return 1;
+    // seals the types, which the program keeps once the context that made them is gone
+    PawScriptContext* first = declared(threads);
+    if (!ran(pawscript_run_program(first, program))) return 1;
+    pawscript_destroy_context(first);
+    int status = run_threads(round_ok);
+    PawScriptContext* last = declared(threads);
+    if (!checked(last, threads, "after every other context") || !checked(last, threads, "after every other context, again")) status = 1;
+    // released while the last context still holds it
+    pawscript_destroy_program(program);
+    if (!ran(pawscript_run(last, "pair p = new[pair]{ .a = 1 }; total += p.a;"))) status = 1;
+    pawscript_destroy_context(last);
+    return status;
+}
@@ -0,0 +1,9 @@
+# saves a context in one process and carries on from the image in another
+paws=$1
+cd lib
+"$paws" -f snapshot_prelude.paw -s snapshot.img
+"$paws" -l snapshot.img -f snapshot_main.paw
+"$paws" -l snapshot.img -f snapshot_main.paw
+head -c 200 snapshot.img > truncated.img
+"$paws" -l truncated.img
+rm -f snapshot.img truncated.img
@@ -0,0 +1,81 @@
+// runs contexts on several threads at once. each context allocates in its own allocator, bound on whichever thread
+// runs it or calls back into it, and each thread recovers from its own segfaults
+// usage: stress [threads] [rounds]
+
+#include "harness.h"
+
+// a script function native code calls back, allocating as it goes
+static const char* fill =
+    "s32<-(s32 n) fill = new[s32<-(s32 n)] => [$] {\n"
+    "    s32# xs = new[s32](n);\n"
+    "    s32 sum = 0;\n"
+    "    for s32 i: 0 => n { xs[i] = i; sum += xs[i]; }\n"
+    "    return sum;\n"
+    "};\n";
+
+// segfaults in the script, and in a script function qsort calls back
+static const char* crashes[] = {
+    "s32# bad = null; bad[0] = 1;",
+    "s32<-(const void# a, const void# b) crash = new[s32<-(const void# a, const void# b)] => [$] { s32# bad = null; return bad[0]; };\n"
+    "qsort(nums, 4, 4, crash);",
+};
+
+typedef struct {
+    int32_t (*fn)(int32_t n);
+    int32_t n, sum;
+} Call;
+
+static void* call(void* arg) {
+    Call* c = arg;
+    c->sum = c->fn(c->n);
+    return NULL;
+}
+
+static bool round_ok(long id, int round) {
+    PawScriptContext* context = seeded(id);
+    bool ok = ran(pawscript_run(context, WORKLOAD)) && ran(pawscript_run(context, fill));
+    ok &= ran(pawscript_run(context, "s32# kept = new[s32](64); kept[63] = seed;"));
+
+    // a second context on the same thread, made and dropped between runs of the first: the allocations of the first
+    // stay in its own allocator
+    PawScriptContext* other = seeded(id + 1);
+    ok &= ran(pawscript_run(other, WORKLOAD));
+    pawscript_destroy_context(other);
+
+    // called from a thread that never ran a context
+    Call c = { NULL, 100 + (int32_t)id, 0 };
+    pawscript_get(context, "fill", &c.fn);
+    pthread_t thread;
+    pthread_create(&thread, NULL, call, &c);
+    pthread_join(thread, NULL);
+    if (c.sum != c.n * (c.n - 1) / 2) {
+        printf("thread %ld, round %d: called back from another thread %d, expected %d\n", id, round, c.sum, c.n * (c.n - 1) / 2);
+        ok = false;
+    }
+
+    // recovered on this thread, while the others are running
+    for (int i = 0; i < 2; i++) {
+        PawScriptError* error = pawscript_run(context, crashes[i]);
+        if (error) pawscript_destroy_error(error);
+        else {
+            printf("thread %ld, round %d: segfault %d not raised\n", id, round, i);
+            ok = false;
+        }
+    }
+
+    // and still usable after
+    ok &= ran(pawscript_run(context, "total += kept[63] + fill(10);"));
+    int total = 0, expected = workload_total(id) + id + 45;
+    pawscript_get(context, "total", &total);
+    if (total != expected) {
+        printf("thread %ld, round %d: total %d, expected %d\n", id, round, total, expected);
+        ok = false;
+    }
+    pawscript_destroy_context(context);
+    return ok;
+}
+
+int main(int argc, char** argv) {
+    parse_args(argc, argv);
+    return run_threads(round_ok);
+}